@@ -0,0 +1,90 @@
+#include <algorithm>
+#include <cstring>
+
+#include "alias.h"
+
+namespace atfix {
+
+StagingAlias::StagingAlias(
+  const ATFIX_CACHED_DATA*        pData)
+: m_data(*pData) {
+
+}
+
+
+HRESULT STDMETHODCALLTYPE StagingAlias::QueryInterface(
+        REFIID                    riid,
+        void**                    ppvObject) {
+  if (!ppvObject)
+    return E_POINTER;
+
+  *ppvObject = nullptr;
+
+  if (riid == __uuidof(IUnknown)) {
+    AddRef();
+    *ppvObject = static_cast<IUnknown*>(this);
+    return S_OK;
+  }
+
+  return E_NOINTERFACE;
+}
+
+
+ULONG STDMETHODCALLTYPE StagingAlias::AddRef() {
+  return ++m_refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE StagingAlias::Release() {
+  ULONG refCount = --m_refCount;
+
+  if (!refCount)
+    delete this;
+
+  return refCount;
+}
+
+
+void StagingAlias::map(
+        D3D11_MAPPED_SUBRESOURCE* pMapped) {
+  /* Games must not write to resources mapped for reading,
+   * so handing out the shared data directly is fine */
+  pMapped->pData = const_cast<char*>(m_data.Data->data());
+  pMapped->RowPitch = m_data.RowPitch;
+  pMapped->DepthPitch = m_data.DepthPitch;
+
+  m_mapped = true;
+}
+
+
+bool StagingAlias::unmap() {
+  bool mapped = m_mapped;
+  m_mapped = false;
+  return mapped;
+}
+
+
+void StagingAlias::copyTo(
+  const ATFIX_RESOURCE_INFO*      pInfo,
+  const D3D11_MAPPED_SUBRESOURCE* pMapped) const {
+  const char* src = m_data.Data->data();
+
+  if (pInfo->Dim == D3D11_RESOURCE_DIMENSION_BUFFER) {
+    std::memcpy(pMapped->pData, src, std::min<size_t>(pInfo->Width, m_data.Data->size()));
+    return;
+  }
+
+  D3D11_BOX box = getResourceBox(pInfo, 0);
+  uint32_t rowSize = box.right * getFormatPixelSize(pInfo->Format);
+
+  for (uint32_t z = 0; z < box.back; z++) {
+    for (uint32_t y = 0; y < box.bottom; y++) {
+      std::memcpy(
+        ptroffset(pMapped->pData, y * pMapped->RowPitch + z * pMapped->DepthPitch),
+        src + y * m_data.RowPitch + z * m_data.DepthPitch,
+        rowSize);
+    }
+  }
+}
+
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <d3d11.h>
+
+#include "impl.h"
+#include "readback.h"
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief Staging alias
+ *
+ * Attached to a staging resource of the game as private data if a
+ * copy from a shadowed resource to that staging resource was served
+ * from the shadow cache without copying any data. The staging
+ * resource itself then holds outdated contents, and the alias holds
+ * a reference to the cached data that it logically contains.
+ *
+ * Mapping the staging resource for reading returns the cached data
+ * directly, and unmapping it is a no-op. Any other access to the
+ * staging resource, i.e. mapping it for writing or using it in a
+ * copy that only partially overwrites it, first copies the cached
+ * data to the staging resource and removes the alias. A copy that
+ * overwrites the entire resource simply removes the alias.
+ *
+ * Only staging resources with a single subresource are aliased.
+ */
+class StagingAlias final : public IUnknown {
+
+public:
+
+  StagingAlias(
+    const ATFIX_CACHED_DATA*        pData);
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(
+          REFIID                    riid,
+          void**                    ppvObject);
+
+  ULONG STDMETHODCALLTYPE AddRef();
+
+  ULONG STDMETHODCALLTYPE Release();
+
+  /** Retrieves cached data in the layout that \c Map would
+   *  return it, and marks the alias as mapped. */
+  void map(
+          D3D11_MAPPED_SUBRESOURCE* pMapped);
+
+  /** Ends a mapping that was served by the alias. Returns
+   *  \c false if the alias was not mapped, in which case the
+   *  resource itself must be unmapped. */
+  bool unmap();
+
+  /** Copies cached data to the mapped staging resource */
+  void copyTo(
+    const ATFIX_RESOURCE_INFO*      pInfo,
+    const D3D11_MAPPED_SUBRESOURCE* pMapped) const;
+
+private:
+
+  std::atomic<ULONG>  m_refCount = { 0u };
+
+  ATFIX_CACHED_DATA   m_data;
+  bool                m_mapped = false;
+
+};
+
+}
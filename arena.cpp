@@ -0,0 +1,222 @@
+#include <algorithm>
+
+#include "arena.h"
+#include "config.h"
+
+namespace atfix {
+
+static const GUID IID_ShadowArena = {0x5c0e7a2d,0x91b4,0x4f38,{0xa6,0x1e,0xd3,0x47,0x08,0xbf,0x2c,0x95}};
+
+/* Copies into the arena do not need any particular
+ * alignment, this only bounds the number of slots */
+constexpr UINT MinSlotSize = 256u;
+
+/* Larger buffers get a shadow of their own, since only
+ * a few of them would fit into an arena buffer anyway */
+constexpr UINT MaxSlotSize = 64u << 10;
+
+/* Size of each arena buffer */
+constexpr UINT ArenaBufferSize = 1u << 20;
+
+uint32_t getSizeClass(
+        UINT                      Size) {
+  uint32_t sizeClass = 0;
+
+  while ((MinSlotSize << sizeClass) < Size)
+    sizeClass++;
+
+  return sizeClass;
+}
+
+UINT getSlotSize(
+        uint32_t                  SizeClass) {
+  return MinSlotSize << SizeClass;
+}
+
+
+ShadowArena::ShadowArena(
+        ID3D11Device*             pDevice,
+        GpuTimeline*              pTimeline,
+        UINT                      MaxSize)
+: m_device(pDevice), m_timeline(pTimeline),
+  m_maxSize(std::min(MaxSize, MaxSlotSize)),
+  m_classes(getSizeClass(m_maxSize) + 1) {
+  m_timeline->AddRef();
+}
+
+
+ShadowArena::~ShadowArena() {
+  addInternalDeviceRefs(m_device, -int32_t(m_buffers.size()));
+
+  for (const auto& buffer : m_buffers)
+    buffer.buffer->Release();
+
+  m_timeline->Release();
+}
+
+
+HRESULT STDMETHODCALLTYPE ShadowArena::QueryInterface(
+        REFIID                    riid,
+        void**                    ppvObject) {
+  if (!ppvObject)
+    return E_POINTER;
+
+  *ppvObject = nullptr;
+
+  if (riid == __uuidof(IUnknown)) {
+    AddRef();
+    *ppvObject = static_cast<IUnknown*>(this);
+    return S_OK;
+  }
+
+  return E_NOINTERFACE;
+}
+
+
+ULONG STDMETHODCALLTYPE ShadowArena::AddRef() {
+  return ++m_refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE ShadowArena::Release() {
+  ULONG refCount = --m_refCount;
+
+  if (!refCount)
+    delete this;
+
+  return refCount;
+}
+
+
+ShadowArena* ShadowArena::get(
+        ID3D11DeviceContext*      pContext) {
+  static mutex s_mutex;
+  std::lock_guard lock(s_mutex);
+
+  ShadowArena* arena = nullptr;
+  UINT size = sizeof(arena);
+
+  /* The context holds a reference to the arena, so the
+   * one returned by GetPrivateData can be dropped */
+  if (SUCCEEDED(pContext->GetPrivateData(IID_ShadowArena, &size, &arena))) {
+    if (arena)
+      arena->Release();
+    return arena;
+  }
+
+  UINT maxSize = getConfig()->ShadowArenaSize;
+
+  if (maxSize) {
+    ID3D11Device* device = nullptr;
+    pContext->GetDevice(&device);
+
+    arena = new ShadowArena(device, GpuTimeline::get(pContext), maxSize);
+    device->Release();
+  }
+
+  /* Also store null pointer so we don't try again */
+  if (arena)
+    pContext->SetPrivateDataInterface(IID_ShadowArena, arena);
+  else
+    pContext->SetPrivateData(IID_ShadowArena, sizeof(arena), &arena);
+
+  return arena;
+}
+
+
+void ShadowArena::detach(
+        ID3D11DeviceContext*      pContext) {
+  pContext->SetPrivateData(IID_ShadowArena, 0, nullptr);
+}
+
+
+HRESULT ShadowArena::allocate(
+        UINT                      Size,
+        ID3D11Resource**          ppBuffer,
+        UINT*                     pOffset) {
+  std::lock_guard lock(m_mutex);
+
+  uint32_t sizeClass = getSizeClass(Size);
+  SlotList& slots = m_classes[sizeClass];
+
+  /* Slots are freed in timeline order, so if the
+   * oldest free slot is still busy, all of them are */
+  if (!slots.freeSlots.empty() && m_timeline->isComplete(slots.freeSlots.front().timelineValue)) {
+    *ppBuffer = slots.freeSlots.front().buffer;
+    *pOffset = slots.freeSlots.front().offset;
+
+    slots.freeSlots.pop_front();
+  } else {
+    UINT slotSize = getSlotSize(sizeClass);
+
+    if (!slots.buffer || slots.offset + slotSize > ArenaBufferSize) {
+      HRESULT hr = createBuffer(sizeClass);
+
+      if (FAILED(hr))
+        return hr;
+    }
+
+    *ppBuffer = slots.buffer;
+    *pOffset = slots.offset;
+
+    slots.offset += slotSize;
+  }
+
+  (*ppBuffer)->AddRef();
+  return S_OK;
+}
+
+
+void ShadowArena::free(
+        ID3D11Resource*           pBuffer,
+        UINT                      Offset) {
+  std::lock_guard lock(m_mutex);
+
+  for (const auto& buffer : m_buffers) {
+    if (buffer.buffer != pBuffer)
+      continue;
+
+    /* Any copy to the slot that was issued so far will
+     * complete once the next timeline value is reached */
+    FreeSlot slot = { };
+    slot.buffer = pBuffer;
+    slot.offset = Offset;
+    slot.timelineValue = m_timeline->getNextValue();
+
+    m_classes[buffer.sizeClass].freeSlots.push_back(slot);
+    return;
+  }
+}
+
+
+HRESULT ShadowArena::createBuffer(
+        uint32_t                  SizeClass) {
+  D3D11_BUFFER_DESC desc = { };
+  desc.ByteWidth = ArenaBufferSize;
+  desc.Usage = D3D11_USAGE_STAGING;
+  desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE | D3D11_CPU_ACCESS_READ;
+
+  ID3D11Buffer* buffer = nullptr;
+  HRESULT hr = forwardCreateBuffer(m_device, &desc, &buffer);
+
+  if (FAILED(hr)) {
+    log("Shadow arena: Failed to create buffer, hr 0x", std::hex, hr);
+    return hr;
+  }
+
+  addInternalDeviceRefs(m_device, 1);
+
+  Buffer entry = { };
+  entry.buffer = buffer;
+  entry.sizeClass = SizeClass;
+
+  m_buffers.push_back(entry);
+
+  m_classes[SizeClass].buffer = buffer;
+  m_classes[SizeClass].offset = 0u;
+
+  log("Shadow arena: Created buffer ", m_buffers.size(), " for ", getSlotSize(SizeClass), "-byte slots");
+  return S_OK;
+}
+
+}
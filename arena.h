@@ -0,0 +1,123 @@
+#pragma once
+
+#include <d3d11.h>
+
+#include <deque>
+#include <vector>
+
+#include "impl.h"
+#include "timeline.h"
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief Shadow arena
+ *
+ * Sub-allocates shadows of small buffers from large staging buffers,
+ * so that games reading back lots of small buffers do not end up with
+ * one driver allocation per buffer, and so that the readback worker
+ * can read back several of those shadows with a single \c Map.
+ *
+ * Each arena buffer is split into slots of one size class, and size
+ * classes are powers of two. Freed slots are put on a free list, and
+ * only get reused once the GPU timeline passed the value that was
+ * current when they were freed, since copies to the slot may still
+ * be in flight at that point.
+ *
+ * Note that mapping an arena buffer on the render thread waits for
+ * all writes to that buffer, not just the ones to the shadow that
+ * is being read, which is why the arena is opt-in.
+ *
+ * One arena is created per immediate context and attached to it as
+ * private data. Shadows allocated from the arena hold a reference to
+ * it, so arena buffers are destroyed once the context has detached
+ * the arena and the last of those shadows is gone.
+ */
+class ShadowArena final : public IUnknown {
+
+public:
+
+  ShadowArena(
+          ID3D11Device*             pDevice,
+          GpuTimeline*              pTimeline,
+          UINT                      MaxSize);
+
+  ~ShadowArena();
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(
+          REFIID                    riid,
+          void**                    ppvObject);
+
+  ULONG STDMETHODCALLTYPE AddRef();
+
+  ULONG STDMETHODCALLTYPE Release();
+
+  /** Retrieves shadow arena for the given immediate context,
+   *  and creates it if necessary. Returns \c nullptr if the
+   *  arena is disabled. */
+  static ShadowArena* get(
+          ID3D11DeviceContext*      pContext);
+
+  /** Drops the context's reference to its shadow arena */
+  static void detach(
+          ID3D11DeviceContext*      pContext);
+
+  /** Checks whether shadows of the given size
+   *  should be allocated from the arena */
+  bool canAllocate(
+          UINT                      Size) const {
+    return Size <= m_maxSize;
+  }
+
+  /** Allocates a slot of at least the given size. Returns the
+   *  arena buffer with a new reference, as well as the offset
+   *  of the slot within that buffer. Must be called from the
+   *  thread that owns the immediate context. */
+  HRESULT allocate(
+          UINT                      Size,
+          ID3D11Resource**          ppBuffer,
+          UINT*                     pOffset);
+
+  /** Returns a slot to the arena. The slot will not be handed
+   *  out again until all work that is currently tracked on the
+   *  GPU timeline has completed. May be called from any thread. */
+  void free(
+          ID3D11Resource*           pBuffer,
+          UINT                      Offset);
+
+private:
+
+  struct FreeSlot {
+    ID3D11Resource* buffer;
+    UINT            offset;
+    uint64_t        timelineValue;
+  };
+
+  struct Buffer {
+    ID3D11Resource* buffer;
+    uint32_t        sizeClass;
+  };
+
+  struct SlotList {
+    ID3D11Resource*       buffer = nullptr;
+    UINT                  offset = 0u;
+    std::deque<FreeSlot>  freeSlots;
+  };
+
+  std::atomic<ULONG> m_refCount = { 0u };
+
+  ID3D11Device*   m_device    = nullptr;
+  GpuTimeline*    m_timeline  = nullptr;
+  UINT            m_maxSize   = 0u;
+
+  mutex                     m_mutex;
+  std::vector<Buffer>       m_buffers;
+  std::vector<SlotList>     m_classes;
+
+  HRESULT createBuffer(
+          uint32_t                  SizeClass);
+
+};
+
+}
@@ -0,0 +1,490 @@
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <d3d11.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <string>
+#include <vector>
+
+/**
+ * Synthetic benchmark that reproduces the resource round trips
+ * Atelier games perform every frame: Create a staging resource,
+ * copy a GPU resource into it, map it, write some data and copy
+ * the staging resource back to the GPU resource.
+ *
+ * Runs headless and only needs a D3D11 device, so it works under
+ * Wine with DXVK on lavapipe. The D3D11 DLL to use is passed on
+ * the command line so that runs with and without atfix can be
+ * compared directly.
+ */
+namespace bench {
+
+using clock = std::chrono::steady_clock;
+
+using PFN_D3D11CreateDevice = HRESULT (__stdcall *) (
+  IDXGIAdapter*, D3D_DRIVER_TYPE, HMODULE, UINT, const D3D_FEATURE_LEVEL*,
+  UINT, UINT, ID3D11Device**, D3D_FEATURE_LEVEL*, ID3D11DeviceContext**);
+
+struct Options {
+  std::string dll;
+  uint32_t frames       = 1000;
+  uint32_t warmup       = 100;
+  uint32_t vbCount      = 16;
+  uint32_t vbSize       = 64u << 10;
+  uint32_t rtCount      = 2;
+  uint32_t rtWidth      = 512;
+  uint32_t rtHeight     = 512;
+  uint32_t uavCount     = 4;
+  uint32_t uavSize      = 256u << 10;
+  uint32_t dynCount     = 4;
+  uint32_t dynSize      = 16u << 10;
+};
+
+struct Resource {
+  ID3D11Resource*             resource  = nullptr;
+  ID3D11Resource*             dynamic   = nullptr;
+  ID3D11RenderTargetView*     rtv       = nullptr;
+  ID3D11UnorderedAccessView*  uav       = nullptr;
+};
+
+struct Context {
+  ID3D11Device*               device    = nullptr;
+  ID3D11DeviceContext*        context   = nullptr;
+
+  std::vector<Resource>       vbs;
+  std::vector<Resource>       rts;
+  std::vector<Resource>       uavs;
+  std::vector<Resource>       dyns;
+
+  std::array<ID3D11Query*, 2> queries   = { };
+};
+
+
+void printUsage(const char* pName) {
+  std::printf(
+    "Usage: %s [options]\n"
+    "  --dll <path>          D3D11 DLL to load, defaults to the system d3d11.dll\n"
+    "  --frames <n>          Number of measured frames\n"
+    "  --warmup <n>          Number of frames to run before measuring\n"
+    "  --vb <count> <size>   Vertex buffers and their size in bytes\n"
+    "  --rt <count> <w> <h>  Render targets and their size in pixels\n"
+    "  --uav <count> <size>  UAV buffers and their size in bytes\n"
+    "  --dyn <count> <size>  Dynamic buffers and their size in bytes\n",
+    pName);
+}
+
+
+bool parseOptions(int argc, char** argv, Options* pOptions) {
+  auto next = [&] (int& i) {
+    return i + 1 < argc ? argv[++i] : nullptr;
+  };
+
+  auto nextUint = [&] (int& i, uint32_t* pValue) {
+    const char* arg = next(i);
+
+    if (arg)
+      *pValue = uint32_t(std::strtoul(arg, nullptr, 0));
+
+    return arg != nullptr;
+  };
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool valid = true;
+
+    if (arg == "--dll") {
+      const char* dll = next(i);
+      valid = dll != nullptr;
+
+      if (valid)
+        pOptions->dll = dll;
+    } else if (arg == "--frames") {
+      valid = nextUint(i, &pOptions->frames);
+    } else if (arg == "--warmup") {
+      valid = nextUint(i, &pOptions->warmup);
+    } else if (arg == "--vb") {
+      valid = nextUint(i, &pOptions->vbCount)
+           && nextUint(i, &pOptions->vbSize);
+    } else if (arg == "--rt") {
+      valid = nextUint(i, &pOptions->rtCount)
+           && nextUint(i, &pOptions->rtWidth)
+           && nextUint(i, &pOptions->rtHeight);
+    } else if (arg == "--uav") {
+      valid = nextUint(i, &pOptions->uavCount)
+           && nextUint(i, &pOptions->uavSize);
+    } else if (arg == "--dyn") {
+      valid = nextUint(i, &pOptions->dynCount)
+           && nextUint(i, &pOptions->dynSize);
+    } else {
+      valid = false;
+    }
+
+    if (!valid) {
+      printUsage(argv[0]);
+      return false;
+    }
+  }
+
+  /* Round trips write the first few bytes of each resource */
+  pOptions->vbSize = std::max(pOptions->vbSize, 16u);
+  pOptions->uavSize = std::max(pOptions->uavSize, 16u);
+  pOptions->dynSize = std::max(pOptions->dynSize, 16u);
+  pOptions->rtWidth = std::max(pOptions->rtWidth, 1u);
+  pOptions->rtHeight = std::max(pOptions->rtHeight, 1u);
+
+  if (pOptions->dll.empty()) {
+    std::array<char, MAX_PATH + 1> path = { };
+    GetSystemDirectoryA(path.data(), MAX_PATH);
+    pOptions->dll = std::string(path.data()) + "\\d3d11.dll";
+  }
+
+  return true;
+}
+
+
+HRESULT createBuffer(
+        ID3D11Device*             pDevice,
+        UINT                      Size,
+        D3D11_USAGE               Usage,
+        UINT                      BindFlags,
+        UINT                      CPUFlags,
+        ID3D11Resource**          ppResource) {
+  D3D11_BUFFER_DESC desc = { };
+  desc.ByteWidth = Size;
+  desc.Usage = Usage;
+  desc.BindFlags = BindFlags;
+  desc.CPUAccessFlags = CPUFlags;
+
+  if (BindFlags & D3D11_BIND_UNORDERED_ACCESS)
+    desc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
+
+  ID3D11Buffer* buffer = nullptr;
+  HRESULT hr = pDevice->CreateBuffer(&desc, nullptr, &buffer);
+
+  *ppResource = buffer;
+  return hr;
+}
+
+
+HRESULT createTexture(
+        ID3D11Device*             pDevice,
+        UINT                      Width,
+        UINT                      Height,
+        D3D11_USAGE               Usage,
+        UINT                      BindFlags,
+        UINT                      CPUFlags,
+        ID3D11Resource**          ppResource) {
+  D3D11_TEXTURE2D_DESC desc = { };
+  desc.Width = Width;
+  desc.Height = Height;
+  desc.MipLevels = 1;
+  desc.ArraySize = 1;
+  desc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+  desc.SampleDesc = { 1, 0 };
+  desc.Usage = Usage;
+  desc.BindFlags = BindFlags;
+  desc.CPUAccessFlags = CPUFlags;
+
+  ID3D11Texture2D* texture = nullptr;
+  HRESULT hr = pDevice->CreateTexture2D(&desc, nullptr, &texture);
+
+  *ppResource = texture;
+  return hr;
+}
+
+
+HRESULT createStagingResource(
+        ID3D11Device*             pDevice,
+        ID3D11Resource*           pResource,
+        ID3D11Resource**          ppStaging) {
+  constexpr UINT cpuFlags = D3D11_CPU_ACCESS_READ | D3D11_CPU_ACCESS_WRITE;
+
+  D3D11_RESOURCE_DIMENSION dim;
+  pResource->GetType(&dim);
+
+  if (dim == D3D11_RESOURCE_DIMENSION_BUFFER) {
+    D3D11_BUFFER_DESC desc = { };
+    static_cast<ID3D11Buffer*>(pResource)->GetDesc(&desc);
+    return createBuffer(pDevice, desc.ByteWidth, D3D11_USAGE_STAGING, 0, cpuFlags, ppStaging);
+  } else {
+    D3D11_TEXTURE2D_DESC desc = { };
+    static_cast<ID3D11Texture2D*>(pResource)->GetDesc(&desc);
+    return createTexture(pDevice, desc.Width, desc.Height, D3D11_USAGE_STAGING, 0, cpuFlags, ppStaging);
+  }
+}
+
+
+bool createResources(
+  const Options&                  options,
+        Context*                  pContext) {
+  ID3D11Device* device = pContext->device;
+  HRESULT hr = S_OK;
+
+  pContext->vbs.resize(options.vbCount);
+  pContext->rts.resize(options.rtCount);
+  pContext->uavs.resize(options.uavCount);
+  pContext->dyns.resize(options.dynCount);
+
+  for (auto& vb : pContext->vbs) {
+    if (FAILED(hr = createBuffer(device, options.vbSize, D3D11_USAGE_DEFAULT,
+        D3D11_BIND_VERTEX_BUFFER, 0, &vb.resource)))
+      break;
+  }
+
+  for (auto& rt : pContext->rts) {
+    if (FAILED(hr = createTexture(device, options.rtWidth, options.rtHeight, D3D11_USAGE_DEFAULT,
+        D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE, 0, &rt.resource))
+     || FAILED(hr = device->CreateRenderTargetView(rt.resource, nullptr, &rt.rtv)))
+      break;
+  }
+
+  for (auto& uav : pContext->uavs) {
+    D3D11_UNORDERED_ACCESS_VIEW_DESC desc = { };
+    desc.Format = DXGI_FORMAT_R32_TYPELESS;
+    desc.ViewDimension = D3D11_UAV_DIMENSION_BUFFER;
+    desc.Buffer.FirstElement = 0;
+    desc.Buffer.NumElements = options.uavSize / 4;
+    desc.Buffer.Flags = D3D11_BUFFER_UAV_FLAG_RAW;
+
+    if (FAILED(hr = createBuffer(device, options.uavSize, D3D11_USAGE_DEFAULT,
+        D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE, 0, &uav.resource))
+     || FAILED(hr = device->CreateUnorderedAccessView(uav.resource, &desc, &uav.uav)))
+      break;
+  }
+
+  for (auto& dyn : pContext->dyns) {
+    if (FAILED(hr = createBuffer(device, options.dynSize, D3D11_USAGE_DEFAULT,
+        D3D11_BIND_VERTEX_BUFFER, 0, &dyn.resource))
+     || FAILED(hr = createBuffer(device, options.dynSize, D3D11_USAGE_DYNAMIC,
+        D3D11_BIND_VERTEX_BUFFER, D3D11_CPU_ACCESS_WRITE, &dyn.dynamic)))
+      break;
+  }
+
+  for (auto& query : pContext->queries) {
+    D3D11_QUERY_DESC desc = { };
+    desc.Query = D3D11_QUERY_EVENT;
+
+    if (FAILED(hr = device->CreateQuery(&desc, &query)))
+      break;
+  }
+
+  if (FAILED(hr)) {
+    std::fprintf(stderr, "Failed to create resources, hr 0x%lx\n", long(hr));
+    return false;
+  }
+
+  return true;
+}
+
+
+void destroyResources(
+        Context*                  pContext) {
+  for (auto list : { &pContext->vbs, &pContext->rts, &pContext->uavs, &pContext->dyns }) {
+    for (auto& r : *list) {
+      if (r.uav)
+        r.uav->Release();
+      if (r.rtv)
+        r.rtv->Release();
+      if (r.dynamic)
+        r.dynamic->Release();
+      if (r.resource)
+        r.resource->Release();
+    }
+  }
+
+  for (auto query : pContext->queries) {
+    if (query)
+      query->Release();
+  }
+}
+
+
+/** Performs the staging round trip that the engine does, and
+ *  optionally copies the result into a dynamic buffer. */
+void roundTrip(
+        Context*                  pContext,
+        ID3D11Resource*           pResource,
+        ID3D11Resource*           pDynamic,
+        uint32_t                  Frame) {
+  ID3D11DeviceContext* context = pContext->context;
+  ID3D11Resource* staging = nullptr;
+
+  if (FAILED(createStagingResource(pContext->device, pResource, &staging)))
+    return;
+
+  context->CopyResource(staging, pResource);
+
+  D3D11_MAPPED_SUBRESOURCE mapped = { };
+
+  if (SUCCEEDED(context->Map(staging, 0, D3D11_MAP_READ_WRITE, 0, &mapped))) {
+    auto data = reinterpret_cast<uint32_t*>(mapped.pData);
+    data[0] += Frame;
+    context->Unmap(staging, 0);
+  }
+
+  if (pDynamic) {
+    context->CopySubresourceRegion(pDynamic, 0, 0, 0, 0, staging, 0, nullptr);
+
+    if (SUCCEEDED(context->Map(pDynamic, 0, D3D11_MAP_WRITE_NO_OVERWRITE, 0, &mapped))) {
+      auto data = reinterpret_cast<uint32_t*>(mapped.pData);
+      data[1] = Frame;
+      context->Unmap(pDynamic, 0);
+    }
+  } else {
+    context->CopySubresourceRegion(pResource, 0, 0, 0, 0, staging, 0, nullptr);
+  }
+
+  staging->Release();
+}
+
+
+void runFrame(
+        Context*                  pContext,
+        uint32_t                  Frame) {
+  ID3D11DeviceContext* context = pContext->context;
+
+  /* Write GPU resources the way rendering would */
+  for (auto& vb : pContext->vbs) {
+    D3D11_BOX box = { 0, 0, 0, 16, 1, 1 };
+    std::array<uint32_t, 4> data = { Frame, Frame, Frame, Frame };
+    context->UpdateSubresource(vb.resource, 0, &box, data.data(), 0, 0);
+  }
+
+  for (auto& rt : pContext->rts) {
+    float value = float(Frame & 0xff) / 255.0f;
+    std::array<float, 4> color = { value, value, value, 1.0f };
+    context->ClearRenderTargetView(rt.rtv, color.data());
+  }
+
+  for (auto& uav : pContext->uavs) {
+    std::array<UINT, 4> value = { Frame, Frame, Frame, Frame };
+    context->ClearUnorderedAccessViewUint(uav.uav, value.data());
+  }
+
+  /* Then do the sync-heavy round trips */
+  for (auto& vb : pContext->vbs)
+    roundTrip(pContext, vb.resource, nullptr, Frame);
+
+  for (auto& rt : pContext->rts)
+    roundTrip(pContext, rt.resource, nullptr, Frame);
+
+  for (auto& uav : pContext->uavs)
+    roundTrip(pContext, uav.resource, nullptr, Frame);
+
+  for (auto& dyn : pContext->dyns)
+    roundTrip(pContext, dyn.resource, dyn.dynamic, Frame);
+
+  /* Emulate presentation with a maximum frame latency of
+   * one frame in flight on top of the current frame. */
+  ID3D11Query* query = pContext->queries[Frame % pContext->queries.size()];
+  context->End(query);
+  context->Flush();
+
+  ID3D11Query* prevQuery = pContext->queries[(Frame + 1) % pContext->queries.size()];
+
+  if (Frame) {
+    while (context->GetData(prevQuery, nullptr, 0, 0) == S_FALSE)
+      SwitchToThread();
+  }
+}
+
+
+void printStats(
+        std::vector<float>&       frameTimes) {
+  if (frameTimes.empty())
+    return;
+
+  std::sort(frameTimes.begin(), frameTimes.end());
+
+  auto percentile = [&] (double p) {
+    size_t index = size_t(p * double(frameTimes.size() - 1));
+    return frameTimes[index];
+  };
+
+  float sum = std::accumulate(frameTimes.begin(), frameTimes.end(), 0.0f);
+  float avg = sum / float(frameTimes.size());
+
+  std::printf("Frames: %zu\n", frameTimes.size());
+  std::printf("Frame time (ms): avg %.3f, p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n",
+    avg, percentile(0.50), percentile(0.90), percentile(0.99), frameTimes.back());
+  std::printf("Average FPS: %.1f\n", 1000.0f / avg);
+}
+
+
+int run(const Options& options) {
+  HMODULE library = LoadLibraryA(options.dll.c_str());
+
+  if (!library) {
+    std::fprintf(stderr, "Failed to load %s\n", options.dll.c_str());
+    return 1;
+  }
+
+  auto createDevice = reinterpret_cast<PFN_D3D11CreateDevice>(
+    GetProcAddress(library, "D3D11CreateDevice"));
+
+  if (!createDevice) {
+    std::fprintf(stderr, "D3D11CreateDevice not found in %s\n", options.dll.c_str());
+    return 1;
+  }
+
+  std::printf("Using %s\n", options.dll.c_str());
+
+  Context context;
+
+  D3D_FEATURE_LEVEL featureLevel = D3D_FEATURE_LEVEL_11_0;
+  HRESULT hr = createDevice(nullptr, D3D_DRIVER_TYPE_HARDWARE, nullptr, 0,
+    &featureLevel, 1, D3D11_SDK_VERSION, &context.device, nullptr, &context.context);
+
+  if (FAILED(hr)) {
+    std::fprintf(stderr, "Failed to create D3D11 device, hr 0x%lx\n", long(hr));
+    return 1;
+  }
+
+  int status = 1;
+
+  if (createResources(options, &context)) {
+    std::vector<float> frameTimes;
+    frameTimes.reserve(options.frames);
+
+    auto last = clock::now();
+
+    for (uint32_t i = 0; i < options.warmup + options.frames; i++) {
+      runFrame(&context, i);
+
+      auto now = clock::now();
+
+      if (i >= options.warmup)
+        frameTimes.push_back(std::chrono::duration<float, std::milli>(now - last).count());
+
+      last = now;
+    }
+
+    printStats(frameTimes);
+    status = 0;
+  }
+
+  destroyResources(&context);
+
+  context.context->Release();
+  context.device->Release();
+  return status;
+}
+
+}
+
+
+int main(int argc, char** argv) {
+  bench::Options options;
+
+  if (!bench::parseOptions(argc, argv, &options))
+    return 1;
+
+  return bench::run(options);
+}
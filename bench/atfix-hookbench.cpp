@@ -0,0 +1,1245 @@
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <d3d11.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../impl.h"
+
+/**
+ * Microbenchmark for the CPU overhead that the atfix hooks add to
+ * individual context methods. Runs the hooks from impl.cpp against
+ * mock D3D11 objects that only implement what atfix itself calls,
+ * so no D3D11 runtime or GPU is needed, and the cost of the hooks
+ * isn't hidden behind driver overhead.
+ *
+ * Every scenario is measured on the plain mock context first, and
+ * again after atfix has hooked it. Besides the time per call, the
+ * number of AddRef/Release calls, private data calls and lock
+ * acquisitions inside atfix per call are reported, so that changes
+ * to lookups and locking show up directly.
+ *
+ * The mock objects use hand-written vtables rather than C++ classes
+ * so that unimplemented methods need no stubs. Each mock method has
+ * a distinct body, since MinHook can't hook two vtable entries that
+ * the linker folded into the same function.
+ */
+namespace atfix {
+  Log log("atfix-hookbench.log");
+}
+
+namespace mock {
+
+using clock = std::chrono::steady_clock;
+
+std::atomic<uint64_t> g_refOps = { 0ull };
+std::atomic<uint64_t> g_privateDataOps = { 0ull };
+
+/* Simulated runtime cost of methods that record GPU work */
+uint32_t g_latencyNs = 0;
+
+void simulateLatency() {
+  if (!g_latencyNs)
+    return;
+
+  auto end = clock::now() + std::chrono::nanoseconds(g_latencyNs);
+
+  while (clock::now() < end)
+    continue;
+}
+
+
+void STDMETHODCALLTYPE unimplemented() {
+  std::fprintf(stderr, "Unimplemented mock method called\n");
+  std::abort();
+}
+
+
+template<size_t N>
+struct Vtable {
+  std::array<void*, N> entries;
+
+  Vtable() {
+    entries.fill(reinterpret_cast<void*>(&unimplemented));
+  }
+
+  template<typename Fn>
+  void set(size_t Index, Fn* pFn) {
+    entries[Index] = reinterpret_cast<void*>(pFn);
+  }
+};
+
+
+struct PrivateData {
+  GUID              guid;
+  std::vector<char> data;
+  IUnknown*         iface;
+};
+
+
+/**
+ * \brief Common state of all mock objects
+ *
+ * Must not have virtual methods, since the hand-written
+ * vtable pointer must be at the start of the object.
+ */
+struct Object {
+  void* const*              vtbl;
+  std::atomic<ULONG>        refCount = { 1u };
+  std::vector<const GUID*>  iids;
+  Object*                   device = nullptr;
+  void                    (*destroy)(Object*) = nullptr;
+
+  std::mutex                privateDataMutex;
+  std::vector<PrivateData>  privateData;
+};
+
+
+ULONG STDMETHODCALLTYPE Object_AddRef(Object* pSelf) {
+  g_refOps++;
+  return ++pSelf->refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE Object_Release(Object* pSelf) {
+  g_refOps++;
+  ULONG refCount = --pSelf->refCount;
+
+  if (!refCount) {
+    for (const auto& entry : pSelf->privateData) {
+      if (entry.iface)
+        entry.iface->Release();
+    }
+
+    if (pSelf->device)
+      Object_Release(pSelf->device);
+
+    pSelf->destroy(pSelf);
+  }
+
+  return refCount;
+}
+
+
+HRESULT STDMETHODCALLTYPE Object_QueryInterface(Object* pSelf, REFIID riid, void** ppvObject) {
+  if (!ppvObject)
+    return E_POINTER;
+
+  *ppvObject = nullptr;
+
+  for (const GUID* iid : pSelf->iids) {
+    if (riid == *iid) {
+      Object_AddRef(pSelf);
+      *ppvObject = pSelf;
+      return S_OK;
+    }
+  }
+
+  return E_NOINTERFACE;
+}
+
+
+void STDMETHODCALLTYPE Object_GetDevice(Object* pSelf, ID3D11Device** ppDevice) {
+  Object_AddRef(pSelf->device);
+  *ppDevice = reinterpret_cast<ID3D11Device*>(pSelf->device);
+}
+
+
+HRESULT STDMETHODCALLTYPE Object_GetPrivateData(Object* pSelf, REFGUID guid, UINT* pDataSize, void* pData) {
+  g_privateDataOps++;
+
+  std::lock_guard lock(pSelf->privateDataMutex);
+
+  for (const auto& entry : pSelf->privateData) {
+    if (entry.guid == guid) {
+      UINT size = entry.iface ? sizeof(entry.iface) : entry.data.size();
+
+      if (pData && *pDataSize < size) {
+        *pDataSize = size;
+        return DXGI_ERROR_MORE_DATA;
+      }
+
+      *pDataSize = size;
+
+      if (pData && entry.iface) {
+        entry.iface->AddRef();
+        std::memcpy(pData, &entry.iface, size);
+      } else if (pData) {
+        std::memcpy(pData, entry.data.data(), size);
+      }
+
+      return S_OK;
+    }
+  }
+
+  *pDataSize = 0;
+  return DXGI_ERROR_NOT_FOUND;
+}
+
+
+void setPrivateData(Object* pSelf, REFGUID guid, UINT DataSize, const void* pData, IUnknown* pInterface) {
+  std::lock_guard lock(pSelf->privateDataMutex);
+
+  if (pInterface)
+    pInterface->AddRef();
+
+  for (size_t i = 0; i < pSelf->privateData.size(); i++) {
+    auto& entry = pSelf->privateData[i];
+
+    if (entry.guid == guid) {
+      if (entry.iface)
+        entry.iface->Release();
+
+      pSelf->privateData.erase(pSelf->privateData.begin() + i);
+      break;
+    }
+  }
+
+  if (!pData && !pInterface)
+    return;
+
+  PrivateData entry = { };
+  entry.guid = guid;
+  entry.iface = pInterface;
+
+  if (pData) {
+    auto bytes = reinterpret_cast<const char*>(pData);
+    entry.data.assign(bytes, bytes + DataSize);
+  }
+
+  pSelf->privateData.push_back(std::move(entry));
+}
+
+
+HRESULT STDMETHODCALLTYPE Object_SetPrivateData(Object* pSelf, REFGUID guid, UINT DataSize, const void* pData) {
+  g_privateDataOps++;
+  setPrivateData(pSelf, guid, DataSize, pData, nullptr);
+  return S_OK;
+}
+
+
+HRESULT STDMETHODCALLTYPE Object_SetPrivateDataInterface(Object* pSelf, REFGUID guid, const IUnknown* pData) {
+  g_privateDataOps++;
+  setPrivateData(pSelf, guid, 0, nullptr, const_cast<IUnknown*>(pData));
+  return S_OK;
+}
+
+
+template<typename T>
+void destroyObject(Object* pObject) {
+  delete static_cast<T*>(pObject);
+}
+
+
+template<size_t N>
+void initDeviceChildVtable(Vtable<N>& vtbl) {
+  vtbl.set(0, &Object_QueryInterface);
+  vtbl.set(1, &Object_AddRef);
+  vtbl.set(2, &Object_Release);
+  vtbl.set(3, &Object_GetDevice);
+  vtbl.set(4, &Object_GetPrivateData);
+  vtbl.set(5, &Object_SetPrivateData);
+  vtbl.set(6, &Object_SetPrivateDataInterface);
+}
+
+
+/**
+ * \brief Mock buffer or 2D texture
+ *
+ * Backed by system memory so that maps work. Only supports
+ * resources with a single subresource, which is all the
+ * benchmark scenarios need.
+ */
+struct Resource : Object {
+  D3D11_RESOURCE_DIMENSION  dim;
+  D3D11_BUFFER_DESC         bufferDesc  = { };
+  D3D11_TEXTURE2D_DESC      textureDesc = { };
+  UINT                      rowPitch    = 0;
+  std::vector<char>         storage;
+};
+
+
+void STDMETHODCALLTYPE Resource_GetType(Resource* pSelf, D3D11_RESOURCE_DIMENSION* pDim) {
+  *pDim = pSelf->dim;
+}
+
+
+void STDMETHODCALLTYPE Resource_SetEvictionPriority(Resource* pSelf, UINT Priority) {
+
+}
+
+
+UINT STDMETHODCALLTYPE Resource_GetEvictionPriority(Resource* pSelf) {
+  return 0;
+}
+
+
+void STDMETHODCALLTYPE Buffer_GetDesc(Resource* pSelf, D3D11_BUFFER_DESC* pDesc) {
+  *pDesc = pSelf->bufferDesc;
+}
+
+
+void STDMETHODCALLTYPE Texture2D_GetDesc(Resource* pSelf, D3D11_TEXTURE2D_DESC* pDesc) {
+  *pDesc = pSelf->textureDesc;
+}
+
+
+template<typename Fn>
+Vtable<11> createResourceVtable(Fn* pGetDesc) {
+  Vtable<11> vtbl;
+  initDeviceChildVtable(vtbl);
+  vtbl.set(7, &Resource_GetType);
+  vtbl.set(8, &Resource_SetEvictionPriority);
+  vtbl.set(9, &Resource_GetEvictionPriority);
+  vtbl.set(10, pGetDesc);
+  return vtbl;
+}
+
+
+const Vtable<11> g_bufferVtbl = createResourceVtable(&Buffer_GetDesc);
+const Vtable<11> g_texture2DVtbl = createResourceVtable(&Texture2D_GetDesc);
+
+
+Resource* createBuffer(Object* pDevice, const D3D11_BUFFER_DESC* pDesc) {
+  auto resource = new Resource();
+  resource->vtbl = g_bufferVtbl.entries.data();
+  resource->iids = { &__uuidof(IUnknown), &__uuidof(ID3D11DeviceChild),
+    &__uuidof(ID3D11Resource), &__uuidof(ID3D11Buffer) };
+  resource->device = pDevice;
+  resource->destroy = &destroyObject<Resource>;
+  resource->dim = D3D11_RESOURCE_DIMENSION_BUFFER;
+  resource->bufferDesc = *pDesc;
+  resource->rowPitch = pDesc->ByteWidth;
+  resource->storage.resize(pDesc->ByteWidth);
+
+  Object_AddRef(pDevice);
+  return resource;
+}
+
+
+Resource* createTexture2D(Object* pDevice, const D3D11_TEXTURE2D_DESC* pDesc) {
+  auto resource = new Resource();
+  resource->vtbl = g_texture2DVtbl.entries.data();
+  resource->iids = { &__uuidof(IUnknown), &__uuidof(ID3D11DeviceChild),
+    &__uuidof(ID3D11Resource), &__uuidof(ID3D11Texture2D) };
+  resource->device = pDevice;
+  resource->destroy = &destroyObject<Resource>;
+  resource->dim = D3D11_RESOURCE_DIMENSION_TEXTURE2D;
+  resource->textureDesc = *pDesc;
+  resource->rowPitch = pDesc->Width * atfix::getFormatPixelSize(pDesc->Format);
+  resource->storage.resize(resource->rowPitch * pDesc->Height);
+
+  Object_AddRef(pDevice);
+  return resource;
+}
+
+
+/**
+ * \brief Mock render target, depth-stencil or unordered access view
+ */
+struct View : Object {
+  Resource* resource = nullptr;
+
+  D3D11_RENDER_TARGET_VIEW_DESC     rtvDesc = { };
+  D3D11_DEPTH_STENCIL_VIEW_DESC     dsvDesc = { };
+  D3D11_UNORDERED_ACCESS_VIEW_DESC  uavDesc = { };
+
+  ~View() {
+    Object_Release(resource);
+  }
+};
+
+
+void STDMETHODCALLTYPE View_GetResource(View* pSelf, ID3D11Resource** ppResource) {
+  Object_AddRef(pSelf->resource);
+  *ppResource = reinterpret_cast<ID3D11Resource*>(pSelf->resource);
+}
+
+
+void STDMETHODCALLTYPE RenderTargetView_GetDesc(View* pSelf, D3D11_RENDER_TARGET_VIEW_DESC* pDesc) {
+  *pDesc = pSelf->rtvDesc;
+}
+
+
+void STDMETHODCALLTYPE DepthStencilView_GetDesc(View* pSelf, D3D11_DEPTH_STENCIL_VIEW_DESC* pDesc) {
+  *pDesc = pSelf->dsvDesc;
+}
+
+
+void STDMETHODCALLTYPE UnorderedAccessView_GetDesc(View* pSelf, D3D11_UNORDERED_ACCESS_VIEW_DESC* pDesc) {
+  *pDesc = pSelf->uavDesc;
+}
+
+
+template<typename Fn>
+Vtable<9> createViewVtable(Fn* pGetDesc) {
+  Vtable<9> vtbl;
+  initDeviceChildVtable(vtbl);
+  vtbl.set(7, &View_GetResource);
+  vtbl.set(8, pGetDesc);
+  return vtbl;
+}
+
+
+const Vtable<9> g_rtvVtbl = createViewVtable(&RenderTargetView_GetDesc);
+const Vtable<9> g_dsvVtbl = createViewVtable(&DepthStencilView_GetDesc);
+const Vtable<9> g_uavVtbl = createViewVtable(&UnorderedAccessView_GetDesc);
+
+
+View* createView(Resource* pResource, const void* pVtbl, const GUID* pIid) {
+  auto view = new View();
+  view->vtbl = reinterpret_cast<void* const*>(pVtbl);
+  view->iids = { &__uuidof(IUnknown), &__uuidof(ID3D11DeviceChild),
+    &__uuidof(ID3D11View), pIid };
+  view->device = pResource->device;
+  view->destroy = &destroyObject<View>;
+  view->resource = pResource;
+
+  Object_AddRef(view->device);
+  Object_AddRef(pResource);
+  return view;
+}
+
+
+ID3D11RenderTargetView* createRenderTargetView(Resource* pResource) {
+  View* view = createView(pResource, g_rtvVtbl.entries.data(), &__uuidof(ID3D11RenderTargetView));
+  view->rtvDesc.Format = pResource->textureDesc.Format;
+  view->rtvDesc.ViewDimension = D3D11_RTV_DIMENSION_TEXTURE2D;
+  return reinterpret_cast<ID3D11RenderTargetView*>(view);
+}
+
+
+ID3D11DepthStencilView* createDepthStencilView(Resource* pResource) {
+  View* view = createView(pResource, g_dsvVtbl.entries.data(), &__uuidof(ID3D11DepthStencilView));
+  view->dsvDesc.Format = pResource->textureDesc.Format;
+  view->dsvDesc.ViewDimension = D3D11_DSV_DIMENSION_TEXTURE2D;
+  return reinterpret_cast<ID3D11DepthStencilView*>(view);
+}
+
+
+ID3D11UnorderedAccessView* createUnorderedAccessView(Resource* pResource) {
+  View* view = createView(pResource, g_uavVtbl.entries.data(), &__uuidof(ID3D11UnorderedAccessView));
+  view->uavDesc.Format = DXGI_FORMAT_R32_TYPELESS;
+  view->uavDesc.ViewDimension = D3D11_UAV_DIMENSION_BUFFER;
+  view->uavDesc.Buffer.FirstElement = 0;
+  view->uavDesc.Buffer.NumElements = pResource->bufferDesc.ByteWidth / 4;
+  view->uavDesc.Buffer.Flags = D3D11_BUFFER_UAV_FLAG_RAW;
+  return reinterpret_cast<ID3D11UnorderedAccessView*>(view);
+}
+
+
+/**
+ * \brief Mock query
+ *
+ * Always reports completion, as if the GPU was infinitely fast.
+ */
+struct Query : Object {
+  D3D11_QUERY_DESC desc = { };
+};
+
+
+UINT STDMETHODCALLTYPE Query_GetDataSize(Query* pSelf) {
+  return 0;
+}
+
+
+void STDMETHODCALLTYPE Query_GetDesc(Query* pSelf, D3D11_QUERY_DESC* pDesc) {
+  *pDesc = pSelf->desc;
+}
+
+
+Vtable<9> createQueryVtable() {
+  Vtable<9> vtbl;
+  initDeviceChildVtable(vtbl);
+  vtbl.set(7, &Query_GetDataSize);
+  vtbl.set(8, &Query_GetDesc);
+  return vtbl;
+}
+
+
+const Vtable<9> g_queryVtbl = createQueryVtable();
+
+
+/**
+ * \brief Mock immediate context
+ *
+ * Tracks bound render targets and UAVs, since atfix reads them back
+ * to update shadow resources, and counts calls per vtable entry.
+ */
+struct Context : Object {
+  std::array<ID3D11RenderTargetView*, D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT> rtvs = { };
+  std::array<ID3D11UnorderedAccessView*, D3D11_PS_CS_UAV_REGISTER_COUNT> omUavs = { };
+  std::array<ID3D11UnorderedAccessView*, D3D11_PS_CS_UAV_REGISTER_COUNT> csUavs = { };
+  ID3D11DepthStencilView* dsv = nullptr;
+
+  std::array<uint64_t, 115> calls = { };
+};
+
+
+template<typename T>
+void bindView(T*& pSlot, T* pView) {
+  if (pView)
+    pView->AddRef();
+
+  if (pSlot)
+    pSlot->Release();
+
+  pSlot = pView;
+}
+
+
+template<typename T>
+T* getView(T* pView) {
+  if (pView)
+    pView->AddRef();
+
+  return pView;
+}
+
+
+void record(Context* pSelf, uint32_t Index, bool Work) {
+  pSelf->calls[Index]++;
+
+  if (Work)
+    simulateLatency();
+}
+
+
+void STDMETHODCALLTYPE Context_DrawIndexed(Context* pSelf, UINT IndexCount, UINT StartIndex, INT BaseVertex) {
+  record(pSelf, 12, true);
+}
+
+
+void STDMETHODCALLTYPE Context_Draw(Context* pSelf, UINT VertexCount, UINT StartVertex) {
+  record(pSelf, 13, true);
+}
+
+
+HRESULT STDMETHODCALLTYPE Context_Map(Context* pSelf, Resource* pResource, UINT Subresource, D3D11_MAP MapType, UINT MapFlags, D3D11_MAPPED_SUBRESOURCE* pMappedResource) {
+  record(pSelf, 14, false);
+
+  if (Subresource || pResource->storage.empty())
+    return E_INVALIDARG;
+
+  pMappedResource->pData = pResource->storage.data();
+  pMappedResource->RowPitch = pResource->rowPitch;
+  pMappedResource->DepthPitch = pResource->storage.size();
+  return S_OK;
+}
+
+
+void STDMETHODCALLTYPE Context_Unmap(Context* pSelf, Resource* pResource, UINT Subresource) {
+  record(pSelf, 15, false);
+}
+
+
+void STDMETHODCALLTYPE Context_DrawIndexedInstanced(Context* pSelf, UINT IndexCount, UINT InstanceCount, UINT StartIndex, INT BaseVertex, UINT StartInstance) {
+  record(pSelf, 20, true);
+}
+
+
+void STDMETHODCALLTYPE Context_DrawInstanced(Context* pSelf, UINT VertexCount, UINT InstanceCount, UINT StartVertex, UINT StartInstance) {
+  record(pSelf, 21, true);
+}
+
+
+void STDMETHODCALLTYPE Context_Begin(Context* pSelf, ID3D11Asynchronous* pAsync) {
+  record(pSelf, 27, false);
+}
+
+
+void STDMETHODCALLTYPE Context_End(Context* pSelf, ID3D11Asynchronous* pAsync) {
+  record(pSelf, 28, false);
+}
+
+
+HRESULT STDMETHODCALLTYPE Context_GetData(Context* pSelf, ID3D11Asynchronous* pAsync, void* pData, UINT DataSize, UINT Flags) {
+  record(pSelf, 29, false);
+  return S_OK;
+}
+
+
+void STDMETHODCALLTYPE Context_OMSetRenderTargets(Context* pSelf, UINT NumRTVs, ID3D11RenderTargetView* const* ppRTVs, ID3D11DepthStencilView* pDSV) {
+  record(pSelf, 33, true);
+
+  for (uint32_t i = 0; i < pSelf->rtvs.size(); i++)
+    bindView(pSelf->rtvs[i], i < NumRTVs ? ppRTVs[i] : nullptr);
+
+  bindView(pSelf->dsv, pDSV);
+}
+
+
+void STDMETHODCALLTYPE Context_OMSetRenderTargetsAndUnorderedAccessViews(Context* pSelf, UINT NumRTVs, ID3D11RenderTargetView* const* ppRTVs, ID3D11DepthStencilView* pDSV, UINT UAVStart, UINT NumUAVs, ID3D11UnorderedAccessView* const* ppUAVs, const UINT* pInitialCounts) {
+  record(pSelf, 34, true);
+
+  if (NumRTVs != D3D11_KEEP_RENDER_TARGETS_AND_DEPTH_STENCIL) {
+    for (uint32_t i = 0; i < pSelf->rtvs.size(); i++)
+      bindView(pSelf->rtvs[i], i < NumRTVs ? ppRTVs[i] : nullptr);
+
+    bindView(pSelf->dsv, pDSV);
+  }
+
+  if (NumUAVs != D3D11_KEEP_UNORDERED_ACCESS_VIEWS) {
+    for (uint32_t i = 0; i < pSelf->omUavs.size(); i++) {
+      bool inRange = i >= UAVStart && i < UAVStart + NumUAVs;
+      bindView(pSelf->omUavs[i], inRange ? ppUAVs[i - UAVStart] : nullptr);
+    }
+  }
+}
+
+
+void STDMETHODCALLTYPE Context_DrawAuto(Context* pSelf) {
+  record(pSelf, 38, true);
+}
+
+
+void STDMETHODCALLTYPE Context_DrawIndexedInstancedIndirect(Context* pSelf, ID3D11Buffer* pArgs, UINT Offset) {
+  record(pSelf, 39, true);
+}
+
+
+void STDMETHODCALLTYPE Context_DrawInstancedIndirect(Context* pSelf, ID3D11Buffer* pArgs, UINT Offset) {
+  record(pSelf, 40, true);
+}
+
+
+void STDMETHODCALLTYPE Context_Dispatch(Context* pSelf, UINT X, UINT Y, UINT Z) {
+  record(pSelf, 41, true);
+}
+
+
+void STDMETHODCALLTYPE Context_DispatchIndirect(Context* pSelf, ID3D11Buffer* pArgs, UINT Offset) {
+  record(pSelf, 42, true);
+}
+
+
+void STDMETHODCALLTYPE Context_CopySubresourceRegion(Context* pSelf, ID3D11Resource* pDst, UINT DstSubresource, UINT DstX, UINT DstY, UINT DstZ, ID3D11Resource* pSrc, UINT SrcSubresource, const D3D11_BOX* pSrcBox) {
+  record(pSelf, 46, true);
+}
+
+
+void STDMETHODCALLTYPE Context_CopyResource(Context* pSelf, ID3D11Resource* pDst, ID3D11Resource* pSrc) {
+  record(pSelf, 47, true);
+}
+
+
+void STDMETHODCALLTYPE Context_UpdateSubresource(Context* pSelf, ID3D11Resource* pDst, UINT DstSubresource, const D3D11_BOX* pDstBox, const void* pData, UINT RowPitch, UINT DepthPitch) {
+  record(pSelf, 48, true);
+}
+
+
+void STDMETHODCALLTYPE Context_CopyStructureCount(Context* pSelf, ID3D11Buffer* pDst, UINT DstOffset, ID3D11UnorderedAccessView* pSrc) {
+  record(pSelf, 49, true);
+}
+
+
+void STDMETHODCALLTYPE Context_ClearRenderTargetView(Context* pSelf, ID3D11RenderTargetView* pRTV, const FLOAT Color[4]) {
+  record(pSelf, 50, true);
+}
+
+
+void STDMETHODCALLTYPE Context_ClearUnorderedAccessViewUint(Context* pSelf, ID3D11UnorderedAccessView* pUAV, const UINT Values[4]) {
+  record(pSelf, 51, true);
+}
+
+
+void STDMETHODCALLTYPE Context_ClearUnorderedAccessViewFloat(Context* pSelf, ID3D11UnorderedAccessView* pUAV, const FLOAT Values[4]) {
+  record(pSelf, 52, true);
+}
+
+
+void STDMETHODCALLTYPE Context_ClearDepthStencilView(Context* pSelf, ID3D11DepthStencilView* pDSV, UINT Flags, FLOAT Depth, UINT8 Stencil) {
+  record(pSelf, 53, true);
+}
+
+
+void STDMETHODCALLTYPE Context_GenerateMips(Context* pSelf, ID3D11ShaderResourceView* pSRV) {
+  record(pSelf, 54, true);
+}
+
+
+void STDMETHODCALLTYPE Context_ResolveSubresource(Context* pSelf, ID3D11Resource* pDst, UINT DstSubresource, ID3D11Resource* pSrc, UINT SrcSubresource, DXGI_FORMAT Format) {
+  record(pSelf, 57, true);
+}
+
+
+void STDMETHODCALLTYPE Context_ExecuteCommandList(Context* pSelf, ID3D11CommandList* pCommandList, BOOL RestoreState) {
+  record(pSelf, 58, true);
+}
+
+
+void STDMETHODCALLTYPE Context_CSSetUnorderedAccessViews(Context* pSelf, UINT StartSlot, UINT NumUAVs, ID3D11UnorderedAccessView* const* ppUAVs, const UINT* pInitialCounts) {
+  record(pSelf, 68, false);
+
+  for (uint32_t i = 0; i < NumUAVs && StartSlot + i < pSelf->csUavs.size(); i++)
+    bindView(pSelf->csUavs[StartSlot + i], ppUAVs[i]);
+}
+
+
+void STDMETHODCALLTYPE Context_OMGetRenderTargets(Context* pSelf, UINT NumRTVs, ID3D11RenderTargetView** ppRTVs, ID3D11DepthStencilView** ppDSV) {
+  record(pSelf, 89, false);
+
+  for (uint32_t i = 0; ppRTVs && i < NumRTVs; i++)
+    ppRTVs[i] = i < pSelf->rtvs.size() ? getView(pSelf->rtvs[i]) : nullptr;
+
+  if (ppDSV)
+    *ppDSV = getView(pSelf->dsv);
+}
+
+
+void STDMETHODCALLTYPE Context_OMGetRenderTargetsAndUnorderedAccessViews(Context* pSelf, UINT NumRTVs, ID3D11RenderTargetView** ppRTVs, ID3D11DepthStencilView** ppDSV, UINT UAVStart, UINT NumUAVs, ID3D11UnorderedAccessView** ppUAVs) {
+  record(pSelf, 90, false);
+
+  for (uint32_t i = 0; ppRTVs && i < NumRTVs; i++)
+    ppRTVs[i] = i < pSelf->rtvs.size() ? getView(pSelf->rtvs[i]) : nullptr;
+
+  if (ppDSV)
+    *ppDSV = getView(pSelf->dsv);
+
+  for (uint32_t i = 0; ppUAVs && i < NumUAVs; i++) {
+    uint32_t slot = UAVStart + i;
+    ppUAVs[i] = slot < pSelf->omUavs.size() ? getView(pSelf->omUavs[slot]) : nullptr;
+  }
+}
+
+
+void STDMETHODCALLTYPE Context_CSGetUnorderedAccessViews(Context* pSelf, UINT StartSlot, UINT NumUAVs, ID3D11UnorderedAccessView** ppUAVs) {
+  record(pSelf, 106, false);
+
+  for (uint32_t i = 0; i < NumUAVs; i++) {
+    uint32_t slot = StartSlot + i;
+    ppUAVs[i] = slot < pSelf->csUavs.size() ? getView(pSelf->csUavs[slot]) : nullptr;
+  }
+}
+
+
+void STDMETHODCALLTYPE Context_ClearState(Context* pSelf) {
+  record(pSelf, 110, false);
+
+  for (auto& rtv : pSelf->rtvs)
+    bindView<ID3D11RenderTargetView>(rtv, nullptr);
+
+  for (auto& uav : pSelf->omUavs)
+    bindView<ID3D11UnorderedAccessView>(uav, nullptr);
+
+  for (auto& uav : pSelf->csUavs)
+    bindView<ID3D11UnorderedAccessView>(uav, nullptr);
+
+  bindView<ID3D11DepthStencilView>(pSelf->dsv, nullptr);
+}
+
+
+void STDMETHODCALLTYPE Context_Flush(Context* pSelf) {
+  record(pSelf, 111, true);
+}
+
+
+D3D11_DEVICE_CONTEXT_TYPE STDMETHODCALLTYPE Context_GetType(Context* pSelf) {
+  return D3D11_DEVICE_CONTEXT_IMMEDIATE;
+}
+
+
+UINT STDMETHODCALLTYPE Context_GetContextFlags(Context* pSelf) {
+  return 0;
+}
+
+
+Vtable<115> createContextVtable() {
+  Vtable<115> vtbl;
+  initDeviceChildVtable(vtbl);
+  vtbl.set(12, &Context_DrawIndexed);
+  vtbl.set(13, &Context_Draw);
+  vtbl.set(14, &Context_Map);
+  vtbl.set(15, &Context_Unmap);
+  vtbl.set(20, &Context_DrawIndexedInstanced);
+  vtbl.set(21, &Context_DrawInstanced);
+  vtbl.set(27, &Context_Begin);
+  vtbl.set(28, &Context_End);
+  vtbl.set(29, &Context_GetData);
+  vtbl.set(33, &Context_OMSetRenderTargets);
+  vtbl.set(34, &Context_OMSetRenderTargetsAndUnorderedAccessViews);
+  vtbl.set(38, &Context_DrawAuto);
+  vtbl.set(39, &Context_DrawIndexedInstancedIndirect);
+  vtbl.set(40, &Context_DrawInstancedIndirect);
+  vtbl.set(41, &Context_Dispatch);
+  vtbl.set(42, &Context_DispatchIndirect);
+  vtbl.set(46, &Context_CopySubresourceRegion);
+  vtbl.set(47, &Context_CopyResource);
+  vtbl.set(48, &Context_UpdateSubresource);
+  vtbl.set(49, &Context_CopyStructureCount);
+  vtbl.set(50, &Context_ClearRenderTargetView);
+  vtbl.set(51, &Context_ClearUnorderedAccessViewUint);
+  vtbl.set(52, &Context_ClearUnorderedAccessViewFloat);
+  vtbl.set(53, &Context_ClearDepthStencilView);
+  vtbl.set(54, &Context_GenerateMips);
+  vtbl.set(57, &Context_ResolveSubresource);
+  vtbl.set(58, &Context_ExecuteCommandList);
+  vtbl.set(68, &Context_CSSetUnorderedAccessViews);
+  vtbl.set(89, &Context_OMGetRenderTargets);
+  vtbl.set(90, &Context_OMGetRenderTargetsAndUnorderedAccessViews);
+  vtbl.set(106, &Context_CSGetUnorderedAccessViews);
+  vtbl.set(110, &Context_ClearState);
+  vtbl.set(111, &Context_Flush);
+  vtbl.set(112, &Context_GetType);
+  vtbl.set(113, &Context_GetContextFlags);
+  return vtbl;
+}
+
+
+const Vtable<115> g_contextVtbl = createContextVtable();
+
+
+/**
+ * \brief Mock device
+ *
+ * Creates the staging resources and queries that atfix needs,
+ * and does not support any newer device interfaces, so that
+ * the GPU timeline falls back to event queries.
+ */
+struct Device : Object {
+  Context* context = nullptr;
+};
+
+
+HRESULT STDMETHODCALLTYPE Device_CreateBuffer(Device* pSelf, const D3D11_BUFFER_DESC* pDesc, const D3D11_SUBRESOURCE_DATA* pData, ID3D11Buffer** ppBuffer) {
+  *ppBuffer = reinterpret_cast<ID3D11Buffer*>(createBuffer(pSelf, pDesc));
+  return S_OK;
+}
+
+
+HRESULT STDMETHODCALLTYPE Device_CreateTexture2D(Device* pSelf, const D3D11_TEXTURE2D_DESC* pDesc, const D3D11_SUBRESOURCE_DATA* pData, ID3D11Texture2D** ppTexture) {
+  if (pDesc->MipLevels != 1 || pDesc->ArraySize != 1)
+    return E_INVALIDARG;
+
+  *ppTexture = reinterpret_cast<ID3D11Texture2D*>(createTexture2D(pSelf, pDesc));
+  return S_OK;
+}
+
+
+HRESULT STDMETHODCALLTYPE Device_CreateQuery(Device* pSelf, const D3D11_QUERY_DESC* pDesc, ID3D11Query** ppQuery) {
+  auto query = new Query();
+  query->vtbl = g_queryVtbl.entries.data();
+  query->iids = { &__uuidof(IUnknown), &__uuidof(ID3D11DeviceChild),
+    &__uuidof(ID3D11Asynchronous), &__uuidof(ID3D11Query) };
+  query->device = pSelf;
+  query->destroy = &destroyObject<Query>;
+  query->desc = *pDesc;
+
+  Object_AddRef(pSelf);
+
+  *ppQuery = reinterpret_cast<ID3D11Query*>(query);
+  return S_OK;
+}
+
+
+HRESULT STDMETHODCALLTYPE Device_GetPrivateData(Device* pSelf, REFGUID guid, UINT* pDataSize, void* pData) {
+  return Object_GetPrivateData(pSelf, guid, pDataSize, pData);
+}
+
+
+HRESULT STDMETHODCALLTYPE Device_SetPrivateData(Device* pSelf, REFGUID guid, UINT DataSize, const void* pData) {
+  return Object_SetPrivateData(pSelf, guid, DataSize, pData);
+}
+
+
+HRESULT STDMETHODCALLTYPE Device_SetPrivateDataInterface(Device* pSelf, REFGUID guid, const IUnknown* pData) {
+  return Object_SetPrivateDataInterface(pSelf, guid, pData);
+}
+
+
+UINT STDMETHODCALLTYPE Device_GetCreationFlags(Device* pSelf) {
+  /* Makes atfix create shadow resources synchronously, which
+   * the scenarios rely on to have them ready after setup */
+  return D3D11_CREATE_DEVICE_SINGLETHREADED;
+}
+
+
+D3D_FEATURE_LEVEL STDMETHODCALLTYPE Device_GetFeatureLevel(Device* pSelf) {
+  return D3D_FEATURE_LEVEL_11_0;
+}
+
+
+void STDMETHODCALLTYPE Device_GetImmediateContext(Device* pSelf, ID3D11DeviceContext** ppContext) {
+  Object_AddRef(pSelf->context);
+  *ppContext = reinterpret_cast<ID3D11DeviceContext*>(pSelf->context);
+}
+
+
+Vtable<43> createDeviceVtable() {
+  Vtable<43> vtbl;
+  vtbl.set(0, &Object_QueryInterface);
+  vtbl.set(1, &Object_AddRef);
+  vtbl.set(2, &Object_Release);
+  vtbl.set(3, &Device_CreateBuffer);
+  vtbl.set(5, &Device_CreateTexture2D);
+  vtbl.set(24, &Device_CreateQuery);
+  vtbl.set(34, &Device_GetPrivateData);
+  vtbl.set(35, &Device_SetPrivateData);
+  vtbl.set(36, &Device_SetPrivateDataInterface);
+  vtbl.set(37, &Device_GetFeatureLevel);
+  vtbl.set(38, &Device_GetCreationFlags);
+  vtbl.set(40, &Device_GetImmediateContext);
+  return vtbl;
+}
+
+
+const Vtable<43> g_deviceVtbl = createDeviceVtable();
+
+
+/** Creates mock device along with its immediate context. Both
+ *  live for the lifetime of the process, like the ones atfix
+ *  hooks in a game. */
+Context* createDevice() {
+  auto device = new Device();
+  device->vtbl = g_deviceVtbl.entries.data();
+  device->iids = { &__uuidof(IUnknown), &__uuidof(ID3D11Device) };
+  device->destroy = &destroyObject<Device>;
+
+  auto context = new Context();
+  context->vtbl = g_contextVtbl.entries.data();
+  context->iids = { &__uuidof(IUnknown), &__uuidof(ID3D11DeviceChild),
+    &__uuidof(ID3D11DeviceContext) };
+  context->device = device;
+  context->destroy = &destroyObject<Context>;
+
+  device->context = context;
+  return context;
+}
+
+}
+
+namespace bench {
+
+using clock = std::chrono::steady_clock;
+
+struct Options {
+  uint32_t iterations   = 100000;
+  uint32_t warmup       = 1000;
+  uint32_t latency      = 0;
+};
+
+struct Counters {
+  uint64_t refOps;
+  uint64_t privateDataOps;
+  uint64_t locks;
+};
+
+struct Result {
+  double ns;
+  double refOps;
+  double privateDataOps;
+  double locks;
+};
+
+struct Scenario {
+  const char* name;
+  std::function<void (ID3D11DeviceContext*)> setup;
+  std::function<void (ID3D11DeviceContext*)> run;
+};
+
+
+void printUsage(const char* pName) {
+  std::printf(
+    "Usage: %s [options]\n"
+    "  --iterations <n>      Number of measured calls per scenario\n"
+    "  --warmup <n>          Number of calls to run before measuring\n"
+    "  --latency <ns>        Simulated runtime cost of methods that record GPU work\n",
+    pName);
+}
+
+
+bool parseOptions(int argc, char** argv, Options* pOptions) {
+  auto next = [&] (int& i) {
+    return i + 1 < argc ? argv[++i] : nullptr;
+  };
+
+  auto nextUint = [&] (int& i, uint32_t* pValue) {
+    const char* arg = next(i);
+
+    if (arg)
+      *pValue = uint32_t(std::strtoul(arg, nullptr, 0));
+
+    return arg != nullptr;
+  };
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool valid = true;
+
+    if (arg == "--iterations") {
+      valid = nextUint(i, &pOptions->iterations);
+    } else if (arg == "--warmup") {
+      valid = nextUint(i, &pOptions->warmup);
+    } else if (arg == "--latency") {
+      valid = nextUint(i, &pOptions->latency);
+    } else {
+      valid = false;
+    }
+
+    if (!valid) {
+      printUsage(argv[0]);
+      return false;
+    }
+  }
+
+  pOptions->iterations = std::max(pOptions->iterations, 1u);
+  return true;
+}
+
+
+Counters getCounters() {
+  Counters counters;
+  counters.refOps = mock::g_refOps.load();
+  counters.privateDataOps = mock::g_privateDataOps.load();
+#ifdef ATFIX_LOCK_STATS
+  counters.locks = atfix::g_lockCount.load();
+#else
+  counters.locks = 0;
+#endif
+  return counters;
+}
+
+
+Result runScenario(
+  const Options&                  options,
+        ID3D11DeviceContext*      pContext,
+  const Scenario&                 scenario) {
+  pContext->ClearState();
+
+  if (scenario.setup)
+    scenario.setup(pContext);
+
+  for (uint32_t i = 0; i < options.warmup; i++)
+    scenario.run(pContext);
+
+  Counters before = getCounters();
+  auto t0 = clock::now();
+
+  for (uint32_t i = 0; i < options.iterations; i++)
+    scenario.run(pContext);
+
+  auto t1 = clock::now();
+  Counters after = getCounters();
+
+  double n = double(options.iterations);
+
+  Result result;
+  result.ns = double(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count()) / n;
+  result.refOps = double(after.refOps - before.refOps) / n;
+  result.privateDataOps = double(after.privateDataOps - before.privateDataOps) / n;
+  result.locks = double(after.locks - before.locks) / n;
+  return result;
+}
+
+
+void release(IUnknown* pObject) {
+  if (pObject)
+    pObject->Release();
+}
+
+}
+
+int main(int argc, char** argv) {
+  using namespace bench;
+
+  Options options;
+
+  if (!parseOptions(argc, argv, &options))
+    return 1;
+
+  mock::g_latencyNs = options.latency;
+
+  if (MH_Initialize() != MH_OK) {
+    std::fprintf(stderr, "Failed to initialize MinHook\n");
+    return 1;
+  }
+
+  mock::Context* mockContext = mock::createDevice();
+  mock::Object* mockDevice = mockContext->device;
+
+  auto context = reinterpret_cast<ID3D11DeviceContext*>(mockContext);
+
+  /* Resources used by the scenarios. Render targets and UAV buffers
+   * come in pairs, one of which gets a shadow resource by copying it
+   * to a staging resource once atfix is active. */
+  D3D11_TEXTURE2D_DESC rtDesc = { };
+  rtDesc.Width = 256;
+  rtDesc.Height = 256;
+  rtDesc.MipLevels = 1;
+  rtDesc.ArraySize = 1;
+  rtDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+  rtDesc.SampleDesc = { 1, 0 };
+  rtDesc.Usage = D3D11_USAGE_DEFAULT;
+  rtDesc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
+
+  D3D11_TEXTURE2D_DESC dsDesc = rtDesc;
+  dsDesc.Format = DXGI_FORMAT_D32_FLOAT;
+  dsDesc.BindFlags = D3D11_BIND_DEPTH_STENCIL;
+
+  D3D11_TEXTURE2D_DESC rtStagingDesc = rtDesc;
+  rtStagingDesc.Usage = D3D11_USAGE_STAGING;
+  rtStagingDesc.BindFlags = 0;
+  rtStagingDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ | D3D11_CPU_ACCESS_WRITE;
+
+  D3D11_BUFFER_DESC bufferDesc = { };
+  bufferDesc.ByteWidth = 64u << 10;
+  bufferDesc.Usage = D3D11_USAGE_DEFAULT;
+  bufferDesc.BindFlags = D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE;
+  bufferDesc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
+
+  D3D11_BUFFER_DESC bufferStagingDesc = bufferDesc;
+  bufferStagingDesc.Usage = D3D11_USAGE_STAGING;
+  bufferStagingDesc.BindFlags = 0;
+  bufferStagingDesc.MiscFlags = 0;
+  bufferStagingDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ | D3D11_CPU_ACCESS_WRITE;
+
+  std::array<mock::Resource*, 2> rts = { };
+  std::array<mock::Resource*, 2> buffers = { };
+  std::array<ID3D11RenderTargetView*, 2> rtvs = { };
+  std::array<ID3D11UnorderedAccessView*, 2> uavs = { };
+
+  for (size_t i = 0; i < rts.size(); i++) {
+    rts[i] = mock::createTexture2D(mockDevice, &rtDesc);
+    rtvs[i] = mock::createRenderTargetView(rts[i]);
+  }
+
+  for (size_t i = 0; i < buffers.size(); i++) {
+    buffers[i] = mock::createBuffer(mockDevice, &bufferDesc);
+    uavs[i] = mock::createUnorderedAccessView(buffers[i]);
+  }
+
+  mock::Resource* ds = mock::createTexture2D(mockDevice, &dsDesc);
+  ID3D11DepthStencilView* dsv = mock::createDepthStencilView(ds);
+
+  auto rtStaging = reinterpret_cast<ID3D11Resource*>(mock::createTexture2D(mockDevice, &rtStagingDesc));
+  auto bufferStaging = reinterpret_cast<ID3D11Resource*>(mock::createBuffer(mockDevice, &bufferStagingDesc));
+
+  auto plainRt = reinterpret_cast<ID3D11Resource*>(rts[0]);
+  auto shadowedRt = reinterpret_cast<ID3D11Resource*>(rts[1]);
+  auto plainBuffer = reinterpret_cast<ID3D11Resource*>(buffers[0]);
+  auto shadowedBuffer = reinterpret_cast<ID3D11Resource*>(buffers[1]);
+
+  std::array<uint32_t, 16> data = { };
+  std::array<float, 4> clearColor = { 0.0f, 0.0f, 0.0f, 1.0f };
+
+  const std::vector<Scenario> scenarios = {
+    { "OMSetRenderTargets, 1 RTV + DSV", nullptr,
+      [&] (ID3D11DeviceContext* ctx) {
+        ctx->OMSetRenderTargets(1, &rtvs[0], dsv);
+      } },
+    { "OMSetRenderTargets, shadowed RTV", [&] (ID3D11DeviceContext* ctx) {
+        ctx->CopyResource(rtStaging, shadowedRt);
+      },
+      [&] (ID3D11DeviceContext* ctx) {
+        ctx->OMSetRenderTargets(1, &rtvs[1], nullptr);
+      } },
+    { "OMSetRenderTargetsAndUAVs, 1 RTV + 1 UAV", nullptr,
+      [&] (ID3D11DeviceContext* ctx) {
+        ctx->OMSetRenderTargetsAndUnorderedAccessViews(1, &rtvs[0], nullptr, 1, 1, &uavs[0], nullptr);
+      } },
+    { "Dispatch, 1 UAV", [&] (ID3D11DeviceContext* ctx) {
+        ctx->CSSetUnorderedAccessViews(0, 1, &uavs[0], nullptr);
+      },
+      [&] (ID3D11DeviceContext* ctx) {
+        ctx->Dispatch(1, 1, 1);
+      } },
+    { "Dispatch, 2 UAVs, 1 shadowed", [&] (ID3D11DeviceContext* ctx) {
+        ctx->CopyResource(bufferStaging, shadowedBuffer);
+        ctx->CSSetUnorderedAccessViews(0, 2, uavs.data(), nullptr);
+      },
+      [&] (ID3D11DeviceContext* ctx) {
+        ctx->Dispatch(1, 1, 1);
+      } },
+    { "Draw", nullptr,
+      [&] (ID3D11DeviceContext* ctx) {
+        ctx->Draw(3, 0);
+      } },
+    { "CopyResource, GPU to GPU", nullptr,
+      [&] (ID3D11DeviceContext* ctx) {
+        ctx->CopyResource(plainRt, shadowedRt);
+      } },
+    { "CopyResource, GPU to staging", nullptr,
+      [&] (ID3D11DeviceContext* ctx) {
+        ctx->CopyResource(bufferStaging, shadowedBuffer);
+      } },
+    { "UpdateSubresource, shadowed buffer", nullptr,
+      [&] (ID3D11DeviceContext* ctx) {
+        D3D11_BOX box = { 0, 0, 0, sizeof(data), 1, 1 };
+        ctx->UpdateSubresource(shadowedBuffer, 0, &box, data.data(), 0, 0);
+      } },
+    { "UpdateSubresource, plain buffer", nullptr,
+      [&] (ID3D11DeviceContext* ctx) {
+        D3D11_BOX box = { 0, 0, 0, sizeof(data), 1, 1 };
+        ctx->UpdateSubresource(plainBuffer, 0, &box, data.data(), 0, 0);
+      } },
+    { "ClearRenderTargetView, shadowed RTV", nullptr,
+      [&] (ID3D11DeviceContext* ctx) {
+        ctx->ClearRenderTargetView(rtvs[1], clearColor.data());
+      } },
+    { "ClearUnorderedAccessViewFloat", nullptr,
+      [&] (ID3D11DeviceContext* ctx) {
+        ctx->ClearUnorderedAccessViewFloat(uavs[0], clearColor.data());
+      } },
+    { "ClearDepthStencilView", nullptr,
+      [&] (ID3D11DeviceContext* ctx) {
+        ctx->ClearDepthStencilView(dsv, D3D11_CLEAR_DEPTH, 1.0f, 0);
+      } },
+  };
+
+  std::vector<Result> baseline;
+
+  for (const auto& scenario : scenarios)
+    baseline.push_back(runScenario(options, context, scenario));
+
+  atfix::hookContext(context);
+
+  std::printf("%-42s %10s %10s %10s %8s %8s %8s\n", "Scenario",
+    "Base ns", "Hooked ns", "Delta ns", "Refs", "PrivData", "Locks");
+
+  for (size_t i = 0; i < scenarios.size(); i++) {
+    Result hooked = runScenario(options, context, scenarios[i]);
+
+    std::printf("%-42s %10.1f %10.1f %10.1f %8.2f %8.2f %8.2f\n", scenarios[i].name,
+      baseline[i].ns, hooked.ns, hooked.ns - baseline[i].ns,
+      hooked.refOps - baseline[i].refOps,
+      hooked.privateDataOps - baseline[i].privateDataOps,
+      hooked.locks - baseline[i].locks);
+  }
+
+  std::printf("\nRefs, PrivData and Locks are per call, on top of the unhooked mock.\n");
+
+  context->ClearState();
+
+  release(dsv);
+  release(rtStaging);
+  release(bufferStaging);
+
+  for (auto rtv : rtvs)
+    release(rtv);
+
+  for (auto uav : uavs)
+    release(uav);
+
+  for (auto rt : rts)
+    mock::Object_Release(rt);
+
+  for (auto buffer : buffers)
+    mock::Object_Release(buffer);
+
+  mock::Object_Release(ds);
+
+  /* The device and context are kept alive, since atfix
+   * holds on to them through per-context objects anyway. */
+  return 0;
+}
@@ -0,0 +1,848 @@
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <d3d11_4.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "../log.h"
+#include "../util.h"
+
+#ifdef _MSC_VER
+  #define DLLEXPORT
+#else
+  #define DLLEXPORT __declspec(dllexport)
+#endif
+
+/**
+ * D3D11 proxy that models GPU completion latency, so that stalls
+ * can be measured reproducibly without a GPU. atfix loads it
+ * instead of the system d3d11.dll if it is placed next to the
+ * executable as \c d3d11_proxy.dll.
+ *
+ * The proxy creates a device through the system d3d11.dll and
+ * replaces the vtable pointer of the immediate context with a
+ * copy of the original vtable, in which methods that submit GPU
+ * work, Map, Flush and query methods are overridden. The driver
+ * still does all the actual work, but the proxy keeps its own GPU
+ * timeline on top of it:
+ *
+ * - Work is recorded until the context is flushed, explicitly or
+ *   because a resource or query with pending work was accessed.
+ *   Submitted work starts after a fixed latency, or once earlier
+ *   work has completed, and takes a modelled amount of time.
+ * - Resources used by copies and updates, as well as queries, are
+ *   busy until the submission that used them completes. Maps of
+ *   busy resources block until then, or fail with
+ *   \c DXGI_ERROR_WAS_STILL_DRAWING if \c DO_NOT_WAIT is set, and
+ *   query data is not available before then.
+ * - Draws, dispatches and clears only add GPU time, since readbacks
+ *   always involve a copy that keeps the affected resources busy.
+ *
+ * Stall counts and modelled stall time are written to
+ * \c d3d11_proxy.log when the process exits. Deferred contexts
+ * are not modelled, their command lists only add GPU time.
+ */
+namespace proxy {
+
+using clock = std::chrono::steady_clock;
+
+atfix::Log log("d3d11_proxy.log");
+
+struct Options {
+  /* Time between a flush and the GPU starting the work */
+  clock::duration latency;
+  /* GPU time of a draw, dispatch or clear */
+  clock::duration drawCost;
+  /* Copy throughput in bytes per microsecond, i.e. MB/s */
+  uint64_t        copyRate;
+};
+
+
+uint32_t getEnvNumber(
+  const char*                     pName,
+        uint32_t                  Default) {
+  const char* value = std::getenv(pName);
+
+  if (!value || !value[0])
+    return Default;
+
+  return uint32_t(std::strtoul(value, nullptr, 10));
+}
+
+
+Options getOptions() {
+  Options options = { };
+  options.latency = std::chrono::microseconds(getEnvNumber("ATFIX_PROXY_LATENCY", 2000));
+  options.drawCost = std::chrono::microseconds(getEnvNumber("ATFIX_PROXY_DRAW_COST", 10));
+  options.copyRate = std::max(getEnvNumber("ATFIX_PROXY_COPY_RATE", 8000), 1u);
+  return options;
+}
+
+
+/** Approximate size of a texel in bytes. Block-compressed
+ *  formats are rounded up to one byte per texel. */
+uint32_t getFormatSize(
+        DXGI_FORMAT               Format) {
+  switch (Format) {
+    case DXGI_FORMAT_R32G32B32A32_TYPELESS:
+    case DXGI_FORMAT_R32G32B32A32_FLOAT:
+    case DXGI_FORMAT_R32G32B32A32_UINT:
+    case DXGI_FORMAT_R32G32B32A32_SINT:
+      return 16;
+
+    case DXGI_FORMAT_R16G16B16A16_TYPELESS:
+    case DXGI_FORMAT_R16G16B16A16_FLOAT:
+    case DXGI_FORMAT_R16G16B16A16_UNORM:
+    case DXGI_FORMAT_R16G16B16A16_UINT:
+    case DXGI_FORMAT_R16G16B16A16_SNORM:
+    case DXGI_FORMAT_R16G16B16A16_SINT:
+    case DXGI_FORMAT_R32G32_TYPELESS:
+    case DXGI_FORMAT_R32G32_FLOAT:
+    case DXGI_FORMAT_R32G32_UINT:
+    case DXGI_FORMAT_R32G32_SINT:
+      return 8;
+
+    case DXGI_FORMAT_R8G8_TYPELESS:
+    case DXGI_FORMAT_R8G8_UNORM:
+    case DXGI_FORMAT_R8G8_UINT:
+    case DXGI_FORMAT_R8G8_SNORM:
+    case DXGI_FORMAT_R8G8_SINT:
+    case DXGI_FORMAT_R16_TYPELESS:
+    case DXGI_FORMAT_R16_FLOAT:
+    case DXGI_FORMAT_D16_UNORM:
+    case DXGI_FORMAT_R16_UNORM:
+    case DXGI_FORMAT_R16_UINT:
+    case DXGI_FORMAT_R16_SNORM:
+    case DXGI_FORMAT_R16_SINT:
+      return 2;
+
+    case DXGI_FORMAT_R8_TYPELESS:
+    case DXGI_FORMAT_R8_UNORM:
+    case DXGI_FORMAT_R8_UINT:
+    case DXGI_FORMAT_R8_SNORM:
+    case DXGI_FORMAT_R8_SINT:
+    case DXGI_FORMAT_A8_UNORM:
+    case DXGI_FORMAT_BC1_TYPELESS:
+    case DXGI_FORMAT_BC1_UNORM:
+    case DXGI_FORMAT_BC1_UNORM_SRGB:
+    case DXGI_FORMAT_BC2_TYPELESS:
+    case DXGI_FORMAT_BC2_UNORM:
+    case DXGI_FORMAT_BC2_UNORM_SRGB:
+    case DXGI_FORMAT_BC3_TYPELESS:
+    case DXGI_FORMAT_BC3_UNORM:
+    case DXGI_FORMAT_BC3_UNORM_SRGB:
+    case DXGI_FORMAT_BC4_TYPELESS:
+    case DXGI_FORMAT_BC4_UNORM:
+    case DXGI_FORMAT_BC4_SNORM:
+    case DXGI_FORMAT_BC5_TYPELESS:
+    case DXGI_FORMAT_BC5_UNORM:
+    case DXGI_FORMAT_BC5_SNORM:
+    case DXGI_FORMAT_BC6H_TYPELESS:
+    case DXGI_FORMAT_BC6H_UF16:
+    case DXGI_FORMAT_BC6H_SF16:
+    case DXGI_FORMAT_BC7_TYPELESS:
+    case DXGI_FORMAT_BC7_UNORM:
+    case DXGI_FORMAT_BC7_UNORM_SRGB:
+      return 1;
+
+    default:
+      return 4;
+  }
+}
+
+
+/** Computes the number of bytes in a subresource region */
+uint64_t getRegionSize(
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+  const D3D11_BOX*                pBox) {
+  D3D11_RESOURCE_DIMENSION dim = D3D11_RESOURCE_DIMENSION_UNKNOWN;
+  pResource->GetType(&dim);
+
+  uint64_t w = 1, h = 1, d = 1;
+  uint32_t mip = 0;
+  uint32_t formatSize = 1;
+
+  switch (dim) {
+    case D3D11_RESOURCE_DIMENSION_BUFFER: {
+      D3D11_BUFFER_DESC desc = { };
+      static_cast<ID3D11Buffer*>(pResource)->GetDesc(&desc);
+      w = desc.ByteWidth;
+    } break;
+
+    case D3D11_RESOURCE_DIMENSION_TEXTURE1D: {
+      D3D11_TEXTURE1D_DESC desc = { };
+      static_cast<ID3D11Texture1D*>(pResource)->GetDesc(&desc);
+      mip = Subresource % desc.MipLevels;
+      w = desc.Width;
+      formatSize = getFormatSize(desc.Format);
+    } break;
+
+    case D3D11_RESOURCE_DIMENSION_TEXTURE2D: {
+      D3D11_TEXTURE2D_DESC desc = { };
+      static_cast<ID3D11Texture2D*>(pResource)->GetDesc(&desc);
+      mip = Subresource % desc.MipLevels;
+      w = desc.Width;
+      h = desc.Height;
+      formatSize = getFormatSize(desc.Format) * desc.SampleDesc.Count;
+    } break;
+
+    case D3D11_RESOURCE_DIMENSION_TEXTURE3D: {
+      D3D11_TEXTURE3D_DESC desc = { };
+      static_cast<ID3D11Texture3D*>(pResource)->GetDesc(&desc);
+      mip = Subresource % desc.MipLevels;
+      w = desc.Width;
+      h = desc.Height;
+      d = desc.Depth;
+      formatSize = getFormatSize(desc.Format);
+    } break;
+
+    default:
+      return 0;
+  }
+
+  w = std::max<uint64_t>(w >> mip, 1u);
+  h = std::max<uint64_t>(h >> mip, 1u);
+  d = std::max<uint64_t>(d >> mip, 1u);
+
+  if (pBox) {
+    w = pBox->right > pBox->left ? pBox->right - pBox->left : 0;
+    h = pBox->bottom > pBox->top ? pBox->bottom - pBox->top : 0;
+    d = pBox->back > pBox->front ? pBox->back - pBox->front : 0;
+  }
+
+  return w * h * d * formatSize;
+}
+
+
+/** Computes the number of bytes in all subresources */
+uint64_t getResourceSize(
+        ID3D11Resource*           pResource) {
+  D3D11_RESOURCE_DIMENSION dim = D3D11_RESOURCE_DIMENSION_UNKNOWN;
+  pResource->GetType(&dim);
+
+  uint32_t count = 1;
+
+  if (dim == D3D11_RESOURCE_DIMENSION_TEXTURE1D) {
+    D3D11_TEXTURE1D_DESC desc = { };
+    static_cast<ID3D11Texture1D*>(pResource)->GetDesc(&desc);
+    count = desc.MipLevels * desc.ArraySize;
+  } else if (dim == D3D11_RESOURCE_DIMENSION_TEXTURE2D) {
+    D3D11_TEXTURE2D_DESC desc = { };
+    static_cast<ID3D11Texture2D*>(pResource)->GetDesc(&desc);
+    count = desc.MipLevels * desc.ArraySize;
+  } else if (dim == D3D11_RESOURCE_DIMENSION_TEXTURE3D) {
+    D3D11_TEXTURE3D_DESC desc = { };
+    static_cast<ID3D11Texture3D*>(pResource)->GetDesc(&desc);
+    count = desc.MipLevels;
+  }
+
+  uint64_t size = 0;
+
+  for (uint32_t i = 0; i < count; i++)
+    size += getRegionSize(pResource, i, nullptr);
+
+  return size;
+}
+
+
+/**
+ * \brief Simulated GPU timeline
+ *
+ * Shared by all immediate contexts, since they share a GPU.
+ * Objects are only used as keys and are not referenced, so
+ * a released object may leave an outdated entry behind, which
+ * is harmless since it only delays access to the same address
+ * until work that was already submitted completes.
+ */
+class SimulatedGpu {
+
+public:
+
+  SimulatedGpu(const Options& options)
+  : m_options(options) {
+    log("Latency: ", std::chrono::duration_cast<std::chrono::microseconds>(m_options.latency).count(), " us",
+      ", draw cost: ", std::chrono::duration_cast<std::chrono::microseconds>(m_options.drawCost).count(), " us",
+      ", copy rate: ", m_options.copyRate, " MB/s");
+  }
+
+  const Options& getOptions() const {
+    return m_options;
+  }
+
+  /** Records work that takes the given GPU time */
+  void addWork(
+          clock::duration           Cost) {
+    std::lock_guard lock(m_mutex);
+    m_pendingCost += Cost;
+  }
+
+  /** Records a copy of the given size between two objects */
+  void addCopy(
+          uint64_t                  Size,
+          void*                     pDst,
+          void*                     pSrc) {
+    std::lock_guard lock(m_mutex);
+    m_pendingCost += std::chrono::microseconds(Size / m_options.copyRate);
+    m_pending.insert(pDst);
+
+    if (pSrc)
+      m_pending.insert(pSrc);
+  }
+
+  /** Records that an object is used by pending work */
+  void addObject(
+          void*                     pObject) {
+    std::lock_guard lock(m_mutex);
+    m_pending.insert(pObject);
+  }
+
+  /** Submits pending work */
+  void flush() {
+    std::lock_guard lock(m_mutex);
+    submit();
+  }
+
+  /** Waits for the object to become idle, as Map does.
+   *  Fails if \c DoNotWait is set and the object is busy. */
+  HRESULT wait(
+          void*                     pObject,
+          bool                      DoNotWait) {
+    std::unique_lock lock(m_mutex);
+
+    /* Drivers submit pending work if the CPU needs its results */
+    if (m_pending.count(pObject)) {
+      m_implicitFlushes += 1;
+      submit();
+    }
+
+    auto entry = m_busy.find(pObject);
+
+    if (entry == m_busy.end())
+      return S_OK;
+
+    auto now = clock::now();
+    auto until = entry->second;
+
+    if (until <= now) {
+      m_busy.erase(entry);
+      return S_OK;
+    }
+
+    if (DoNotWait) {
+      m_failedMaps += 1;
+      return DXGI_ERROR_WAS_STILL_DRAWING;
+    }
+
+    m_blockingMaps += 1;
+    m_stallTime += until - now;
+
+    lock.unlock();
+    waitUntil(until);
+    return S_OK;
+  }
+
+  /** Checks whether query data is not available yet, and
+   *  submits pending work unless \c DoNotFlush is set. */
+  bool isBusy(
+          void*                     pObject,
+          bool                      DoNotFlush) {
+    std::lock_guard lock(m_mutex);
+
+    if (m_pending.count(pObject)) {
+      if (DoNotFlush)
+        return true;
+
+      m_implicitFlushes += 1;
+      submit();
+    }
+
+    auto entry = m_busy.find(pObject);
+
+    if (entry == m_busy.end())
+      return false;
+
+    if (entry->second > clock::now())
+      return true;
+
+    m_busy.erase(entry);
+    return false;
+  }
+
+  void writeStats() {
+    std::lock_guard lock(m_mutex);
+
+    log("Submissions: ", m_submissions, " (", m_implicitFlushes, " implicit)");
+    log("Blocking maps: ", m_blockingMaps, ", stalled for ",
+      std::chrono::duration<double, std::milli>(m_stallTime).count(), " ms");
+    log("Failed DO_NOT_WAIT maps: ", m_failedMaps);
+  }
+
+private:
+
+  atfix::mutex                                  m_mutex;
+  Options                                       m_options;
+
+  clock::duration                               m_pendingCost = clock::duration::zero();
+  std::unordered_set<void*>                     m_pending;
+
+  clock::time_point                             m_idleTime;
+  std::unordered_map<void*, clock::time_point>  m_busy;
+
+  uint64_t                                      m_submissions     = 0u;
+  uint64_t                                      m_implicitFlushes = 0u;
+  uint64_t                                      m_blockingMaps    = 0u;
+  uint64_t                                      m_failedMaps      = 0u;
+  clock::duration                               m_stallTime       = clock::duration::zero();
+
+  void submit() {
+    if (m_pending.empty() && m_pendingCost == clock::duration::zero())
+      return;
+
+    /* The GPU processes submissions in order */
+    auto now = clock::now();
+    auto start = std::max(now + m_options.latency, m_idleTime);
+    m_idleTime = start + m_pendingCost;
+
+    for (void* object : m_pending)
+      m_busy[object] = m_idleTime;
+
+    m_pending.clear();
+    m_pendingCost = clock::duration::zero();
+    m_submissions += 1;
+
+    /* Drop completed entries once in a while */
+    if (m_busy.size() > 4096) {
+      for (auto i = m_busy.begin(); i != m_busy.end(); ) {
+        if (i->second <= now)
+          i = m_busy.erase(i);
+        else
+          i++;
+      }
+    }
+  }
+
+  static void waitUntil(
+          clock::time_point         Time) {
+    /* Sleep is too coarse for sub-millisecond waits */
+    auto coarse = Time - std::chrono::milliseconds(1);
+
+    if (clock::now() < coarse)
+      std::this_thread::sleep_until(coarse);
+
+    while (clock::now() < Time)
+      std::this_thread::yield();
+  }
+
+};
+
+SimulatedGpu* g_gpu = nullptr;
+
+
+/* Enough room for ID3D11DeviceContext4, plus the entries in front
+ * of the vtable that hold RTTI information in both C++ ABIs */
+constexpr uint32_t VtablePrefix = 2;
+constexpr uint32_t MaxContextMethods = 149;
+
+atfix::mutex g_vtableMutex;
+void** g_origVtable = nullptr;
+std::array<void*, VtablePrefix + MaxContextMethods> g_vtable = { };
+
+template<uint32_t Index, typename Ret, typename... Args>
+Ret callOriginal(ID3D11DeviceContext* pContext, Args... args) {
+  using PFN = Ret (STDMETHODCALLTYPE *) (ID3D11DeviceContext*, Args...);
+  return reinterpret_cast<PFN>(g_origVtable[Index])(pContext, args...);
+}
+
+/** Override for methods that only take GPU time */
+template<uint32_t Index, typename... Args>
+void STDMETHODCALLTYPE addDrawCost(ID3D11DeviceContext* pContext, Args... args) {
+  g_gpu->addWork(g_gpu->getOptions().drawCost);
+  callOriginal<Index, void>(pContext, args...);
+}
+
+
+HRESULT STDMETHODCALLTYPE Context_Map(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+        D3D11_MAP                 MapType,
+        UINT                      MapFlags,
+        D3D11_MAPPED_SUBRESOURCE* pMappedResource) {
+  /* Discard and no-overwrite maps never wait for the GPU */
+  if (MapType == D3D11_MAP_READ || MapType == D3D11_MAP_WRITE || MapType == D3D11_MAP_READ_WRITE) {
+    HRESULT hr = g_gpu->wait(pResource, MapFlags & D3D11_MAP_FLAG_DO_NOT_WAIT);
+
+    if (FAILED(hr))
+      return hr;
+  }
+
+  return callOriginal<14, HRESULT>(pContext, pResource, Subresource, MapType, MapFlags, pMappedResource);
+}
+
+
+void STDMETHODCALLTYPE Context_End(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Asynchronous*       pAsync) {
+  g_gpu->addObject(pAsync);
+  callOriginal<28, void>(pContext, pAsync);
+}
+
+
+HRESULT STDMETHODCALLTYPE Context_GetData(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Asynchronous*       pAsync,
+        void*                     pData,
+        UINT                      DataSize,
+        UINT                      GetDataFlags) {
+  if (g_gpu->isBusy(pAsync, GetDataFlags & D3D11_ASYNC_GETDATA_DONOTFLUSH))
+    return S_FALSE;
+
+  return callOriginal<29, HRESULT>(pContext, pAsync, pData, DataSize, GetDataFlags);
+}
+
+
+void STDMETHODCALLTYPE Context_CopySubresourceRegion(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+        UINT                      DstX,
+        UINT                      DstY,
+        UINT                      DstZ,
+        ID3D11Resource*           pSrcResource,
+        UINT                      SrcSubresource,
+  const D3D11_BOX*                pSrcBox) {
+  g_gpu->addCopy(getRegionSize(pSrcResource, SrcSubresource, pSrcBox), pDstResource, pSrcResource);
+  callOriginal<46, void>(pContext, pDstResource, DstSubresource, DstX, DstY, DstZ,
+    pSrcResource, SrcSubresource, pSrcBox);
+}
+
+
+void STDMETHODCALLTYPE Context_CopyResource(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        ID3D11Resource*           pSrcResource) {
+  g_gpu->addCopy(getResourceSize(pSrcResource), pDstResource, pSrcResource);
+  callOriginal<47, void>(pContext, pDstResource, pSrcResource);
+}
+
+
+void STDMETHODCALLTYPE Context_UpdateSubresource(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+  const D3D11_BOX*                pDstBox,
+  const void*                     pSrcData,
+        UINT                      SrcRowPitch,
+        UINT                      SrcDepthPitch) {
+  g_gpu->addCopy(getRegionSize(pDstResource, DstSubresource, pDstBox), pDstResource, nullptr);
+  callOriginal<48, void>(pContext, pDstResource, DstSubresource, pDstBox,
+    pSrcData, SrcRowPitch, SrcDepthPitch);
+}
+
+
+void STDMETHODCALLTYPE Context_CopyStructureCount(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Buffer*             pDstBuffer,
+        UINT                      DstAlignedByteOffset,
+        ID3D11UnorderedAccessView* pSrcView) {
+  g_gpu->addCopy(sizeof(UINT), static_cast<ID3D11Resource*>(pDstBuffer), nullptr);
+  callOriginal<49, void>(pContext, pDstBuffer, DstAlignedByteOffset, pSrcView);
+}
+
+
+void STDMETHODCALLTYPE Context_ResolveSubresource(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+        ID3D11Resource*           pSrcResource,
+        UINT                      SrcSubresource,
+        DXGI_FORMAT               Format) {
+  g_gpu->addCopy(getRegionSize(pSrcResource, SrcSubresource, nullptr), pDstResource, pSrcResource);
+  callOriginal<57, void>(pContext, pDstResource, DstSubresource,
+    pSrcResource, SrcSubresource, Format);
+}
+
+
+void STDMETHODCALLTYPE Context_Flush(
+        ID3D11DeviceContext*      pContext) {
+  g_gpu->flush();
+  callOriginal<111, void>(pContext);
+}
+
+
+void STDMETHODCALLTYPE Context1_CopySubresourceRegion1(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+        UINT                      DstX,
+        UINT                      DstY,
+        UINT                      DstZ,
+        ID3D11Resource*           pSrcResource,
+        UINT                      SrcSubresource,
+  const D3D11_BOX*                pSrcBox,
+        UINT                      CopyFlags) {
+  g_gpu->addCopy(getRegionSize(pSrcResource, SrcSubresource, pSrcBox), pDstResource, pSrcResource);
+  callOriginal<115, void>(pContext, pDstResource, DstSubresource, DstX, DstY, DstZ,
+    pSrcResource, SrcSubresource, pSrcBox, CopyFlags);
+}
+
+
+void STDMETHODCALLTYPE Context1_UpdateSubresource1(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+  const D3D11_BOX*                pDstBox,
+  const void*                     pSrcData,
+        UINT                      SrcRowPitch,
+        UINT                      SrcDepthPitch,
+        UINT                      CopyFlags) {
+  g_gpu->addCopy(getRegionSize(pDstResource, DstSubresource, pDstBox), pDstResource, nullptr);
+  callOriginal<116, void>(pContext, pDstResource, DstSubresource, pDstBox,
+    pSrcData, SrcRowPitch, SrcDepthPitch, CopyFlags);
+}
+
+
+struct VtableOverride {
+  uint32_t  Index;
+  void*     Proc;
+};
+
+const std::array<VtableOverride, 26> g_overrides = {{
+  { 12,   reinterpret_cast<void*>(&addDrawCost<12, UINT, UINT, INT>) },                     /* DrawIndexed */
+  { 13,   reinterpret_cast<void*>(&addDrawCost<13, UINT, UINT>) },                          /* Draw */
+  { 14,   reinterpret_cast<void*>(&Context_Map) },
+  { 20,   reinterpret_cast<void*>(&addDrawCost<20, UINT, UINT, UINT, INT, UINT>) },         /* DrawIndexedInstanced */
+  { 21,   reinterpret_cast<void*>(&addDrawCost<21, UINT, UINT, UINT, UINT>) },              /* DrawInstanced */
+  { 28,   reinterpret_cast<void*>(&Context_End) },
+  { 29,   reinterpret_cast<void*>(&Context_GetData) },
+  { 38,   reinterpret_cast<void*>(&addDrawCost<38>) },                                      /* DrawAuto */
+  { 39,   reinterpret_cast<void*>(&addDrawCost<39, ID3D11Buffer*, UINT>) },                 /* DrawIndexedInstancedIndirect */
+  { 40,   reinterpret_cast<void*>(&addDrawCost<40, ID3D11Buffer*, UINT>) },                 /* DrawInstancedIndirect */
+  { 41,   reinterpret_cast<void*>(&addDrawCost<41, UINT, UINT, UINT>) },                    /* Dispatch */
+  { 42,   reinterpret_cast<void*>(&addDrawCost<42, ID3D11Buffer*, UINT>) },                 /* DispatchIndirect */
+  { 46,   reinterpret_cast<void*>(&Context_CopySubresourceRegion) },
+  { 47,   reinterpret_cast<void*>(&Context_CopyResource) },
+  { 48,   reinterpret_cast<void*>(&Context_UpdateSubresource) },
+  { 49,   reinterpret_cast<void*>(&Context_CopyStructureCount) },
+  { 50,   reinterpret_cast<void*>(&addDrawCost<50, ID3D11RenderTargetView*, const FLOAT*>) },    /* ClearRenderTargetView */
+  { 51,   reinterpret_cast<void*>(&addDrawCost<51, ID3D11UnorderedAccessView*, const UINT*>) },  /* ClearUnorderedAccessViewUint */
+  { 52,   reinterpret_cast<void*>(&addDrawCost<52, ID3D11UnorderedAccessView*, const FLOAT*>) }, /* ClearUnorderedAccessViewFloat */
+  { 53,   reinterpret_cast<void*>(&addDrawCost<53, ID3D11DepthStencilView*, UINT, FLOAT, UINT8>) }, /* ClearDepthStencilView */
+  { 54,   reinterpret_cast<void*>(&addDrawCost<54, ID3D11ShaderResourceView*>) },           /* GenerateMips */
+  { 57,   reinterpret_cast<void*>(&Context_ResolveSubresource) },
+  { 58,   reinterpret_cast<void*>(&addDrawCost<58, ID3D11CommandList*, BOOL>) },            /* ExecuteCommandList */
+  { 111,  reinterpret_cast<void*>(&Context_Flush) },
+  { 115,  reinterpret_cast<void*>(&Context1_CopySubresourceRegion1) },
+  { 116,  reinterpret_cast<void*>(&Context1_UpdateSubresource1) },
+}};
+
+
+/** Determines the number of vtable entries from the newest context
+ *  interface that the runtime implements on the same object */
+uint32_t getContextMethodCount(
+        ID3D11DeviceContext*      pContext) {
+  struct Interface {
+    GUID      iid;
+    uint32_t  methodCount;
+  };
+
+  const std::array<Interface, 4> interfaces = {{
+    { __uuidof(ID3D11DeviceContext4), 149 },
+    { __uuidof(ID3D11DeviceContext3), 147 },
+    { __uuidof(ID3D11DeviceContext2), 144 },
+    { __uuidof(ID3D11DeviceContext1), 134 },
+  }};
+
+  for (const auto& iface : interfaces) {
+    IUnknown* object = nullptr;
+
+    if (FAILED(pContext->QueryInterface(iface.iid, reinterpret_cast<void**>(&object))))
+      continue;
+
+    bool isSameObject = object == static_cast<IUnknown*>(pContext);
+    object->Release();
+
+    if (isSameObject)
+      return iface.methodCount;
+  }
+
+  return 115;
+}
+
+
+void patchContext(
+        ID3D11DeviceContext*      pContext) {
+  std::lock_guard lock(g_vtableMutex);
+
+  void*** object = reinterpret_cast<void***>(pContext);
+  void** vtable = &g_vtable[VtablePrefix];
+
+  if (*object == vtable)
+    return;
+
+  if (g_origVtable && *object != g_origVtable) {
+    log("Context ", pContext, " uses a different vtable, not patching");
+    return;
+  }
+
+  if (!g_origVtable) {
+    g_origVtable = *object;
+
+    uint32_t methodCount = getContextMethodCount(pContext);
+    std::memcpy(g_vtable.data(), g_origVtable - VtablePrefix,
+      sizeof(void*) * (VtablePrefix + methodCount));
+
+    for (const auto& entry : g_overrides) {
+      if (entry.Index < methodCount)
+        vtable[entry.Index] = entry.Proc;
+    }
+
+    log("Patched context vtable with ", methodCount, " methods");
+  }
+
+  *object = vtable;
+}
+
+
+/** Patches the immediate context of a newly created device. The
+ *  context is the same object no matter how the game gets it. */
+void patchDevice(
+        ID3D11Device**            ppDevice,
+        ID3D11DeviceContext**     ppImmediateContext) {
+  if (ppImmediateContext && *ppImmediateContext) {
+    patchContext(*ppImmediateContext);
+  } else if (ppDevice && *ppDevice) {
+    ID3D11DeviceContext* context = nullptr;
+    (*ppDevice)->GetImmediateContext(&context);
+
+    patchContext(context);
+    context->Release();
+  }
+}
+
+
+/** Load system D3D11 DLL and return entry points */
+using PFN_D3D11CreateDevice = HRESULT (__stdcall *) (
+  IDXGIAdapter*, D3D_DRIVER_TYPE, HMODULE, UINT, const D3D_FEATURE_LEVEL*,
+  UINT, UINT, ID3D11Device**, D3D_FEATURE_LEVEL*, ID3D11DeviceContext**);
+
+using PFN_D3D11CreateDeviceAndSwapChain = HRESULT (__stdcall *) (
+  IDXGIAdapter*, D3D_DRIVER_TYPE, HMODULE, UINT, const D3D_FEATURE_LEVEL*,
+  UINT, UINT, const DXGI_SWAP_CHAIN_DESC*, IDXGISwapChain**, ID3D11Device**,
+  D3D_FEATURE_LEVEL*, ID3D11DeviceContext**);
+
+struct D3D11Proc {
+  PFN_D3D11CreateDevice             D3D11CreateDevice             = nullptr;
+  PFN_D3D11CreateDeviceAndSwapChain D3D11CreateDeviceAndSwapChain = nullptr;
+};
+
+D3D11Proc loadSystemD3D11() {
+  static atfix::mutex initMutex;
+  static D3D11Proc d3d11Proc;
+
+  std::lock_guard lock(initMutex);
+
+  if (d3d11Proc.D3D11CreateDevice)
+    return d3d11Proc;
+
+  std::array<char, MAX_PATH + 1> path = { };
+
+  if (!GetSystemDirectoryA(path.data(), MAX_PATH))
+    return D3D11Proc();
+
+  std::strncat(path.data(), "\\d3d11.dll", MAX_PATH);
+  HMODULE libD3D11 = LoadLibraryA(path.data());
+
+  if (!libD3D11) {
+    log("Failed to load d3d11.dll (", path.data(), ")");
+    return D3D11Proc();
+  }
+
+  d3d11Proc.D3D11CreateDevice = reinterpret_cast<PFN_D3D11CreateDevice>(
+    GetProcAddress(libD3D11, "D3D11CreateDevice"));
+  d3d11Proc.D3D11CreateDeviceAndSwapChain = reinterpret_cast<PFN_D3D11CreateDeviceAndSwapChain>(
+    GetProcAddress(libD3D11, "D3D11CreateDeviceAndSwapChain"));
+
+  if (!g_gpu)
+    g_gpu = new SimulatedGpu(getOptions());
+
+  return d3d11Proc;
+}
+
+}
+
+extern "C" {
+
+DLLEXPORT HRESULT __stdcall D3D11CreateDevice(
+        IDXGIAdapter*         pAdapter,
+        D3D_DRIVER_TYPE       DriverType,
+        HMODULE               Software,
+        UINT                  Flags,
+  const D3D_FEATURE_LEVEL*    pFeatureLevels,
+        UINT                  FeatureLevels,
+        UINT                  SDKVersion,
+        ID3D11Device**        ppDevice,
+        D3D_FEATURE_LEVEL*    pFeatureLevel,
+        ID3D11DeviceContext** ppImmediateContext) {
+  auto proc = proxy::loadSystemD3D11();
+
+  if (!proc.D3D11CreateDevice)
+    return E_FAIL;
+
+  HRESULT hr = (*proc.D3D11CreateDevice)(pAdapter, DriverType, Software,
+    Flags, pFeatureLevels, FeatureLevels, SDKVersion, ppDevice, pFeatureLevel,
+    ppImmediateContext);
+
+  if (FAILED(hr))
+    return hr;
+
+  proxy::patchDevice(ppDevice, ppImmediateContext);
+  return hr;
+}
+
+DLLEXPORT HRESULT __stdcall D3D11CreateDeviceAndSwapChain(
+        IDXGIAdapter*         pAdapter,
+        D3D_DRIVER_TYPE       DriverType,
+        HMODULE               Software,
+        UINT                  Flags,
+  const D3D_FEATURE_LEVEL*    pFeatureLevels,
+        UINT                  FeatureLevels,
+        UINT                  SDKVersion,
+  const DXGI_SWAP_CHAIN_DESC* pSwapChainDesc,
+        IDXGISwapChain**      ppSwapChain,
+        ID3D11Device**        ppDevice,
+        D3D_FEATURE_LEVEL*    pFeatureLevel,
+        ID3D11DeviceContext** ppImmediateContext) {
+  auto proc = proxy::loadSystemD3D11();
+
+  if (!proc.D3D11CreateDeviceAndSwapChain)
+    return E_FAIL;
+
+  HRESULT hr = (*proc.D3D11CreateDeviceAndSwapChain)(pAdapter, DriverType, Software,
+    Flags, pFeatureLevels, FeatureLevels, SDKVersion, pSwapChainDesc, ppSwapChain,
+    ppDevice, pFeatureLevel, ppImmediateContext);
+
+  if (FAILED(hr))
+    return hr;
+
+  proxy::patchDevice(ppDevice, ppImmediateContext);
+  return hr;
+}
+
+BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved) {
+  if (fdwReason == DLL_PROCESS_DETACH && proxy::g_gpu)
+    proxy::g_gpu->writeStats();
+
+  return TRUE;
+}
+
+}
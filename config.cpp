@@ -0,0 +1,140 @@
+#include <array>
+#include <cstdlib>
+
+#include "config.h"
+#include "impl.h"
+#include "util.h"
+
+namespace atfix {
+
+bool getEnvOption(
+        const char*               pName,
+        std::array<char, 64>&     value) {
+  DWORD len = GetEnvironmentVariableA(pName, value.data(), value.size());
+
+  if (!len || len >= value.size())
+    return false;
+
+  log("Config: ", pName, " = ", value.data());
+  return true;
+}
+
+void getEnvOption(
+        const char*               pName,
+        uint32_t*                 pValue) {
+  std::array<char, 64> value = { };
+
+  if (getEnvOption(pName, value))
+    *pValue = uint32_t(std::strtoul(value.data(), nullptr, 10));
+}
+
+void getEnvOption(
+        const char*               pName,
+        std::string*              pValue) {
+  std::array<char, MAX_PATH + 1> value = { };
+  DWORD len = GetEnvironmentVariableA(pName, value.data(), value.size());
+
+  if (!len || len >= value.size())
+    return;
+
+  log("Config: ", pName, " = ", value.data());
+  *pValue = value.data();
+}
+
+void getEnvOption(
+        const char*               pName,
+        bool*                     pValue) {
+  std::array<char, 64> value = { };
+
+  if (getEnvOption(pName, value))
+    *pValue = std::strtoul(value.data(), nullptr, 10) != 0;
+}
+
+void getEnvOption(
+        const char*               pName,
+        double*                   pValue) {
+  std::array<char, 64> value = { };
+
+  if (getEnvOption(pName, value))
+    *pValue = std::strtod(value.data(), nullptr);
+}
+
+uint32_t parseResourceClasses(
+  const std::string&              value) {
+  uint32_t classes = 0u;
+  size_t start = 0;
+
+  while (start <= value.size()) {
+    size_t end = value.find(',', start);
+
+    if (end == std::string::npos)
+      end = value.size();
+
+    std::string name = value.substr(start, end - start);
+
+    if (name == "buffer")
+      classes |= ATFIX_RESOURCE_CLASS_BUFFER;
+    else if (name == "texture")
+      classes |= ATFIX_RESOURCE_CLASS_TEXTURE;
+    else if (name == "rt")
+      classes |= ATFIX_RESOURCE_CLASS_RENDER_TARGET;
+    else if (name == "ds")
+      classes |= ATFIX_RESOURCE_CLASS_DEPTH_STENCIL;
+    else if (name == "uav")
+      classes |= ATFIX_RESOURCE_CLASS_UAV;
+    else if (name == "all")
+      classes |= ~0u;
+    else if (!name.empty())
+      log("Config: Unknown resource class ", name);
+
+    start = end + 1;
+  }
+
+  return classes;
+}
+
+ATFIX_CONFIG loadConfig() {
+  ATFIX_CONFIG config = { };
+  config.MaxFrameLatency = 0;
+  config.FrameRateLimit = 0.0;
+  config.FrameStatsInterval = 0;
+  config.AdaptiveCopies = true;
+  config.CpuCopyBudget = 0;
+  config.StagingPool = false;
+  config.StaleReadClasses = 0u;
+  config.EarlyFlush = true;
+  config.ReadbackThread = false;
+  config.ShadowArenaSize = 0u;
+  config.GpuProfileInterval = 0u;
+  config.StagingAliasing = false;
+  config.WriteWatchSize = 0u;
+  config.PersistentMaps = false;
+
+  std::string staleReads;
+
+  getEnvOption("ATFIX_MAX_FRAME_LATENCY", &config.MaxFrameLatency);
+  getEnvOption("ATFIX_FRAME_RATE", &config.FrameRateLimit);
+  getEnvOption("ATFIX_FRAME_STATS", &config.FrameStatsInterval);
+  getEnvOption("ATFIX_ADAPTIVE_COPY", &config.AdaptiveCopies);
+  getEnvOption("ATFIX_CPU_COPY_BUDGET", &config.CpuCopyBudget);
+  getEnvOption("ATFIX_STAGING_POOL", &config.StagingPool);
+  getEnvOption("ATFIX_EARLY_FLUSH", &config.EarlyFlush);
+  getEnvOption("ATFIX_READBACK_THREAD", &config.ReadbackThread);
+  getEnvOption("ATFIX_SHADOW_ARENA", &config.ShadowArenaSize);
+  getEnvOption("ATFIX_GPU_PROFILE", &config.GpuProfileInterval);
+  getEnvOption("ATFIX_STAGING_ALIAS", &config.StagingAliasing);
+  getEnvOption("ATFIX_WRITE_WATCH", &config.WriteWatchSize);
+  getEnvOption("ATFIX_PERSISTENT_MAPS", &config.PersistentMaps);
+  getEnvOption("ATFIX_TRACE", &config.TracePath);
+  getEnvOption("ATFIX_STALE_READS", &staleReads);
+
+  config.StaleReadClasses = parseResourceClasses(staleReads);
+  return config;
+}
+
+const ATFIX_CONFIG* getConfig() {
+  static const ATFIX_CONFIG s_config = loadConfig();
+  return &s_config;
+}
+
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace atfix {
+
+/**
+ * \brief Resource classes
+ *
+ * Used to select resources for behaviour that only makes sense
+ * for some kinds of resources. A resource may belong to multiple
+ * classes, e.g. a texture that is both a render target and UAV.
+ */
+enum ATFIX_RESOURCE_CLASS : uint32_t {
+  ATFIX_RESOURCE_CLASS_BUFFER         = (1u << 0),
+  ATFIX_RESOURCE_CLASS_TEXTURE        = (1u << 1),
+  ATFIX_RESOURCE_CLASS_RENDER_TARGET  = (1u << 2),
+  ATFIX_RESOURCE_CLASS_DEPTH_STENCIL  = (1u << 3),
+  ATFIX_RESOURCE_CLASS_UAV            = (1u << 4),
+};
+
+/**
+ * \brief User configuration
+ *
+ * Read once from environment variables when first accessed.
+ * Options that are not set keep their default values.
+ */
+struct ATFIX_CONFIG {
+  /** Maximum number of frames the game may queue ahead
+   *  of the GPU. \c ATFIX_MAX_FRAME_LATENCY, 0 leaves the
+   *  runtime default unchanged. */
+  uint32_t MaxFrameLatency;
+  /** Frame rate limit in frames per second.
+   *  \c ATFIX_FRAME_RATE, 0 disables the limiter. */
+  double FrameRateLimit;
+  /** Number of frames over which frame time statistics
+   *  are gathered before writing them to the log.
+   *  \c ATFIX_FRAME_STATS, 0 disables statistics. */
+  uint32_t FrameStatsInterval;
+  /** Whether to switch resources between CPU and GPU
+   *  copies based on measured cost. \c ATFIX_ADAPTIVE_COPY */
+  bool AdaptiveCopies;
+  /** Time in microseconds that the render thread may spend
+   *  on CPU copies per frame. \c ATFIX_CPU_COPY_BUDGET, 0
+   *  means unlimited. */
+  uint32_t CpuCopyBudget;
+  /** Whether to recycle staging resources that the game
+   *  releases instead of destroying them.
+   *  \c ATFIX_STAGING_POOL */
+  bool StagingPool;
+  /** Resource classes for which reads may be served from
+   *  an older snapshot instead of waiting for the GPU.
+   *  \c ATFIX_STALE_READS, a comma-separated list of
+   *  \c buffer, \c texture, \c rt, \c ds, \c uav or
+   *  \c all. Disabled by default. */
+  uint32_t StaleReadClasses;
+  /** Whether to flush the immediate context early if
+   *  the game is predicted to read back data that atfix
+   *  just issued copies for. \c ATFIX_EARLY_FLUSH */
+  bool EarlyFlush;
+  /** Whether to make the immediate context multithread-
+   *  protected so that the readback worker can be used if
+   *  the game did not do so itself. \c ATFIX_READBACK_THREAD.
+   *  Disabled by default. */
+  bool ReadbackThread;
+  /** Maximum size in bytes of buffers whose shadows are
+   *  sub-allocated from a shared arena buffer instead of
+   *  getting their own. \c ATFIX_SHADOW_ARENA, 0 disables
+   *  the arena. Disabled by default. */
+  uint32_t ShadowArenaSize;
+  /** Number of frames over which GPU time spent on
+   *  copies issued by atfix is measured before writing
+   *  it to the log. \c ATFIX_GPU_PROFILE, 0 disables
+   *  the profiler. Disabled by default. */
+  uint32_t GpuProfileInterval;
+  /** Whether copies from shadowed resources to staging
+   *  resources may be served by letting the staging
+   *  resource reference cached data without copying it.
+   *  \c ATFIX_STAGING_ALIAS. Disabled by default. */
+  bool StagingAliasing;
+  /** Minimum size in bytes of staging resources whose
+   *  read-write mappings are write-watched, so that only
+   *  written data is copied back to the GPU resource that
+   *  the staging resource was copied from.
+   *  \c ATFIX_WRITE_WATCH, 0 disables write watches.
+   *  Disabled by default. */
+  uint32_t WriteWatchSize;
+  /** Whether resources that atfix maps for CPU copies are
+   *  kept mapped until they are next accessed otherwise,
+   *  rather than unmapped after each copy.
+   *  \c ATFIX_PERSISTENT_MAPS. Disabled by default. */
+  bool PersistentMaps;
+  /** Path of the trace file to write. \c ATFIX_TRACE,
+   *  tracing is disabled if empty. */
+  std::string TracePath;
+};
+
+const ATFIX_CONFIG* getConfig();
+
+}
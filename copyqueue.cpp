@@ -0,0 +1,326 @@
+#include <algorithm>
+
+#include "copyqueue.h"
+#include "trace.h"
+
+namespace atfix {
+
+static const GUID IID_CopyQueue = {0x92d4f1c8,0x3a6e,0x4b05,{0xbd,0x71,0x5e,0x08,0xa3,0xc6,0x2f,0x94}};
+
+/* Flush early if the game issues a lot of copies without
+ * doing anything else, so that the GPU doesn't go idle */
+constexpr size_t MaxQueuedCopies = 128;
+
+/* Queue returned by the last lookup. Reset when that
+ * queue gets destroyed, so it is valid while set. */
+static std::atomic<CopyQueue*> s_lastQueue = { nullptr };
+
+bool mergeBoxes(
+        D3D11_BOX&                a,
+  const D3D11_BOX&                b) {
+  bool x = a.left == b.left && a.right == b.right;
+  bool y = a.top == b.top && a.bottom == b.bottom;
+  bool z = a.front == b.front && a.back == b.back;
+
+  bool aContainsB = a.left <= b.left && a.right >= b.right
+                 && a.top <= b.top && a.bottom >= b.bottom
+                 && a.front <= b.front && a.back >= b.back;
+
+  bool bContainsA = b.left <= a.left && b.right >= a.right
+                 && b.top <= a.top && b.bottom >= a.bottom
+                 && b.front <= a.front && b.back >= a.back;
+
+  /* Otherwise, the union is only a box if the two boxes
+   * match in two dimensions and touch in the third one */
+  bool touches = (y && z && a.left <= b.right && b.left <= a.right)
+              || (x && z && a.top <= b.bottom && b.top <= a.bottom)
+              || (x && y && a.front <= b.back && b.front <= a.back);
+
+  if (!aContainsB && !bContainsA && !touches)
+    return false;
+
+  a.left   = std::min(a.left,   b.left);
+  a.top    = std::min(a.top,    b.top);
+  a.front  = std::min(a.front,  b.front);
+  a.right  = std::max(a.right,  b.right);
+  a.bottom = std::max(a.bottom, b.bottom);
+  a.back   = std::max(a.back,   b.back);
+  return true;
+}
+
+
+CopyQueue::CopyQueue(
+        ID3D11DeviceContext*      pContext,
+        GpuTimeline*              pTimeline,
+        GpuProfiler*              pProfiler,
+        SubmitScheduler*          pScheduler)
+: m_context(pContext), m_timeline(pTimeline),
+  m_profiler(pProfiler), m_scheduler(pScheduler) {
+  m_timeline->AddRef();
+
+  if (m_profiler)
+    m_profiler->AddRef();
+
+  if (m_scheduler)
+    m_scheduler->AddRef();
+
+  m_copies.reserve(MaxQueuedCopies);
+}
+
+
+CopyQueue::~CopyQueue() {
+  CopyQueue* self = this;
+  s_lastQueue.compare_exchange_strong(self, nullptr);
+
+  for (const auto& copy : m_copies)
+    releaseCopy(copy);
+
+  if (m_scheduler)
+    m_scheduler->Release();
+
+  if (m_profiler)
+    m_profiler->Release();
+
+  m_timeline->Release();
+}
+
+
+HRESULT STDMETHODCALLTYPE CopyQueue::QueryInterface(
+        REFIID                    riid,
+        void**                    ppvObject) {
+  if (!ppvObject)
+    return E_POINTER;
+
+  *ppvObject = nullptr;
+
+  if (riid == __uuidof(IUnknown)) {
+    AddRef();
+    *ppvObject = static_cast<IUnknown*>(this);
+    return S_OK;
+  }
+
+  return E_NOINTERFACE;
+}
+
+
+ULONG STDMETHODCALLTYPE CopyQueue::AddRef() {
+  return ++m_refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE CopyQueue::Release() {
+  ULONG refCount = --m_refCount;
+
+  if (!refCount)
+    delete this;
+
+  return refCount;
+}
+
+
+CopyQueue* CopyQueue::get(
+        ID3D11DeviceContext*      pContext) {
+  /* This gets called on every draw, so skip the
+   * private data lookup for the common case */
+  CopyQueue* queue = s_lastQueue.load();
+
+  if (queue && queue->m_context == pContext)
+    return queue;
+
+  static mutex s_mutex;
+  std::lock_guard lock(s_mutex);
+
+  UINT size = sizeof(queue);
+
+  /* The context holds a reference to the queue, so the
+   * one returned by GetPrivateData can be dropped */
+  if (SUCCEEDED(pContext->GetPrivateData(IID_CopyQueue, &size, &queue))) {
+    queue->Release();
+  } else {
+    queue = new CopyQueue(pContext, GpuTimeline::get(pContext),
+      GpuProfiler::get(pContext), SubmitScheduler::get(pContext));
+    pContext->SetPrivateDataInterface(IID_CopyQueue, queue);
+  }
+
+  s_lastQueue.store(queue);
+  return queue;
+}
+
+
+void CopyQueue::detach(
+        ID3D11DeviceContext*      pContext) {
+  pContext->SetPrivateData(IID_CopyQueue, 0, nullptr);
+}
+
+
+void CopyQueue::copyResource(
+        ID3D11Resource*           pDstResource,
+        ID3D11Resource*           pSrcResource) {
+  Copy copy = { };
+  copy.dst = pDstResource;
+  copy.src = pSrcResource;
+  copy.wholeResource = true;
+
+  enqueue(copy);
+}
+
+
+void CopyQueue::copySubresourceRegion(
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+        UINT                      DstX,
+        UINT                      DstY,
+        UINT                      DstZ,
+        ID3D11Resource*           pSrcResource,
+        UINT                      SrcSubresource,
+  const D3D11_BOX*                pSrcBox,
+        UINT                      CopyFlags) {
+  Copy copy = { };
+  copy.dst = pDstResource;
+  copy.dstSubresource = DstSubresource;
+  copy.dstX = DstX;
+  copy.dstY = DstY;
+  copy.dstZ = DstZ;
+  copy.src = pSrcResource;
+  copy.srcSubresource = SrcSubresource;
+  copy.flags = CopyFlags;
+
+  if (pSrcBox) {
+    copy.srcBox = *pSrcBox;
+    copy.hasSrcBox = true;
+  }
+
+  enqueue(copy);
+}
+
+
+void CopyQueue::flush() {
+  if (m_copies.empty() && !m_timeline->hasWork())
+    return;
+
+  TraceScope trace("atfix::flushCopies");
+
+  if (m_profiler && !m_copies.empty())
+    m_profiler->beginCopies();
+
+  for (const auto& copy : m_copies) {
+    if (copy.wholeResource) {
+      forwardCopyResource(m_context, copy.dst, copy.src);
+    } else {
+      forwardCopySubresourceRegion(m_context,
+        copy.dst, copy.dstSubresource, copy.dstX, copy.dstY, copy.dstZ,
+        copy.src, copy.srcSubresource, copy.hasSrcBox ? &copy.srcBox : nullptr,
+        copy.flags);
+    }
+
+    if (m_profiler)
+      m_profiler->endCopy(copy.src);
+  }
+
+  for (const auto& copy : m_copies)
+    releaseCopy(copy);
+
+  m_copies.clear();
+
+  /* Any work tracked on the timeline is something that
+   * the CPU is going to wait for at some point */
+  bool hasTrackedWork = m_timeline->hasWork();
+  m_timeline->submit();
+
+  if (hasTrackedWork && m_scheduler && m_scheduler->shouldFlush()) {
+    TraceScope flushTrace("atfix::earlyFlush");
+    forwardFlush(m_context);
+  }
+}
+
+
+void CopyQueue::enqueue(
+  const Copy&                     copy) {
+  copy.dst->AddRef();
+  copy.src->AddRef();
+
+  if (copy.wholeResource)
+    dropOverwrittenCopies(copy.dst);
+
+  if (!m_copies.empty() && mergeCopies(m_copies.back(), copy)) {
+    releaseCopy(copy);
+    return;
+  }
+
+  m_copies.push_back(copy);
+
+  if (m_copies.size() >= MaxQueuedCopies)
+    flush();
+}
+
+
+void CopyQueue::dropOverwrittenCopies(
+        ID3D11Resource*           pDstResource) {
+  /* Walk backwards until we find a copy that reads the
+   * resource, since that one needs the previous data. */
+  size_t index = m_copies.size();
+
+  while (index--) {
+    const Copy& copy = m_copies[index];
+
+    if (copy.src == pDstResource)
+      break;
+
+    if (copy.dst == pDstResource) {
+      releaseCopy(copy);
+      m_copies.erase(m_copies.begin() + index);
+    }
+  }
+}
+
+
+bool CopyQueue::mergeCopies(
+        Copy&                     prev,
+  const Copy&                     next) {
+  if (prev.dst != next.dst || prev.src != next.src || prev.src == prev.dst)
+    return false;
+
+  if (prev.wholeResource || next.wholeResource)
+    return prev.wholeResource && next.wholeResource;
+
+  /* Discarding the destination would also discard the data
+   * written by the previous copy, so we can't merge those */
+  if (prev.dstSubresource != next.dstSubresource
+   || prev.srcSubresource != next.srcSubresource
+   || prev.flags != next.flags || (next.flags & D3D11_COPY_DISCARD))
+    return false;
+
+  if (!prev.hasSrcBox || !next.hasSrcBox) {
+    return !prev.hasSrcBox && !next.hasSrcBox
+        && prev.dstX == next.dstX
+        && prev.dstY == next.dstY
+        && prev.dstZ == next.dstZ;
+  }
+
+  /* Both copies must move data by the same offset */
+  if (int64_t(prev.dstX) - prev.srcBox.left  != int64_t(next.dstX) - next.srcBox.left
+   || int64_t(prev.dstY) - prev.srcBox.top   != int64_t(next.dstY) - next.srcBox.top
+   || int64_t(prev.dstZ) - prev.srcBox.front != int64_t(next.dstZ) - next.srcBox.front)
+    return false;
+
+  UINT offsetX = prev.dstX - prev.srcBox.left;
+  UINT offsetY = prev.dstY - prev.srcBox.top;
+  UINT offsetZ = prev.dstZ - prev.srcBox.front;
+
+  if (!mergeBoxes(prev.srcBox, next.srcBox))
+    return false;
+
+  prev.dstX = prev.srcBox.left  + offsetX;
+  prev.dstY = prev.srcBox.top   + offsetY;
+  prev.dstZ = prev.srcBox.front + offsetZ;
+  return true;
+}
+
+
+void CopyQueue::releaseCopy(
+  const Copy&                     copy) {
+  copy.dst->Release();
+  copy.src->Release();
+}
+
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <d3d11_4.h>
+
+#include <vector>
+
+#include "impl.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "timeline.h"
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief Copy queue
+ *
+ * Collects GPU copies that atfix issues on the immediate context,
+ * i.e. copies that could not be done on the CPU as well as shadow
+ * resource updates, and submits them to the driver in one burst.
+ *
+ * While queued, a copy is merged with the preceding copy if both
+ * copy adjacent or overlapping regions between the same pair of
+ * subresources, and copies to a resource are dropped if a later
+ * \c CopyResource overwrites that resource entirely without any
+ * queued copy reading it in between.
+ *
+ * The queue must be flushed before any operation that may access
+ * the resources involved, i.e. on every hooked context method that
+ * is not a copy, including \c Map and draws, as well as on present.
+ * Flushing also submits the current GPU timeline batch, since the
+ * timeline must not signal work that has not been issued yet, and
+ * may flush the context if the submission scheduler asks for it.
+ *
+ * One queue is created per immediate context and attached to it as
+ * private data, without holding a reference to the context. Copies
+ * that are still queued when the queue is destroyed are dropped.
+ * Must only be used from the thread that owns the immediate context.
+ */
+class CopyQueue final : public IUnknown {
+
+public:
+
+  CopyQueue(
+          ID3D11DeviceContext*      pContext,
+          GpuTimeline*              pTimeline,
+          GpuProfiler*              pProfiler,
+          SubmitScheduler*          pScheduler);
+
+  ~CopyQueue();
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(
+          REFIID                    riid,
+          void**                    ppvObject);
+
+  ULONG STDMETHODCALLTYPE AddRef();
+
+  ULONG STDMETHODCALLTYPE Release();
+
+  /** Retrieves copy queue for the given immediate context,
+   *  and creates it if necessary. */
+  static CopyQueue* get(
+          ID3D11DeviceContext*      pContext);
+
+  /** Drops the context's reference to its copy queue */
+  static void detach(
+          ID3D11DeviceContext*      pContext);
+
+  /** Queues a full resource copy */
+  void copyResource(
+          ID3D11Resource*           pDstResource,
+          ID3D11Resource*           pSrcResource);
+
+  /** Queues a subresource copy. Copy flags are only
+   *  supported if the context supports them. */
+  void copySubresourceRegion(
+          ID3D11Resource*           pDstResource,
+          UINT                      DstSubresource,
+          UINT                      DstX,
+          UINT                      DstY,
+          UINT                      DstZ,
+          ID3D11Resource*           pSrcResource,
+          UINT                      SrcSubresource,
+    const D3D11_BOX*                pSrcBox,
+          UINT                      CopyFlags);
+
+  /** Issues all queued copies and submits the timeline */
+  void flush();
+
+private:
+
+  struct Copy {
+    ID3D11Resource* dst;
+    UINT            dstSubresource;
+    UINT            dstX;
+    UINT            dstY;
+    UINT            dstZ;
+    ID3D11Resource* src;
+    UINT            srcSubresource;
+    D3D11_BOX       srcBox;
+    bool            hasSrcBox;
+    bool            wholeResource;
+    UINT            flags;
+  };
+
+  std::atomic<ULONG>        m_refCount  = { 0u };
+
+  ID3D11DeviceContext*      m_context   = nullptr;
+  GpuTimeline*              m_timeline  = nullptr;
+  GpuProfiler*              m_profiler  = nullptr;
+  SubmitScheduler*          m_scheduler = nullptr;
+
+  std::vector<Copy>         m_copies;
+
+  void enqueue(
+    const Copy&                     copy);
+
+  void dropOverwrittenCopies(
+          ID3D11Resource*           pDstResource);
+
+  static bool mergeCopies(
+          Copy&                     prev,
+    const Copy&                     next);
+
+  static void releaseCopy(
+    const Copy&                     copy);
+
+};
+
+}
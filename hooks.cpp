@@ -0,0 +1,26 @@
+#include "hooks.h"
+
+namespace atfix {
+
+HookBatch::HookBatch(
+  const char*                     pName)
+: m_name(pName), m_start(clock::now()) {
+
+}
+
+
+void HookBatch::apply() {
+  if (m_hookCount) {
+    MH_STATUS mh = MH_ApplyQueued();
+
+    if (mh) {
+      log("Failed to enable hooks for ", m_name, ": ", MH_StatusToString(mh));
+      return;
+    }
+  }
+
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - m_start);
+  log("Installed ", m_hookCount, " hooks for ", m_name, " in ", us.count(), " us");
+}
+
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+#include "impl.h"
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief Vtable slot of an interface method
+ *
+ * Slot indices are fixed by the COM ABI and include the methods
+ * of all base interfaces, starting with the three \c IUnknown
+ * methods. Only methods that atfix hooks are listed.
+ */
+struct VtableSlot {
+  const char* Name;
+  uint32_t    Index;
+};
+
+constexpr uint32_t InvalidVtableIndex = ~0u;
+
+constexpr bool isSameName(const char* a, const char* b) {
+  while (*a && *a == *b) {
+    a++;
+    b++;
+  }
+
+  return *a == *b;
+}
+
+/** Looks up the slot of a method by name. Returns
+ *  \c InvalidVtableIndex if the method is not listed. */
+template<size_t N>
+constexpr uint32_t getVtableIndex(const std::array<VtableSlot, N>& Table, const char* pName) {
+  for (const auto& slot : Table) {
+    if (isSameName(slot.Name, pName))
+      return slot.Index;
+  }
+
+  return InvalidVtableIndex;
+}
+
+/** Checks that no two methods in a table share a name or a slot */
+template<size_t N>
+constexpr bool isVtableValid(const std::array<VtableSlot, N>& Table) {
+  for (size_t i = 0; i < N; i++) {
+    for (size_t j = i + 1; j < N; j++) {
+      if (isSameName(Table[i].Name, Table[j].Name) || Table[i].Index == Table[j].Index)
+        return false;
+    }
+  }
+
+  return true;
+}
+
+constexpr std::array<VtableSlot, 1> IUnknownVtable = {{
+  { "Release",                                    2   },
+}};
+
+constexpr std::array<VtableSlot, 6> ID3D11DeviceVtable = {{
+  { "Release",                                    2   },
+  { "CreateBuffer",                               3   },
+  { "CreateTexture1D",                            4   },
+  { "CreateTexture2D",                            5   },
+  { "CreateTexture3D",                            6   },
+  { "CreateDeferredContext",                      27  },
+}};
+
+constexpr std::array<VtableSlot, 28> ID3D11DeviceContextVtable = {{
+  { "DrawIndexed",                                12  },
+  { "Draw",                                       13  },
+  { "Map",                                        14  },
+  { "Unmap",                                      15  },
+  { "DrawIndexedInstanced",                       20  },
+  { "DrawInstanced",                              21  },
+  { "End",                                        28  },
+  { "GetData",                                    29  },
+  { "OMSetRenderTargets",                         33  },
+  { "OMSetRenderTargetsAndUnorderedAccessViews",  34  },
+  { "DrawAuto",                                   38  },
+  { "DrawIndexedInstancedIndirect",               39  },
+  { "DrawInstancedIndirect",                      40  },
+  { "Dispatch",                                   41  },
+  { "DispatchIndirect",                           42  },
+  { "CopySubresourceRegion",                      46  },
+  { "CopyResource",                               47  },
+  { "UpdateSubresource",                          48  },
+  { "CopyStructureCount",                         49  },
+  { "ClearRenderTargetView",                      50  },
+  { "ClearUnorderedAccessViewUint",               51  },
+  { "ClearUnorderedAccessViewFloat",              52  },
+  { "ClearDepthStencilView",                      53  },
+  { "GenerateMips",                               54  },
+  { "ResolveSubresource",                         57  },
+  { "ExecuteCommandList",                         58  },
+  { "ClearState",                                 110 },
+  { "Flush",                                      111 },
+}};
+
+constexpr std::array<VtableSlot, 4> ID3D11DeviceContext1Vtable = {{
+  { "CopySubresourceRegion1",                     115 },
+  { "UpdateSubresource1",                         116 },
+  { "SwapDeviceContextState",                     131 },
+  { "ClearView",                                  132 },
+}};
+
+constexpr std::array<VtableSlot, 1> IDXGISwapChainVtable = {{
+  { "Present",                                    8   },
+}};
+
+constexpr std::array<VtableSlot, 1> IDXGIFactoryVtable = {{
+  { "CreateSwapChain",                            10  },
+}};
+
+constexpr std::array<VtableSlot, 3> IDXGIFactory2Vtable = {{
+  { "CreateSwapChainForHwnd",                     15  },
+  { "CreateSwapChainForCoreWindow",               16  },
+  { "CreateSwapChainForComposition",              24  },
+}};
+
+/* Resources only have Release hooked */
+constexpr auto ID3D11BufferVtable = IUnknownVtable;
+constexpr auto ID3D11Texture1DVtable = IUnknownVtable;
+constexpr auto ID3D11Texture2DVtable = IUnknownVtable;
+constexpr auto ID3D11Texture3DVtable = IUnknownVtable;
+
+static_assert(isVtableValid(IUnknownVtable));
+static_assert(isVtableValid(ID3D11DeviceVtable));
+static_assert(isVtableValid(ID3D11DeviceContextVtable));
+static_assert(isVtableValid(ID3D11DeviceContext1Vtable));
+static_assert(isVtableValid(IDXGISwapChainVtable));
+static_assert(isVtableValid(IDXGIFactoryVtable));
+static_assert(isVtableValid(IDXGIFactory2Vtable));
+
+
+/**
+ * \brief Hook batch
+ *
+ * Creates hooks right away, so that the original functions are
+ * available immediately, but only queues them for enablement.
+ * Enabling hooks suspends all other threads of the process, so
+ * doing that once per batch rather than once per hook keeps game
+ * threads frozen for a lot less time during device creation.
+ *
+ * Must be used with the hook mutex held, since MinHook applies
+ * all queued hooks at once, not just those of this batch.
+ */
+class HookBatch {
+
+public:
+
+  using clock = std::chrono::steady_clock;
+
+  HookBatch(
+    const char*                     pName);
+
+  /** Creates hook for the given vtable slot and queues it
+   *  for enablement. Failures are logged and otherwise
+   *  ignored, the method then simply isn't hooked. */
+  template<typename T>
+  void add(
+          void*                     pObject,
+    const char*                     pName,
+          T**                       ppOrig,
+          T*                        pHook,
+          uint32_t                  Index) {
+    void** vtbl = *reinterpret_cast<void***>(pObject);
+
+    if (!vtbl[Index]) {
+      log("No function for ", pName, " in vtable slot ", Index);
+      return;
+    }
+
+    MH_STATUS mh = MH_CreateHook(vtbl[Index],
+      reinterpret_cast<void*>(pHook),
+      reinterpret_cast<void**>(ppOrig));
+
+    if (mh) {
+      if (mh != MH_ERROR_ALREADY_CREATED)
+        log("Failed to create hook for ", pName, ": ", MH_StatusToString(mh));
+      return;
+    }
+
+    mh = MH_QueueEnableHook(vtbl[Index]);
+
+    if (mh) {
+      log("Failed to queue hook for ", pName, ": ", MH_StatusToString(mh));
+      return;
+    }
+
+    log("Created hook for ", pName, " @ ", reinterpret_cast<void*>(pHook));
+    m_hookCount += 1;
+  }
+
+  /** Enables all queued hooks */
+  void apply();
+
+private:
+
+  const char*       m_name;
+  clock::time_point m_start;
+  uint32_t          m_hookCount = 0u;
+
+};
+
+}
+
+/* Looks up the vtable slot of a method at compile time,
+ * so that hooking an unlisted method fails to compile */
+#define HOOK_PROC(batch, iface, object, table, proc) do { \
+    constexpr uint32_t index = getVtableIndex(iface ## Vtable, #proc); \
+    static_assert(index != InvalidVtableIndex, \
+      #iface "::" #proc " is missing from the vtable table"); \
+    (batch).add(object, #iface "::" #proc, &(table)->proc, &iface ## _ ## proc, index); \
+  } while (0)
@@ -1,8 +1,25 @@
+#include <algorithm>
 #include <array>
 #include <cstring>
+#include <unordered_map>
+#include <vector>
 
+#include "alias.h"
+#include "copyqueue.h"
+#include "hooks.h"
 #include "impl.h"
+#include "mapcache.h"
+#include "pacing.h"
+#include "pool.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "readback.h"
+#include "shadow.h"
+#include "strategy.h"
+#include "timeline.h"
+#include "trace.h"
 #include "util.h"
+#include "writewatch.h"
 
 namespace atfix {
 
@@ -18,6 +35,9 @@ using PFN_ID3D11Device_CreateTexture2D = HRESULT (STDMETHODCALLTYPE *) (ID3D11De
 using PFN_ID3D11Device_CreateTexture3D = HRESULT (STDMETHODCALLTYPE *) (ID3D11Device*,
   const D3D11_TEXTURE3D_DESC*, const D3D11_SUBRESOURCE_DATA*, ID3D11Texture3D**);
 
+using PFN_ID3D11DeviceContext_ClearState = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*);
+using PFN_ID3D11DeviceContext_ClearDepthStencilView = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
+  ID3D11DepthStencilView*, UINT, FLOAT, UINT8);
 using PFN_ID3D11DeviceContext_ClearRenderTargetView = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
   ID3D11RenderTargetView*, const FLOAT[4]);
 using PFN_ID3D11DeviceContext_ClearUnorderedAccessViewFloat = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
@@ -34,14 +54,67 @@ using PFN_ID3D11DeviceContext_Dispatch = void (STDMETHODCALLTYPE *) (ID3D11Devic
   UINT, UINT, UINT);
 using PFN_ID3D11DeviceContext_DispatchIndirect = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
   ID3D11Buffer*, UINT);
+using PFN_ID3D11DeviceContext_Draw = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
+  UINT, UINT);
+using PFN_ID3D11DeviceContext_DrawAuto = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*);
+using PFN_ID3D11DeviceContext_DrawIndexed = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
+  UINT, UINT, INT);
+using PFN_ID3D11DeviceContext_DrawIndexedInstanced = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
+  UINT, UINT, UINT, INT, UINT);
+using PFN_ID3D11DeviceContext_DrawIndexedInstancedIndirect = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
+  ID3D11Buffer*, UINT);
+using PFN_ID3D11DeviceContext_DrawInstanced = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
+  UINT, UINT, UINT, UINT);
+using PFN_ID3D11DeviceContext_DrawInstancedIndirect = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
+  ID3D11Buffer*, UINT);
+using PFN_ID3D11DeviceContext_End = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
+  ID3D11Asynchronous*);
+using PFN_ID3D11DeviceContext_ExecuteCommandList = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
+  ID3D11CommandList*, BOOL);
+using PFN_ID3D11DeviceContext_Flush = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*);
+using PFN_ID3D11DeviceContext_GenerateMips = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
+  ID3D11ShaderResourceView*);
+using PFN_ID3D11DeviceContext_GetData = HRESULT (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
+  ID3D11Asynchronous*, void*, UINT, UINT);
+using PFN_ID3D11DeviceContext_Map = HRESULT (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
+  ID3D11Resource*, UINT, D3D11_MAP, UINT, D3D11_MAPPED_SUBRESOURCE*);
 using PFN_ID3D11DeviceContext_OMSetRenderTargets = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
   UINT, ID3D11RenderTargetView* const*, ID3D11DepthStencilView*);
 using PFN_ID3D11DeviceContext_OMSetRenderTargetsAndUnorderedAccessViews = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
   UINT, ID3D11RenderTargetView* const*, ID3D11DepthStencilView*, UINT, UINT, ID3D11UnorderedAccessView* const*, const UINT*);
+using PFN_ID3D11DeviceContext_ResolveSubresource = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
+  ID3D11Resource*, UINT, ID3D11Resource*, UINT, DXGI_FORMAT);
+using PFN_ID3D11DeviceContext_Unmap = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
+  ID3D11Resource*, UINT);
 using PFN_ID3D11DeviceContext_UpdateSubresource = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext*,
   ID3D11Resource*, UINT, const D3D11_BOX*, const void*, UINT, UINT);
 
+using PFN_ID3D11DeviceContext1_ClearView = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext1*,
+  ID3D11View*, const FLOAT[4], const D3D11_RECT*, UINT);
+using PFN_ID3D11DeviceContext1_CopySubresourceRegion1 = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext1*,
+  ID3D11Resource*, UINT, UINT, UINT, UINT, ID3D11Resource*, UINT, const D3D11_BOX*, UINT);
+using PFN_ID3D11DeviceContext1_UpdateSubresource1 = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext1*,
+  ID3D11Resource*, UINT, const D3D11_BOX*, const void*, UINT, UINT, UINT);
+using PFN_ID3D11DeviceContext1_SwapDeviceContextState = void (STDMETHODCALLTYPE *) (ID3D11DeviceContext1*,
+  ID3DDeviceContextState*, ID3DDeviceContextState**);
+
+using PFN_IUnknown_Release = ULONG (STDMETHODCALLTYPE *) (IUnknown*);
+
+using PFN_IDXGISwapChain_Present = HRESULT (STDMETHODCALLTYPE *) (IDXGISwapChain*,
+  UINT, UINT);
+
+using PFN_IDXGIFactory_CreateSwapChain = HRESULT (STDMETHODCALLTYPE *) (IDXGIFactory*,
+  IUnknown*, DXGI_SWAP_CHAIN_DESC*, IDXGISwapChain**);
+using PFN_IDXGIFactory2_CreateSwapChainForHwnd = HRESULT (STDMETHODCALLTYPE *) (IDXGIFactory2*,
+  IUnknown*, HWND, const DXGI_SWAP_CHAIN_DESC1*, const DXGI_SWAP_CHAIN_FULLSCREEN_DESC*,
+  IDXGIOutput*, IDXGISwapChain1**);
+using PFN_IDXGIFactory2_CreateSwapChainForCoreWindow = HRESULT (STDMETHODCALLTYPE *) (IDXGIFactory2*,
+  IUnknown*, IUnknown*, const DXGI_SWAP_CHAIN_DESC1*, IDXGIOutput*, IDXGISwapChain1**);
+using PFN_IDXGIFactory2_CreateSwapChainForComposition = HRESULT (STDMETHODCALLTYPE *) (IDXGIFactory2*,
+  IUnknown*, const DXGI_SWAP_CHAIN_DESC1*, IDXGIOutput*, IDXGISwapChain1**);
+
 struct DeviceProcs {
+  PFN_IUnknown_Release                                  Release                       = nullptr;
   PFN_ID3D11Device_CreateBuffer                         CreateBuffer                  = nullptr;
   PFN_ID3D11Device_CreateDeferredContext                CreateDeferredContext         = nullptr;
   PFN_ID3D11Device_CreateTexture1D                      CreateTexture1D               = nullptr;
@@ -50,6 +123,8 @@ struct DeviceProcs {
 };
 
 struct ContextProcs {
+  PFN_ID3D11DeviceContext_ClearDepthStencilView         ClearDepthStencilView         = nullptr;
+  PFN_ID3D11DeviceContext_ClearState                    ClearState                    = nullptr;
   PFN_ID3D11DeviceContext_ClearRenderTargetView         ClearRenderTargetView         = nullptr;
   PFN_ID3D11DeviceContext_ClearUnorderedAccessViewFloat ClearUnorderedAccessViewFloat = nullptr;
   PFN_ID3D11DeviceContext_ClearUnorderedAccessViewUint  ClearUnorderedAccessViewUint  = nullptr;
@@ -58,9 +133,45 @@ struct ContextProcs {
   PFN_ID3D11DeviceContext_CopyStructureCount            CopyStructureCount            = nullptr;
   PFN_ID3D11DeviceContext_Dispatch                      Dispatch                      = nullptr;
   PFN_ID3D11DeviceContext_DispatchIndirect              DispatchIndirect              = nullptr;
+  PFN_ID3D11DeviceContext_Draw                          Draw                          = nullptr;
+  PFN_ID3D11DeviceContext_DrawAuto                      DrawAuto                      = nullptr;
+  PFN_ID3D11DeviceContext_DrawIndexed                   DrawIndexed                   = nullptr;
+  PFN_ID3D11DeviceContext_DrawIndexedInstanced          DrawIndexedInstanced          = nullptr;
+  PFN_ID3D11DeviceContext_DrawIndexedInstancedIndirect  DrawIndexedInstancedIndirect  = nullptr;
+  PFN_ID3D11DeviceContext_DrawInstanced                 DrawInstanced                 = nullptr;
+  PFN_ID3D11DeviceContext_DrawInstancedIndirect         DrawInstancedIndirect         = nullptr;
+  PFN_ID3D11DeviceContext_End                           End                           = nullptr;
+  PFN_ID3D11DeviceContext_ExecuteCommandList            ExecuteCommandList            = nullptr;
+  PFN_ID3D11DeviceContext_Flush                         Flush                         = nullptr;
+  PFN_ID3D11DeviceContext_GenerateMips                  GenerateMips                  = nullptr;
+  PFN_ID3D11DeviceContext_GetData                       GetData                       = nullptr;
+  PFN_ID3D11DeviceContext_Map                           Map                           = nullptr;
   PFN_ID3D11DeviceContext_OMSetRenderTargets            OMSetRenderTargets            = nullptr;
   PFN_ID3D11DeviceContext_OMSetRenderTargetsAndUnorderedAccessViews OMSetRenderTargetsAndUnorderedAccessViews = nullptr;
+  PFN_ID3D11DeviceContext_ResolveSubresource            ResolveSubresource            = nullptr;
+  PFN_ID3D11DeviceContext_Unmap                         Unmap                         = nullptr;
   PFN_ID3D11DeviceContext_UpdateSubresource             UpdateSubresource             = nullptr;
+
+  PFN_ID3D11DeviceContext1_ClearView                    ClearView                     = nullptr;
+  PFN_ID3D11DeviceContext1_CopySubresourceRegion1       CopySubresourceRegion1        = nullptr;
+  PFN_ID3D11DeviceContext1_SwapDeviceContextState       SwapDeviceContextState        = nullptr;
+  PFN_ID3D11DeviceContext1_UpdateSubresource1           UpdateSubresource1            = nullptr;
+};
+
+struct ResourceProcs {
+  PFN_IUnknown_Release                                  Release                       = nullptr;
+};
+
+struct SwapChainProcs {
+  PFN_IDXGISwapChain_Present                            Present                       = nullptr;
+};
+
+struct FactoryProcs {
+  PFN_IDXGIFactory_CreateSwapChain                      CreateSwapChain               = nullptr;
+
+  PFN_IDXGIFactory2_CreateSwapChainForHwnd              CreateSwapChainForHwnd        = nullptr;
+  PFN_IDXGIFactory2_CreateSwapChainForCoreWindow        CreateSwapChainForCoreWindow  = nullptr;
+  PFN_IDXGIFactory2_CreateSwapChainForComposition       CreateSwapChainForComposition = nullptr;
 };
 
 static mutex  g_hookMutex;
@@ -69,10 +180,22 @@ static mutex  g_globalMutex;
 DeviceProcs   g_deviceProcs;
 ContextProcs  g_immContextProcs;
 ContextProcs  g_defContextProcs;
-
-constexpr uint32_t HOOK_DEVICE  = (1u << 0);
-constexpr uint32_t HOOK_IMM_CTX = (1u << 1);
-constexpr uint32_t HOOK_DEF_CTX = (1u << 2);
+SwapChainProcs g_swapChainProcs;
+FactoryProcs  g_factoryProcs;
+ResourceProcs g_bufferProcs;
+ResourceProcs g_texture1DProcs;
+ResourceProcs g_texture2DProcs;
+ResourceProcs g_texture3DProcs;
+
+constexpr uint32_t HOOK_DEVICE    = (1u << 0);
+constexpr uint32_t HOOK_IMM_CTX   = (1u << 1);
+constexpr uint32_t HOOK_DEF_CTX   = (1u << 2);
+constexpr uint32_t HOOK_SWAPCHAIN = (1u << 3);
+constexpr uint32_t HOOK_BUFFER    = (1u << 4);
+constexpr uint32_t HOOK_TEXTURE1D = (1u << 5);
+constexpr uint32_t HOOK_TEXTURE2D = (1u << 6);
+constexpr uint32_t HOOK_TEXTURE3D = (1u << 7);
+constexpr uint32_t HOOK_FACTORY   = (1u << 8);
 
 uint32_t      g_installedHooks = 0u;
 
@@ -86,21 +209,74 @@ const ContextProcs* getContextProcs(ID3D11DeviceContext* pContext) {
     : &g_defContextProcs;
 }
 
+const SwapChainProcs* getSwapChainProcs(IDXGISwapChain* pSwapChain) {
+  return &g_swapChainProcs;
+}
+
+/* Some runtimes implement copy and update methods on top of their
+ * ID3D11DeviceContext1 variants, which are hooked as well. Hooks
+ * called while atfix itself forwards a call to the runtime must go
+ * straight to the runtime, or they would run atfix logic again. */
+thread_local uint32_t g_forwardDepth = 0u;
+
+class ForwardScope {
+
+public:
+
+  ForwardScope() { g_forwardDepth += 1; }
+  ~ForwardScope() { g_forwardDepth -= 1; }
+
+  ForwardScope(const ForwardScope&) = delete;
+  ForwardScope& operator = (const ForwardScope&) = delete;
+
+  static bool isNested() {
+    return g_forwardDepth != 0u;
+  }
+
+};
+
 /** Metadata */
 static const GUID IID_StagingShadowResource = {0xe2728d91,0x9fdd,0x40d0,{0x87,0xa8,0x09,0xb6,0x2d,0xf3,0x14,0x9a}};
+static const GUID IID_ResourceStats = {0x4c83e1a9,0x5f2d,0x4a6b,{0x8e,0x17,0xd9,0x30,0xb4,0x6f,0x52,0xc1}};
+static const GUID IID_CopyRecord = {0x8d3f61b2,0x27ce,0x4e95,{0xb0,0x4a,0x6c,0x19,0xe7,0x52,0xd8,0x3e}};
+static const GUID IID_StagingAlias = {0x5a0c93e4,0xd17b,0x4c28,{0xa6,0x3f,0x81,0xe2,0x0b,0x97,0x4d,0x15}};
+static const GUID IID_WriteWatch = {0x91d4b6e0,0x3c7a,0x4f52,{0xbe,0x08,0x5d,0x2f,0xa1,0x6c,0x93,0x47}};
+static const GUID IID_WriteBack = {0x26f8a3c5,0x8e41,0x4d9b,{0x93,0x7c,0xe0,0x4b,0x15,0xd2,0x6a,0x8f}};
+
+/* Writes recorded on deferred contexts only happen once the command
+ * list gets executed, so copy records are only valid as long as no
+ * command list was executed since the copy was recorded. */
+std::atomic<uint64_t> g_commandListCount = { 0ull };
+
+/* Describes the last copy to a staging resource. Stored as private
+ * data of the staging resource, so that copying the same data to it
+ * again can be skipped if the source was not written in between. */
+struct ATFIX_COPY_RECORD {
+  ID3D11Resource* SrcResource;
+  UINT            SrcSubresource;
+  D3D11_BOX       SrcBox;
+  UINT            DstX;
+  UINT            DstY;
+  UINT            DstZ;
+  uint64_t        Generation;
+  uint64_t        CommandListCount;
+};
 
-struct ATFIX_RESOURCE_INFO {
-  D3D11_RESOURCE_DIMENSION Dim;
-  DXGI_FORMAT Format;
-  uint32_t Width;
-  uint32_t Height;
-  uint32_t Depth;
-  uint32_t Layers;
-  uint32_t Mips;
-  D3D11_USAGE Usage;
-  uint32_t BindFlags;
-  uint32_t MiscFlags;
-  uint32_t CPUFlags;
+/* Maximum number of regions that are copied back individually */
+constexpr uint32_t MaxWriteBackBoxes = 16;
+
+/* Describes regions of a staging resource that the game wrote
+ * through a write-watched mapping, along with the copy record
+ * that was valid when the resource was mapped. Unwritten data
+ * still matches the source of that copy if the record is still
+ * current, so copying the staging resource back to that source
+ * only needs to copy the written regions. */
+struct ATFIX_WRITE_BACK {
+  ATFIX_COPY_RECORD Record;
+  UINT            RowPitch;
+  UINT            DepthPitch;
+  UINT            BoxCount;
+  D3D11_BOX       Boxes[MaxWriteBackBoxes];
 };
 
 void* ptroffset(void* base, ptrdiff_t offset) {
@@ -119,8 +295,8 @@ uint32_t getFormatPixelSize(
   static const std::array<FormatRange, 7> s_ranges = {{
     { DXGI_FORMAT_R32G32B32A32_TYPELESS,  DXGI_FORMAT_R32G32B32A32_SINT,    16u },
     { DXGI_FORMAT_R32G32B32_TYPELESS,     DXGI_FORMAT_R32G32B32_SINT,       12u },
-    { DXGI_FORMAT_R16G16B16A16_TYPELESS,  DXGI_FORMAT_R32G32_SINT,          8u  },
-    { DXGI_FORMAT_R10G10B10A2_TYPELESS,   DXGI_FORMAT_R32_SINT,             4u  },
+    { DXGI_FORMAT_R16G16B16A16_TYPELESS,  DXGI_FORMAT_X32_TYPELESS_G8X24_UINT, 8u },
+    { DXGI_FORMAT_R10G10B10A2_TYPELESS,   DXGI_FORMAT_X24_TYPELESS_G8_UINT, 4u  },
     { DXGI_FORMAT_B8G8R8A8_UNORM,         DXGI_FORMAT_B8G8R8X8_UNORM_SRGB,  4u  },
     { DXGI_FORMAT_R8G8_TYPELESS,          DXGI_FORMAT_R16_SINT,             2u  },
     { DXGI_FORMAT_R8_TYPELESS,            DXGI_FORMAT_A8_UNORM,             1u  },
@@ -135,6 +311,12 @@ uint32_t getFormatPixelSize(
   return 1u;
 }
 
+bool isBlockCompressedFormat(
+        DXGI_FORMAT               Format) {
+  return (Format >= DXGI_FORMAT_BC1_TYPELESS  && Format <= DXGI_FORMAT_BC5_SNORM)
+      || (Format >= DXGI_FORMAT_BC6H_TYPELESS && Format <= DXGI_FORMAT_BC7_UNORM_SRGB);
+}
+
 bool getResourceInfo(
         ID3D11Resource*           pResource,
         ATFIX_RESOURCE_INFO*      pInfo) {
@@ -155,6 +337,7 @@ bool getResourceInfo(
       pInfo->Depth = 1;
       pInfo->Layers = 1;
       pInfo->Mips = 1;
+      pInfo->Samples = 1;
       pInfo->Usage = desc.Usage;
       pInfo->BindFlags = desc.BindFlags;
       pInfo->MiscFlags = desc.MiscFlags;
@@ -175,6 +358,7 @@ bool getResourceInfo(
       pInfo->Depth = 1;
       pInfo->Layers = desc.ArraySize;
       pInfo->Mips = desc.MipLevels;
+      pInfo->Samples = 1;
       pInfo->Usage = desc.Usage;
       pInfo->BindFlags = desc.BindFlags;
       pInfo->MiscFlags = desc.MiscFlags;
@@ -195,6 +379,7 @@ bool getResourceInfo(
       pInfo->Depth = 1;
       pInfo->Layers = desc.ArraySize;
       pInfo->Mips = desc.MipLevels;
+      pInfo->Samples = desc.SampleDesc.Count;
       pInfo->Usage = desc.Usage;
       pInfo->BindFlags = desc.BindFlags;
       pInfo->MiscFlags = desc.MiscFlags;
@@ -215,6 +400,7 @@ bool getResourceInfo(
       pInfo->Depth = desc.Depth;
       pInfo->Layers = 1;
       pInfo->Mips = desc.MipLevels;
+      pInfo->Samples = 1;
       pInfo->Usage = desc.Usage;
       pInfo->BindFlags = desc.BindFlags;
       pInfo->MiscFlags = desc.MiscFlags;
@@ -227,6 +413,16 @@ bool getResourceInfo(
   }
 }
 
+uint64_t getResourceSize(
+  const ATFIX_RESOURCE_INFO*      pInfo) {
+  uint64_t size = uint64_t(pInfo->Width) * pInfo->Height * pInfo->Depth * pInfo->Layers;
+
+  if (pInfo->Dim != D3D11_RESOURCE_DIMENSION_BUFFER)
+    size *= getFormatPixelSize(pInfo->Format);
+
+  return size;
+}
+
 D3D11_BOX getResourceBox(
   const ATFIX_RESOURCE_INFO*      pInfo,
         UINT                      Subresource) {
@@ -244,6 +440,138 @@ bool isImmediatecontext(
   return pContext->GetType() == D3D11_DEVICE_CONTEXT_IMMEDIATE;
 }
 
+GpuTimeline* getGpuTimeline(
+        ID3D11DeviceContext*      pContext) {
+  return isImmediatecontext(pContext)
+    ? GpuTimeline::get(pContext)
+    : nullptr;
+}
+
+CopyQueue* getCopyQueue(
+        ID3D11DeviceContext*      pContext) {
+  return isImmediatecontext(pContext)
+    ? CopyQueue::get(pContext)
+    : nullptr;
+}
+
+MappingCache* getMappingCache(
+        ID3D11DeviceContext*      pContext) {
+  return isImmediatecontext(pContext)
+    ? MappingCache::get(pContext)
+    : nullptr;
+}
+
+void invalidateMapping(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pResource) {
+  MappingCache* mappings = getMappingCache(pContext);
+
+  if (mappings)
+    mappings->invalidate(pResource);
+}
+
+void flushCopies(
+        ID3D11DeviceContext*      pContext) {
+  CopyQueue* queue = getCopyQueue(pContext);
+
+  if (queue)
+    queue->flush();
+}
+
+/* If no Present was seen for this long, end the frame at the next
+ * Map on the immediate context instead, so that per-frame work still
+ * happens for swap chains that could not be hooked, or for games that
+ * do not present at all */
+constexpr std::chrono::milliseconds MaxFrameTime(250);
+
+std::atomic<std::chrono::steady_clock::rep> g_frameEndTime = { 0 };
+
+void endFrame(
+        ID3D11DeviceContext*      pContext) {
+  CopyStrategy::get(pContext)->endFrame();
+
+  SubmitScheduler* scheduler = SubmitScheduler::get(pContext);
+
+  if (scheduler)
+    scheduler->endFrame();
+
+  GpuProfiler* profiler = GpuProfiler::get(pContext);
+
+  if (profiler)
+    profiler->endFrame();
+
+  StagingPool::get().endFrame();
+
+  /* Signal the timeline at least once per frame so that
+   * work the game submitted on its own can be tracked */
+  GpuTimeline* timeline = GpuTimeline::get(pContext);
+  timeline->track();
+  timeline->submit();
+
+  g_frameEndTime.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+}
+
+void checkFrameEnd(
+        ID3D11DeviceContext*      pContext) {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  auto last = std::chrono::steady_clock::duration(g_frameEndTime.load(std::memory_order_relaxed));
+
+  if (now - last < MaxFrameTime || pContext->GetType() != D3D11_DEVICE_CONTEXT_IMMEDIATE)
+    return;
+
+  flushCopies(pContext);
+
+  MappingCache* mappings = MappingCache::get(pContext);
+
+  if (mappings)
+    mappings->invalidateAll();
+
+  endFrame(pContext);
+}
+
+void queueCopyResource(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        ID3D11Resource*           pSrcResource) {
+  CopyQueue* queue = getCopyQueue(pContext);
+
+  /* Neither resource may stay mapped while the GPU accesses it */
+  invalidateMapping(pContext, pDstResource);
+  invalidateMapping(pContext, pSrcResource);
+
+  if (queue)
+    queue->copyResource(pDstResource, pSrcResource);
+  else
+    forwardCopyResource(pContext, pDstResource, pSrcResource);
+}
+
+void queueCopySubresourceRegion(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+        UINT                      DstX,
+        UINT                      DstY,
+        UINT                      DstZ,
+        ID3D11Resource*           pSrcResource,
+        UINT                      SrcSubresource,
+  const D3D11_BOX*                pSrcBox,
+        UINT                      CopyFlags) {
+  CopyQueue* queue = getCopyQueue(pContext);
+
+  invalidateMapping(pContext, pDstResource);
+  invalidateMapping(pContext, pSrcResource);
+
+  if (queue) {
+    queue->copySubresourceRegion(
+      pDstResource, DstSubresource, DstX, DstY, DstZ,
+      pSrcResource, SrcSubresource, pSrcBox, CopyFlags);
+  } else {
+    forwardCopySubresourceRegion(pContext,
+      pDstResource, DstSubresource, DstX, DstY, DstZ,
+      pSrcResource, SrcSubresource, pSrcBox, CopyFlags);
+  }
+}
+
 bool isCpuWritableResource(
   const ATFIX_RESOURCE_INFO*      pInfo) {
   return (pInfo->Usage == D3D11_USAGE_STAGING || pInfo->Usage == D3D11_USAGE_DYNAMIC)
@@ -260,17 +588,117 @@ bool isCpuReadableResource(
       && (pInfo->Mips == 1);
 }
 
-ID3D11Resource* createShadowResourceLocked(
-        ID3D11DeviceContext*      pContext,
-        ID3D11Resource*           pBaseResource) {
-  auto procs = getContextProcs(pContext);
+uint32_t getResourceClasses(
+  const ATFIX_RESOURCE_INFO*      pInfo) {
+  uint32_t classes = pInfo->Dim == D3D11_RESOURCE_DIMENSION_BUFFER
+    ? ATFIX_RESOURCE_CLASS_BUFFER
+    : ATFIX_RESOURCE_CLASS_TEXTURE;
 
-  ID3D11Device* device = nullptr;
-  pContext->GetDevice(&device);
+  if (pInfo->BindFlags & D3D11_BIND_RENDER_TARGET)
+    classes |= ATFIX_RESOURCE_CLASS_RENDER_TARGET;
+
+  if (pInfo->BindFlags & D3D11_BIND_DEPTH_STENCIL)
+    classes |= ATFIX_RESOURCE_CLASS_DEPTH_STENCIL;
+
+  if (pInfo->BindFlags & D3D11_BIND_UNORDERED_ACCESS)
+    classes |= ATFIX_RESOURCE_CLASS_UAV;
+
+  return classes;
+}
+
+bool allowStaleReads(
+  const ATFIX_RESOURCE_INFO*      pInfo) {
+  return getConfig()->StaleReadClasses & getResourceClasses(pInfo);
+}
+
+ResourceStats* getResourceStats(
+        ID3D11Resource*           pResource) {
+  IUnknown* stats = nullptr;
+  UINT resultSize = sizeof(stats);
+
+  if (SUCCEEDED(pResource->GetPrivateData(IID_ResourceStats, &resultSize, &stats)))
+    return static_cast<ResourceStats*>(stats);
+
+  return nullptr;
+}
+
+void scheduleShadowReadback(
+        GpuTimeline*              pTimeline,
+  const ATFIX_SHADOW*             pShadow) {
+  if (pShadow->Stats)
+    pShadow->Stats->recordShadowUpdate();
+
+  if (pTimeline) {
+    uint64_t value = pTimeline->trackResource(pShadow->Resource);
 
+    /* Don't bother reading back shadows that the game stopped
+     * reading from, the render thread maps them if necessary */
+    if (pShadow->Cache) {
+      pShadow->Cache->setTimelineValue(value);
+
+      if (pShadow->Cache->isReadRecently()) {
+        pShadow->Cache->getWorker()->scheduleReadback(
+          pShadow->Resource, pShadow->Offset, pShadow->Cache, value);
+      }
+    }
+  } else if (pShadow->Cache) {
+    pShadow->Cache->disable();
+  }
+}
+
+void markShadowResourceWritten(
+        GpuTimeline*              pTimeline,
+  const ATFIX_SHADOW*             pShadow) {
+  /* The write may still be queued, so make sure the shadow
+   * resource is tracked as busy before bumping the version */
+  scheduleShadowReadback(pTimeline, pShadow);
+
+  if (pShadow->Cache)
+    pShadow->Cache->invalidate(0);
+}
+
+ATFIX_RESOURCE_INFO getShadowResourceInfo(
+  const ATFIX_RESOURCE_INFO*      pBaseInfo,
+        UINT                      Subresource) {
+  /* The shadow only covers the given subresource */
+  D3D11_BOX box = getResourceBox(pBaseInfo, Subresource);
+
+  ATFIX_RESOURCE_INFO shadowInfo = *pBaseInfo;
+  shadowInfo.Width = box.right;
+  shadowInfo.Height = box.bottom;
+  shadowInfo.Depth = box.back;
+
+  /* Mips of block-compressed textures that are smaller than a block
+   * still occupy a whole block, but a top-level mip of that size is
+   * invalid, so round the shadow up to the block size. Copying the
+   * entire subresource into it is valid since the copy covers whole
+   * blocks either way. */
+  if (isBlockCompressedFormat(pBaseInfo->Format)) {
+    shadowInfo.Width = (shadowInfo.Width + 3u) & ~3u;
+    shadowInfo.Height = (shadowInfo.Height + 3u) & ~3u;
+  }
+  shadowInfo.Layers = 1;
+  shadowInfo.Mips = 1;
+  return shadowInfo;
+}
+
+HRESULT createShadowResource(
+        ID3D11Device*             pDevice,
+        ID3D11Resource*           pBaseResource,
+        UINT                      Subresource,
+        ID3D11Resource**          ppShadowResource) {
   ATFIX_RESOURCE_INFO resourceInfo = { };
   getResourceInfo(pBaseResource, &resourceInfo);
 
+  ATFIX_RESOURCE_INFO shadowInfo = getShadowResourceInfo(&resourceInfo, Subresource);
+
+  /* Staging resources cannot be multisampled */
+  if (resourceInfo.Samples > 1) {
+    log("Cannot create shadow for multisampled resource");
+    *ppShadowResource = nullptr;
+    return E_INVALIDARG;
+  }
+
   ID3D11Resource* shadowResource = nullptr;
   HRESULT hr;
 
@@ -290,7 +718,7 @@ ID3D11Resource* createShadowResourceLocked(
       desc.StructureByteStride = 0;
 
       ID3D11Buffer* shadowBuffer = nullptr;
-      hr = device->CreateBuffer(&desc, nullptr, &shadowBuffer);
+      hr = forwardCreateBuffer(pDevice, &desc, &shadowBuffer);
 
       shadowResource = shadowBuffer;
     } break;
@@ -303,13 +731,16 @@ ID3D11Resource* createShadowResourceLocked(
       texture->GetDesc(&desc);
       texture->Release();
 
+      desc.Width = shadowInfo.Width;
+      desc.MipLevels = 1;
+      desc.ArraySize = 1;
       desc.Usage = D3D11_USAGE_STAGING;
       desc.BindFlags = 0;
       desc.MiscFlags = 0;
       desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE | D3D11_CPU_ACCESS_READ;
 
       ID3D11Texture1D* shadowBuffer = nullptr;
-      hr = device->CreateTexture1D(&desc, nullptr, &shadowBuffer);
+      hr = forwardCreateTexture1D(pDevice, &desc, &shadowBuffer);
 
       shadowResource = shadowBuffer;
     } break;
@@ -322,13 +753,17 @@ ID3D11Resource* createShadowResourceLocked(
       texture->GetDesc(&desc);
       texture->Release();
 
+      desc.Width = shadowInfo.Width;
+      desc.Height = shadowInfo.Height;
+      desc.MipLevels = 1;
+      desc.ArraySize = 1;
       desc.Usage = D3D11_USAGE_STAGING;
       desc.BindFlags = 0;
       desc.MiscFlags = 0;
       desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE | D3D11_CPU_ACCESS_READ;
 
       ID3D11Texture2D* shadowBuffer = nullptr;
-      hr = device->CreateTexture2D(&desc, nullptr, &shadowBuffer);
+      hr = forwardCreateTexture2D(pDevice, &desc, &shadowBuffer);
 
       shadowResource = shadowBuffer;
     } break;
@@ -341,13 +776,17 @@ ID3D11Resource* createShadowResourceLocked(
       texture->GetDesc(&desc);
       texture->Release();
 
+      desc.Width = shadowInfo.Width;
+      desc.Height = shadowInfo.Height;
+      desc.Depth = shadowInfo.Depth;
+      desc.MipLevels = 1;
       desc.Usage = D3D11_USAGE_STAGING;
       desc.BindFlags = 0;
       desc.MiscFlags = 0;
       desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE | D3D11_CPU_ACCESS_READ;
 
       ID3D11Texture3D* shadowBuffer = nullptr;
-      hr = device->CreateTexture3D(&desc, nullptr, &shadowBuffer);
+      hr = forwardCreateTexture3D(pDevice, &desc, &shadowBuffer);
 
       shadowResource = shadowBuffer;
     } break;
@@ -357,56 +796,303 @@ ID3D11Resource* createShadowResourceLocked(
       hr = E_INVALIDARG;
   }
 
-  if (SUCCEEDED(hr)) {
-    procs->CopyResource(pContext, shadowResource, pBaseResource);
-    pBaseResource->SetPrivateDataInterface(IID_StagingShadowResource, shadowResource);
-  } else
+  if (FAILED(hr))
     log("Failed to create shadow resource, hr ", std::hex, hr);
 
-  device->Release();
-  return shadowResource;
+  *ppShadowResource = shadowResource;
+  return hr;
+}
+
+void initShadowResource(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pBaseResource,
+        UINT                      Subresource,
+        ATFIX_SHADOW*             pShadow) {
+  ATFIX_RESOURCE_INFO resourceInfo = { };
+  getResourceInfo(pBaseResource, &resourceInfo);
+
+  ATFIX_RESOURCE_INFO shadowInfo = getShadowResourceInfo(&resourceInfo, Subresource);
+
+  queueCopySubresourceRegion(pContext,
+    pShadow->Resource, 0, pShadow->Offset, 0, 0,
+    pBaseResource,     Subresource, nullptr, 0);
+
+  /* Statistics outlive the shadow resource since it may get
+   * destroyed and recreated when the copy strategy changes */
+  ResourceStats* stats;
+
+  { std::lock_guard lock(g_globalMutex);
+    stats = getResourceStats(pBaseResource);
+
+    if (!stats) {
+      stats = new ResourceStats(&resourceInfo);
+      stats->AddRef();
+
+      pBaseResource->SetPrivateDataInterface(IID_ResourceStats, stats);
+    }
+  }
+
+  pShadow->Stats = stats;
+
+  GpuTimeline* timeline = getGpuTimeline(pContext);
+  ReadbackWorker* worker = timeline
+    ? ReadbackWorker::get(pContext)
+    : nullptr;
+
+  if (worker) {
+    pShadow->Cache = new ShadowCache(worker, CopyStrategy::get(pContext), &shadowInfo);
+    pShadow->Cache->AddRef();
+  }
+
+  scheduleShadowReadback(timeline, pShadow);
 }
 
-ID3D11Resource* getShadowResourceLocked(
+ShadowSet* getShadowSetLocked(
         ID3D11Resource*           pBaseResource) {
-  ID3D11Resource* shadowResource = nullptr;
-  UINT resultSize = sizeof(shadowResource);
-  
-  if (SUCCEEDED(pBaseResource->GetPrivateData(IID_StagingShadowResource, &resultSize, &shadowResource)))
-    return shadowResource;
+  IUnknown* shadows = nullptr;
+  UINT resultSize = sizeof(shadows);
+
+  if (SUCCEEDED(pBaseResource->GetPrivateData(IID_StagingShadowResource, &resultSize, &shadows)))
+    return static_cast<ShadowSet*>(shadows);
 
   return nullptr;
 }
 
-ID3D11Resource* getShadowResource(
+ShadowSet* getShadowSet(
         ID3D11Resource*           pBaseResource) {
   std::lock_guard lock(g_globalMutex);
-  return getShadowResourceLocked(pBaseResource);
+  return getShadowSetLocked(pBaseResource);
 }
 
-ID3D11Resource* getOrCreateShadowResource(
-        ID3D11DeviceContext*      pContext,
+ShadowSet* getOrCreateShadowSet(
         ID3D11Resource*           pBaseResource) {
   std::lock_guard lock(g_globalMutex);
-  ID3D11Resource* shadowResource = getShadowResourceLocked(pBaseResource);
+  ShadowSet* shadows = getShadowSetLocked(pBaseResource);
+
+  if (!shadows) {
+    ATFIX_RESOURCE_INFO resourceInfo = { };
+    getResourceInfo(pBaseResource, &resourceInfo);
+
+    shadows = new ShadowSet(resourceInfo.Mips * resourceInfo.Layers);
+    shadows->AddRef();
+
+    pBaseResource->SetPrivateDataInterface(IID_StagingShadowResource, shadows);
+  }
+
+  return shadows;
+}
+
+bool getShadowForWrite(
+        ID3D11Resource*           pBaseResource,
+        UINT                      Subresource,
+        ATFIX_SHADOW*             pShadow) {
+  ShadowSet* shadows = getShadowSet(pBaseResource);
+
+  if (!shadows)
+    return false;
+
+  shadows->markWritten(Subresource);
+
+  bool hasShadow = shadows->getShadow(Subresource, pShadow);
+  shadows->Release();
+  return hasShadow;
+}
+
+void destroyShadowResources(
+        ID3D11Resource*           pBaseResource) {
+  /* Keep the shadow set itself so that writes are still tracked */
+  ShadowSet* shadows = getShadowSet(pBaseResource);
+
+  if (shadows) {
+    shadows->clear();
+    shadows->Release();
+  }
+}
+
+bool getOrCreateShadow(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pBaseResource,
+        UINT                      Subresource,
+        ATFIX_SHADOW*             pShadow) {
+  ShadowSet* shadows = getOrCreateShadowSet(pBaseResource);
+  bool hasShadow = shadows->getShadow(Subresource, pShadow);
+
+  if (!hasShadow) {
+    ATFIX_SHADOW shadow = { };
+
+    /* Shadows created in the background only get their initial copy
+     * here, so that it captures the current contents of the resource.
+     * Until then, the caller has to fall back to the GPU path. */
+    shadow.Resource = shadows->takePublishedShadow(Subresource);
+
+    if (!shadow.Resource) {
+      /* Allocating a slot in the arena is cheap, so small
+       * buffers don't need to go through the shadow worker */
+      ShadowArena* arena = ShadowArena::get(pContext);
+
+      if (arena) {
+        ATFIX_RESOURCE_INFO resourceInfo = { };
+        getResourceInfo(pBaseResource, &resourceInfo);
+
+        if (resourceInfo.Dim == D3D11_RESOURCE_DIMENSION_BUFFER
+         && arena->canAllocate(resourceInfo.Width)
+         && SUCCEEDED(arena->allocate(resourceInfo.Width, &shadow.Resource, &shadow.Offset))) {
+          arena->AddRef();
+          shadow.Arena = arena;
+        }
+      }
+    }
+
+    if (!shadow.Resource) {
+      ShadowWorker* worker = ShadowWorker::get(pContext);
+
+      if (worker) {
+        if (shadows->beginCreation(Subresource))
+          worker->scheduleCreation(shadows, pBaseResource, Subresource);
+      } else if (!shadows->isCreationFailed(Subresource)) {
+        TraceScope trace("atfix::createShadowResource", pBaseResource);
+        ID3D11Device* device = nullptr;
+        pContext->GetDevice(&device);
+
+        /* Don't retry on every copy if creation failed */
+        if (FAILED(createShadowResource(device, pBaseResource, Subresource, &shadow.Resource))) {
+          shadows->publishShadow(Subresource, nullptr);
+          shadow.Resource = nullptr;
+        }
+
+        device->Release();
+      }
+    }
+
+    if (shadow.Resource) {
+      initShadowResource(pContext, pBaseResource, Subresource, &shadow);
+      shadows->setShadow(Subresource, &shadow);
+
+      *pShadow = shadow;
+      hasShadow = true;
+    }
+  }
+
+  shadows->Release();
+  return hasShadow;
+}
+
+bool getBufferViewRange(
+        ID3D11UnorderedAccessView* pView,
+        ID3D11Resource*           pResource,
+        D3D11_BOX*                pRange) {
+  D3D11_UNORDERED_ACCESS_VIEW_DESC viewDesc = { };
+  pView->GetDesc(&viewDesc);
 
-  if (!shadowResource)
-    shadowResource = createShadowResourceLocked(pContext, pBaseResource);
+  if (viewDesc.ViewDimension != D3D11_UAV_DIMENSION_BUFFER)
+    return false;
 
-  return shadowResource;
+  ID3D11Buffer* buffer = nullptr;
+
+  if (FAILED(pResource->QueryInterface(IID_PPV_ARGS(&buffer))))
+    return false;
+
+  D3D11_BUFFER_DESC bufferDesc = { };
+  buffer->GetDesc(&bufferDesc);
+  buffer->Release();
+
+  /* Structured buffer views have no format, raw views
+   * use R32_TYPELESS and thus work the same as typed ones */
+  uint32_t elementSize = viewDesc.Format == DXGI_FORMAT_UNKNOWN
+    ? bufferDesc.StructureByteStride
+    : getFormatPixelSize(viewDesc.Format);
+
+  uint64_t begin = uint64_t(viewDesc.Buffer.FirstElement) * elementSize;
+  uint64_t end = begin + uint64_t(viewDesc.Buffer.NumElements) * elementSize;
+
+  if (!elementSize || end > bufferDesc.ByteWidth)
+    end = bufferDesc.ByteWidth;
+
+  if (begin >= end)
+    return false;
+
+  *pRange = D3D11_BOX { uint32_t(begin), 0, 0, uint32_t(end), 1, 1 };
+  return true;
+}
+
+void addBufferRange(
+        std::vector<D3D11_BOX>&   Ranges,
+  const D3D11_BOX&                Range) {
+  D3D11_BOX merged = Range;
+
+  /* Keep ranges sorted and disjoint, merging any
+   * range that overlaps or touches the new one */
+  auto begin = std::lower_bound(Ranges.begin(), Ranges.end(), merged,
+    [] (const D3D11_BOX& a, const D3D11_BOX& b) { return a.right < b.left; });
+  auto end = begin;
+
+  while (end != Ranges.end() && end->left <= merged.right) {
+    merged.left = std::min(merged.left, end->left);
+    merged.right = std::max(merged.right, end->right);
+    end++;
+  }
+
+  begin = Ranges.erase(begin, end);
+  Ranges.insert(begin, merged);
+}
+
+void updateShadowBufferRanges(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pBaseResource,
+  const ATFIX_SHADOW*             pShadow,
+  const std::vector<D3D11_BOX>&   Ranges) {
+  TraceScope trace("atfix::updateShadowBufferRanges", pBaseResource);
+
+  for (const auto& range : Ranges) {
+    queueCopySubresourceRegion(pContext,
+      pShadow->Resource, 0, pShadow->Offset + range.left, 0, 0,
+      pBaseResource,     0, &range, 0);
+  }
+
+  markShadowResourceWritten(getGpuTimeline(pContext), pShadow);
+}
+
+void updateShadowSubresources(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pBaseResource,
+        ShadowSet*                pShadows,
+  const ATFIX_RESOURCE_INFO*      pInfo,
+        uint32_t                  MipLevel,
+        uint32_t                  MipCount,
+        uint32_t                  LayerIndex,
+        uint32_t                  LayerCount) {
+  TraceScope trace("atfix::updateShadowSubresources", pBaseResource);
+  GpuTimeline* timeline = getGpuTimeline(pContext);
+
+  /* Only subresources that were read back have a shadow */
+  for (uint32_t i = 0; i < LayerCount; i++) {
+    for (uint32_t j = 0; j < MipCount; j++) {
+      uint32_t subresource = D3D11CalcSubresource(MipLevel + j, LayerIndex + i, pInfo->Mips);
+      ATFIX_SHADOW shadow = { };
+      pShadows->markWritten(subresource);
+
+      if (!pShadows->getShadow(subresource, &shadow))
+        continue;
+
+      queueCopySubresourceRegion(pContext,
+        shadow.Resource, 0,           shadow.Offset, 0, 0,
+        pBaseResource,   subresource, nullptr, 0);
+
+      markShadowResourceWritten(timeline, &shadow);
+      releaseShadow(&shadow);
+    }
+  }
 }
 
 void updateViewShadowResource(
         ID3D11DeviceContext*      pContext,
         ID3D11View*               pView) {
-  auto procs = getContextProcs(pContext);
-
   ID3D11Resource* baseResource;
   pView->GetResource(&baseResource);
 
-  ID3D11Resource* shadowResource = getShadowResource(baseResource);
+  ShadowSet* shadows = getShadowSet(baseResource);
 
-  if (shadowResource) {
+  if (shadows) {
     ATFIX_RESOURCE_INFO resourceInfo = { };
     getResourceInfo(baseResource, &resourceInfo);
 
@@ -415,6 +1101,7 @@ void updateViewShadowResource(
     uint32_t layerCount = 1;
 
     ID3D11RenderTargetView* rtv = nullptr;
+    ID3D11DepthStencilView* dsv = nullptr;
     ID3D11UnorderedAccessView* uav = nullptr;
 
     if (SUCCEEDED(pView->QueryInterface(IID_PPV_ARGS(&rtv)))) {
@@ -450,14 +1137,68 @@ void updateViewShadowResource(
         default:
           log("Unhandled RTV dimension ", desc.ViewDimension);
       }
+    } else if (SUCCEEDED(pView->QueryInterface(IID_PPV_ARGS(&dsv)))) {
+      D3D11_DEPTH_STENCIL_VIEW_DESC desc = { };
+      dsv->GetDesc(&desc);
+      dsv->Release();
+
+      switch (desc.ViewDimension) {
+        case D3D11_DSV_DIMENSION_TEXTURE1D:
+          mipLevel = desc.Texture1D.MipSlice;
+          break;
+
+        case D3D11_DSV_DIMENSION_TEXTURE1DARRAY:
+          mipLevel = desc.Texture1DArray.MipSlice;
+          layerIndex = desc.Texture1DArray.FirstArraySlice;
+          layerCount = desc.Texture1DArray.ArraySize;
+          break;
+
+        case D3D11_DSV_DIMENSION_TEXTURE2D:
+          mipLevel = desc.Texture2D.MipSlice;
+          break;
+
+        case D3D11_DSV_DIMENSION_TEXTURE2DARRAY:
+          mipLevel = desc.Texture2DArray.MipSlice;
+          layerIndex = desc.Texture2DArray.FirstArraySlice;
+          layerCount = desc.Texture2DArray.ArraySize;
+          break;
+
+        case D3D11_DSV_DIMENSION_TEXTURE2DMS:
+          break;
+
+        case D3D11_DSV_DIMENSION_TEXTURE2DMSARRAY:
+          layerIndex = desc.Texture2DMSArray.FirstArraySlice;
+          layerCount = desc.Texture2DMSArray.ArraySize;
+          break;
+
+        default:
+          log("Unhandled DSV dimension ", desc.ViewDimension);
+      }
     } else if (SUCCEEDED(pView->QueryInterface(IID_PPV_ARGS(&uav)))) {
       D3D11_UNORDERED_ACCESS_VIEW_DESC desc = { };
       uav->GetDesc(&desc);
       uav->Release();
 
       switch (desc.ViewDimension) {
-        case D3D11_UAV_DIMENSION_BUFFER:
-          break;
+        case D3D11_UAV_DIMENSION_BUFFER: {
+          /* Only copy the part of the buffer that the view can
+           * write, compute passes often only touch a small part */
+          D3D11_BOX range = { };
+
+          if (getBufferViewRange(uav, baseResource, &range)) {
+            ATFIX_SHADOW shadow = { };
+            shadows->markWritten(0);
+
+            if (shadows->getShadow(0, &shadow)) {
+              updateShadowBufferRanges(pContext, baseResource, &shadow, { range });
+              releaseShadow(&shadow);
+            }
+
+            shadows->Release();
+            baseResource->Release();
+            return;
+          }
+        } break;
 
         case D3D11_UAV_DIMENSION_TEXTURE1D:
           mipLevel = desc.Texture1D.MipSlice;
@@ -490,67 +1231,375 @@ void updateViewShadowResource(
       log("Unhandled view type");
     }
 
-    for (uint32_t i = 0; i < layerCount; i++) {
-      uint32_t subresource = D3D11CalcSubresource(mipLevel, layerIndex + i, resourceInfo.Mips);
-
-      procs->CopySubresourceRegion(pContext,
-        shadowResource, subresource, 0, 0, 0,
-        baseResource,   subresource, nullptr);
-    }
+    updateShadowSubresources(pContext, baseResource, shadows,
+      &resourceInfo, mipLevel, 1, layerIndex, layerCount);
 
-    shadowResource->Release();
+    shadows->Release();
   }
 
   baseResource->Release();
 }
 
-void updateRtvShadowResources(
-        ID3D11DeviceContext*      pContext) {
-  std::array<ID3D11RenderTargetView*, 8> rtvs;
-  pContext->OMGetRenderTargets(rtvs.size(), rtvs.data(), nullptr);
+void updateUavShadowResources(
+        ID3D11DeviceContext*      pContext,
+        UINT                      UAVCount,
+        ID3D11UnorderedAccessView* const* ppUAVs) {
+  /* Multiple views may write to the same buffer, so gather
+   * and merge their ranges before updating the shadow */
+  struct BufferRanges {
+    ID3D11Resource*         resource;
+    ShadowSet*              shadows;
+    std::vector<D3D11_BOX>  ranges;
+  };
 
-  for (ID3D11RenderTargetView* rtv : rtvs) {
-    if (rtv) {
-      updateViewShadowResource(pContext, rtv);
-      rtv->Release();
-    }
-  }
-}
+  std::array<BufferRanges, D3D11_PS_CS_UAV_REGISTER_COUNT> buffers;
+  uint32_t bufferCount = 0;
 
-void updateUavShadowResources(
+  for (uint32_t i = 0; i < UAVCount; i++) {
+    ID3D11UnorderedAccessView* uav = ppUAVs[i];
+
+    if (!uav)
+      continue;
+
+    ID3D11Resource* resource = nullptr;
+    uav->GetResource(&resource);
+
+    /* Most UAVs are never copied to staging resources, so skip
+     * those before doing any work to find the written range */
+    ShadowSet* shadows = getShadowSet(resource);
+
+    if (!shadows) {
+      resource->Release();
+      continue;
+    }
+
+    D3D11_BOX range = { };
+
+    if (getBufferViewRange(uav, resource, &range)) {
+      uint32_t index = 0;
+
+      while (index < bufferCount && buffers[index].resource != resource)
+        index++;
+
+      if (index == bufferCount) {
+        buffers[index].resource = resource;
+        buffers[index].resource->AddRef();
+        buffers[index].shadows = shadows;
+        buffers[index].shadows->AddRef();
+        bufferCount++;
+      }
+
+      addBufferRange(buffers[index].ranges, range);
+    } else {
+      updateViewShadowResource(pContext, uav);
+    }
+
+    shadows->Release();
+    resource->Release();
+  }
+
+  for (uint32_t i = 0; i < bufferCount; i++) {
+    ATFIX_SHADOW shadow = { };
+    buffers[i].shadows->markWritten(0);
+
+    if (buffers[i].shadows->getShadow(0, &shadow)) {
+      updateShadowBufferRanges(pContext, buffers[i].resource,
+        &shadow, buffers[i].ranges);
+      releaseShadow(&shadow);
+    }
+
+    buffers[i].shadows->Release();
+    buffers[i].resource->Release();
+  }
+}
+
+void updateOmShadowResources(
+        ID3D11DeviceContext*      pContext) {
+  std::array<ID3D11RenderTargetView*, D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT> rtvs;
+  std::array<ID3D11UnorderedAccessView*, D3D11_PS_CS_UAV_REGISTER_COUNT> uavs;
+  ID3D11DepthStencilView* dsv = nullptr;
+
+  /* Pixel shader UAVs share slots with render targets, and
+   * slots that are occupied by render targets return null */
+  pContext->OMGetRenderTargetsAndUnorderedAccessViews(
+    rtvs.size(), rtvs.data(), &dsv, 0, uavs.size(), uavs.data());
+
+  for (ID3D11RenderTargetView* rtv : rtvs) {
+    if (rtv) {
+      updateViewShadowResource(pContext, rtv);
+      rtv->Release();
+    }
+  }
+
+  if (dsv) {
+    D3D11_DEPTH_STENCIL_VIEW_DESC desc = { };
+    dsv->GetDesc(&desc);
+
+    /* Read-only views can't have modified the resource */
+    constexpr UINT ReadOnlyFlags = D3D11_DSV_READ_ONLY_DEPTH | D3D11_DSV_READ_ONLY_STENCIL;
+
+    if ((desc.Flags & ReadOnlyFlags) != ReadOnlyFlags)
+      updateViewShadowResource(pContext, dsv);
+
+    dsv->Release();
+  }
+
+  updateUavShadowResources(pContext, uavs.size(), uavs.data());
+
+  for (ID3D11UnorderedAccessView* uav : uavs) {
+    if (uav)
+      uav->Release();
+  }
+}
+
+void updateCsShadowResources(
         ID3D11DeviceContext*      pContext) {
-  std::array<ID3D11UnorderedAccessView*, 8> uavs;
+  std::array<ID3D11UnorderedAccessView*, D3D11_PS_CS_UAV_REGISTER_COUNT> uavs;
   pContext->CSGetUnorderedAccessViews(0, uavs.size(), uavs.data());
 
+  updateUavShadowResources(pContext, uavs.size(), uavs.data());
+
   for (ID3D11UnorderedAccessView* uav : uavs) {
-    if (uav) {
-      updateViewShadowResource(pContext, uav);
+    if (uav)
       uav->Release();
-    }
   }
 }
 
+StagingAlias* getStagingAlias(
+        ID3D11Resource*           pResource) {
+  IUnknown* alias = nullptr;
+  UINT resultSize = sizeof(alias);
+
+  if (SUCCEEDED(pResource->GetPrivateData(IID_StagingAlias, &resultSize, &alias)))
+    return static_cast<StagingAlias*>(alias);
+
+  return nullptr;
+}
+
+void setStagingAlias(
+        ID3D11Resource*           pResource,
+        StagingAlias*             pAlias) {
+  if (pAlias)
+    pResource->SetPrivateDataInterface(IID_StagingAlias, pAlias);
+  else
+    pResource->SetPrivateData(IID_StagingAlias, 0, nullptr);
+}
+
+bool shouldPoolResource(
+  const D3D11_SUBRESOURCE_DATA*   pData,
+        void*                     ppResource) {
+  /* Resources with initial data would need to be re-initialized,
+   * and a null output pointer means the game only validates */
+  return getConfig()->StagingPool && !pData && ppResource;
+}
+
+void trackPooledResource(
+        ID3D11Device*             pDevice,
+        ID3D11Resource*           pResource,
+  const ATFIX_POOL_DESC*          pDesc) {
+  hookResource(pResource);
+  StagingPool::get().track(pDevice, pResource, pDesc);
+}
+
+void resetPooledResource(
+        ID3D11Resource*           pResource) {
+  /* Contents of recycled resources are undefined anyway, so don't
+   * keep cached data alive for no reason, and make sure that none
+   * of it applies to the resource's next incarnation. */
+  setStagingAlias(pResource, nullptr);
+
+  pResource->SetPrivateData(IID_CopyRecord, 0, nullptr);
+  pResource->SetPrivateData(IID_WriteBack, 0, nullptr);
+  pResource->SetPrivateData(IID_WriteWatch, 0, nullptr);
+
+  GpuTimeline::untrackResource(pResource);
+}
+
+ULONG releaseResource(
+  const ResourceProcs*            pProcs,
+        IUnknown*                 pResource) {
+  StagingPool& pool = StagingPool::get();
+
+  if (pool.isEmpty())
+    return pProcs->Release(pResource);
+
+  /* If only the pool's reference is left, the game released the
+   * resource and we can recycle it. This can't miss other holders
+   * inside atfix: queued copies, kept mappings and readback jobs
+   * all hold a reference of their own while they use a resource,
+   * so the count stays above 1 until the last of them lets go, and
+   * that Release call ends up here as well. Nothing can add a new
+   * reference in between without holding one already. */
+  ULONG refCount = pProcs->Release(pResource);
+
+  if (refCount == 1 && pool.recycle(static_cast<ID3D11Resource*>(pResource))) {
+    resetPooledResource(static_cast<ID3D11Resource*>(pResource));
+    return 0;
+  }
+
+  return refCount;
+}
+
+/* Device children hold a reference to their device on native D3D11,
+ * which is what keeps devices alive as long as atfix holds on to any
+ * objects. Checked once, since internal references are meaningless
+ * on runtimes where this is not the case. */
+bool g_childrenHoldDevice = false;
+
+mutex g_internalRefMutex;
+std::unordered_map<ID3D11Device*, int32_t> g_internalRefs;
+std::atomic<int32_t> g_internalRefTotal = { 0 };
+
+thread_local bool g_releasingDevice = false;
+
+void addInternalDeviceRefs(
+        ID3D11Device*             pDevice,
+        int32_t                   Count) {
+  if (!g_childrenHoldDevice)
+    return;
+
+  std::lock_guard lock(g_internalRefMutex);
+  int32_t refs = (g_internalRefs[pDevice] += Count);
+
+  if (!refs)
+    g_internalRefs.erase(pDevice);
+
+  g_internalRefTotal += Count;
+}
+
+bool isDeviceReleased(
+        ID3D11Device*             pDevice,
+        ULONG                     RefCount) {
+  /* The total across all devices is an upper bound, and
+   * lets us skip the lookup for most Release calls */
+  if (!RefCount || int64_t(RefCount) > g_internalRefTotal.load())
+    return false;
+
+  std::lock_guard lock(g_internalRefMutex);
+  auto entry = g_internalRefs.find(pDevice);
+
+  return entry != g_internalRefs.end()
+    && int64_t(RefCount) <= entry->second;
+}
+
+void releaseDeviceObjects(
+        ID3D11Device*             pDevice) {
+  log("Device ", pDevice, " released, dropping internal objects");
+
+  /* Releasing objects drops device references, which
+   * must not get back here while the device is alive */
+  g_releasingDevice = true;
+  pDevice->AddRef();
+
+  ID3D11DeviceContext* context = nullptr;
+  pDevice->GetImmediateContext(&context);
+
+  /* Kept mappings and queued copies may hold the last reference
+   * to pooled resources, so drop them before the pool itself */
+  MappingCache::detach(context);
+  ReadbackWorker::detach(context);
+  CopyQueue::detach(context);
+  GpuProfiler::detach(context);
+  SubmitScheduler::detach(context);
+  ShadowArena::detach(context);
+
+  StagingPool::get().releaseDevice(pDevice);
+
+  CopyStrategy::detach(context);
+  GpuTimeline::detach(context);
+
+  context->Release();
+
+  g_deviceProcs.Release(pDevice);
+  g_releasingDevice = false;
+}
+
+ULONG STDMETHODCALLTYPE ID3D11Device_Release(
+        IUnknown*                 pDevice) {
+  TraceScope trace("ID3D11Device::Release");
+  auto device = static_cast<ID3D11Device*>(pDevice);
+
+  ULONG refCount = g_deviceProcs.Release(pDevice);
+
+  /* If only internal references are left, the game is done with
+   * the device, and dropping those objects will destroy it */
+  if (!g_releasingDevice && isDeviceReleased(device, refCount)) {
+    releaseDeviceObjects(device);
+    return 0;
+  }
+
+  return refCount;
+}
+
+ULONG STDMETHODCALLTYPE ID3D11Buffer_Release(
+        IUnknown*                 pResource) {
+  TraceScope trace("ID3D11Buffer::Release");
+  return releaseResource(&g_bufferProcs, pResource);
+}
+
+ULONG STDMETHODCALLTYPE ID3D11Texture1D_Release(
+        IUnknown*                 pResource) {
+  TraceScope trace("ID3D11Texture1D::Release");
+  return releaseResource(&g_texture1DProcs, pResource);
+}
+
+ULONG STDMETHODCALLTYPE ID3D11Texture2D_Release(
+        IUnknown*                 pResource) {
+  TraceScope trace("ID3D11Texture2D::Release");
+  return releaseResource(&g_texture2DProcs, pResource);
+}
+
+ULONG STDMETHODCALLTYPE ID3D11Texture3D_Release(
+        IUnknown*                 pResource) {
+  TraceScope trace("ID3D11Texture3D::Release");
+  return releaseResource(&g_texture3DProcs, pResource);
+}
+
 HRESULT STDMETHODCALLTYPE ID3D11Device_CreateBuffer(
         ID3D11Device*             pDevice,
   const D3D11_BUFFER_DESC*        pDesc,
   const D3D11_SUBRESOURCE_DATA*   pData,
         ID3D11Buffer**            ppBuffer) {
+  TraceScope trace("ID3D11Device::CreateBuffer");
   auto procs = getDeviceProcs(pDevice);
   D3D11_BUFFER_DESC desc;
 
+  ATFIX_POOL_DESC poolDesc = { };
+  bool usePool = false;
+
   if (pDesc && pDesc->Usage == D3D11_USAGE_STAGING) {
     desc = *pDesc;
     desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ | D3D11_CPU_ACCESS_WRITE;
     pDesc = &desc;
+
+    poolDesc.Dim = D3D11_RESOURCE_DIMENSION_BUFFER;
+    poolDesc.Buffer = desc;
+
+    usePool = shouldPoolResource(pData, ppBuffer);
+  }
+
+  if (usePool) {
+    ID3D11Resource* resource = StagingPool::get().acquire(pDevice, &poolDesc);
+
+    if (resource) {
+      *ppBuffer = static_cast<ID3D11Buffer*>(resource);
+      return S_OK;
+    }
   }
 
-  return procs->CreateBuffer(pDevice, pDesc, pData, ppBuffer);
+  HRESULT hr = procs->CreateBuffer(pDevice, pDesc, pData, ppBuffer);
+
+  if (SUCCEEDED(hr) && usePool)
+    trackPooledResource(pDevice, *ppBuffer, &poolDesc);
+
+  return hr;
 }
 
 HRESULT STDMETHODCALLTYPE ID3D11Device_CreateDeferredContext(
         ID3D11Device*             pDevice,
         UINT                      Flags,
         ID3D11DeviceContext**     ppDeferredContext) {
+  TraceScope trace("ID3D11Device::CreateDeferredContext");
   auto procs = getDeviceProcs(pDevice);
   HRESULT hr = procs->CreateDeferredContext(pDevice, Flags, ppDeferredContext);
 
@@ -565,16 +1614,39 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreateTexture1D(
   const D3D11_TEXTURE1D_DESC*     pDesc,
   const D3D11_SUBRESOURCE_DATA*   pData,
         ID3D11Texture1D**         ppTexture) {
+  TraceScope trace("ID3D11Device::CreateTexture1D");
   auto procs = getDeviceProcs(pDevice);
   D3D11_TEXTURE1D_DESC desc;
 
+  ATFIX_POOL_DESC poolDesc = { };
+  bool usePool = false;
+
   if (pDesc && pDesc->Usage == D3D11_USAGE_STAGING) {
     desc = *pDesc;
     desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ | D3D11_CPU_ACCESS_WRITE;
     pDesc = &desc;
+
+    poolDesc.Dim = D3D11_RESOURCE_DIMENSION_TEXTURE1D;
+    poolDesc.Texture1D = desc;
+
+    usePool = shouldPoolResource(pData, ppTexture);
+  }
+
+  if (usePool) {
+    ID3D11Resource* resource = StagingPool::get().acquire(pDevice, &poolDesc);
+
+    if (resource) {
+      *ppTexture = static_cast<ID3D11Texture1D*>(resource);
+      return S_OK;
+    }
   }
 
-  return procs->CreateTexture1D(pDevice, pDesc, pData, ppTexture);
+  HRESULT hr = procs->CreateTexture1D(pDevice, pDesc, pData, ppTexture);
+
+  if (SUCCEEDED(hr) && usePool)
+    trackPooledResource(pDevice, *ppTexture, &poolDesc);
+
+  return hr;
 }
 
 HRESULT STDMETHODCALLTYPE ID3D11Device_CreateTexture2D(
@@ -582,16 +1654,39 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreateTexture2D(
   const D3D11_TEXTURE2D_DESC*     pDesc,
   const D3D11_SUBRESOURCE_DATA*   pData,
         ID3D11Texture2D**         ppTexture) {
+  TraceScope trace("ID3D11Device::CreateTexture2D");
   auto procs = getDeviceProcs(pDevice);
   D3D11_TEXTURE2D_DESC desc;
 
+  ATFIX_POOL_DESC poolDesc = { };
+  bool usePool = false;
+
   if (pDesc && pDesc->Usage == D3D11_USAGE_STAGING) {
     desc = *pDesc;
     desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ | D3D11_CPU_ACCESS_WRITE;
     pDesc = &desc;
+
+    poolDesc.Dim = D3D11_RESOURCE_DIMENSION_TEXTURE2D;
+    poolDesc.Texture2D = desc;
+
+    usePool = shouldPoolResource(pData, ppTexture);
+  }
+
+  if (usePool) {
+    ID3D11Resource* resource = StagingPool::get().acquire(pDevice, &poolDesc);
+
+    if (resource) {
+      *ppTexture = static_cast<ID3D11Texture2D*>(resource);
+      return S_OK;
+    }
   }
 
-  return procs->CreateTexture2D(pDevice, pDesc, pData, ppTexture);
+  HRESULT hr = procs->CreateTexture2D(pDevice, pDesc, pData, ppTexture);
+
+  if (SUCCEEDED(hr) && usePool)
+    trackPooledResource(pDevice, *ppTexture, &poolDesc);
+
+  return hr;
 }
 
 HRESULT STDMETHODCALLTYPE ID3D11Device_CreateTexture3D(
@@ -599,23 +1694,49 @@ HRESULT STDMETHODCALLTYPE ID3D11Device_CreateTexture3D(
   const D3D11_TEXTURE3D_DESC*     pDesc,
   const D3D11_SUBRESOURCE_DATA*   pData,
         ID3D11Texture3D**         ppTexture) {
+  TraceScope trace("ID3D11Device::CreateTexture3D");
   auto procs = getDeviceProcs(pDevice);
   D3D11_TEXTURE3D_DESC desc;
 
+  ATFIX_POOL_DESC poolDesc = { };
+  bool usePool = false;
+
   if (pDesc && pDesc->Usage == D3D11_USAGE_STAGING) {
     desc = *pDesc;
     desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ | D3D11_CPU_ACCESS_WRITE;
     pDesc = &desc;
+
+    poolDesc.Dim = D3D11_RESOURCE_DIMENSION_TEXTURE3D;
+    poolDesc.Texture3D = desc;
+
+    usePool = shouldPoolResource(pData, ppTexture);
+  }
+
+  if (usePool) {
+    ID3D11Resource* resource = StagingPool::get().acquire(pDevice, &poolDesc);
+
+    if (resource) {
+      *ppTexture = static_cast<ID3D11Texture3D*>(resource);
+      return S_OK;
+    }
   }
 
-  return procs->CreateTexture3D(pDevice, pDesc, pData, ppTexture);
+  HRESULT hr = procs->CreateTexture3D(pDevice, pDesc, pData, ppTexture);
+
+  if (SUCCEEDED(hr) && usePool)
+    trackPooledResource(pDevice, *ppTexture, &poolDesc);
+
+  return hr;
 }
 
 void STDMETHODCALLTYPE ID3D11DeviceContext_ClearRenderTargetView(
         ID3D11DeviceContext*      pContext,
         ID3D11RenderTargetView*   pRTV,
   const FLOAT                     pColor[4]) {
+  TraceScope trace("ID3D11DeviceContext::ClearRenderTargetView");
   auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
+
   procs->ClearRenderTargetView(pContext, pRTV, pColor);
 
   if (pRTV)
@@ -626,7 +1747,10 @@ void STDMETHODCALLTYPE ID3D11DeviceContext_ClearUnorderedAccessViewFloat(
         ID3D11DeviceContext*      pContext,
         ID3D11UnorderedAccessView* pUAV,
   const FLOAT                     pColor[4]) {
+  TraceScope trace("ID3D11DeviceContext::ClearUnorderedAccessViewFloat");
   auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
+
   procs->ClearUnorderedAccessViewFloat(pContext, pUAV, pColor);
 
   if (pUAV)
@@ -637,335 +1761,1960 @@ void STDMETHODCALLTYPE ID3D11DeviceContext_ClearUnorderedAccessViewUint(
         ID3D11DeviceContext*      pContext,
         ID3D11UnorderedAccessView* pUAV,
   const UINT                      pColor[4]) {
+  TraceScope trace("ID3D11DeviceContext::ClearUnorderedAccessViewUint");
   auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
+
   procs->ClearUnorderedAccessViewUint(pContext, pUAV, pColor);
 
   if (pUAV)
     updateViewShadowResource(pContext, pUAV);
 }
 
-HRESULT tryCpuCopy(
+bool isTrackedCopyDestination(
         ID3D11DeviceContext*      pContext,
         ID3D11Resource*           pDstResource,
-        UINT                      DstSubresource,
+        UINT                      DstSubresource) {
+  if (!isImmediatecontext(pContext) || DstSubresource)
+    return false;
+
+  ATFIX_RESOURCE_INFO dstInfo = { };
+  getResourceInfo(pDstResource, &dstInfo);
+
+  /* Copy records are stored per resource */
+  return dstInfo.Usage == D3D11_USAGE_STAGING
+      && dstInfo.Mips * dstInfo.Layers == 1;
+}
+
+bool getCopyRecord(
+        ID3D11Resource*           pDstResource,
         UINT                      DstX,
         UINT                      DstY,
         UINT                      DstZ,
         ID3D11Resource*           pSrcResource,
         UINT                      SrcSubresource,
-  const D3D11_BOX*                pSrcBox) {
-  ATFIX_RESOURCE_INFO dstInfo = { };
-  getResourceInfo(pDstResource, &dstInfo);
-
-  if (!isCpuWritableResource(&dstInfo))
-    return E_INVALIDARG;
-
-  /* Compute source region for the given copy */
+  const D3D11_BOX*                pSrcBox,
+        ATFIX_COPY_RECORD*        pRecord) {
   ATFIX_RESOURCE_INFO srcInfo = { };
   getResourceInfo(pSrcResource, &srcInfo);
 
-  D3D11_BOX srcBox = getResourceBox(&srcInfo, SrcSubresource);
-  D3D11_BOX dstBox = getResourceBox(&dstInfo, DstSubresource);
+  /* Anything the CPU can write, stream output targets and shared
+   * resources can be written without atfix noticing */
+  constexpr UINT SharedFlags = D3D11_RESOURCE_MISC_SHARED
+    | D3D11_RESOURCE_MISC_SHARED_KEYEDMUTEX
+    | D3D11_RESOURCE_MISC_SHARED_NTHANDLE
+    | D3D11_RESOURCE_MISC_GDI_COMPATIBLE;
+
+  if (srcInfo.Usage != D3D11_USAGE_DEFAULT
+   || (srcInfo.BindFlags & D3D11_BIND_STREAM_OUTPUT)
+   || (srcInfo.MiscFlags & SharedFlags))
+    return false;
+
+  ShadowSet* shadows = getOrCreateShadowSet(pSrcResource);
+
+  /* Zero-initialize padding since records are compared bytewise */
+  std::memset(pRecord, 0, sizeof(*pRecord));
+  pRecord->SrcResource = pSrcResource;
+  pRecord->SrcSubresource = SrcSubresource;
+  pRecord->SrcBox = pSrcBox ? *pSrcBox : getResourceBox(&srcInfo, SrcSubresource);
+  pRecord->DstX = DstX;
+  pRecord->DstY = DstY;
+  pRecord->DstZ = DstZ;
+  pRecord->Generation = shadows->getGeneration(SrcSubresource);
+  pRecord->CommandListCount = g_commandListCount.load();
+
+  shadows->Release();
+  return true;
+}
 
-  if (pSrcBox)
-    srcBox = *pSrcBox;
+void setCopyRecord(
+        ID3D11Resource*           pDstResource,
+  const ATFIX_COPY_RECORD*        pRecord) {
+  if (pRecord)
+    pDstResource->SetPrivateData(IID_CopyRecord, sizeof(*pRecord), pRecord);
+  else
+    pDstResource->SetPrivateData(IID_CopyRecord, 0, nullptr);
+
+  /* Any write to the resource also invalidates written regions */
+  if (getConfig()->WriteWatchSize)
+    pDstResource->SetPrivateData(IID_WriteBack, 0, nullptr);
+}
 
-  uint32_t w = std::min(srcBox.right - srcBox.left, dstBox.right - DstX);
-  uint32_t h = std::min(srcBox.bottom - srcBox.top, dstBox.bottom - DstY);
-  uint32_t d = std::min(srcBox.back - srcBox.front, dstBox.back - DstZ);
+bool isBoundForOutput(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pResource) {
+  std::array<ID3D11RenderTargetView*, D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT> rtvs;
+  std::array<ID3D11UnorderedAccessView*, D3D11_PS_CS_UAV_REGISTER_COUNT> uavs;
+  ID3D11DepthStencilView* dsv = nullptr;
 
-  srcBox = { srcBox.left,     srcBox.top,     srcBox.front,
-             srcBox.left + w, srcBox.top + h, srcBox.front + d };
+  pContext->OMGetRenderTargetsAndUnorderedAccessViews(
+    rtvs.size(), rtvs.data(), &dsv, 0, uavs.size(), uavs.data());
 
-  dstBox = { DstX,     DstY,     DstZ,
-             DstX + w, DstY + h, DstZ + d };
+  bool isBound = false;
 
-  if (!w || !h || !d)
-    return S_OK;
+  auto checkView = [pResource, &isBound] (ID3D11View* pView) {
+    if (!pView)
+      return;
 
-  /* Check if we can map the destination resource immediately. The
-   * engine creates all buffers that cause the severe stalls right
-   * before mapping them, so this should succeed. */
-  D3D11_MAPPED_SUBRESOURCE dstSr;
-  D3D11_MAPPED_SUBRESOURCE srcSr;
-  HRESULT hr = DXGI_ERROR_WAS_STILL_DRAWING;
+    ID3D11Resource* resource = nullptr;
+    pView->GetResource(&resource);
 
-  if (dstInfo.Usage == D3D11_USAGE_DYNAMIC) {
-    /* Don't bother with dynamic images etc., haven't seen a situation where it's relevant */
-    if (dstInfo.Dim == D3D11_RESOURCE_DIMENSION_BUFFER && w == dstInfo.Width)
-      hr = pContext->Map(pDstResource, DstSubresource, D3D11_MAP_WRITE_DISCARD, 0, &dstSr);
-  } else {
-    hr = pContext->Map(pDstResource, DstSubresource, D3D11_MAP_WRITE, D3D11_MAP_FLAG_DO_NOT_WAIT, &dstSr);
-  }
+    isBound |= resource == pResource;
 
-  if (FAILED(hr)) {
-    if (hr != DXGI_ERROR_WAS_STILL_DRAWING) {
-      log("Failed to map destination resource, hr 0x", std::hex, hr);
-      log("Resource dim ", dstInfo.Dim, ", size ", dstInfo.Width , "x", dstInfo.Height, ", usage ", dstInfo.Usage);
-    }
-    return hr;
-  }
+    resource->Release();
+    pView->Release();
+  };
 
-  ID3D11Resource* shadowResource = nullptr;
+  for (ID3D11RenderTargetView* rtv : rtvs)
+    checkView(rtv);
 
-  if (!isCpuReadableResource(&srcInfo)) {
-    shadowResource = getOrCreateShadowResource(pContext, pSrcResource);
-    hr = pContext->Map(shadowResource, SrcSubresource, D3D11_MAP_READ, 0, &srcSr);
+  for (ID3D11UnorderedAccessView* uav : uavs)
+    checkView(uav);
 
-    if (FAILED(hr)) {
-      shadowResource->Release();
+  checkView(dsv);
+  return isBound;
+}
 
-      log("Failed to map shadow resource, hr 0x", std::hex, hr);
-      pContext->Unmap(pDstResource, DstSubresource);
-      return hr;
-    }
-  } else {
-    hr = pContext->Map(pSrcResource, SrcSubresource, D3D11_MAP_READ, 0, &srcSr);
+bool isCopyRedundant(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+  const ATFIX_COPY_RECORD*        pRecord) {
+  ATFIX_COPY_RECORD prevRecord;
+  UINT size = sizeof(prevRecord);
+
+  if (FAILED(pDstResource->GetPrivateData(IID_CopyRecord, &size, &prevRecord))
+   || size != sizeof(prevRecord)
+   || std::memcmp(&prevRecord, pRecord, sizeof(prevRecord)))
+    return false;
+
+  /* Draws only bump the generation of their render targets once
+   * those get unbound, so the source may have been written since
+   * the copy if it is currently bound for output. */
+  return !isBoundForOutput(pContext, pRecord->SrcResource);
+}
 
-    if (FAILED(hr)) {
-      log("Failed to map source resource, hr 0x", std::hex, hr);
-      log("Resource dim ", srcInfo.Dim, ", size ", srcInfo.Width , "x", srcInfo.Height, ", usage ", srcInfo.Usage);
-      pContext->Unmap(pDstResource, DstSubresource);
-      return hr;
-    }
-  }
+bool isWriteWatchCandidate(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+        ATFIX_COPY_RECORD*        pRecord) {
+  uint32_t minSize = getConfig()->WriteWatchSize;
 
-  /* Do the copy */
-  if (dstInfo.Dim == D3D11_RESOURCE_DIMENSION_BUFFER) {
-    std::memcpy(
-      ptroffset(dstSr.pData, dstBox.left),
-      ptroffset(srcSr.pData, srcBox.left), w);
-  } else {
-    uint32_t formatSize = getFormatPixelSize(dstInfo.Format);
+  if (!minSize || !getContextProcs(pContext)->Unmap
+   || !isTrackedCopyDestination(pContext, pResource, Subresource))
+    return false;
 
-    for (uint32_t z = 0; z < d; z++) {
-      for (uint32_t y = 0; y < h; y++) {
-        uint32_t dstOffset = (dstBox.left) * formatSize
-                           + (dstBox.top + y) * dstSr.RowPitch
-                           + (dstBox.front + z) * dstSr.DepthPitch;
-        uint32_t srcOffset = (srcBox.left) * formatSize
-                           + (srcBox.top + y) * srcSr.RowPitch
-                           + (srcBox.front + z) * srcSr.DepthPitch;
-        std::memcpy(
-          ptroffset(dstSr.pData, dstOffset),
-          ptroffset(srcSr.pData, srcOffset),
-          w * formatSize);
-      }
-    }
-  }
+  ATFIX_RESOURCE_INFO info = { };
+  getResourceInfo(pResource, &info);
 
-  pContext->Unmap(pDstResource, DstSubresource);
+  /* Also skips block-compressed formats, which have no pixel size */
+  if (getResourceSize(&info) < minSize)
+    return false;
 
-  if (shadowResource) {
-    pContext->Unmap(shadowResource, SrcSubresource);
-    shadowResource->Release();
-  } else {
-    pContext->Unmap(pSrcResource, SrcSubresource);
-  }
+  /* Written data can only be copied back to where it came from */
+  UINT size = sizeof(*pRecord);
 
-  return S_OK;
+  return SUCCEEDED(pResource->GetPrivateData(IID_CopyRecord, &size, pRecord))
+      && size == sizeof(*pRecord);
 }
 
-void STDMETHODCALLTYPE ID3D11DeviceContext_CopyResource(
-        ID3D11DeviceContext*      pContext,
-        ID3D11Resource*           pDstResource,
-        ID3D11Resource*           pSrcResource) {
-  auto procs = getContextProcs(pContext);
+size_t getMappedSize(
+  const ATFIX_RESOURCE_INFO*      pInfo,
+  const D3D11_MAPPED_SUBRESOURCE* pMapped) {
+  if (pInfo->Dim == D3D11_RESOURCE_DIMENSION_BUFFER)
+    return pInfo->Width;
 
-  ID3D11Resource* dstShadow = getShadowResource(pDstResource);
+  D3D11_BOX box = getResourceBox(pInfo, 0);
 
-  bool needsBaseCopy = true;
-  bool needsShadowCopy = true;
+  return size_t(box.back - 1)   * pMapped->DepthPitch
+       + size_t(box.bottom - 1) * pMapped->RowPitch
+       + size_t(box.right)      * getFormatPixelSize(pInfo->Format);
+}
 
-  if (isImmediatecontext(pContext)) {
-    HRESULT hr = tryCpuCopy(pContext, pDstResource,
-      0, 0, 0, 0, pSrcResource, 0, nullptr);
-    needsBaseCopy = FAILED(hr);
+WriteWatch* getWriteWatch(
+        ID3D11Resource*           pResource) {
+  IUnknown* watch = nullptr;
+  UINT resultSize = sizeof(watch);
 
-    if (!needsBaseCopy && dstShadow) {
-      hr = tryCpuCopy(pContext, dstShadow,
-        0, 0, 0, 0, pSrcResource, 0, nullptr);
-      needsShadowCopy = FAILED(hr);
-    }
-  }
+  if (SUCCEEDED(pResource->GetPrivateData(IID_WriteWatch, &resultSize, &watch)))
+    return static_cast<WriteWatch*>(watch);
 
-  if (needsBaseCopy)
-    procs->CopyResource(pContext, pDstResource, pSrcResource);
+  return nullptr;
+}
+
+void beginWriteWatch(
+        ID3D11Resource*           pResource,
+  const ATFIX_COPY_RECORD*        pRecord,
+        D3D11_MAPPED_SUBRESOURCE* pMapped) {
+  TraceScope trace("atfix::beginWriteWatch", pResource);
+
+  ATFIX_RESOURCE_INFO info = { };
+  getResourceInfo(pResource, &info);
+
+  /* Keep the watch around so that its memory is reused */
+  WriteWatch* watch = getWriteWatch(pResource);
+
+  if (!watch) {
+    watch = new WriteWatch();
+    watch->AddRef();
+
+    pResource->SetPrivateDataInterface(IID_WriteWatch, watch);
+  }
+
+  D3D11_MAPPED_SUBRESOURCE watched;
+
+  if (watch->begin(pMapped, getMappedSize(&info, pMapped), &watched)) {
+    /* Regions are only known on Unmap, mark as incomplete until then */
+    ATFIX_WRITE_BACK writeBack = { };
+    writeBack.Record = *pRecord;
+    writeBack.RowPitch = pMapped->RowPitch;
+    writeBack.DepthPitch = pMapped->DepthPitch;
+    writeBack.BoxCount = ~0u;
+
+    pResource->SetPrivateData(IID_WriteBack, sizeof(writeBack), &writeBack);
+    *pMapped = watched;
+  }
+
+  watch->Release();
+}
+
+bool getWriteBackBoxes(
+  const ATFIX_RESOURCE_INFO*      pInfo,
+  const std::vector<WriteWatchRange>& Ranges,
+        ATFIX_WRITE_BACK*         pWriteBack) {
+  pWriteBack->BoxCount = 0;
+
+  auto addBox = [pWriteBack] (const D3D11_BOX& box) {
+    if (pWriteBack->BoxCount >= MaxWriteBackBoxes)
+      return false;
+
+    pWriteBack->Boxes[pWriteBack->BoxCount++] = box;
+    return true;
+  };
+
+  if (pInfo->Dim == D3D11_RESOURCE_DIMENSION_BUFFER) {
+    for (const auto& range : Ranges) {
+      if (!addBox({ UINT(range.first), 0, 0, UINT(range.first + range.second), 1, 1 }))
+        return false;
+    }
+
+    return true;
+  }
+
+  /* Merge consecutive rows that contain written data. Row offsets
+   * increase monotonically, and so do the offsets of the ranges. */
+  D3D11_BOX box = getResourceBox(pInfo, 0);
+  size_t rowSize = size_t(box.right) * getFormatPixelSize(pInfo->Format);
+
+  auto range = Ranges.begin();
+
+  for (uint32_t z = 0; z < box.back; z++) {
+    uint32_t firstRow = ~0u;
+
+    for (uint32_t y = 0; y <= box.bottom; y++) {
+      bool isWritten = false;
+
+      if (y < box.bottom) {
+        size_t offset = size_t(z) * pWriteBack->DepthPitch
+                      + size_t(y) * pWriteBack->RowPitch;
+
+        while (range != Ranges.end() && range->first + range->second <= offset)
+          range++;
+
+        isWritten = range != Ranges.end() && range->first < offset + rowSize;
+      }
+
+      if (isWritten && firstRow == ~0u)
+        firstRow = y;
+
+      if (!isWritten && firstRow != ~0u) {
+        if (!addBox({ 0, firstRow, z, box.right, y, z + 1 }))
+          return false;
+
+        firstRow = ~0u;
+      }
+    }
+  }
+
+  return true;
+}
+
+void endWriteWatch(
+        ID3D11Resource*           pResource) {
+  WriteWatch* watch = getWriteWatch(pResource);
+
+  if (!watch)
+    return;
+
+  if (watch->isActive()) {
+    TraceScope trace("atfix::endWriteWatch", pResource);
+
+    std::vector<WriteWatchRange> ranges;
+    watch->end(&ranges);
+
+    ATFIX_WRITE_BACK writeBack;
+    UINT size = sizeof(writeBack);
+
+    if (SUCCEEDED(pResource->GetPrivateData(IID_WriteBack, &size, &writeBack))
+     && size == sizeof(writeBack)) {
+      ATFIX_RESOURCE_INFO info = { };
+      getResourceInfo(pResource, &info);
+
+      /* Copy everything back if too many regions were written */
+      if (getWriteBackBoxes(&info, ranges, &writeBack))
+        pResource->SetPrivateData(IID_WriteBack, sizeof(writeBack), &writeBack);
+      else
+        pResource->SetPrivateData(IID_WriteBack, 0, nullptr);
+    }
+  }
+
+  watch->Release();
+}
+
+bool isStagingAliasEnabled(
+        ID3D11DeviceContext*      pContext) {
+  /* Staging resources used on deferred contexts are not supported,
+   * but there is no way to resolve aliases there anyway. */
+  return getConfig()->StagingAliasing
+      && isImmediatecontext(pContext)
+      && getContextProcs(pContext)->Unmap;
+}
+
+void resolveStagingAlias(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pResource) {
+  StagingAlias* alias = getStagingAlias(pResource);
+
+  if (!alias)
+    return;
+
+  TraceScope trace("atfix::resolveStagingAlias", pResource);
+
+  /* Remove alias first so that the resource can be mapped, and
+   * make sure that queued copies to it can't overwrite the data */
+  setStagingAlias(pResource, nullptr);
+  flushCopies(pContext);
+  invalidateMapping(pContext, pResource);
+
+  ATFIX_RESOURCE_INFO info = { };
+  getResourceInfo(pResource, &info);
+
+  D3D11_MAPPED_SUBRESOURCE mapped;
+  HRESULT hr = forwardMap(pContext, pResource, 0, D3D11_MAP_WRITE, 0, &mapped);
+
+  if (SUCCEEDED(hr)) {
+    alias->copyTo(&info, &mapped);
+    forwardUnmap(pContext, pResource, 0);
+  } else {
+    log("Failed to map aliased staging resource, hr 0x", std::hex, hr);
+  }
+
+  alias->Release();
+}
+
+bool tryAliasCopy(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+        UINT                      DstX,
+        UINT                      DstY,
+        UINT                      DstZ,
+        ID3D11Resource*           pSrcResource,
+        UINT                      SrcSubresource,
+  const D3D11_BOX*                pSrcBox) {
+  if (!isStagingAliasEnabled(pContext) || DstSubresource || DstX || DstY || DstZ)
+    return false;
+
+  ATFIX_RESOURCE_INFO dstInfo = { };
+  getResourceInfo(pDstResource, &dstInfo);
+
+  if (dstInfo.Usage != D3D11_USAGE_STAGING || dstInfo.Mips * dstInfo.Layers != 1)
+    return false;
+
+  /* Only shadowed resources have cached data */
+  ATFIX_RESOURCE_INFO srcInfo = { };
+  getResourceInfo(pSrcResource, &srcInfo);
+
+  if (isCpuReadableResource(&srcInfo))
+    return false;
+
+  if (isBlockCompressedFormat(dstInfo.Format))
+    return false;
+
+  /* The copy must overwrite the entire destination with an
+   * entire source subresource, otherwise the destination
+   * would have to retain some of its previous contents */
+  D3D11_BOX srcBox = getResourceBox(&srcInfo, SrcSubresource);
+  D3D11_BOX dstBox = getResourceBox(&dstInfo, 0);
+
+  if (pSrcBox && std::memcmp(pSrcBox, &srcBox, sizeof(srcBox)))
+    return false;
+
+  if (std::memcmp(&srcBox, &dstBox, sizeof(srcBox)))
+    return false;
+
+  ShadowSet* shadows = getShadowSet(pSrcResource);
+
+  if (!shadows)
+    return false;
+
+  ATFIX_SHADOW shadow = { };
+  bool hasShadow = shadows->getShadow(SrcSubresource, &shadow);
+  shadows->Release();
+
+  if (!hasShadow)
+    return false;
+
+  ATFIX_CACHED_DATA data = { };
+  bool hasData = false;
+
+  if (shadow.Cache) {
+    shadow.Cache->lock();
+    shadow.Cache->markRead();
+    hasData = shadow.Cache->getDataRef(0, &data);
+    shadow.Cache->unlock();
+  }
+
+  releaseShadow(&shadow);
+
+  if (!hasData)
+    return false;
+
+  TraceScope trace("atfix::aliasCopy", pSrcResource);
+
+  /* A previous alias, if any, is replaced */
+  setStagingAlias(pDstResource, new StagingAlias(&data));
+  return true;
+}
+
+HRESULT tryCpuCopy(
+        ID3D11DeviceContext*      pContext,
+        GpuTimeline*              pTimeline,
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+        UINT                      DstX,
+        UINT                      DstY,
+        UINT                      DstZ,
+        ID3D11Resource*           pSrcResource,
+        UINT                      SrcSubresource,
+  const D3D11_BOX*                pSrcBox,
+        UINT                      CopyFlags,
+        bool                      KeepDstMapped,
+        bool                      RecordStats) {
+  TraceScope trace("atfix::tryCpuCopy", pSrcResource);
+  ATFIX_RESOURCE_INFO dstInfo = { };
+  getResourceInfo(pDstResource, &dstInfo);
+
+  if (!isCpuWritableResource(&dstInfo))
+    return E_INVALIDARG;
+
+  /* Compute source region for the given copy */
+  ATFIX_RESOURCE_INFO srcInfo = { };
+  getResourceInfo(pSrcResource, &srcInfo);
+
+  /* Multisampled resources cannot be copied to CPU-accessible ones,
+   * games have to resolve them first, and the resolve target gets
+   * a regular shadow. Leave invalid copies to the runtime. */
+  if (srcInfo.Samples > 1)
+    return E_INVALIDARG;
+
+  /* The copy below works on pixels, not blocks */
+  if (isBlockCompressedFormat(dstInfo.Format) || isBlockCompressedFormat(srcInfo.Format))
+    return E_INVALIDARG;
+
+  /* Check whether the CPU path is worth it for this resource. Copies
+   * to shadows repeat a copy that was just recorded, so they only
+   * count towards the frame budget and not the resource stats. */
+  CopyStrategy* strategy = CopyStrategy::get(pContext);
+  ResourceStats* srcStats = (!RecordStats || isCpuReadableResource(&srcInfo))
+    ? nullptr
+    : getResourceStats(pSrcResource);
+
+  if (!strategy->allowCpuCopy(srcStats)) {
+    if (srcStats)
+      srcStats->Release();
+    return E_FAIL;
+  }
+
+  auto copyStart = CopyStrategy::clock::now();
+  auto mapWaitTime = CopyStrategy::clock::duration::zero();
+
+  D3D11_BOX srcBox = getResourceBox(&srcInfo, SrcSubresource);
+  D3D11_BOX dstBox = getResourceBox(&dstInfo, DstSubresource);
+
+  if (pSrcBox)
+    srcBox = *pSrcBox;
+
+  uint32_t w = std::min(srcBox.right - srcBox.left, dstBox.right - DstX);
+  uint32_t h = std::min(srcBox.bottom - srcBox.top, dstBox.bottom - DstY);
+  uint32_t d = std::min(srcBox.back - srcBox.front, dstBox.back - DstZ);
+
+  srcBox = { srcBox.left,     srcBox.top,     srcBox.front,
+             srcBox.left + w, srcBox.top + h, srcBox.front + d };
+
+  dstBox = { DstX,     DstY,     DstZ,
+             DstX + w, DstY + h, DstZ + d };
+
+  if (!w || !h || !d) {
+    if (srcStats)
+      srcStats->Release();
+    return S_OK;
+  }
+
+  /* Check if we can map the destination resource immediately. The
+   * engine creates all buffers that cause the severe stalls right
+   * before mapping them, so this should succeed. */
+  D3D11_MAPPED_SUBRESOURCE dstSr;
+  D3D11_MAPPED_SUBRESOURCE srcSr;
+  HRESULT hr = DXGI_ERROR_WAS_STILL_DRAWING;
+
+  /* Resources mapped through the cache stay mapped for subsequent
+   * copies, and get unmapped when something else accesses them */
+  MappingCache* mappings = getMappingCache(pContext);
+  bool dstPersistent = false;
+
+  if (mappings)
+    mappings->beginCopy();
+
+  { TraceScope mapTrace("atfix::mapDestination", pDstResource);
+
+    if (dstInfo.Usage == D3D11_USAGE_DYNAMIC) {
+      /* Don't bother with dynamic images etc., haven't seen a situation where it's relevant.
+       * For partial buffer copies, the copy flags tell us whether we can discard the rest
+       * of the buffer or whether the GPU is not using the region we're about to write. */
+      if (dstInfo.Dim == D3D11_RESOURCE_DIMENSION_BUFFER) {
+        if (w == dstInfo.Width || (CopyFlags & D3D11_COPY_DISCARD))
+          hr = forwardMap(pContext, pDstResource, DstSubresource, D3D11_MAP_WRITE_DISCARD, 0, &dstSr);
+        else if (CopyFlags & D3D11_COPY_NO_OVERWRITE)
+          hr = forwardMap(pContext, pDstResource, DstSubresource, D3D11_MAP_WRITE_NO_OVERWRITE, 0, &dstSr);
+      }
+    } else if (mappings && KeepDstMapped) {
+      /* A mapping kept from a previous copy implies that the
+       * GPU has not been told to use the resource since */
+      if (mappings->isMapped(pDstResource, DstSubresource, D3D11_MAP_WRITE)
+       || pTimeline->isResourceIdle(pDstResource)) {
+        hr = mappings->map(pDstResource, DstSubresource, D3D11_MAP_WRITE, D3D11_MAP_FLAG_DO_NOT_WAIT, &dstSr);
+        dstPersistent = SUCCEEDED(hr);
+      }
+    } else if (pTimeline->isResourceIdle(pDstResource)) {
+      /* If we know that the GPU is still using the resource from a
+       * copy we issued ourselves, don't bother trying to map it */
+      hr = forwardMap(pContext, pDstResource, DstSubresource, D3D11_MAP_WRITE, D3D11_MAP_FLAG_DO_NOT_WAIT, &dstSr);
+    }
+  }
+
+  if (FAILED(hr)) {
+    if (hr != DXGI_ERROR_WAS_STILL_DRAWING) {
+      log("Failed to map destination resource, hr 0x", std::hex, hr);
+      log("Resource dim ", dstInfo.Dim, ", size ", dstInfo.Width , "x", dstInfo.Height, ", usage ", dstInfo.Usage);
+    }
+
+    if (srcStats)
+      srcStats->Release();
+    return hr;
+  }
+
+  ATFIX_SHADOW shadow = { };
+  bool shadowMapped = false;
+
+  if (!isCpuReadableResource(&srcInfo)) {
+    bool hasShadow = getOrCreateShadow(pContext, pSrcResource, SrcSubresource, &shadow);
+
+    /* The shadow may be in the same arena buffer as the destination,
+     * which is already mapped for writing, so use the GPU for that. */
+    if (hasShadow && shadow.Resource == pDstResource) {
+      releaseShadow(&shadow);
+      hasShadow = false;
+    }
+
+    if (!hasShadow) {
+      if (srcStats)
+        srcStats->Release();
+
+      if (!dstPersistent)
+        forwardUnmap(pContext, pDstResource, DstSubresource);
+      return E_FAIL;
+    }
+
+    /* Use data that the readback worker already copied to
+     * system memory if it is up to date, and only map the
+     * shadow resource if that is not the case. */
+    if (shadow.Cache) {
+      shadow.Cache->lock();
+      shadow.Cache->markRead();
+    }
+
+    uint64_t snapshotFrame = 0;
+
+    if (!shadow.Cache || !shadow.Cache->getData(0, &srcSr)) {
+      /* If the user opted into stale reads for this resource and
+       * the shadow is still busy, use whatever data we have rather
+       * than waiting for the GPU. */
+      if (shadow.Cache && allowStaleReads(&srcInfo)
+       && !pTimeline->isComplete(shadow.Cache->getTimelineValue())
+       && shadow.Cache->getSnapshot(0, &srcSr, &snapshotFrame)) {
+        TraceScope staleTrace("atfix::staleRead", shadow.Resource);
+        strategy->recordStaleRead(snapshotFrame);
+      } else {
+        { TraceScope mapTrace("atfix::mapShadow", shadow.Resource);
+
+          /* The readback worker may map shadows that have a cache
+           * at any time, so those cannot be kept mapped */
+          auto mapStart = CopyStrategy::clock::now();
+
+          if (mappings && !shadow.Cache)
+            hr = mappings->map(shadow.Resource, 0, D3D11_MAP_READ, 0, &srcSr);
+          else
+            hr = forwardMap(pContext, shadow.Resource, 0, D3D11_MAP_READ, 0, &srcSr);
+
+          mapWaitTime = CopyStrategy::clock::now() - mapStart;
+        }
+
+        if (FAILED(hr)) {
+          if (shadow.Cache)
+            shadow.Cache->unlock();
+
+          if (srcStats)
+            srcStats->Release();
+
+          releaseShadow(&shadow);
+
+          log("Failed to map shadow resource, hr 0x", std::hex, hr);
+
+          if (!dstPersistent)
+            forwardUnmap(pContext, pDstResource, DstSubresource);
+          return hr;
+        }
+
+        srcSr.pData = ptroffset(srcSr.pData, shadow.Offset);
+        shadowMapped = !mappings || shadow.Cache;
+
+        /* Instead, hand the data to the cache so that further copies
+         * from this shadow do not have to map it again. The Map call
+         * flushed all queued writes, so the data is current. */
+        if (mappings && shadow.Cache && shadow.Cache->isStale(0)) {
+          shadow.Cache->store(0, shadow.Cache->getVersion(0),
+            shadow.Cache->getVersionFrame(0), &srcSr);
+        }
+      }
+    }
+  } else {
+    /* The source may still be mapped from a copy to it. Copies
+     * within the same resource fail either way. */
+    if (mappings && pSrcResource != pDstResource)
+      mappings->invalidate(pSrcResource);
+
+    hr = forwardMap(pContext, pSrcResource, SrcSubresource, D3D11_MAP_READ, 0, &srcSr);
+
+    if (FAILED(hr)) {
+      log("Failed to map source resource, hr 0x", std::hex, hr);
+      log("Resource dim ", srcInfo.Dim, ", size ", srcInfo.Width , "x", srcInfo.Height, ", usage ", srcInfo.Usage);
+
+      if (!dstPersistent)
+        forwardUnmap(pContext, pDstResource, DstSubresource);
+
+      if (srcStats)
+        srcStats->Release();
+      return hr;
+    }
+  }
+
+  /* Do the copy */
+  if (dstInfo.Dim == D3D11_RESOURCE_DIMENSION_BUFFER) {
+    std::memcpy(
+      ptroffset(dstSr.pData, dstBox.left),
+      ptroffset(srcSr.pData, srcBox.left), w);
+  } else {
+    uint32_t formatSize = getFormatPixelSize(dstInfo.Format);
+
+    for (uint32_t z = 0; z < d; z++) {
+      for (uint32_t y = 0; y < h; y++) {
+        uint32_t dstOffset = (dstBox.left) * formatSize
+                           + (dstBox.top + y) * dstSr.RowPitch
+                           + (dstBox.front + z) * dstSr.DepthPitch;
+        uint32_t srcOffset = (srcBox.left) * formatSize
+                           + (srcBox.top + y) * srcSr.RowPitch
+                           + (srcBox.front + z) * srcSr.DepthPitch;
+        std::memcpy(
+          ptroffset(dstSr.pData, dstOffset),
+          ptroffset(srcSr.pData, srcOffset),
+          w * formatSize);
+      }
+    }
+  }
+
+  if (!dstPersistent)
+    forwardUnmap(pContext, pDstResource, DstSubresource);
+
+  if (shadow.Resource) {
+    if (shadowMapped)
+      forwardUnmap(pContext, shadow.Resource, 0);
+
+    if (shadow.Cache)
+      shadow.Cache->unlock();
+
+    releaseShadow(&shadow);
+  } else {
+    forwardUnmap(pContext, pSrcResource, SrcSubresource);
+  }
+
+  /* The shadow resource is not needed anymore if the
+   * resource was switched to GPU copies */
+  auto copyTime = CopyStrategy::clock::now() - copyStart;
+
+  if (strategy->recordCpuCopy(srcStats, copyTime, mapWaitTime))
+    destroyShadowResources(pSrcResource);
+
+  if (srcStats)
+    srcStats->Release();
+
+  return S_OK;
+}
+
+void copySubresourceRegion(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+        UINT                      DstX,
+        UINT                      DstY,
+        UINT                      DstZ,
+        ID3D11Resource*           pSrcResource,
+        UINT                      SrcSubresource,
+  const D3D11_BOX*                pSrcBox,
+        UINT                      CopyFlags);
+
+bool tryPartialWriteBack(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+        UINT                      DstX,
+        UINT                      DstY,
+        UINT                      DstZ,
+        ID3D11Resource*           pSrcResource,
+        UINT                      SrcSubresource,
+  const D3D11_BOX*                pSrcBox,
+        UINT                      CopyFlags) {
+  if (!getConfig()->WriteWatchSize || !isImmediatecontext(pContext) || SrcSubresource)
+    return false;
+
+  ATFIX_WRITE_BACK writeBack;
+  UINT size = sizeof(writeBack);
+
+  if (FAILED(pSrcResource->GetPrivateData(IID_WriteBack, &size, &writeBack))
+   || size != sizeof(writeBack) || writeBack.BoxCount > MaxWriteBackBoxes)
+    return false;
+
+  /* Written regions are only valid for one copy back */
+  pSrcResource->SetPrivateData(IID_WriteBack, 0, nullptr);
+
+  const ATFIX_COPY_RECORD& record = writeBack.Record;
+
+  if (pDstResource != record.SrcResource || DstSubresource != record.SrcSubresource)
+    return false;
+
+  /* The copy must put the region of the staging resource that holds
+   * the copied data back to exactly where that data came from */
+  D3D11_BOX region = {
+    record.DstX, record.DstY, record.DstZ,
+    record.DstX + record.SrcBox.right  - record.SrcBox.left,
+    record.DstY + record.SrcBox.bottom - record.SrcBox.top,
+    record.DstZ + record.SrcBox.back   - record.SrcBox.front };
+
+  ATFIX_RESOURCE_INFO srcInfo = { };
+  getResourceInfo(pSrcResource, &srcInfo);
+
+  D3D11_BOX srcBox = pSrcBox ? *pSrcBox : getResourceBox(&srcInfo, 0);
+
+  if (std::memcmp(&srcBox, &region, sizeof(region))
+   || DstX != record.SrcBox.left || DstY != record.SrcBox.top || DstZ != record.SrcBox.front)
+    return false;
+
+  /* Unwritten data only matches if the destination was not written
+   * since it was copied to the staging resource */
+  ATFIX_COPY_RECORD current;
+
+  if (!getCopyRecord(pSrcResource, record.DstX, record.DstY, record.DstZ,
+        pDstResource, DstSubresource, &record.SrcBox, &current)
+   || std::memcmp(&current, &record, sizeof(record))
+   || isBoundForOutput(pContext, pDstResource))
+    return false;
+
+  TraceScope trace("atfix::partialWriteBack", pSrcResource);
+
+  for (uint32_t i = 0; i < writeBack.BoxCount; i++) {
+    D3D11_BOX box = writeBack.Boxes[i];
+    box.left   = std::max(box.left,   region.left);
+    box.top    = std::max(box.top,    region.top);
+    box.front  = std::max(box.front,  region.front);
+    box.right  = std::min(box.right,  region.right);
+    box.bottom = std::min(box.bottom, region.bottom);
+    box.back   = std::min(box.back,   region.back);
+
+    if (box.left >= box.right || box.top >= box.bottom || box.front >= box.back)
+      continue;
+
+    copySubresourceRegion(pContext, pDstResource, DstSubresource,
+      DstX + box.left  - region.left,
+      DstY + box.top   - region.top,
+      DstZ + box.front - region.front,
+      pSrcResource, 0, &box, CopyFlags);
+  }
+
+  return true;
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_CopyResource(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        ID3D11Resource*           pSrcResource) {
+  if (ForwardScope::isNested()) {
+    getContextProcs(pContext)->CopyResource(pContext, pDstResource, pSrcResource);
+    return;
+  }
+
+  TraceScope trace("ID3D11DeviceContext::CopyResource", pSrcResource);
+
+  /* Only copy back what the game wrote to a mapped staging resource */
+  if (tryPartialWriteBack(pContext, pDstResource, 0, 0, 0, 0, pSrcResource, 0, nullptr, 0))
+    return;
+
+  /* Skip the copy if the destination already holds the same data */
+  ATFIX_COPY_RECORD record;
+  bool isTracked = isTrackedCopyDestination(pContext, pDstResource, 0);
+
+  if (isTracked && getCopyRecord(pDstResource, 0, 0, 0, pSrcResource, 0, nullptr, &record)
+   && isCopyRedundant(pContext, pDstResource, &record)) {
+    TraceScope skipTrace("atfix::skipCopy", pSrcResource);
+    return;
+  }
+
+  /* The GPU must see actual contents of an aliased source, but
+   * an aliased destination is overwritten entirely anyway */
+  bool isAliasCopy = false;
+
+  if (isStagingAliasEnabled(pContext)) {
+    resolveStagingAlias(pContext, pSrcResource);
+    isAliasCopy = tryAliasCopy(pContext, pDstResource, 0, 0, 0, 0, pSrcResource, 0, nullptr);
+
+    if (!isAliasCopy)
+      setStagingAlias(pDstResource, nullptr);
+  }
+
+  GpuTimeline* timeline = getGpuTimeline(pContext);
+  ShadowSet* dstShadows = getShadowSet(pDstResource);
+
+  bool needsBaseCopy = !isAliasCopy;
+  bool needsShadowCopy = true;
+
+  if (timeline && needsBaseCopy) {
+    HRESULT hr = tryCpuCopy(pContext, timeline, pDstResource,
+      0, 0, 0, 0, pSrcResource, 0, nullptr, 0, true, true);
+    needsBaseCopy = FAILED(hr);
+
+    /* The CPU path only supports resources with a single
+     * subresource, so there is at most one shadow here */
+    ATFIX_SHADOW dstShadow = { };
+
+    if (!needsBaseCopy && dstShadows && pDstResource != pSrcResource
+     && dstShadows->getShadow(0, &dstShadow)) {
+      if (dstShadow.Cache)
+        dstShadow.Cache->lock();
+
+      hr = tryCpuCopy(pContext, timeline, dstShadow.Resource,
+        0, dstShadow.Offset, 0, 0, pSrcResource, 0, nullptr, 0, !dstShadow.Cache, false);
+      needsShadowCopy = FAILED(hr);
+
+      if (dstShadow.Cache)
+        dstShadow.Cache->unlock();
+
+      releaseShadow(&dstShadow);
+    }
+  }
+
+  if (needsBaseCopy) {
+    queueCopyResource(pContext, pDstResource, pSrcResource);
+
+    if (timeline)
+      timeline->trackResource(pDstResource);
+  }
+
+  if (dstShadows) {
+    uint32_t subresourceCount = dstShadows->getSubresourceCount();
+    dstShadows->markWritten(~0u);
+
+    for (uint32_t i = 0; i < subresourceCount; i++) {
+      ATFIX_SHADOW dstShadow = { };
+
+      if (!dstShadows->getShadow(i, &dstShadow))
+        continue;
+
+      if (needsShadowCopy) {
+        /* Arena buffers are shared with other shadows */
+        if (subresourceCount == 1 && !dstShadow.Arena) {
+          queueCopyResource(pContext, dstShadow.Resource, pSrcResource);
+        } else {
+          queueCopySubresourceRegion(pContext,
+            dstShadow.Resource, 0, dstShadow.Offset, 0, 0,
+            pSrcResource,       i, nullptr, 0);
+        }
+      }
+
+      markShadowResourceWritten(timeline, &dstShadow);
+      releaseShadow(&dstShadow);
+    }
+
+    dstShadows->Release();
+  }
+
+  /* Record the copy after it was issued, since the source
+   * may only have gotten a shadow set in the process */
+  if (isTracked) {
+    bool hasRecord = getCopyRecord(pDstResource, 0, 0, 0, pSrcResource, 0, nullptr, &record);
+    setCopyRecord(pDstResource, hasRecord ? &record : nullptr);
+  }
+}
+
+void forwardCopyResource(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        ID3D11Resource*           pSrcResource) {
+  auto procs = getContextProcs(pContext);
+
+  ForwardScope scope;
+  procs->CopyResource(pContext, pDstResource, pSrcResource);
+}
+
+void forwardCopySubresourceRegion(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+        UINT                      DstX,
+        UINT                      DstY,
+        UINT                      DstZ,
+        ID3D11Resource*           pSrcResource,
+        UINT                      SrcSubresource,
+  const D3D11_BOX*                pSrcBox,
+        UINT                      CopyFlags) {
+  auto procs = getContextProcs(pContext);
+  ForwardScope scope;
+
+  if (CopyFlags) {
+    procs->CopySubresourceRegion1(static_cast<ID3D11DeviceContext1*>(pContext),
+      pDstResource, DstSubresource, DstX, DstY, DstZ,
+      pSrcResource, SrcSubresource, pSrcBox, CopyFlags);
+  } else {
+    procs->CopySubresourceRegion(pContext,
+      pDstResource, DstSubresource, DstX, DstY, DstZ,
+      pSrcResource, SrcSubresource, pSrcBox);
+  }
+}
+
+void copySubresourceRegion(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+        UINT                      DstX,
+        UINT                      DstY,
+        UINT                      DstZ,
+        ID3D11Resource*           pSrcResource,
+        UINT                      SrcSubresource,
+  const D3D11_BOX*                pSrcBox,
+        UINT                      CopyFlags) {
+  if (tryPartialWriteBack(pContext,
+        pDstResource, DstSubresource, DstX, DstY, DstZ,
+        pSrcResource, SrcSubresource, pSrcBox, CopyFlags))
+    return;
+
+  /* Skip the copy if the destination already holds the same data */
+  ATFIX_COPY_RECORD record;
+  bool isTracked = isTrackedCopyDestination(pContext, pDstResource, DstSubresource);
+
+  if (isTracked && getCopyRecord(pDstResource, DstX, DstY, DstZ,
+        pSrcResource, SrcSubresource, pSrcBox, &record)
+   && isCopyRedundant(pContext, pDstResource, &record)) {
+    TraceScope skipTrace("atfix::skipCopy", pSrcResource);
+    return;
+  }
+
+  /* Aliased resources must hold their actual contents unless
+   * the destination gets aliased again */
+  bool isAliasCopy = false;
+
+  if (isStagingAliasEnabled(pContext)) {
+    resolveStagingAlias(pContext, pSrcResource);
+    isAliasCopy = tryAliasCopy(pContext,
+      pDstResource, DstSubresource, DstX, DstY, DstZ,
+      pSrcResource, SrcSubresource, pSrcBox);
+
+    if (!isAliasCopy)
+      resolveStagingAlias(pContext, pDstResource);
+  }
+
+  GpuTimeline* timeline = getGpuTimeline(pContext);
+
+  ATFIX_SHADOW dstShadow = { };
+  bool hasDstShadow = getShadowForWrite(pDstResource, DstSubresource, &dstShadow);
+
+  bool needsBaseCopy = !isAliasCopy;
+  bool needsShadowCopy = true;
+
+  if (timeline && needsBaseCopy) {
+    HRESULT hr = tryCpuCopy(pContext, timeline,
+      pDstResource, DstSubresource, DstX, DstY, DstZ,
+      pSrcResource, SrcSubresource, pSrcBox, CopyFlags, true, true);
+    needsBaseCopy = FAILED(hr);
+
+    if (!needsBaseCopy && hasDstShadow && pDstResource != pSrcResource) {
+      if (dstShadow.Cache)
+        dstShadow.Cache->lock();
+
+      hr = tryCpuCopy(pContext, timeline,
+        dstShadow.Resource, 0,              dstShadow.Offset + DstX, DstY, DstZ,
+        pSrcResource,       SrcSubresource, pSrcBox, 0, !dstShadow.Cache, false);
+      needsShadowCopy = FAILED(hr);
+
+      if (dstShadow.Cache)
+        dstShadow.Cache->unlock();
+    }
+  }
+
+  if (needsBaseCopy) {
+    queueCopySubresourceRegion(pContext,
+      pDstResource, DstSubresource, DstX, DstY, DstZ,
+      pSrcResource, SrcSubresource, pSrcBox, CopyFlags);
+
+    if (timeline)
+      timeline->trackResource(pDstResource);
+  }
+
+  if (hasDstShadow) {
+    /* The game's copy flags describe how it uses the base resource.
+     * Discarding would throw away the rest of the shadow, or other
+     * shadows sharing an arena buffer, and atfix's own queued copies
+     * may still be using the region that the game promised not to
+     * overwrite, so shadow copies never use any flags. */
+    if (needsShadowCopy) {
+      queueCopySubresourceRegion(pContext,
+        dstShadow.Resource, 0,              dstShadow.Offset + DstX, DstY, DstZ,
+        pSrcResource,       SrcSubresource, pSrcBox, 0);
+    }
+
+    markShadowResourceWritten(timeline, &dstShadow);
+    releaseShadow(&dstShadow);
+  }
+
+  if (isTracked) {
+    bool hasRecord = getCopyRecord(pDstResource, DstX, DstY, DstZ,
+      pSrcResource, SrcSubresource, pSrcBox, &record);
+    setCopyRecord(pDstResource, hasRecord ? &record : nullptr);
+  }
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_CopySubresourceRegion(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+        UINT                      DstX,
+        UINT                      DstY,
+        UINT                      DstZ,
+        ID3D11Resource*           pSrcResource,
+        UINT                      SrcSubresource,
+  const D3D11_BOX*                pSrcBox) {
+  if (ForwardScope::isNested()) {
+    getContextProcs(pContext)->CopySubresourceRegion(pContext,
+      pDstResource, DstSubresource, DstX, DstY, DstZ,
+      pSrcResource, SrcSubresource, pSrcBox);
+    return;
+  }
+
+  TraceScope trace("ID3D11DeviceContext::CopySubresourceRegion", pSrcResource);
+  copySubresourceRegion(pContext,
+    pDstResource, DstSubresource, DstX, DstY, DstZ,
+    pSrcResource, SrcSubresource, pSrcBox, 0);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext1_CopySubresourceRegion1(
+        ID3D11DeviceContext1*     pContext,
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+        UINT                      DstX,
+        UINT                      DstY,
+        UINT                      DstZ,
+        ID3D11Resource*           pSrcResource,
+        UINT                      SrcSubresource,
+  const D3D11_BOX*                pSrcBox,
+        UINT                      CopyFlags) {
+  if (ForwardScope::isNested()) {
+    getContextProcs(pContext)->CopySubresourceRegion1(pContext,
+      pDstResource, DstSubresource, DstX, DstY, DstZ,
+      pSrcResource, SrcSubresource, pSrcBox, CopyFlags);
+    return;
+  }
+
+  TraceScope trace("ID3D11DeviceContext1::CopySubresourceRegion1", pSrcResource);
+  copySubresourceRegion(pContext,
+    pDstResource, DstSubresource, DstX, DstY, DstZ,
+    pSrcResource, SrcSubresource, pSrcBox, CopyFlags);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_CopyStructureCount(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Buffer*             pDstBuffer,
+        UINT                      DstOffset,
+        ID3D11UnorderedAccessView* pSrcUav) {
+  TraceScope trace("ID3D11DeviceContext::CopyStructureCount");
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
+
+  if (isStagingAliasEnabled(pContext))
+    resolveStagingAlias(pContext, pDstBuffer);
+
+  invalidateMapping(pContext, pDstBuffer);
+  procs->CopyStructureCount(pContext, pDstBuffer, DstOffset, pSrcUav);
+
+  ATFIX_SHADOW shadow = { };
+
+  setCopyRecord(pDstBuffer, nullptr);
+
+  if (getShadowForWrite(pDstBuffer, 0, &shadow)) {
+    ID3D11Buffer* shadowBuffer = nullptr;
+    shadow.Resource->QueryInterface(IID_PPV_ARGS(&shadowBuffer));
+    invalidateMapping(pContext, shadow.Resource);
+
+    procs->CopyStructureCount(pContext, shadowBuffer, shadow.Offset + DstOffset, pSrcUav);
+    shadowBuffer->Release();
+
+    markShadowResourceWritten(getGpuTimeline(pContext), &shadow);
+    releaseShadow(&shadow);
+  }
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_Dispatch(
+        ID3D11DeviceContext*      pContext,
+        UINT                      X,
+        UINT                      Y,
+        UINT                      Z) {
+  TraceScope trace("ID3D11DeviceContext::Dispatch");
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
+
+  procs->Dispatch(pContext, X, Y, Z);
+
+  updateCsShadowResources(pContext);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_DispatchIndirect(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Buffer*             pParameterBuffer,
+        UINT                      pParameterOffset) {
+  TraceScope trace("ID3D11DeviceContext::DispatchIndirect");
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
+
+  procs->DispatchIndirect(pContext, pParameterBuffer, pParameterOffset);
+
+  updateCsShadowResources(pContext);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_OMSetRenderTargets(
+        ID3D11DeviceContext*      pContext,
+        UINT                      RTVCount,
+        ID3D11RenderTargetView* const* ppRTVs,
+        ID3D11DepthStencilView*   pDSV) {
+  TraceScope trace("ID3D11DeviceContext::OMSetRenderTargets");
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
+
+  updateOmShadowResources(pContext);
+
+  procs->OMSetRenderTargets(pContext, RTVCount, ppRTVs, pDSV);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_OMSetRenderTargetsAndUnorderedAccessViews(
+        ID3D11DeviceContext*      pContext,
+        UINT                      RTVCount,
+        ID3D11RenderTargetView* const* ppRTVs,
+        ID3D11DepthStencilView*   pDSV,
+        UINT                      UAVIndex,
+        UINT                      UAVCount,
+        ID3D11UnorderedAccessView* const* ppUAVs,
+  const UINT*                     pUAVClearValues) {
+  TraceScope trace("ID3D11DeviceContext::OMSetRenderTargetsAndUnorderedAccessViews");
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
+
+  updateOmShadowResources(pContext);
+
+  procs->OMSetRenderTargetsAndUnorderedAccessViews(pContext,
+    RTVCount, ppRTVs, pDSV, UAVIndex, UAVCount, ppUAVs, pUAVClearValues);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_ClearState(
+        ID3D11DeviceContext*      pContext) {
+  TraceScope trace("ID3D11DeviceContext::ClearState");
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
+
+  /* Unbinds render targets and UAVs as well */
+  updateOmShadowResources(pContext);
+
+  procs->ClearState(pContext);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext1_SwapDeviceContextState(
+        ID3D11DeviceContext1*     pContext,
+        ID3DDeviceContextState*   pState,
+        ID3DDeviceContextState**  ppPreviousState) {
+  TraceScope trace("ID3D11DeviceContext1::SwapDeviceContextState");
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
+
+  /* Render targets and UAVs of the current state
+   * are no longer bound once the state is swapped */
+  updateOmShadowResources(pContext);
+
+  procs->SwapDeviceContextState(pContext, pState, ppPreviousState);
+}
+
+void updateSubresource(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+  const D3D11_BOX*                pBox,
+  const void*                     pData,
+        UINT                      RowPitch,
+        UINT                      SlicePitch,
+        UINT                      CopyFlags) {
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
+
+  if (isStagingAliasEnabled(pContext))
+    resolveStagingAlias(pContext, pResource);
+
+  invalidateMapping(pContext, pResource);
+
+  { ForwardScope scope;
+
+    if (CopyFlags) {
+      procs->UpdateSubresource1(static_cast<ID3D11DeviceContext1*>(pContext),
+        pResource, Subresource, pBox, pData, RowPitch, SlicePitch, CopyFlags);
+    } else {
+      procs->UpdateSubresource(pContext, pResource,
+        Subresource, pBox, pData, RowPitch, SlicePitch);
+    }
+  }
+
+  /* Staging resources may be updated directly */
+  setCopyRecord(pResource, nullptr);
+
+  ATFIX_SHADOW shadow = { };
+
+  if (getShadowForWrite(pResource, Subresource, &shadow)) {
+    /* Arena buffers are shared, so move the box into the slot */
+    D3D11_BOX shadowBox = { };
+    const D3D11_BOX* pShadowBox = pBox;
+
+    if (shadow.Arena) {
+      ATFIX_RESOURCE_INFO resourceInfo = { };
+      getResourceInfo(pResource, &resourceInfo);
+
+      shadowBox = pBox ? *pBox : getResourceBox(&resourceInfo, 0);
+      shadowBox.left += shadow.Offset;
+      shadowBox.right += shadow.Offset;
+
+      pShadowBox = &shadowBox;
+    }
+
+    invalidateMapping(pContext, shadow.Resource);
+
+    /* Copy flags only apply to the base resource, see above */
+    { ForwardScope scope;
+      procs->UpdateSubresource(pContext, shadow.Resource,
+        0, pShadowBox, pData, RowPitch, SlicePitch);
+    }
+
+    markShadowResourceWritten(getGpuTimeline(pContext), &shadow);
+    releaseShadow(&shadow);
+  }
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_UpdateSubresource(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+  const D3D11_BOX*                pBox,
+  const void*                     pData,
+        UINT                      RowPitch,
+        UINT                      SlicePitch) {
+  if (ForwardScope::isNested()) {
+    getContextProcs(pContext)->UpdateSubresource(pContext, pResource,
+      Subresource, pBox, pData, RowPitch, SlicePitch);
+    return;
+  }
+
+  TraceScope trace("ID3D11DeviceContext::UpdateSubresource", pResource);
+  updateSubresource(pContext, pResource,
+    Subresource, pBox, pData, RowPitch, SlicePitch, 0);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext1_UpdateSubresource1(
+        ID3D11DeviceContext1*     pContext,
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+  const D3D11_BOX*                pBox,
+  const void*                     pData,
+        UINT                      RowPitch,
+        UINT                      SlicePitch,
+        UINT                      CopyFlags) {
+  if (ForwardScope::isNested()) {
+    getContextProcs(pContext)->UpdateSubresource1(pContext, pResource,
+      Subresource, pBox, pData, RowPitch, SlicePitch, CopyFlags);
+    return;
+  }
+
+  TraceScope trace("ID3D11DeviceContext1::UpdateSubresource1", pResource);
+  updateSubresource(pContext, pResource,
+    Subresource, pBox, pData, RowPitch, SlicePitch, CopyFlags);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext1_ClearView(
+        ID3D11DeviceContext1*     pContext,
+        ID3D11View*               pView,
+  const FLOAT                     pColor[4],
+  const D3D11_RECT*               pRects,
+        UINT                      NumRects) {
+  TraceScope trace("ID3D11DeviceContext1::ClearView");
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
+
+  procs->ClearView(pContext, pView, pColor, pRects, NumRects);
+
+  if (pView)
+    updateViewShadowResource(pContext, pView);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_GenerateMips(
+        ID3D11DeviceContext*      pContext,
+        ID3D11ShaderResourceView* pView) {
+  TraceScope trace("ID3D11DeviceContext::GenerateMips");
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
+
+  procs->GenerateMips(pContext, pView);
+
+  if (!pView)
+    return;
+
+  ID3D11Resource* baseResource;
+  pView->GetResource(&baseResource);
+
+  ShadowSet* shadows = getShadowSet(baseResource);
+
+  if (shadows) {
+    /* Just update the entire resource, this is rare enough that
+     * parsing the view description is not worth the trouble */
+    ATFIX_RESOURCE_INFO resourceInfo = { };
+    getResourceInfo(baseResource, &resourceInfo);
+
+    updateShadowSubresources(pContext, baseResource, shadows,
+      &resourceInfo, 0, resourceInfo.Mips, 0, resourceInfo.Layers);
+
+    shadows->Release();
+  }
+
+  baseResource->Release();
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_ResolveSubresource(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+        ID3D11Resource*           pSrcResource,
+        UINT                      SrcSubresource,
+        DXGI_FORMAT               Format) {
+  TraceScope trace("ID3D11DeviceContext::ResolveSubresource", pDstResource);
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
+
+  procs->ResolveSubresource(pContext, pDstResource, DstSubresource, pSrcResource, SrcSubresource, Format);
+
+  ShadowSet* shadows = getShadowSet(pDstResource);
 
-  if (dstShadow) {
-    if (needsShadowCopy)
-      procs->CopyResource(pContext, dstShadow, pSrcResource);
+  if (shadows) {
+    ATFIX_RESOURCE_INFO resourceInfo = { };
+    getResourceInfo(pDstResource, &resourceInfo);
+
+    updateShadowSubresources(pContext, pDstResource, shadows, &resourceInfo,
+      DstSubresource % resourceInfo.Mips, 1, DstSubresource / resourceInfo.Mips, 1);
 
-    dstShadow->Release();
+    shadows->Release();
   }
 }
 
-void STDMETHODCALLTYPE ID3D11DeviceContext_CopySubresourceRegion(
+void STDMETHODCALLTYPE ID3D11DeviceContext_ClearDepthStencilView(
         ID3D11DeviceContext*      pContext,
-        ID3D11Resource*           pDstResource,
-        UINT                      DstSubresource,
-        UINT                      DstX,
-        UINT                      DstY,
-        UINT                      DstZ,
-        ID3D11Resource*           pSrcResource,
-        UINT                      SrcSubresource,
-  const D3D11_BOX*                pSrcBox) {
+        ID3D11DepthStencilView*   pDSV,
+        UINT                      ClearFlags,
+        FLOAT                     Depth,
+        UINT8                     Stencil) {
+  TraceScope trace("ID3D11DeviceContext::ClearDepthStencilView");
   auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
 
-  ID3D11Resource* dstShadow = getShadowResource(pDstResource);
+  procs->ClearDepthStencilView(pContext, pDSV, ClearFlags, Depth, Stencil);
 
-  bool needsBaseCopy = true;
-  bool needsShadowCopy = true;
+  if (pDSV)
+    updateViewShadowResource(pContext, pDSV);
+}
 
-  if (isImmediatecontext(pContext)) {
-    HRESULT hr = tryCpuCopy(pContext,
-      pDstResource, DstSubresource, DstX, DstY, DstZ,
-      pSrcResource, SrcSubresource, pSrcBox);
-    needsBaseCopy = FAILED(hr);
+void STDMETHODCALLTYPE ID3D11DeviceContext_Draw(
+        ID3D11DeviceContext*      pContext,
+        UINT                      VertexCount,
+        UINT                      FirstVertex) {
+  TraceScope trace("ID3D11DeviceContext::Draw");
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
 
-    if (!needsBaseCopy && dstShadow) {
-      hr = tryCpuCopy(pContext,
-        dstShadow,    DstSubresource, DstX, DstY, DstZ,
-        pSrcResource, SrcSubresource, pSrcBox);
-      needsShadowCopy = FAILED(hr);
-    }
-  }
+  procs->Draw(pContext, VertexCount, FirstVertex);
+}
 
-  if (needsBaseCopy) {
-    procs->CopySubresourceRegion(pContext,
-      pDstResource, DstSubresource, DstX, DstY, DstZ,
-      pSrcResource, SrcSubresource, pSrcBox);
-  }
+void STDMETHODCALLTYPE ID3D11DeviceContext_DrawAuto(
+        ID3D11DeviceContext*      pContext) {
+  TraceScope trace("ID3D11DeviceContext::DrawAuto");
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
 
-  if (dstShadow) {
-    if (needsShadowCopy) {
-      ATFIX_RESOURCE_INFO srcInfo = { };
-      getResourceInfo(pSrcResource, &srcInfo);
+  procs->DrawAuto(pContext);
+}
 
-      procs->CopySubresourceRegion(pContext,
-        dstShadow,    DstSubresource, DstX, DstY, DstZ,
-        pSrcResource, SrcSubresource, pSrcBox);
-    }
+void STDMETHODCALLTYPE ID3D11DeviceContext_DrawIndexed(
+        ID3D11DeviceContext*      pContext,
+        UINT                      IndexCount,
+        UINT                      FirstIndex,
+        INT                       BaseVertex) {
+  TraceScope trace("ID3D11DeviceContext::DrawIndexed");
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
 
-    dstShadow->Release();
-  }
+  procs->DrawIndexed(pContext, IndexCount, FirstIndex, BaseVertex);
 }
 
-void STDMETHODCALLTYPE ID3D11DeviceContext_CopyStructureCount(
+void STDMETHODCALLTYPE ID3D11DeviceContext_DrawIndexedInstanced(
         ID3D11DeviceContext*      pContext,
-        ID3D11Buffer*             pDstBuffer,
-        UINT                      DstOffset,
-        ID3D11UnorderedAccessView* pSrcUav) {
+        UINT                      IndexCount,
+        UINT                      InstanceCount,
+        UINT                      FirstIndex,
+        INT                       BaseVertex,
+        UINT                      FirstInstance) {
+  TraceScope trace("ID3D11DeviceContext::DrawIndexedInstanced");
   auto procs = getContextProcs(pContext);
-  procs->CopyStructureCount(pContext, pDstBuffer, DstOffset, pSrcUav);
+  flushCopies(pContext);
 
-  ID3D11Resource* shadowResource = getShadowResource(pDstBuffer);
-  ID3D11Buffer*   shadowBuffer   = nullptr;
+  procs->DrawIndexedInstanced(pContext, IndexCount,
+    InstanceCount, FirstIndex, BaseVertex, FirstInstance);
+}
 
-  if (shadowResource) {
-    shadowResource->QueryInterface(IID_PPV_ARGS(&shadowBuffer));
-    shadowResource->Release();
+void STDMETHODCALLTYPE ID3D11DeviceContext_DrawIndexedInstancedIndirect(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Buffer*             pParameterBuffer,
+        UINT                      ParameterOffset) {
+  TraceScope trace("ID3D11DeviceContext::DrawIndexedInstancedIndirect");
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
 
-    procs->CopyStructureCount(pContext, shadowBuffer, DstOffset, pSrcUav);
-    shadowBuffer->Release();
-  }
+  procs->DrawIndexedInstancedIndirect(pContext, pParameterBuffer, ParameterOffset);
 }
 
-void STDMETHODCALLTYPE ID3D11DeviceContext_Dispatch(
+void STDMETHODCALLTYPE ID3D11DeviceContext_DrawInstanced(
         ID3D11DeviceContext*      pContext,
-        UINT                      X,
-        UINT                      Y,
-        UINT                      Z) {
+        UINT                      VertexCount,
+        UINT                      InstanceCount,
+        UINT                      FirstVertex,
+        UINT                      FirstInstance) {
+  TraceScope trace("ID3D11DeviceContext::DrawInstanced");
   auto procs = getContextProcs(pContext);
-  procs->Dispatch(pContext, X, Y, Z);
+  flushCopies(pContext);
 
-  updateUavShadowResources(pContext);
+  procs->DrawInstanced(pContext, VertexCount,
+    InstanceCount, FirstVertex, FirstInstance);
 }
 
-void STDMETHODCALLTYPE ID3D11DeviceContext_DispatchIndirect(
+void STDMETHODCALLTYPE ID3D11DeviceContext_DrawInstancedIndirect(
         ID3D11DeviceContext*      pContext,
         ID3D11Buffer*             pParameterBuffer,
-        UINT                      pParameterOffset) {
+        UINT                      ParameterOffset) {
+  TraceScope trace("ID3D11DeviceContext::DrawInstancedIndirect");
   auto procs = getContextProcs(pContext);
-  procs->DispatchIndirect(pContext, pParameterBuffer, pParameterOffset);
+  flushCopies(pContext);
 
-  updateUavShadowResources(pContext);
+  procs->DrawInstancedIndirect(pContext, pParameterBuffer, ParameterOffset);
 }
 
-void STDMETHODCALLTYPE ID3D11DeviceContext_OMSetRenderTargets(
+void STDMETHODCALLTYPE ID3D11DeviceContext_End(
         ID3D11DeviceContext*      pContext,
-        UINT                      RTVCount,
-        ID3D11RenderTargetView* const* ppRTVs,
-        ID3D11DepthStencilView*   pDSV) {
+        ID3D11Asynchronous*       pAsync) {
+  TraceScope trace("ID3D11DeviceContext::End");
   auto procs = getContextProcs(pContext);
-  updateRtvShadowResources(pContext);
 
-  procs->OMSetRenderTargets(pContext, RTVCount, ppRTVs, pDSV);
+  /* Queries and events must cover copies that the game
+   * issued before, even if atfix has not submitted them */
+  flushCopies(pContext);
+
+  procs->End(pContext, pAsync);
 }
 
-void STDMETHODCALLTYPE ID3D11DeviceContext_OMSetRenderTargetsAndUnorderedAccessViews(
+HRESULT STDMETHODCALLTYPE ID3D11DeviceContext_GetData(
         ID3D11DeviceContext*      pContext,
-        UINT                      RTVCount,
-        ID3D11RenderTargetView* const* ppRTVs,
-        ID3D11DepthStencilView*   pDSV,
-        UINT                      UAVIndex,
-        UINT                      UAVCount,
-        ID3D11UnorderedAccessView* const* ppUAVs,
-  const UINT*                     pUAVClearValues) {
+        ID3D11Asynchronous*       pAsync,
+        void*                     pData,
+        UINT                      DataSize,
+        UINT                      GetDataFlags) {
+  TraceScope trace("ID3D11DeviceContext::GetData");
   auto procs = getContextProcs(pContext);
-  updateRtvShadowResources(pContext);
 
-  procs->OMSetRenderTargetsAndUnorderedAccessViews(pContext,
-    RTVCount, ppRTVs, pDSV, UAVIndex, UAVCount, ppUAVs, pUAVClearValues);
+  /* Unless told otherwise, GetData flushes pending work,
+   * so make sure that queued copies get submitted too */
+  if (!(GetDataFlags & D3D11_ASYNC_GETDATA_DONOTFLUSH))
+    flushCopies(pContext);
+
+  return procs->GetData(pContext, pAsync, pData, DataSize, GetDataFlags);
 }
 
-void STDMETHODCALLTYPE ID3D11DeviceContext_UpdateSubresource(
+void STDMETHODCALLTYPE ID3D11DeviceContext_ExecuteCommandList(
+        ID3D11DeviceContext*      pContext,
+        ID3D11CommandList*        pCommandList,
+        BOOL                      RestoreState) {
+  TraceScope trace("ID3D11DeviceContext::ExecuteCommandList");
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
+
+  /* Command lists may access any resource */
+  MappingCache* mappings = getMappingCache(pContext);
+
+  if (mappings)
+    mappings->invalidateAll();
+
+  procs->ExecuteCommandList(pContext, pCommandList, RestoreState);
+
+  /* Invalidates copy records, see above */
+  g_commandListCount += 1;
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_Flush(
+        ID3D11DeviceContext*      pContext) {
+  TraceScope trace("ID3D11DeviceContext::Flush");
+  auto procs = getContextProcs(pContext);
+  flushCopies(pContext);
+
+  /* Don't rely on Present alone to drop mappings */
+  MappingCache* mappings = getMappingCache(pContext);
+
+  if (mappings)
+    mappings->invalidateAll();
+
+  procs->Flush(pContext);
+}
+
+HRESULT STDMETHODCALLTYPE ID3D11DeviceContext_Map(
         ID3D11DeviceContext*      pContext,
         ID3D11Resource*           pResource,
         UINT                      Subresource,
-  const D3D11_BOX*                pBox,
-  const void*                     pData,
-        UINT                      RowPitch,
-        UINT                      SlicePitch) {
+        D3D11_MAP                 MapType,
+        UINT                      MapFlags,
+        D3D11_MAPPED_SUBRESOURCE* pMappedResource) {
+  TraceScope trace("ID3D11DeviceContext::Map", pResource);
+  checkFrameEnd(pContext);
+  flushCopies(pContext);
+
+  /* The game expects the resource to be unmapped */
+  invalidateMapping(pContext, pResource);
+
+  /* Watch which pages the game writes to a staging resource that
+   * holds a copy of a GPU resource, so that copying it back to
+   * that resource only needs to copy the written regions */
+  ATFIX_COPY_RECORD watchRecord;
+  bool watchWrites = MapType == D3D11_MAP_READ_WRITE
+    && isWriteWatchCandidate(pContext, pResource, Subresource, &watchRecord);
+
+  /* The game may overwrite data that we copied to the resource */
+  if (MapType == D3D11_MAP_WRITE || MapType == D3D11_MAP_READ_WRITE)
+    setCopyRecord(pResource, nullptr);
+
+  /* Serve reads of aliased staging resources from cached data, and
+   * give the resource its actual contents for any other access.
+   * Dynamic resources are never aliased. */
+  if (MapType != D3D11_MAP_WRITE_DISCARD && MapType != D3D11_MAP_WRITE_NO_OVERWRITE
+   && isStagingAliasEnabled(pContext)) {
+    StagingAlias* alias = getStagingAlias(pResource);
+
+    if (alias) {
+      bool isAliasRead = MapType == D3D11_MAP_READ;
+
+      if (isAliasRead)
+        alias->map(pMappedResource);
+
+      alias->Release();
+
+      if (isAliasRead)
+        return S_OK;
+
+      resolveStagingAlias(pContext, pResource);
+    }
+  }
+
+  /* Let the scheduler know when reads happen within a frame */
+  SubmitScheduler* scheduler = nullptr;
+
+  if ((MapType == D3D11_MAP_READ || MapType == D3D11_MAP_READ_WRITE) && isImmediatecontext(pContext))
+    scheduler = SubmitScheduler::get(pContext);
+
+  auto mapStart = scheduler
+    ? SubmitScheduler::clock::now()
+    : SubmitScheduler::clock::time_point();
+
+  HRESULT hr = forwardMap(pContext, pResource, Subresource, MapType, MapFlags, pMappedResource);
+
+  if (FAILED(hr))
+    return hr;
+
+  if (scheduler)
+    scheduler->recordRead(SubmitScheduler::clock::now() - mapStart);
+
+  if (watchWrites)
+    beginWriteWatch(pResource, &watchRecord, pMappedResource);
+
+  return hr;
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_Unmap(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pResource,
+        UINT                      Subresource) {
+  TraceScope trace("ID3D11DeviceContext::Unmap", pResource);
   auto procs = getContextProcs(pContext);
 
-  procs->UpdateSubresource(pContext, pResource,
-    Subresource, pBox, pData, RowPitch, SlicePitch);
+  /* Resource itself was not mapped if the alias served the read */
+  if (isStagingAliasEnabled(pContext)) {
+    StagingAlias* alias = getStagingAlias(pResource);
 
-  ID3D11Resource* shadowResource = getShadowResource(pResource);
-  
-  if (shadowResource) {
-    procs->UpdateSubresource(pContext, shadowResource,
-      Subresource, pBox, pData, RowPitch, SlicePitch);
-    shadowResource->Release();
+    if (alias) {
+      bool wasMapped = alias->unmap();
+      alias->Release();
+
+      if (wasMapped)
+        return;
+    }
   }
+
+  /* Written pages must be copied back before the actual Unmap */
+  if (getConfig()->WriteWatchSize && isImmediatecontext(pContext))
+    endWriteWatch(pResource);
+
+  procs->Unmap(pContext, pResource, Subresource);
 }
 
-#define HOOK_PROC(iface, object, table, index, proc) \
-  hookProc(object, #iface "::" #proc, &table->proc, &iface ## _ ## proc, index)
+void forwardEnd(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Asynchronous*       pAsync) {
+  auto procs = getContextProcs(pContext);
 
-template<typename T>
-void hookProc(void* pObject, const char* pName, T** ppOrig, T* pHook, uint32_t index) {
-  void** vtbl = *reinterpret_cast<void***>(pObject);
+  /* Only happens if hooking End failed */
+  if (!procs->End)
+    pContext->End(pAsync);
+  else
+    procs->End(pContext, pAsync);
+}
 
-  MH_STATUS mh = MH_CreateHook(vtbl[index],
-    reinterpret_cast<void*>(pHook),
-    reinterpret_cast<void**>(ppOrig));
+HRESULT forwardGetData(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Asynchronous*       pAsync,
+        void*                     pData,
+        UINT                      DataSize,
+        UINT                      GetDataFlags) {
+  auto procs = getContextProcs(pContext);
 
-  if (mh) {
-    if (mh != MH_ERROR_ALREADY_CREATED)
-      log("Failed to create hook for ", pName, ": ", MH_StatusToString(mh));
-    return;
+  /* Only happens if hooking GetData failed */
+  if (!procs->GetData)
+    return pContext->GetData(pAsync, pData, DataSize, GetDataFlags);
+
+  return procs->GetData(pContext, pAsync, pData, DataSize, GetDataFlags);
+}
+
+void forwardFlush(
+        ID3D11DeviceContext*      pContext) {
+  auto procs = getContextProcs(pContext);
+
+  /* Only happens if hooking Flush failed */
+  if (!procs->Flush)
+    pContext->Flush();
+  else
+    procs->Flush(pContext);
+}
+
+HRESULT forwardCreateBuffer(
+        ID3D11Device*             pDevice,
+  const D3D11_BUFFER_DESC*        pDesc,
+        ID3D11Buffer**            ppBuffer) {
+  auto procs = getDeviceProcs(pDevice);
+
+  if (!procs->CreateBuffer)
+    return pDevice->CreateBuffer(pDesc, nullptr, ppBuffer);
+
+  return procs->CreateBuffer(pDevice, pDesc, nullptr, ppBuffer);
+}
+
+HRESULT forwardCreateTexture1D(
+        ID3D11Device*             pDevice,
+  const D3D11_TEXTURE1D_DESC*     pDesc,
+        ID3D11Texture1D**         ppTexture) {
+  auto procs = getDeviceProcs(pDevice);
+
+  if (!procs->CreateTexture1D)
+    return pDevice->CreateTexture1D(pDesc, nullptr, ppTexture);
+
+  return procs->CreateTexture1D(pDevice, pDesc, nullptr, ppTexture);
+}
+
+HRESULT forwardCreateTexture2D(
+        ID3D11Device*             pDevice,
+  const D3D11_TEXTURE2D_DESC*     pDesc,
+        ID3D11Texture2D**         ppTexture) {
+  auto procs = getDeviceProcs(pDevice);
+
+  if (!procs->CreateTexture2D)
+    return pDevice->CreateTexture2D(pDesc, nullptr, ppTexture);
+
+  return procs->CreateTexture2D(pDevice, pDesc, nullptr, ppTexture);
+}
+
+HRESULT forwardCreateTexture3D(
+        ID3D11Device*             pDevice,
+  const D3D11_TEXTURE3D_DESC*     pDesc,
+        ID3D11Texture3D**         ppTexture) {
+  auto procs = getDeviceProcs(pDevice);
+
+  if (!procs->CreateTexture3D)
+    return pDevice->CreateTexture3D(pDesc, nullptr, ppTexture);
+
+  return procs->CreateTexture3D(pDevice, pDesc, nullptr, ppTexture);
+}
+
+HRESULT forwardMap(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+        D3D11_MAP                 MapType,
+        UINT                      MapFlags,
+        D3D11_MAPPED_SUBRESOURCE* pMappedResource) {
+  auto procs = getContextProcs(pContext);
+
+  /* Only happens if hooking Map failed */
+  if (!procs->Map)
+    return pContext->Map(pResource, Subresource, MapType, MapFlags, pMappedResource);
+
+  return procs->Map(pContext, pResource, Subresource, MapType, MapFlags, pMappedResource);
+}
+
+void forwardUnmap(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pResource,
+        UINT                      Subresource) {
+  auto procs = getContextProcs(pContext);
+
+  /* Unmap is only hooked if staging aliases or write watches are used */
+  if (!procs->Unmap)
+    pContext->Unmap(pResource, Subresource);
+  else
+    procs->Unmap(pContext, pResource, Subresource);
+}
+
+HRESULT STDMETHODCALLTYPE IDXGISwapChain_Present(
+        IDXGISwapChain*           pSwapChain,
+        UINT                      SyncInterval,
+        UINT                      Flags) {
+  TraceScope trace("IDXGISwapChain::Present");
+  auto procs = getSwapChainProcs(pSwapChain);
+
+  if (Flags & DXGI_PRESENT_TEST)
+    return procs->Present(pSwapChain, SyncInterval, Flags);
+
+  ID3D11Device* device = nullptr;
+  ID3D11DeviceContext* context = nullptr;
+
+  if (SUCCEEDED(pSwapChain->GetDevice(IID_PPV_ARGS(&device)))) {
+    device->GetImmediateContext(&context);
+
+    /* Don't let queued copies sit around across frames */
+    CopyQueue::get(context)->flush();
+
+    /* Mappings hold on to resources that the game may
+     * have released, so don't keep them across frames */
+    MappingCache* mappings = MappingCache::get(context);
+
+    if (mappings)
+      mappings->invalidateAll();
+  }
+
+  FramePacer* pacer = FramePacer::get(pSwapChain);
+  pacer->beginPresent();
+
+  HRESULT hr = procs->Present(pSwapChain, SyncInterval, Flags);
+
+  pacer->endPresent();
+
+  if (context) {
+    endFrame(context);
+
+    context->Release();
+    device->Release();
+  }
+
+  return hr;
+}
+
+/* The factory also creates swap chains for D3D12 command
+ * queues, only hook Present for those of D3D11 devices */
+void hookFactorySwapChain(
+        IUnknown*                 pDevice,
+        IDXGISwapChain*           pSwapChain) {
+  ID3D11Device* device = nullptr;
+
+  if (SUCCEEDED(pDevice->QueryInterface(IID_PPV_ARGS(&device)))) {
+    hookSwapChain(pSwapChain);
+    device->Release();
+  }
+}
+
+HRESULT STDMETHODCALLTYPE IDXGIFactory_CreateSwapChain(
+        IDXGIFactory*             pFactory,
+        IUnknown*                 pDevice,
+        DXGI_SWAP_CHAIN_DESC*     pDesc,
+        IDXGISwapChain**          ppSwapChain) {
+  HRESULT hr = g_factoryProcs.CreateSwapChain(pFactory, pDevice, pDesc, ppSwapChain);
+
+  if (SUCCEEDED(hr) && pDevice && ppSwapChain && *ppSwapChain)
+    hookFactorySwapChain(pDevice, *ppSwapChain);
+
+  return hr;
+}
+
+HRESULT STDMETHODCALLTYPE IDXGIFactory2_CreateSwapChainForHwnd(
+        IDXGIFactory2*            pFactory,
+        IUnknown*                 pDevice,
+        HWND                      hWnd,
+  const DXGI_SWAP_CHAIN_DESC1*    pDesc,
+  const DXGI_SWAP_CHAIN_FULLSCREEN_DESC* pFullscreenDesc,
+        IDXGIOutput*              pRestrictToOutput,
+        IDXGISwapChain1**         ppSwapChain) {
+  HRESULT hr = g_factoryProcs.CreateSwapChainForHwnd(pFactory, pDevice,
+    hWnd, pDesc, pFullscreenDesc, pRestrictToOutput, ppSwapChain);
+
+  if (SUCCEEDED(hr) && pDevice && ppSwapChain && *ppSwapChain)
+    hookFactorySwapChain(pDevice, *ppSwapChain);
+
+  return hr;
+}
+
+HRESULT STDMETHODCALLTYPE IDXGIFactory2_CreateSwapChainForCoreWindow(
+        IDXGIFactory2*            pFactory,
+        IUnknown*                 pDevice,
+        IUnknown*                 pWindow,
+  const DXGI_SWAP_CHAIN_DESC1*    pDesc,
+        IDXGIOutput*              pRestrictToOutput,
+        IDXGISwapChain1**         ppSwapChain) {
+  HRESULT hr = g_factoryProcs.CreateSwapChainForCoreWindow(pFactory, pDevice,
+    pWindow, pDesc, pRestrictToOutput, ppSwapChain);
+
+  if (SUCCEEDED(hr) && pDevice && ppSwapChain && *ppSwapChain)
+    hookFactorySwapChain(pDevice, *ppSwapChain);
+
+  return hr;
+}
+
+HRESULT STDMETHODCALLTYPE IDXGIFactory2_CreateSwapChainForComposition(
+        IDXGIFactory2*            pFactory,
+        IUnknown*                 pDevice,
+  const DXGI_SWAP_CHAIN_DESC1*    pDesc,
+        IDXGIOutput*              pRestrictToOutput,
+        IDXGISwapChain1**         ppSwapChain) {
+  HRESULT hr = g_factoryProcs.CreateSwapChainForComposition(pFactory, pDevice,
+    pDesc, pRestrictToOutput, ppSwapChain);
+
+  if (SUCCEEDED(hr) && pDevice && ppSwapChain && *ppSwapChain)
+    hookFactorySwapChain(pDevice, *ppSwapChain);
+
+  return hr;
+}
+
+IDXGIFactory* getDeviceFactory(
+        ID3D11Device*             pDevice) {
+  IDXGIDevice* dxgiDevice = nullptr;
+  IDXGIAdapter* adapter = nullptr;
+  IDXGIFactory* factory = nullptr;
+
+  if (SUCCEEDED(pDevice->QueryInterface(IID_PPV_ARGS(&dxgiDevice)))) {
+    if (SUCCEEDED(dxgiDevice->GetAdapter(&adapter))) {
+      adapter->GetParent(IID_PPV_ARGS(&factory));
+      adapter->Release();
+    }
+
+    dxgiDevice->Release();
   }
 
-  mh = MH_EnableHook(vtbl[index]);
+  return factory;
+}
+
+void hookFactory(
+        HookBatch&                Batch,
+        ID3D11Device*             pDevice) {
+  if (g_installedHooks & HOOK_FACTORY)
+    return;
+
+  IDXGIFactory* factory = getDeviceFactory(pDevice);
 
-  if (mh) {
-    log("Failed to enable hook for ", pName, ": ", MH_StatusToString(mh));
+  if (!factory) {
+    log("Failed to query DXGI factory");
     return;
   }
 
-  log("Created hook for ", pName, " @ ", reinterpret_cast<void*>(pHook));
+  log("Hooking factory ", factory);
+
+  FactoryProcs* procs = &g_factoryProcs;
+  HOOK_PROC(Batch, IDXGIFactory, factory, procs, CreateSwapChain);
+
+  IDXGIFactory2* factory2 = nullptr;
+
+  if (SUCCEEDED(factory->QueryInterface(IID_PPV_ARGS(&factory2)))) {
+    HOOK_PROC(Batch, IDXGIFactory2, factory2, procs, CreateSwapChainForHwnd);
+    HOOK_PROC(Batch, IDXGIFactory2, factory2, procs, CreateSwapChainForCoreWindow);
+    HOOK_PROC(Batch, IDXGIFactory2, factory2, procs, CreateSwapChainForComposition);
+    factory2->Release();
+  }
+
+  factory->Release();
+  g_installedHooks |= HOOK_FACTORY;
+}
+
+bool checkChildrenHoldDevice(
+        ID3D11Device*             pDevice) {
+  D3D11_QUERY_DESC desc = { };
+  desc.Query = D3D11_QUERY_EVENT;
+
+  /* Nothing else uses the device yet, so the
+   * reference count can't change in between */
+  pDevice->AddRef();
+  ULONG before = pDevice->Release();
+
+  ID3D11Query* query = nullptr;
+
+  if (FAILED(pDevice->CreateQuery(&desc, &query)))
+    return false;
+
+  pDevice->AddRef();
+  ULONG after = pDevice->Release();
+
+  query->Release();
+  return after > before;
 }
 
 void hookDevice(ID3D11Device* pDevice) {
@@ -976,13 +3725,26 @@ void hookDevice(ID3D11Device* pDevice) {
 
   log("Hooking device ", pDevice);
 
-  DeviceProcs* procs = &g_deviceProcs;
-  HOOK_PROC(ID3D11Device, pDevice, procs, 3,  CreateBuffer);
-  HOOK_PROC(ID3D11Device, pDevice, procs, 27, CreateDeferredContext);
-  HOOK_PROC(ID3D11Device, pDevice, procs, 4,  CreateTexture1D);
-  HOOK_PROC(ID3D11Device, pDevice, procs, 5,  CreateTexture2D);
-  HOOK_PROC(ID3D11Device, pDevice, procs, 6,  CreateTexture3D);
+  g_childrenHoldDevice = checkChildrenHoldDevice(pDevice);
 
+  HookBatch batch("device");
+  DeviceProcs* procs = &g_deviceProcs;
+  HOOK_PROC(batch, ID3D11Device, pDevice, procs, CreateBuffer);
+  HOOK_PROC(batch, ID3D11Device, pDevice, procs, CreateDeferredContext);
+  HOOK_PROC(batch, ID3D11Device, pDevice, procs, CreateTexture1D);
+  HOOK_PROC(batch, ID3D11Device, pDevice, procs, CreateTexture2D);
+  HOOK_PROC(batch, ID3D11Device, pDevice, procs, CreateTexture3D);
+
+  /* Objects that atfix keeps around keep the device alive,
+   * so we need to know when the game is done with the device */
+  HOOK_PROC(batch, ID3D11Device, pDevice, procs, Release);
+
+  /* Games may create their swap chain through the DXGI factory
+   * rather than D3D11CreateDeviceAndSwapChain, so hook swap chain
+   * creation there in order to hook Present either way */
+  hookFactory(batch, pDevice);
+
+  batch.apply();
   g_installedHooks |= HOOK_DEVICE;
 }
 
@@ -1002,18 +3764,57 @@ void hookContext(ID3D11DeviceContext* pContext) {
 
   log("Hooking context ", pContext);
 
-  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 50, ClearRenderTargetView);
-  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 52, ClearUnorderedAccessViewFloat);
-  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 51, ClearUnorderedAccessViewUint);
-  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 47, CopyResource);
-  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 46, CopySubresourceRegion);
-  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 49, CopyStructureCount);
-  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 41, Dispatch);
-  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 42, DispatchIndirect);
-  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 33, OMSetRenderTargets);
-  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 34, OMSetRenderTargetsAndUnorderedAccessViews);
-  HOOK_PROC(ID3D11DeviceContext, pContext, procs, 48, UpdateSubresource);
+  HookBatch batch("context");
+
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, ClearRenderTargetView);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, ClearUnorderedAccessViewFloat);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, ClearUnorderedAccessViewUint);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, CopyResource);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, CopySubresourceRegion);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, CopyStructureCount);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, Dispatch);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, DispatchIndirect);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, OMSetRenderTargets);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, OMSetRenderTargetsAndUnorderedAccessViews);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, ClearState);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, UpdateSubresource);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, GenerateMips);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, ResolveSubresource);
+
+  /* Anything that may access resource contents must
+   * flush copies that atfix has queued up so far */
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, ClearDepthStencilView);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, DrawIndexed);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, Draw);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, Map);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, DrawIndexedInstanced);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, DrawInstanced);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, DrawAuto);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, DrawIndexedInstancedIndirect);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, DrawInstancedIndirect);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, ExecuteCommandList);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, Flush);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, End);
+  HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, GetData);
+
+  /* Unmap is only relevant for staging aliases and write watches,
+   * don't add overhead to every single Unmap call otherwise */
+  if (getConfig()->StagingAliasing || getConfig()->WriteWatchSize)
+    HOOK_PROC(batch, ID3D11DeviceContext, pContext, procs, Unmap);
+
+  /* DiscardResource and DiscardView leave resource contents undefined,
+   * so they don't need to update shadow resources and aren't hooked. */
+  ID3D11DeviceContext1* context1 = nullptr;
+
+  if (SUCCEEDED(pContext->QueryInterface(IID_PPV_ARGS(&context1)))) {
+    HOOK_PROC(batch, ID3D11DeviceContext1, context1, procs, CopySubresourceRegion1);
+    HOOK_PROC(batch, ID3D11DeviceContext1, context1, procs, UpdateSubresource1);
+    HOOK_PROC(batch, ID3D11DeviceContext1, context1, procs, ClearView);
+    HOOK_PROC(batch, ID3D11DeviceContext1, context1, procs, SwapDeviceContextState);
+    context1->Release();
+  }
 
+  batch.apply();
   g_installedHooks |= flag;
 
   /* Immediate context and deferred context methods may share code */
@@ -1021,4 +3822,73 @@ void hookContext(ID3D11DeviceContext* pContext) {
     g_defContextProcs = g_immContextProcs;
 }
 
+void hookSwapChain(IDXGISwapChain* pSwapChain) {
+  std::lock_guard lock(g_hookMutex);
+
+  if (g_installedHooks & HOOK_SWAPCHAIN)
+    return;
+
+  log("Hooking swap chain ", pSwapChain);
+
+  /* Present1 is not hooked since runtimes may implement Present
+   * on top of it, which would make us pace the same frame twice. */
+  HookBatch batch("swap chain");
+  SwapChainProcs* procs = &g_swapChainProcs;
+  HOOK_PROC(batch, IDXGISwapChain, pSwapChain, procs, Present);
+  batch.apply();
+
+  g_installedHooks |= HOOK_SWAPCHAIN;
+}
+
+void hookResource(ID3D11Resource* pResource) {
+  D3D11_RESOURCE_DIMENSION dim;
+  pResource->GetType(&dim);
+
+  std::lock_guard lock(g_hookMutex);
+
+  /* Different resource types may share their Release implementation,
+   * in which case only the first hook gets installed, which is fine
+   * since it will forward to the same function anyway. */
+  switch (dim) {
+    case D3D11_RESOURCE_DIMENSION_BUFFER:
+      if (!(g_installedHooks & HOOK_BUFFER)) {
+        ResourceProcs* procs = &g_bufferProcs;
+        HookBatch batch("buffers");
+        HOOK_PROC(batch, ID3D11Buffer, pResource, procs, Release);
+        batch.apply();
+        g_installedHooks |= HOOK_BUFFER;
+      } break;
+
+    case D3D11_RESOURCE_DIMENSION_TEXTURE1D:
+      if (!(g_installedHooks & HOOK_TEXTURE1D)) {
+        ResourceProcs* procs = &g_texture1DProcs;
+        HookBatch batch("1D textures");
+        HOOK_PROC(batch, ID3D11Texture1D, pResource, procs, Release);
+        batch.apply();
+        g_installedHooks |= HOOK_TEXTURE1D;
+      } break;
+
+    case D3D11_RESOURCE_DIMENSION_TEXTURE2D:
+      if (!(g_installedHooks & HOOK_TEXTURE2D)) {
+        ResourceProcs* procs = &g_texture2DProcs;
+        HookBatch batch("2D textures");
+        HOOK_PROC(batch, ID3D11Texture2D, pResource, procs, Release);
+        batch.apply();
+        g_installedHooks |= HOOK_TEXTURE2D;
+      } break;
+
+    case D3D11_RESOURCE_DIMENSION_TEXTURE3D:
+      if (!(g_installedHooks & HOOK_TEXTURE3D)) {
+        ResourceProcs* procs = &g_texture3DProcs;
+        HookBatch batch("3D textures");
+        HOOK_PROC(batch, ID3D11Texture3D, pResource, procs, Release);
+        batch.apply();
+        g_installedHooks |= HOOK_TEXTURE3D;
+      } break;
+
+    default:
+      break;
+  }
+}
+
 }
\ No newline at end of file
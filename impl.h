@@ -1,13 +1,136 @@
 #pragma once
 
 #include <d3d11.h>
+#include <dxgi1_2.h>
 
 #include "log.h"
 
 namespace atfix {
 
+struct ATFIX_RESOURCE_INFO {
+  D3D11_RESOURCE_DIMENSION Dim;
+  DXGI_FORMAT Format;
+  uint32_t Width;
+  uint32_t Height;
+  uint32_t Depth;
+  uint32_t Layers;
+  uint32_t Mips;
+  uint32_t Samples;
+  D3D11_USAGE Usage;
+  uint32_t BindFlags;
+  uint32_t MiscFlags;
+  uint32_t CPUFlags;
+};
+
+void* ptroffset(void* base, ptrdiff_t offset);
+
+uint32_t getFormatPixelSize(
+        DXGI_FORMAT               Format);
+
+bool isBlockCompressedFormat(
+        DXGI_FORMAT               Format);
+
+bool getResourceInfo(
+        ID3D11Resource*           pResource,
+        ATFIX_RESOURCE_INFO*      pInfo);
+
+uint64_t getResourceSize(
+  const ATFIX_RESOURCE_INFO*      pInfo);
+
+D3D11_BOX getResourceBox(
+  const ATFIX_RESOURCE_INFO*      pInfo,
+        UINT                      Subresource);
+
+/* Creates a staging resource for a single subresource of the
+ * given resource, without initializing it. May be called from
+ * any thread unless the device is single-threaded. */
+HRESULT createShadowResource(
+        ID3D11Device*             pDevice,
+        ID3D11Resource*           pBaseResource,
+        UINT                      Subresource,
+        ID3D11Resource**          ppShadowResource);
+
+/* Adjusts the number of references to the device held by objects
+ * that atfix keeps around on its own, such as queries or pooled
+ * resources. Must be called after creating such an object and
+ * before releasing it. Once the game released all of its own
+ * references to the device, atfix drops all of those objects
+ * so that the device can actually be destroyed. */
+void addInternalDeviceRefs(
+        ID3D11Device*             pDevice,
+        int32_t                   Count);
+
+/* Call the original context methods, bypassing any hooks */
+void forwardCopyResource(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        ID3D11Resource*           pSrcResource);
+
+void forwardCopySubresourceRegion(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pDstResource,
+        UINT                      DstSubresource,
+        UINT                      DstX,
+        UINT                      DstY,
+        UINT                      DstZ,
+        ID3D11Resource*           pSrcResource,
+        UINT                      SrcSubresource,
+  const D3D11_BOX*                pSrcBox,
+        UINT                      CopyFlags);
+
+void forwardEnd(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Asynchronous*       pAsync);
+
+HRESULT forwardGetData(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Asynchronous*       pAsync,
+        void*                     pData,
+        UINT                      DataSize,
+        UINT                      GetDataFlags);
+
+void forwardFlush(
+        ID3D11DeviceContext*      pContext);
+
+/* Call the original device methods, bypassing any hooks. Resources
+ * that atfix creates for itself must not end up in the staging pool. */
+HRESULT forwardCreateBuffer(
+        ID3D11Device*             pDevice,
+  const D3D11_BUFFER_DESC*        pDesc,
+        ID3D11Buffer**            ppBuffer);
+
+HRESULT forwardCreateTexture1D(
+        ID3D11Device*             pDevice,
+  const D3D11_TEXTURE1D_DESC*     pDesc,
+        ID3D11Texture1D**         ppTexture);
+
+HRESULT forwardCreateTexture2D(
+        ID3D11Device*             pDevice,
+  const D3D11_TEXTURE2D_DESC*     pDesc,
+        ID3D11Texture2D**         ppTexture);
+
+HRESULT forwardCreateTexture3D(
+        ID3D11Device*             pDevice,
+  const D3D11_TEXTURE3D_DESC*     pDesc,
+        ID3D11Texture3D**         ppTexture);
+
+HRESULT forwardMap(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+        D3D11_MAP                 MapType,
+        UINT                      MapFlags,
+        D3D11_MAPPED_SUBRESOURCE* pMappedResource);
+
+void forwardUnmap(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pResource,
+        UINT                      Subresource);
+
 void hookDevice(ID3D11Device* pDevice);
 void hookContext(ID3D11DeviceContext* pContext);
+void hookSwapChain(IDXGISwapChain* pSwapChain);
+void hookResource(ID3D11Resource* pResource);
 
 /* lives in main.cpp */
 extern Log log;
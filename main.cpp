@@ -1,6 +1,7 @@
 #include <iostream>
 
 #include "impl.h"
+#include "trace.h"
 #include "util.h"
 
 #include <array>
@@ -96,6 +97,8 @@ DLLEXPORT HRESULT __stdcall D3D11CreateDevice(
   if (ppImmediateContext)
     *ppImmediateContext = nullptr;
 
+  atfix::Tracer::init();
+
   auto proc = atfix::loadSystemD3D11();
 
   if (!proc.D3D11CreateDevice)
@@ -151,6 +154,8 @@ DLLEXPORT HRESULT __stdcall D3D11CreateDeviceAndSwapChain(
   if (ppSwapChain)
     *ppSwapChain = nullptr;
 
+  atfix::Tracer::init();
+
   auto proc = atfix::loadSystemD3D11();
 
   if (!proc.D3D11CreateDeviceAndSwapChain)
@@ -169,6 +174,9 @@ DLLEXPORT HRESULT __stdcall D3D11CreateDeviceAndSwapChain(
   atfix::hookDevice(device);
   atfix::hookContext(context);
 
+  if (ppSwapChain && *ppSwapChain)
+    atfix::hookSwapChain(*ppSwapChain);
+
   if (ppDevice) {
     device->AddRef();
     *ppDevice = device;
@@ -191,6 +199,7 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved) {
       break;
 
     case DLL_PROCESS_DETACH:
+      atfix::Tracer::shutdown();
       MH_Uninitialize();
       break;
   }
@@ -0,0 +1,204 @@
+#include "config.h"
+#include "mapcache.h"
+
+namespace atfix {
+
+static const GUID IID_MappingCache = {0x3b7d5e18,0x92c4,0x4f0a,{0xa6,0x1e,0xd8,0x05,0x7c,0x3f,0x94,0xb2}};
+
+/* Each mapping holds on to the resource until the end of the frame,
+ * so limit how many there can be at once */
+constexpr size_t MaxMappings = 64u;
+
+/* A copy maps at most its destination and its source */
+constexpr size_t MaxMappingsPerCopy = 2u;
+
+/* Drop all mappings after this many maps even if no frame
+ * boundary or flush was seen, so that resources the game
+ * released don't stay alive indefinitely */
+constexpr uint32_t MaxMapsPerInterval = 1024u;
+
+
+MappingCache::MappingCache(
+        ID3D11DeviceContext*      pContext)
+: m_context(pContext) {
+
+}
+
+
+MappingCache::~MappingCache() {
+  /* Mappings are dropped when the cache gets detached, so only
+   * references remain if the context itself got destroyed */
+  for (const auto& e : m_entries)
+    e.resource->Release();
+}
+
+
+HRESULT STDMETHODCALLTYPE MappingCache::QueryInterface(
+        REFIID                    riid,
+        void**                    ppvObject) {
+  if (!ppvObject)
+    return E_POINTER;
+
+  *ppvObject = nullptr;
+
+  if (riid == __uuidof(IUnknown)) {
+    AddRef();
+    *ppvObject = static_cast<IUnknown*>(this);
+    return S_OK;
+  }
+
+  return E_NOINTERFACE;
+}
+
+
+ULONG STDMETHODCALLTYPE MappingCache::AddRef() {
+  return ++m_refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE MappingCache::Release() {
+  ULONG refCount = --m_refCount;
+
+  if (!refCount)
+    delete this;
+
+  return refCount;
+}
+
+
+MappingCache* MappingCache::get(
+        ID3D11DeviceContext*      pContext) {
+  static mutex s_mutex;
+  std::lock_guard lock(s_mutex);
+
+  MappingCache* cache = nullptr;
+  UINT size = sizeof(cache);
+
+  /* The context holds a reference to the cache, so the
+   * one returned by GetPrivateData can be dropped */
+  if (SUCCEEDED(pContext->GetPrivateData(IID_MappingCache, &size, &cache))) {
+    if (cache)
+      cache->Release();
+    return cache;
+  }
+
+  if (getConfig()->PersistentMaps)
+    cache = new MappingCache(pContext);
+
+  /* Also store null pointer so we don't try again */
+  if (cache)
+    pContext->SetPrivateDataInterface(IID_MappingCache, cache);
+  else
+    pContext->SetPrivateData(IID_MappingCache, sizeof(cache), &cache);
+
+  return cache;
+}
+
+
+void MappingCache::detach(
+        ID3D11DeviceContext*      pContext) {
+  MappingCache* cache = nullptr;
+  UINT size = sizeof(cache);
+
+  if (SUCCEEDED(pContext->GetPrivateData(IID_MappingCache, &size, &cache)) && cache) {
+    cache->invalidateAll();
+    cache->Release();
+  }
+
+  pContext->SetPrivateData(IID_MappingCache, 0, nullptr);
+}
+
+
+void MappingCache::beginCopy() {
+  if (m_mapCount >= MaxMapsPerInterval) {
+    invalidateAll();
+    return;
+  }
+
+  /* Make room for all mappings the copy may add */
+  while (m_entries.size() > MaxMappings - MaxMappingsPerCopy) {
+    Entry oldest = m_entries.front();
+    m_entries.erase(m_entries.begin());
+    unmap(oldest);
+  }
+}
+
+
+HRESULT MappingCache::map(
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+        D3D11_MAP                 MapType,
+        UINT                      MapFlags,
+        D3D11_MAPPED_SUBRESOURCE* pMapped) {
+  m_mapCount += 1;
+
+  for (const auto& e : m_entries) {
+    if (e.resource == pResource && e.subresource == Subresource && e.mapType == MapType) {
+      *pMapped = e.mapped;
+      return S_OK;
+    }
+  }
+
+  invalidate(pResource);
+
+  HRESULT hr = forwardMap(m_context, pResource, Subresource, MapType, MapFlags, pMapped);
+
+  if (FAILED(hr))
+    return hr;
+
+  pResource->AddRef();
+  m_entries.push_back({ pResource, Subresource, MapType, *pMapped });
+  return hr;
+}
+
+
+bool MappingCache::isMapped(
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+        D3D11_MAP                 MapType) const {
+  for (const auto& e : m_entries) {
+    if (e.resource == pResource && e.subresource == Subresource && e.mapType == MapType)
+      return true;
+  }
+
+  return false;
+}
+
+
+void MappingCache::invalidate(
+        ID3D11Resource*           pResource) {
+  /* This is called for every copy, so keep the common case fast */
+  if (m_entries.empty())
+    return;
+
+  for (size_t i = 0; i < m_entries.size(); ) {
+    if (m_entries[i].resource == pResource) {
+      /* Remove the entry first since releasing the
+       * resource may recycle it via the hooks */
+      Entry entry = m_entries[i];
+      m_entries.erase(m_entries.begin() + i);
+      unmap(entry);
+    } else {
+      i++;
+    }
+  }
+}
+
+
+void MappingCache::invalidateAll() {
+  std::vector<Entry> entries = std::move(m_entries);
+  m_entries.clear();
+  m_mapCount = 0u;
+
+  for (const auto& e : entries)
+    unmap(e);
+}
+
+
+void MappingCache::unmap(
+  const Entry&                    Mapping) {
+  forwardUnmap(m_context, Mapping.resource, Mapping.subresource);
+  Mapping.resource->Release();
+}
+
+}
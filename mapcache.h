@@ -0,0 +1,117 @@
+#pragma once
+
+#include <d3d11.h>
+
+#include <vector>
+
+#include "impl.h"
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief Persistent mapping cache
+ *
+ * Keeps resources that atfix maps for CPU copies mapped after the
+ * copy, so that copying the same shadow resource to several staging
+ * resources, or several regions to the same staging resource, only
+ * maps and unmaps each resource once rather than once per copy.
+ *
+ * Mappings are dropped right before anything else accesses the
+ * resource, i.e. before atfix issues a GPU copy or update involving
+ * it, and before the game maps it. Since the hooks cannot see work
+ * recorded on deferred contexts, all mappings are dropped before
+ * command lists get executed, when the game flushes the context,
+ * at the end of each frame, and after a fixed number of maps.
+ *
+ * A copy may use mappings of both its source and destination, so
+ * the limits on the number of mappings and maps are only enforced
+ * before a copy starts, never while mappings are in use.
+ *
+ * Shadow resources with a shadow cache are never kept mapped, since
+ * the readback worker may map those at any time.
+ *
+ * Each mapping holds a reference to the resource. One cache is created
+ * per immediate context if enabled, and is attached to it as private
+ * data. Must only be used from the thread that owns the immediate
+ * context.
+ */
+class MappingCache final : public IUnknown {
+
+public:
+
+  MappingCache(
+          ID3D11DeviceContext*      pContext);
+
+  ~MappingCache();
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(
+          REFIID                    riid,
+          void**                    ppvObject);
+
+  ULONG STDMETHODCALLTYPE AddRef();
+
+  ULONG STDMETHODCALLTYPE Release();
+
+  /** Retrieves mapping cache for the given immediate context,
+   *  and creates it if necessary. Returns \c nullptr if
+   *  persistent mappings are disabled. */
+  static MappingCache* get(
+          ID3D11DeviceContext*      pContext);
+
+  /** Unmaps all resources and drops the context's
+   *  reference to its mapping cache */
+  static void detach(
+          ID3D11DeviceContext*      pContext);
+
+  /** Drops mappings as necessary to stay within the limits.
+   *  Must be called before each copy that uses the cache. */
+  void beginCopy();
+
+  /** Maps a subresource, or returns the existing mapping if
+   *  the subresource is still mapped with the same map type.
+   *  An existing mapping with a different type is dropped. */
+  HRESULT map(
+          ID3D11Resource*           pResource,
+          UINT                      Subresource,
+          D3D11_MAP                 MapType,
+          UINT                      MapFlags,
+          D3D11_MAPPED_SUBRESOURCE* pMapped);
+
+  /** Checks whether a subresource is currently kept
+   *  mapped with the given map type */
+  bool isMapped(
+          ID3D11Resource*           pResource,
+          UINT                      Subresource,
+          D3D11_MAP                 MapType) const;
+
+  /** Unmaps all subresources of the given resource that are
+   *  kept mapped. Must be called before the resource is used
+   *  in any other way. */
+  void invalidate(
+          ID3D11Resource*           pResource);
+
+  /** Unmaps all resources */
+  void invalidateAll();
+
+private:
+
+  struct Entry {
+    ID3D11Resource*           resource;
+    UINT                      subresource;
+    D3D11_MAP                 mapType;
+    D3D11_MAPPED_SUBRESOURCE  mapped;
+  };
+
+  std::atomic<ULONG>    m_refCount = { 0u };
+
+  ID3D11DeviceContext*  m_context;
+  std::vector<Entry>    m_entries;
+  uint32_t              m_mapCount = 0u;
+
+  void unmap(
+    const Entry&                    Mapping);
+
+};
+
+}
@@ -0,0 +1,216 @@
+#include <algorithm>
+#include <numeric>
+
+#include "pacing.h"
+
+namespace atfix {
+
+static const GUID IID_FramePacer = {0x1f6c2e94,0x7a3d,0x4b85,{0x9c,0x0e,0x5b,0xd1,0x26,0x8a,0xf3,0x47}};
+
+FramePacer::FramePacer(
+        IDXGISwapChain*           pSwapChain) {
+  auto config = getConfig();
+
+  if (config->MaxFrameLatency)
+    setupFrameLatency(pSwapChain, config->MaxFrameLatency);
+
+  if (config->FrameRateLimit > 0.0) {
+    m_frameInterval = std::chrono::duration_cast<clock::duration>(
+      std::chrono::duration<double>(1.0 / config->FrameRateLimit));
+
+    /* High-resolution timers are only supported on Windows 10 1803
+     * and newer, fall back to spinning if they are not available. */
+    m_timer = CreateWaitableTimerExW(nullptr, nullptr,
+      CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+
+    log("Frame pacer: Limiting frame rate to ", config->FrameRateLimit, " FPS",
+      m_timer ? "" : " (no high-resolution timer)");
+  }
+
+  m_statsInterval = config->FrameStatsInterval;
+  m_frameTimes.reserve(m_statsInterval);
+}
+
+
+FramePacer::~FramePacer() {
+  if (m_timer)
+    CloseHandle(m_timer);
+}
+
+
+HRESULT STDMETHODCALLTYPE FramePacer::QueryInterface(
+        REFIID                    riid,
+        void**                    ppvObject) {
+  if (!ppvObject)
+    return E_POINTER;
+
+  *ppvObject = nullptr;
+
+  if (riid == __uuidof(IUnknown)) {
+    AddRef();
+    *ppvObject = static_cast<IUnknown*>(this);
+    return S_OK;
+  }
+
+  return E_NOINTERFACE;
+}
+
+
+ULONG STDMETHODCALLTYPE FramePacer::AddRef() {
+  return ++m_refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE FramePacer::Release() {
+  ULONG refCount = --m_refCount;
+
+  if (!refCount)
+    delete this;
+
+  return refCount;
+}
+
+
+FramePacer* FramePacer::get(
+        IDXGISwapChain*           pSwapChain) {
+  static mutex s_mutex;
+  std::lock_guard lock(s_mutex);
+
+  FramePacer* pacer = nullptr;
+  UINT size = sizeof(pacer);
+
+  /* The swap chain holds a reference to the pacer, so the
+   * one returned by GetPrivateData can be dropped */
+  if (SUCCEEDED(pSwapChain->GetPrivateData(IID_FramePacer, &size, &pacer))) {
+    pacer->Release();
+    return pacer;
+  }
+
+  pacer = new FramePacer(pSwapChain);
+  pSwapChain->SetPrivateDataInterface(IID_FramePacer, pacer);
+  return pacer;
+}
+
+
+void FramePacer::beginPresent() {
+  if (m_frameInterval == clock::duration::zero())
+    return;
+
+  auto now = clock::now();
+
+  /* Don't try to catch up if we fell behind by more
+   * than a frame, that would just cause stutter. */
+  if (m_nextDeadline + m_frameInterval < now)
+    m_nextDeadline = now;
+  else
+    sleepUntil(m_nextDeadline);
+
+  m_nextDeadline += m_frameInterval;
+}
+
+
+void FramePacer::endPresent() {
+  if (m_statsInterval)
+    recordFrameTime(clock::now());
+}
+
+
+void FramePacer::setupFrameLatency(
+        IDXGISwapChain*           pSwapChain,
+        uint32_t                  MaxFrameLatency) {
+  DXGI_SWAP_CHAIN_DESC desc = { };
+  pSwapChain->GetDesc(&desc);
+
+  /* Swap chains created with a frame latency waitable object ignore
+   * the device frame latency. The game waits on that object itself,
+   * so only change the latency and never wait on it here, since
+   * waiting twice per frame would throttle the game even further. */
+  IDXGISwapChain2* swapChain2 = nullptr;
+
+  if ((desc.Flags & DXGI_SWAP_CHAIN_FLAG_FRAME_LATENCY_WAITABLE_OBJECT)
+   && SUCCEEDED(pSwapChain->QueryInterface(IID_PPV_ARGS(&swapChain2)))) {
+    HRESULT hr = swapChain2->SetMaximumFrameLatency(MaxFrameLatency);
+    swapChain2->Release();
+
+    if (SUCCEEDED(hr)) {
+      log("Frame pacer: Set swap chain frame latency to ", MaxFrameLatency);
+      return;
+    }
+
+    log("Frame pacer: Failed to set swap chain frame latency, hr 0x", std::hex, hr);
+  }
+
+  IDXGIDevice1* device = nullptr;
+
+  if (FAILED(pSwapChain->GetDevice(IID_PPV_ARGS(&device)))) {
+    log("Frame pacer: IDXGIDevice1 not supported");
+    return;
+  }
+
+  HRESULT hr = device->SetMaximumFrameLatency(MaxFrameLatency);
+  device->Release();
+
+  if (SUCCEEDED(hr))
+    log("Frame pacer: Set device frame latency to ", MaxFrameLatency);
+  else
+    log("Frame pacer: Failed to set device frame latency, hr 0x", std::hex, hr);
+}
+
+
+void FramePacer::sleepUntil(
+        clock::time_point         Deadline) {
+  /* Sleep until shortly before the deadline, then spin
+   * for the remaining time to compensate for timer slack */
+  constexpr auto SpinThreshold = std::chrono::microseconds(1000);
+
+  auto now = clock::now();
+
+  if (m_timer && now + SpinThreshold < Deadline) {
+    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(Deadline - now - SpinThreshold);
+
+    LARGE_INTEGER dueTime;
+    dueTime.QuadPart = -int64_t(duration.count() / 100);
+
+    if (SetWaitableTimer(m_timer, &dueTime, 0, nullptr, nullptr, FALSE))
+      WaitForSingleObject(m_timer, INFINITE);
+  }
+
+  while (clock::now() < Deadline)
+    YieldProcessor();
+}
+
+
+void FramePacer::recordFrameTime(
+        clock::time_point         Now) {
+  if (m_lastPresent != clock::time_point()) {
+    auto frameTime = std::chrono::duration<float, std::milli>(Now - m_lastPresent);
+    m_frameTimes.push_back(frameTime.count());
+
+    if (m_frameTimes.size() >= m_statsInterval) {
+      logFrameStats();
+      m_frameTimes.clear();
+    }
+  }
+
+  m_lastPresent = Now;
+}
+
+
+void FramePacer::logFrameStats() {
+  std::sort(m_frameTimes.begin(), m_frameTimes.end());
+
+  auto percentile = [this] (double p) {
+    size_t index = size_t(p * double(m_frameTimes.size() - 1));
+    return m_frameTimes[index];
+  };
+
+  float sum = std::accumulate(m_frameTimes.begin(), m_frameTimes.end(), 0.0f);
+  float avg = sum / float(m_frameTimes.size());
+
+  log("Frame times (ms) over ", m_frameTimes.size(), " frames: avg ", avg,
+    ", p50 ", percentile(0.50), ", p90 ", percentile(0.90),
+    ", p99 ", percentile(0.99), ", max ", m_frameTimes.back(),
+    " (", 1000.0f / avg, " FPS)");
+}
+
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <dxgi1_3.h>
+
+#include <chrono>
+#include <vector>
+
+#include "config.h"
+#include "impl.h"
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief Frame pacer
+ *
+ * With most GPU sync points gone, the game can queue up several
+ * frames ahead of the GPU, which increases input latency and can
+ * lead to uneven frame pacing. The frame pacer limits the number
+ * of queued frames, can optionally limit the frame rate, and logs
+ * frame time statistics.
+ *
+ * The frame latency is applied to the swap chain if it was created
+ * with a frame latency waitable object, and to the DXGI device
+ * otherwise. The pacer never waits on the waitable object itself,
+ * since the game already does that.
+ *
+ * One frame pacer is created per swap chain and attached to it as
+ * private data, so that it gets destroyed along with the swap chain.
+ */
+class FramePacer final : public IUnknown {
+
+public:
+
+  using clock = std::chrono::steady_clock;
+
+  FramePacer(
+          IDXGISwapChain*           pSwapChain);
+
+  ~FramePacer();
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(
+          REFIID                    riid,
+          void**                    ppvObject);
+
+  ULONG STDMETHODCALLTYPE AddRef();
+
+  ULONG STDMETHODCALLTYPE Release();
+
+  /** Retrieves frame pacer for the given swap chain,
+   *  and creates it if necessary. */
+  static FramePacer* get(
+          IDXGISwapChain*           pSwapChain);
+
+  /** Called right before the game presents. Runs the
+   *  frame rate limiter if enabled. */
+  void beginPresent();
+
+  /** Called right after the game presented.
+   *  Records frame times if enabled. */
+  void endPresent();
+
+private:
+
+  std::atomic<ULONG>        m_refCount      = { 0u };
+
+  HANDLE                    m_timer         = nullptr;
+
+  clock::duration           m_frameInterval = clock::duration::zero();
+  clock::time_point         m_nextDeadline  = clock::time_point();
+  clock::time_point         m_lastPresent   = clock::time_point();
+
+  uint32_t                  m_statsInterval = 0u;
+  std::vector<float>        m_frameTimes;
+
+  void setupFrameLatency(
+          IDXGISwapChain*           pSwapChain,
+          uint32_t                  MaxFrameLatency);
+
+  void sleepUntil(
+          clock::time_point         Deadline);
+
+  void recordFrameTime(
+          clock::time_point         Now);
+
+  void logFrameStats();
+
+};
+
+}
@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cstring>
+
+#include "pool.h"
+
+namespace atfix {
+
+/* Maximum number of idle resources per description. The game
+ * only creates a handful of them per frame, so anything beyond
+ * this is most likely a one-off that we shouldn't hold on to. */
+constexpr uint32_t MaxFreeEntriesPerDesc = 4;
+
+/* Maximum number of resources tracked by the pool */
+constexpr uint32_t MaxEntries = 256;
+
+/* Number of frames after which idle resources are dropped */
+constexpr uint64_t MaxIdleFrames = 120;
+
+bool isSameDesc(
+  const ATFIX_POOL_DESC*          pA,
+  const ATFIX_POOL_DESC*          pB) {
+  return !std::memcmp(pA, pB, sizeof(*pA));
+}
+
+
+StagingPool& StagingPool::get() {
+  static StagingPool s_pool;
+  return s_pool;
+}
+
+
+ID3D11Resource* StagingPool::acquire(
+        ID3D11Device*             pDevice,
+  const ATFIX_POOL_DESC*          pDesc) {
+  std::lock_guard lock(m_mutex);
+
+  for (auto r = m_free.begin(); r != m_free.end(); r++) {
+    Entry& entry = m_entries.at(*r);
+
+    if (entry.device != pDevice || !isSameDesc(&entry.desc, pDesc))
+      continue;
+
+    if (entry.timeline && !entry.timeline->isComplete(entry.timelineValue))
+      continue;
+
+    ID3D11Resource* resource = *r;
+    m_free.erase(r);
+
+    entry.free = false;
+    resource->AddRef();
+    return resource;
+  }
+
+  return nullptr;
+}
+
+
+void StagingPool::track(
+        ID3D11Device*             pDevice,
+        ID3D11Resource*           pResource,
+  const ATFIX_POOL_DESC*          pDesc) {
+  std::lock_guard lock(m_mutex);
+
+  if (m_entries.size() >= MaxEntries)
+    return;
+
+  ID3D11DeviceContext* context = nullptr;
+  pDevice->GetImmediateContext(&context);
+
+  Entry entry = { };
+  entry.device = pDevice;
+  entry.timeline = GpuTimeline::get(context);
+  entry.desc = *pDesc;
+  entry.free = false;
+
+  entry.timeline->AddRef();
+  context->Release();
+
+  /* The pool's reference keeps the resource alive
+   * after the game released it */
+  pResource->AddRef();
+  addInternalDeviceRefs(pDevice, 1);
+
+  m_entries.emplace(pResource, entry);
+  m_count.store(m_entries.size());
+}
+
+
+bool StagingPool::recycle(
+        ID3D11Resource*           pResource) {
+  Entry evicted = { };
+
+  { std::lock_guard lock(m_mutex);
+
+    auto entry = m_entries.find(pResource);
+
+    if (entry == m_entries.end() || entry->second.free)
+      return false;
+
+    if (countFreeEntries(&entry->second.desc) < MaxFreeEntriesPerDesc) {
+      /* Any work the game submitted for the resource so far
+       * will complete once the next timeline value is reached */
+      entry->second.free = true;
+      entry->second.freeFrame = m_frameId;
+      entry->second.timelineValue = entry->second.timeline
+        ? entry->second.timeline->getNextValue()
+        : 0ull;
+
+      m_free.push_back(pResource);
+      return true;
+    }
+
+    evicted = entry->second;
+    m_entries.erase(entry);
+    m_count.store(m_entries.size());
+  }
+
+  /* This will go through the Release hook again, so
+   * it must not happen while holding the lock. */
+  releaseEntry(pResource, evicted);
+  return true;
+}
+
+
+void StagingPool::releaseDevice(
+        ID3D11Device*             pDevice) {
+  std::vector<std::pair<ID3D11Resource*, Entry>> evicted;
+
+  { std::lock_guard lock(m_mutex);
+
+    /* Resources that are still in use belong to the game
+     * now, so only the pool's own reference is dropped */
+    for (auto e = m_entries.begin(); e != m_entries.end(); ) {
+      if (e->second.device == pDevice) {
+        evicted.push_back(*e);
+        e = m_entries.erase(e);
+      } else {
+        e++;
+      }
+    }
+
+    m_free.erase(std::remove_if(m_free.begin(), m_free.end(),
+      [this] (ID3D11Resource* r) { return !m_entries.count(r); }), m_free.end());
+    m_count.store(m_entries.size());
+  }
+
+  for (const auto& e : evicted)
+    releaseEntry(e.first, e.second);
+}
+
+
+void StagingPool::endFrame() {
+  std::vector<std::pair<ID3D11Resource*, Entry>> evicted;
+
+  { std::lock_guard lock(m_mutex);
+    m_frameId += 1;
+
+    /* Idle resources are ordered by the frame they were released in */
+    size_t count = 0;
+
+    while (count < m_free.size()
+        && m_entries.at(m_free[count]).freeFrame + MaxIdleFrames < m_frameId) {
+      auto entry = m_entries.find(m_free[count]);
+      evicted.push_back(*entry);
+      m_entries.erase(entry);
+      count++;
+    }
+
+    if (!count)
+      return;
+
+    m_free.erase(m_free.begin(), m_free.begin() + count);
+    m_count.store(m_entries.size());
+  }
+
+  for (const auto& e : evicted)
+    releaseEntry(e.first, e.second);
+}
+
+
+uint32_t StagingPool::countFreeEntries(
+  const ATFIX_POOL_DESC*          pDesc) const {
+  uint32_t count = 0;
+
+  for (ID3D11Resource* resource : m_free) {
+    if (isSameDesc(&m_entries.at(resource).desc, pDesc))
+      count++;
+  }
+
+  return count;
+}
+
+
+void StagingPool::releaseEntry(
+        ID3D11Resource*           pResource,
+  const Entry&                    Evicted) {
+  addInternalDeviceRefs(Evicted.device, -1);
+
+  Evicted.timeline->Release();
+  pResource->Release();
+}
+
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <d3d11.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "config.h"
+#include "impl.h"
+#include "timeline.h"
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief Staging resource description
+ *
+ * Used as the key for pooled resources. Must be zero-initialized
+ * before filling in the description so that it can be compared
+ * with \c memcmp.
+ */
+struct ATFIX_POOL_DESC {
+  D3D11_RESOURCE_DIMENSION Dim;
+  union {
+    D3D11_BUFFER_DESC    Buffer;
+    D3D11_TEXTURE1D_DESC Texture1D;
+    D3D11_TEXTURE2D_DESC Texture2D;
+    D3D11_TEXTURE3D_DESC Texture3D;
+  };
+};
+
+/**
+ * \brief Staging resource pool
+ *
+ * The game creates and destroys staging resources every frame, right
+ * before using them. Instead of destroying them, the pool keeps a
+ * reference to each staging resource it created, and hooks \c Release
+ * so that it can take the resource back once the game dropped its last
+ * reference. Subsequent creation requests with the same description
+ * are then served from the pool.
+ *
+ * Resources are only reused once the GPU timeline passed the value
+ * that was current when the game released them, so that mapping a
+ * recycled resource does not stall on work the game submitted for
+ * its previous incarnation.
+ *
+ * Idle resources that are not reused within a number of frames are
+ * dropped, and so are all resources of a device once the game has
+ * released that device. Since pooled resources keep the device alive,
+ * each of them counts as an internal reference to the device, see
+ * \c addInternalDeviceRefs.
+ *
+ * Note that recycled resources keep their previous contents and any
+ * private data the game may have set. Resources that atfix creates
+ * for itself bypass the device hooks and are never pooled.
+ */
+class StagingPool {
+
+public:
+
+  /** Retrieves the global staging pool */
+  static StagingPool& get();
+
+  /** Checks whether any resources are tracked at all. Used
+   *  to skip all pool logic in \c Release hooks. */
+  bool isEmpty() const {
+    return !m_count.load();
+  }
+
+  /** Looks for an idle resource with the given description and
+   *  returns it with a reference for the caller, or \c nullptr
+   *  if no suitable resource is available. */
+  ID3D11Resource* acquire(
+          ID3D11Device*             pDevice,
+    const ATFIX_POOL_DESC*          pDesc);
+
+  /** Adds a newly created resource to the pool. The resource
+   *  is considered in use until the game releases it. */
+  void track(
+          ID3D11Device*             pDevice,
+          ID3D11Resource*           pResource,
+    const ATFIX_POOL_DESC*          pDesc);
+
+  /** Must be called from \c Release hooks when the reference
+   *  count dropped to 1. Returns \c true if the resource was
+   *  returned to the pool, in which case the hook should report
+   *  a reference count of 0 to the game. */
+  bool recycle(
+          ID3D11Resource*           pResource);
+
+  /** Drops the pool's references to all resources of the
+   *  given device. Called once the game released the device. */
+  void releaseDevice(
+          ID3D11Device*             pDevice);
+
+  /** Starts a new frame and drops resources that
+   *  have not been reused for a while */
+  void endFrame();
+
+private:
+
+  struct Entry {
+    ID3D11Device*   device;
+    GpuTimeline*    timeline;
+    ATFIX_POOL_DESC desc;
+    uint64_t        timelineValue;
+    uint64_t        freeFrame;
+    bool            free;
+  };
+
+  mutex                   m_mutex;
+  std::atomic<uint32_t>   m_count = { 0u };
+  uint64_t                m_frameId = 0ull;
+
+  std::unordered_map<ID3D11Resource*, Entry> m_entries;
+
+  /* Idle resources, in the order in which they were released */
+  std::vector<ID3D11Resource*> m_free;
+
+  uint32_t countFreeEntries(
+    const ATFIX_POOL_DESC*          pDesc) const;
+
+  static void releaseEntry(
+          ID3D11Resource*           pResource,
+    const Entry&                    Evicted);
+
+};
+
+}
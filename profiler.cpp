@@ -0,0 +1,342 @@
+#include <algorithm>
+
+#include "config.h"
+#include "profiler.h"
+
+namespace atfix {
+
+static const GUID IID_GpuProfiler = {0x3b9e5d17,0xa6c2,0x4f81,{0x9d,0x4e,0x27,0x81,0xc0,0x5a,0xe3,0x6b}};
+static const GUID IID_ProfilerResourceId = {0x8c41f2a6,0x1d7b,0x4e93,{0xb5,0x0c,0x6e,0x93,0x2a,0xd4,0x17,0xf8}};
+
+/* Number of resources listed per report */
+constexpr size_t MaxReportedResources = 8;
+
+/* Timestamp queries issued per frame before samples get dropped */
+constexpr size_t MaxQueriesPerFrame = 4096;
+
+/* Frames waiting to be resolved before the oldest one gets dropped */
+constexpr size_t MaxPendingFrames = 16;
+
+const char* getDimensionName(
+        D3D11_RESOURCE_DIMENSION  Dim) {
+  switch (Dim) {
+    case D3D11_RESOURCE_DIMENSION_BUFFER:     return "buffer";
+    case D3D11_RESOURCE_DIMENSION_TEXTURE1D:  return "tex1d";
+    case D3D11_RESOURCE_DIMENSION_TEXTURE2D:  return "tex2d";
+    case D3D11_RESOURCE_DIMENSION_TEXTURE3D:  return "tex3d";
+    default:                                  return "unknown";
+  }
+}
+
+
+GpuProfiler::GpuProfiler(
+        ID3D11DeviceContext*      pContext,
+        uint32_t                  Interval)
+: m_context(pContext), m_interval(Interval) {
+  /* The context keeps the device alive, and a reference
+   * held here would keep it alive past the context */
+  pContext->GetDevice(&m_device);
+  m_device->Release();
+
+  log("GPU profiler: Reporting copy times every ", m_interval, " frames");
+}
+
+
+GpuProfiler::~GpuProfiler() {
+  m_pending.push_back(std::move(m_frame));
+
+  for (auto& frame : m_pending)
+    recycleQueries(frame);
+
+  addInternalDeviceRefs(m_device, -int32_t(m_queryCount));
+
+  for (ID3D11Query* query : m_timestampQueries)
+    query->Release();
+
+  for (ID3D11Query* query : m_disjointQueries)
+    query->Release();
+}
+
+
+HRESULT STDMETHODCALLTYPE GpuProfiler::QueryInterface(
+        REFIID                    riid,
+        void**                    ppvObject) {
+  if (!ppvObject)
+    return E_POINTER;
+
+  *ppvObject = nullptr;
+
+  if (riid == __uuidof(IUnknown)) {
+    AddRef();
+    *ppvObject = static_cast<IUnknown*>(this);
+    return S_OK;
+  }
+
+  return E_NOINTERFACE;
+}
+
+
+ULONG STDMETHODCALLTYPE GpuProfiler::AddRef() {
+  return ++m_refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE GpuProfiler::Release() {
+  ULONG refCount = --m_refCount;
+
+  if (!refCount)
+    delete this;
+
+  return refCount;
+}
+
+
+GpuProfiler* GpuProfiler::get(
+        ID3D11DeviceContext*      pContext) {
+  static mutex s_mutex;
+  std::lock_guard lock(s_mutex);
+
+  GpuProfiler* profiler = nullptr;
+  UINT size = sizeof(profiler);
+
+  /* The context holds a reference to the profiler, so the
+   * one returned by GetPrivateData can be dropped */
+  if (SUCCEEDED(pContext->GetPrivateData(IID_GpuProfiler, &size, &profiler))) {
+    if (profiler)
+      profiler->Release();
+    return profiler;
+  }
+
+  uint32_t interval = getConfig()->GpuProfileInterval;
+
+  if (interval)
+    profiler = new GpuProfiler(pContext, interval);
+
+  /* Also store null pointer so we don't try again */
+  if (profiler)
+    pContext->SetPrivateDataInterface(IID_GpuProfiler, profiler);
+  else
+    pContext->SetPrivateData(IID_GpuProfiler, sizeof(profiler), &profiler);
+
+  return profiler;
+}
+
+
+void GpuProfiler::detach(
+        ID3D11DeviceContext*      pContext) {
+  pContext->SetPrivateData(IID_GpuProfiler, 0, nullptr);
+}
+
+
+void GpuProfiler::beginCopies() {
+  if (m_frame.queries.size() >= MaxQueriesPerFrame)
+    return;
+
+  /* Timestamps are only meaningful within a disjoint query */
+  if (!m_frame.disjoint) {
+    m_frame.disjoint = allocQuery(D3D11_QUERY_TIMESTAMP_DISJOINT);
+
+    if (!m_frame.disjoint)
+      return;
+
+    m_context->Begin(m_frame.disjoint);
+  }
+
+  m_lastQuery = allocQuery(D3D11_QUERY_TIMESTAMP);
+
+  if (m_lastQuery) {
+    forwardEnd(m_context, m_lastQuery);
+    m_frame.queries.push_back(m_lastQuery);
+  }
+}
+
+
+void GpuProfiler::endCopy(
+        ID3D11Resource*           pSrcResource) {
+  if (m_frame.queries.size() >= MaxQueriesPerFrame) {
+    m_droppedCount += 1;
+    m_lastQuery = nullptr;
+    return;
+  }
+
+  if (!m_lastQuery)
+    return;
+
+  ID3D11Query* query = allocQuery(D3D11_QUERY_TIMESTAMP);
+
+  if (!query)
+    return;
+
+  forwardEnd(m_context, query);
+  m_frame.queries.push_back(query);
+
+  /* The previous timestamp is always the last one issued */
+  Sample sample = { };
+  sample.begin = m_frame.queries.size() - 2;
+  sample.end = m_frame.queries.size() - 1;
+  sample.resourceId = getResourceId(pSrcResource);
+  getResourceInfo(pSrcResource, &sample.info);
+
+  m_frame.samples.push_back(sample);
+  m_lastQuery = query;
+}
+
+
+void GpuProfiler::endFrame() {
+  if (m_frame.disjoint)
+    forwardEnd(m_context, m_frame.disjoint);
+
+  m_pending.push_back(std::move(m_frame));
+  m_frame = Frame();
+  m_lastQuery = nullptr;
+
+  /* Don't keep queries around indefinitely if the GPU never
+   * reports them as available. Reusing a query that may still
+   * be in flight is fine, its result just gets replaced. */
+  if (m_pending.size() > MaxPendingFrames) {
+    m_droppedCount += m_pending.front().samples.size();
+    recycleQueries(m_pending.front());
+    m_pending.pop_front();
+  }
+
+  /* Frames complete in order, so stop at the first one
+   * whose queries are not available yet */
+  while (!m_pending.empty() && resolveFrame(m_pending.front())) {
+    recycleQueries(m_pending.front());
+    m_pending.pop_front();
+
+    if (m_frameCount >= m_interval)
+      writeStats();
+  }
+}
+
+
+ID3D11Query* GpuProfiler::allocQuery(
+        D3D11_QUERY               Type) {
+  auto& pool = Type == D3D11_QUERY_TIMESTAMP
+    ? m_timestampQueries
+    : m_disjointQueries;
+
+  if (!pool.empty()) {
+    ID3D11Query* query = pool.back();
+    pool.pop_back();
+    return query;
+  }
+
+  D3D11_QUERY_DESC desc = { };
+  desc.Query = Type;
+
+  ID3D11Query* query = nullptr;
+
+  if (SUCCEEDED(m_device->CreateQuery(&desc, &query))) {
+    addInternalDeviceRefs(m_device, 1);
+    m_queryCount += 1;
+  } else {
+    log("GPU profiler: Failed to create query");
+    query = nullptr;
+  }
+
+  return query;
+}
+
+
+void GpuProfiler::recycleQueries(
+        Frame&                    frame) {
+  if (frame.disjoint)
+    m_disjointQueries.push_back(frame.disjoint);
+
+  for (ID3D11Query* query : frame.queries)
+    m_timestampQueries.push_back(query);
+}
+
+
+uint64_t GpuProfiler::getResourceId(
+        ID3D11Resource*           pResource) {
+  static std::atomic<uint64_t> s_nextId = { 0u };
+
+  uint64_t id = 0u;
+  UINT size = sizeof(id);
+
+  if (SUCCEEDED(pResource->GetPrivateData(IID_ProfilerResourceId, &size, &id)))
+    return id;
+
+  id = ++s_nextId;
+  pResource->SetPrivateData(IID_ProfilerResourceId, sizeof(id), &id);
+  return id;
+}
+
+
+bool GpuProfiler::resolveFrame(
+        Frame&                    frame) {
+  if (frame.disjoint) {
+    D3D11_QUERY_DATA_TIMESTAMP_DISJOINT disjoint = { };
+
+    if (forwardGetData(m_context, frame.disjoint, &disjoint, sizeof(disjoint), D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK)
+      return false;
+
+    std::vector<UINT64> timestamps(frame.queries.size());
+
+    for (size_t i = 0; i < frame.queries.size(); i++) {
+      if (forwardGetData(m_context, frame.queries[i], &timestamps[i], sizeof(UINT64), D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK)
+        return false;
+    }
+
+    if (disjoint.Disjoint || !disjoint.Frequency) {
+      m_disjointCount += 1;
+      return true;
+    }
+
+    double frameMs = 0.0;
+
+    for (const auto& sample : frame.samples) {
+      UINT64 ticks = timestamps[sample.end] - timestamps[sample.begin];
+      double ms = 1000.0 * double(ticks) / double(disjoint.Frequency);
+      frameMs += ms;
+
+      auto& entry = m_resources[sample.resourceId];
+      entry.info = sample.info;
+      entry.copies += 1;
+      entry.ms += ms;
+    }
+
+    m_totalMs += frameMs;
+    m_maxMs = std::max(m_maxMs, frameMs);
+  }
+
+  m_frameCount += 1;
+  return true;
+}
+
+
+void GpuProfiler::writeStats() {
+  log("GPU profiler: Copies took ", m_totalMs / double(m_frameCount), " ms/frame avg, ",
+    m_maxMs, " ms max over ", m_frameCount, " frames",
+    ", ", m_disjointCount, " disjoint frames skipped, ", m_droppedCount, " samples dropped");
+
+  std::vector<std::pair<uint64_t, ResourceTime>> resources(m_resources.begin(), m_resources.end());
+
+  std::sort(resources.begin(), resources.end(), [] (const auto& a, const auto& b) {
+    return a.second.ms > b.second.ms;
+  });
+
+  if (resources.size() > MaxReportedResources)
+    resources.resize(MaxReportedResources);
+
+  for (const auto& r : resources) {
+    log("GPU profiler:   Resource #", r.first,
+      " (", getDimensionName(r.second.info.Dim), ", ",
+      r.second.info.Width, "x", r.second.info.Height, "x", r.second.info.Depth,
+      ", format ", r.second.info.Format, "): ",
+      r.second.ms / double(m_frameCount), " ms/frame, ",
+      double(r.second.copies) / double(m_frameCount), " copies/frame");
+  }
+
+  m_resources.clear();
+  m_frameCount = 0u;
+  m_disjointCount = 0u;
+  m_droppedCount = 0u;
+  m_totalMs = 0.0;
+  m_maxMs = 0.0;
+}
+
+}
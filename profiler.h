@@ -0,0 +1,143 @@
+#pragma once
+
+#include <d3d11.h>
+
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include "impl.h"
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief GPU profiler
+ *
+ * Measures GPU time spent on copies that atfix issues through the
+ * copy queue, i.e. shadow resource updates, initial shadow copies
+ * and copies that fell back to the GPU. A timestamp query is issued
+ * before each burst of copies and after each individual copy, so
+ * that the time between two timestamps can be attributed to the
+ * source resource of the copy.
+ *
+ * Queries are pooled and resolved without flushing a few frames
+ * later, so profiling never stalls the render thread. Frames for
+ * which the GPU reports disjoint timestamps are ignored. Results
+ * are written to the log at a configurable frame interval.
+ *
+ * The number of queries per frame and the number of frames waiting
+ * to be resolved are capped, so that a missed frame boundary can't
+ * grow them without bound. Samples past either cap are dropped and
+ * counted in the report. Resources are identified by an ID stored
+ * as private data rather than by address, since the address of a
+ * released resource may be reused before its samples get resolved.
+ *
+ * Note that timestamps between copies also include any GPU work
+ * that the game issued right before a flush and that was still
+ * running, so numbers are an upper bound.
+ *
+ * One profiler is created per immediate context if enabled, and is
+ * attached to it as private data. Queries of frames that were not
+ * resolved yet are dropped when the profiler is destroyed. Must only
+ * be used from the thread that owns the immediate context.
+ */
+class GpuProfiler final : public IUnknown {
+
+public:
+
+  GpuProfiler(
+          ID3D11DeviceContext*      pContext,
+          uint32_t                  Interval);
+
+  ~GpuProfiler();
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(
+          REFIID                    riid,
+          void**                    ppvObject);
+
+  ULONG STDMETHODCALLTYPE AddRef();
+
+  ULONG STDMETHODCALLTYPE Release();
+
+  /** Retrieves GPU profiler for the given immediate context,
+   *  and creates it if necessary. Returns \c nullptr if the
+   *  profiler is disabled. */
+  static GpuProfiler* get(
+          ID3D11DeviceContext*      pContext);
+
+  /** Drops the context's reference to its GPU profiler */
+  static void detach(
+          ID3D11DeviceContext*      pContext);
+
+  /** Issues timestamp before a burst of copies */
+  void beginCopies();
+
+  /** Issues timestamp after a copy from the given resource */
+  void endCopy(
+          ID3D11Resource*           pSrcResource);
+
+  /** Ends the current frame and resolves previous frames
+   *  whose queries have become available. */
+  void endFrame();
+
+private:
+
+  struct Sample {
+    size_t              begin;
+    size_t              end;
+    uint64_t            resourceId;
+    ATFIX_RESOURCE_INFO info;
+  };
+
+  struct Frame {
+    ID3D11Query*              disjoint = nullptr;
+    std::vector<ID3D11Query*> queries;
+    std::vector<Sample>       samples;
+  };
+
+  struct ResourceTime {
+    ATFIX_RESOURCE_INFO info;
+    uint64_t            copies;
+    double              ms;
+  };
+
+  std::atomic<ULONG>        m_refCount  = { 0u };
+
+  ID3D11Device*             m_device    = nullptr;
+  ID3D11DeviceContext*      m_context   = nullptr;
+  uint32_t                  m_interval  = 0u;
+  uint32_t                  m_queryCount = 0u;
+
+  Frame                     m_frame;
+  ID3D11Query*              m_lastQuery = nullptr;
+  std::deque<Frame>         m_pending;
+
+  std::vector<ID3D11Query*> m_timestampQueries;
+  std::vector<ID3D11Query*> m_disjointQueries;
+
+  std::unordered_map<uint64_t, ResourceTime> m_resources;
+
+  uint32_t                  m_frameCount    = 0u;
+  uint32_t                  m_disjointCount = 0u;
+  uint64_t                  m_droppedCount  = 0u;
+  double                    m_totalMs       = 0.0;
+  double                    m_maxMs         = 0.0;
+
+  ID3D11Query* allocQuery(
+          D3D11_QUERY               Type);
+
+  void recycleQueries(
+          Frame&                    frame);
+
+  static uint64_t getResourceId(
+          ID3D11Resource*           pResource);
+
+  bool resolveFrame(
+          Frame&                    frame);
+
+  void writeStats();
+
+};
+
+}
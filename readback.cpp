@@ -0,0 +1,534 @@
+#include <algorithm>
+#include <cstring>
+
+#include "config.h"
+#include "readback.h"
+
+namespace atfix {
+
+static const GUID IID_ReadbackWorker = {0x3b2ac1f4,0x6d10,0x4c57,{0x9e,0x2b,0x71,0x0c,0x5d,0x88,0x4a,0x13}};
+
+/* Number of frames after the last read during which
+ * updates to a shadow are still read back eagerly */
+constexpr uint64_t MaxReadbackIdleFrames = 8u;
+
+ShadowCache::ShadowCache(
+        ReadbackWorker*           pWorker,
+        CopyStrategy*             pStrategy,
+  const ATFIX_RESOURCE_INFO*      pInfo)
+: m_worker(pWorker), m_strategy(pStrategy), m_info(*pInfo),
+  m_subresourceCount(pInfo->Mips * pInfo->Layers),
+  m_subresources(new Subresource[pInfo->Mips * pInfo->Layers]) {
+  m_worker->AddRef();
+  m_strategy->AddRef();
+
+  /* Shadows are created when the game reads from a resource */
+  markRead();
+}
+
+
+ShadowCache::~ShadowCache() {
+  m_strategy->Release();
+  m_worker->Release();
+}
+
+
+HRESULT STDMETHODCALLTYPE ShadowCache::QueryInterface(
+        REFIID                    riid,
+        void**                    ppvObject) {
+  if (!ppvObject)
+    return E_POINTER;
+
+  *ppvObject = nullptr;
+
+  if (riid == __uuidof(IUnknown)) {
+    AddRef();
+    *ppvObject = static_cast<IUnknown*>(this);
+    return S_OK;
+  }
+
+  return E_NOINTERFACE;
+}
+
+
+ULONG STDMETHODCALLTYPE ShadowCache::AddRef() {
+  return ++m_refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE ShadowCache::Release() {
+  ULONG refCount = --m_refCount;
+
+  if (!refCount)
+    delete this;
+
+  return refCount;
+}
+
+
+void ShadowCache::markRead() {
+  m_lastReadFrame = m_strategy->getFrameId();
+}
+
+
+bool ShadowCache::isReadRecently() const {
+  return m_strategy->getFrameId() - m_lastReadFrame.load() <= MaxReadbackIdleFrames;
+}
+
+
+void ShadowCache::invalidate(
+        UINT                      Subresource) {
+  /* Set the frame first so that it is never older
+   * than the version that readers observe */
+  uint64_t frame = m_strategy->getFrameId();
+
+  if (Subresource == ~0u) {
+    for (uint32_t i = 0; i < m_subresourceCount; i++) {
+      m_subresources[i].versionFrame = frame;
+      m_subresources[i].version += 1;
+    }
+  } else if (Subresource < m_subresourceCount) {
+    m_subresources[Subresource].versionFrame = frame;
+    m_subresources[Subresource].version += 1;
+  }
+}
+
+
+void ShadowCache::disable() {
+  m_enabled = false;
+}
+
+
+bool ShadowCache::isStale(
+        UINT                      Subresource) const {
+  const auto& sr = m_subresources[Subresource];
+  return m_enabled && sr.cachedVersion != sr.version.load();
+}
+
+
+uint64_t ShadowCache::getVersion(
+        UINT                      Subresource) const {
+  return m_subresources[Subresource].version.load();
+}
+
+
+uint64_t ShadowCache::getVersionFrame(
+        UINT                      Subresource) const {
+  return m_subresources[Subresource].versionFrame.load();
+}
+
+
+void ShadowCache::store(
+        UINT                      Subresource,
+        uint64_t                  Version,
+        uint64_t                  Frame,
+  const D3D11_MAPPED_SUBRESOURCE* pMapped) {
+  auto& sr = m_subresources[Subresource];
+
+  size_t size = m_info.Width;
+
+  if (m_info.Dim != D3D11_RESOURCE_DIMENSION_BUFFER) {
+    D3D11_BOX box = getResourceBox(&m_info, Subresource);
+
+    /* Mapped block-compressed data has one row per block row */
+    uint32_t rows = isBlockCompressedFormat(m_info.Format)
+      ? (box.bottom + 3u) / 4u
+      : box.bottom;
+
+    size = size_t(box.back - 1) * pMapped->DepthPitch
+         + size_t(rows)         * pMapped->RowPitch;
+  }
+
+  /* Don't overwrite data that is still referenced elsewhere */
+  if (!sr.data || sr.data.use_count() > 1)
+    sr.data = std::make_shared<std::vector<char>>();
+
+  sr.data->resize(size);
+  std::memcpy(sr.data->data(), pMapped->pData, size);
+
+  sr.rowPitch = pMapped->RowPitch;
+  sr.depthPitch = pMapped->DepthPitch;
+  sr.cachedVersion = Version;
+  sr.cachedFrame = Frame;
+}
+
+
+bool ShadowCache::getData(
+        UINT                      Subresource,
+        D3D11_MAPPED_SUBRESOURCE* pData) const {
+  if (Subresource >= m_subresourceCount || isStale(Subresource) || !m_enabled)
+    return false;
+
+  const auto& sr = m_subresources[Subresource];
+  pData->pData = sr.data->data();
+  pData->RowPitch = sr.rowPitch;
+  pData->DepthPitch = sr.depthPitch;
+  return true;
+}
+
+
+bool ShadowCache::getDataRef(
+        UINT                      Subresource,
+        ATFIX_CACHED_DATA*        pData) const {
+  if (Subresource >= m_subresourceCount || isStale(Subresource) || !m_enabled)
+    return false;
+
+  const auto& sr = m_subresources[Subresource];
+  pData->Data = sr.data;
+  pData->RowPitch = sr.rowPitch;
+  pData->DepthPitch = sr.depthPitch;
+  return true;
+}
+
+
+bool ShadowCache::getSnapshot(
+        UINT                      Subresource,
+        D3D11_MAPPED_SUBRESOURCE* pData,
+        uint64_t*                 pFrame) const {
+  if (Subresource >= m_subresourceCount || !m_enabled)
+    return false;
+
+  const auto& sr = m_subresources[Subresource];
+
+  if (!sr.cachedVersion.load())
+    return false;
+
+  pData->pData = sr.data->data();
+  pData->RowPitch = sr.rowPitch;
+  pData->DepthPitch = sr.depthPitch;
+
+  *pFrame = sr.cachedFrame;
+  return true;
+}
+
+
+ReadbackWorker::ReadbackWorker(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Multithread*        pMultithread,
+        GpuTimeline*              pTimeline)
+: m_context(pContext), m_multithread(pMultithread), m_timeline(pTimeline) {
+  m_timeline->AddRef();
+  m_thread = CreateThread(nullptr, 0, &threadProc, this, 0, &m_threadId);
+}
+
+
+ReadbackWorker::~ReadbackWorker() {
+  CloseHandle(m_thread);
+  m_timeline->Release();
+}
+
+
+HRESULT STDMETHODCALLTYPE ReadbackWorker::QueryInterface(
+        REFIID                    riid,
+        void**                    ppvObject) {
+  if (!ppvObject)
+    return E_POINTER;
+
+  *ppvObject = nullptr;
+
+  if (riid == __uuidof(IUnknown)) {
+    AddRef();
+    *ppvObject = static_cast<IUnknown*>(this);
+    return S_OK;
+  }
+
+  return E_NOINTERFACE;
+}
+
+
+ULONG STDMETHODCALLTYPE ReadbackWorker::AddRef() {
+  return ++m_refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE ReadbackWorker::Release() {
+  ULONG refCount = --m_refCount;
+
+  if (refCount)
+    return refCount;
+
+  std::unique_lock lock(m_mutex);
+  m_stopped = true;
+  m_cond.notify_one();
+
+  /* Releasing a job on the worker thread may destroy the device
+   * and with it the worker, in which case the thread cannot join
+   * itself, and deletes the worker once it returns instead. */
+  if (GetCurrentThreadId() == m_threadId) {
+    m_detached = true;
+    return 0;
+  }
+
+  lock.unlock();
+
+  WaitForSingleObject(m_thread, INFINITE);
+  delete this;
+  return 0;
+}
+
+
+ReadbackWorker* ReadbackWorker::get(
+        ID3D11DeviceContext*      pContext) {
+  static mutex s_mutex;
+  std::lock_guard lock(s_mutex);
+
+  ReadbackWorker* worker = nullptr;
+  UINT size = sizeof(worker);
+
+  /* The context holds a reference to the worker, so the
+   * one returned by GetPrivateData can be dropped */
+  if (SUCCEEDED(pContext->GetPrivateData(IID_ReadbackWorker, &size, &worker))) {
+    if (worker)
+      worker->Release();
+    return worker;
+  }
+
+  ID3D11Multithread* multithread = nullptr;
+
+  if (SUCCEEDED(pContext->QueryInterface(IID_PPV_ARGS(&multithread)))) {
+    /* Enabling protection adds locking overhead to every
+     * context call, so only do that if the user allows it */
+    bool isProtected = multithread->GetMultithreadProtected();
+
+    if (!isProtected && getConfig()->ReadbackThread) {
+      multithread->SetMultithreadProtected(TRUE);
+      isProtected = true;
+    }
+
+    /* The worker must not keep the context alive */
+    if (isProtected)
+      worker = new ReadbackWorker(pContext, multithread, GpuTimeline::get(pContext));
+    else
+      log("Readback worker: Context is not multithread-protected");
+
+    multithread->Release();
+  } else {
+    log("Readback worker: ID3D11Multithread not supported");
+  }
+
+  if (worker)
+    pContext->SetPrivateDataInterface(IID_ReadbackWorker, worker);
+  else
+    pContext->SetPrivateData(IID_ReadbackWorker, sizeof(worker), &worker);
+
+  return worker;
+}
+
+
+void ReadbackWorker::detach(
+        ID3D11DeviceContext*      pContext) {
+  pContext->SetPrivateData(IID_ReadbackWorker, 0, nullptr);
+}
+
+
+void ReadbackWorker::scheduleReadback(
+        ID3D11Resource*           pShadowResource,
+        UINT                      Offset,
+        ShadowCache*              pCache,
+        uint64_t                  TimelineValue) {
+  Job job = { };
+  job.shadow = pShadowResource;
+  job.offset = Offset;
+  job.cache = pCache;
+  job.timelineValue = TimelineValue;
+
+  job.shadow->AddRef();
+  job.cache->AddRef();
+
+  std::lock_guard lock(m_mutex);
+  m_jobs.push_back(job);
+  m_cond.notify_one();
+}
+
+
+void ReadbackWorker::gatherJobs(
+        std::deque<Job>&          Jobs) {
+  ID3D11Resource* shadow = m_batch.front().shadow;
+
+  for (auto job = Jobs.begin(); job != Jobs.end(); ) {
+    if (job->shadow != shadow || !m_timeline->isComplete(job->timelineValue)) {
+      job++;
+      continue;
+    }
+
+    /* Reading back the same shadow twice is pointless */
+    bool isDuplicate = std::any_of(m_batch.begin(), m_batch.end(),
+      [cache = job->cache] (const Job& j) { return j.cache == cache; });
+
+    if (isDuplicate) {
+      job->shadow->Release();
+      job->cache->Release();
+    } else {
+      m_batch.push_back(*job);
+    }
+
+    job = Jobs.erase(job);
+  }
+}
+
+
+void ReadbackWorker::processBatch() {
+  uint32_t subresourceCount = 0;
+
+  for (const auto& job : m_batch)
+    subresourceCount = std::max(subresourceCount, job.cache->getSubresourceCount());
+
+  bool busy = false;
+
+  for (uint32_t i = 0; i < subresourceCount; i++) {
+    /* The render thread may map the shadow resource for a short
+     * time, so retry a few times before giving up. Giving up is
+     * fine since the render thread will just map it instead. */
+    for (uint32_t attempt = 0; attempt < 16; attempt++) {
+      if (readbackSubresource(i, &busy))
+        break;
+
+      SwitchToThread();
+    }
+  }
+
+  /* If the resource is still in use by writes to other shadows
+   * in the same arena buffer, hold the jobs back. Each of those
+   * writes comes with a job of its own, which picks them up. */
+  for (const auto& job : m_batch) {
+    if (busy) {
+      m_deferred.push_back(job);
+    } else {
+      job.shadow->Release();
+      job.cache->Release();
+    }
+  }
+
+  m_batch.clear();
+}
+
+
+bool ReadbackWorker::readbackSubresource(
+        UINT                      Subresource,
+        bool*                     pBusy) {
+  ID3D11Resource* shadow = m_batch.front().shadow;
+
+  /* If a newer write to a shadow is pending, we will get to it
+   * when processing the next job, so don't bother mapping. This
+   * has to be checked per shadow rather than per resource since
+   * shadows in an arena share their resource. */
+  auto needsReadback = [this, Subresource] (const Job& job) {
+    return Subresource < job.cache->getSubresourceCount()
+        && job.cache->isStale(Subresource)
+        && m_timeline->isComplete(job.cache->getTimelineValue());
+  };
+
+  if (std::none_of(m_batch.begin(), m_batch.end(), needsReadback))
+    return true;
+
+  /* Lock order matters here: The render thread locks the cache
+   * first and then enters the runtime, so we must not block on
+   * the cache while holding the multithread lock. */
+  m_multithread->Enter();
+
+  bool complete = true;
+
+  for (const auto& job : m_batch) {
+    if (!needsReadback(job))
+      continue;
+
+    if (!job.cache->try_lock()) {
+      complete = false;
+      continue;
+    }
+
+    /* Writes to the shadow bump the version after being tracked
+     * on the timeline, so capturing the version before mapping is
+     * conservative. The write itself may still be sitting in the
+     * copy queue though, so check again whether the shadow is idle
+     * at that version, or we'd cache stale data. Read the frame
+     * before the version, so that it can only be older than the
+     * frame the data was actually written in. */
+    Readback readback = { };
+    readback.job = &job;
+    readback.frame = job.cache->getVersionFrame(Subresource);
+    readback.version = job.cache->getVersion(Subresource);
+
+    if (m_timeline->isComplete(job.cache->getTimelineValue()))
+      m_readbacks.push_back(readback);
+    else
+      job.cache->unlock();
+  }
+
+  if (!m_readbacks.empty()) {
+    /* Bypass the Map hook since flushing the
+     * queue is up to the render thread */
+    D3D11_MAPPED_SUBRESOURCE mapped = { };
+    HRESULT hr = forwardMap(m_context, shadow, Subresource, D3D11_MAP_READ, D3D11_MAP_FLAG_DO_NOT_WAIT, &mapped);
+
+    if (SUCCEEDED(hr)) {
+      for (const auto& readback : m_readbacks) {
+        D3D11_MAPPED_SUBRESOURCE data = mapped;
+        data.pData = ptroffset(mapped.pData, readback.job->offset);
+
+        readback.job->cache->store(Subresource, readback.version, readback.frame, &data);
+      }
+
+      forwardUnmap(m_context, shadow, Subresource);
+    } else if (hr == DXGI_ERROR_WAS_STILL_DRAWING) {
+      *pBusy |= !m_timeline->isResourceIdle(shadow);
+    } else {
+      log("Readback worker: Failed to map shadow resource, hr 0x", std::hex, hr);
+    }
+
+    for (const auto& readback : m_readbacks)
+      readback.job->cache->unlock();
+
+    m_readbacks.clear();
+  }
+
+  m_multithread->Leave();
+  return complete;
+}
+
+
+void ReadbackWorker::run() {
+  while (true) {
+    { std::unique_lock lock(m_mutex);
+      m_cond.wait(lock, [this] { return m_stopped || !m_jobs.empty(); });
+
+      /* Pending jobs hold references to the device, so
+       * there can't be any if the worker is destroyed */
+      if (m_stopped)
+        return;
+
+      m_batch.push_back(m_jobs.front());
+      m_jobs.pop_front();
+    }
+
+    m_timeline->wait(m_batch.front().timelineValue);
+
+    /* Writes to shadows in the same arena buffer are usually
+     * issued back to back, so take any other queued jobs for
+     * the same resource that are ready as well, along with jobs
+     * that were held back because the resource was busy. */
+    { std::lock_guard lock(m_mutex);
+      gatherJobs(m_jobs);
+    }
+
+    gatherJobs(m_deferred);
+    processBatch();
+  }
+}
+
+
+DWORD WINAPI ReadbackWorker::threadProc(LPVOID pParam) {
+  auto worker = reinterpret_cast<ReadbackWorker*>(pParam);
+  worker->run();
+
+  std::unique_lock lock(worker->m_mutex);
+  bool detached = worker->m_detached;
+  lock.unlock();
+
+  if (detached)
+    delete worker;
+
+  return 0;
+}
+
+}
@@ -0,0 +1,314 @@
+#pragma once
+
+#include <d3d11_4.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "impl.h"
+#include "strategy.h"
+#include "timeline.h"
+#include "util.h"
+
+namespace atfix {
+
+class ReadbackWorker;
+
+/**
+ * \brief Reference to cached subresource data
+ *
+ * Keeps the data alive and unchanged even if the cache is updated
+ * in the meantime, since the cache allocates new storage for the
+ * subresource rather than overwriting data that is referenced.
+ */
+struct ATFIX_CACHED_DATA {
+  std::shared_ptr<const std::vector<char>> Data;
+  UINT RowPitch;
+  UINT DepthPitch;
+};
+
+/**
+ * \brief CPU-side copy of a shadow resource
+ *
+ * Referenced by the shadow it belongs to. Stores the contents of
+ * each subresource as they were read back by the readback worker,
+ * so that copying from a shadow resource to a CPU-writable resource
+ * does not have to map the shadow resource on the render thread.
+ *
+ * Each subresource has a version that gets bumped \e after a write
+ * to the shadow resource was issued. Cached data is only valid if
+ * it was read back at the current version. Outdated data is kept
+ * as a snapshot, along with the frame in which it was written, for
+ * resources where the user allows reading stale data.
+ *
+ * Shadows are only read back while the game keeps reading from
+ * them, so that resources that are shadowed but rarely copied to
+ * staging resources do not cost a readback on every update.
+ *
+ * The object itself is locked while the shadow resource is mapped,
+ * either by the render thread or by the readback worker.
+ */
+class ShadowCache final : public IUnknown {
+
+public:
+
+  ShadowCache(
+          ReadbackWorker*           pWorker,
+          CopyStrategy*             pStrategy,
+    const ATFIX_RESOURCE_INFO*      pInfo);
+
+  ~ShadowCache();
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(
+          REFIID                    riid,
+          void**                    ppvObject);
+
+  ULONG STDMETHODCALLTYPE AddRef();
+
+  ULONG STDMETHODCALLTYPE Release();
+
+  void lock() {
+    m_mutex.lock();
+  }
+
+  void unlock() {
+    m_mutex.unlock();
+  }
+
+  bool try_lock() {
+    return m_mutex.try_lock();
+  }
+
+  ReadbackWorker* getWorker() const {
+    return m_worker;
+  }
+
+  const ATFIX_RESOURCE_INFO* getInfo() const {
+    return &m_info;
+  }
+
+  uint32_t getSubresourceCount() const {
+    return m_subresourceCount;
+  }
+
+  /** Sets timeline value of the last write to the shadow.
+   *  Shadows in an arena share their buffer with others, so
+   *  whether the shadow itself is idle must be checked with
+   *  this value rather than the value of the resource. */
+  void setTimelineValue(
+          uint64_t                  TimelineValue) {
+    m_timelineValue = TimelineValue;
+  }
+
+  /** Returns timeline value of the last write to the shadow */
+  uint64_t getTimelineValue() const {
+    return m_timelineValue.load();
+  }
+
+  /** Records that the game read from the shadow in the
+   *  current frame, either from cached data or not */
+  void markRead();
+
+  /** Checks whether the game read from the shadow recently
+   *  enough that updates should be read back eagerly */
+  bool isReadRecently() const;
+
+  /** Invalidates cached data of a subresource, or all
+   *  subresources if \c Subresource is \c ~0u. Must be
+   *  called after the write to the shadow was issued. */
+  void invalidate(
+          UINT                      Subresource);
+
+  /** Permanently disables caching. Used when the shadow
+   *  resource is written on a deferred context, since we
+   *  cannot know when those writes will execute. */
+  void disable();
+
+  /** Checks whether a subresource needs to be read back */
+  bool isStale(
+          UINT                      Subresource) const;
+
+  /** Returns current version of a subresource */
+  uint64_t getVersion(
+          UINT                      Subresource) const;
+
+  /** Returns frame in which the current version
+   *  of a subresource was written */
+  uint64_t getVersionFrame(
+          UINT                      Subresource) const;
+
+  /** Stores data read back from the mapped shadow
+   *  resource. Object must be locked by the caller. */
+  void store(
+          UINT                      Subresource,
+          uint64_t                  Version,
+          uint64_t                  Frame,
+    const D3D11_MAPPED_SUBRESOURCE* pMapped);
+
+  /** Retrieves cached subresource data if it is up to date.
+   *  Object must be locked for as long as the returned
+   *  pointer is in use. */
+  bool getData(
+          UINT                      Subresource,
+          D3D11_MAPPED_SUBRESOURCE* pData) const;
+
+  /** Retrieves a reference to cached subresource data if it
+   *  is up to date. Unlike \c getData, the data stays valid
+   *  after the object is unlocked. Object must be locked. */
+  bool getDataRef(
+          UINT                      Subresource,
+          ATFIX_CACHED_DATA*        pData) const;
+
+  /** Retrieves the most recent data that was read back,
+   *  even if it is outdated, as well as the frame in which
+   *  it was written. Object must be locked for as long as
+   *  the returned pointer is in use. */
+  bool getSnapshot(
+          UINT                      Subresource,
+          D3D11_MAPPED_SUBRESOURCE* pData,
+          uint64_t*                 pFrame) const;
+
+private:
+
+  struct Subresource {
+    std::atomic<uint64_t> version       = { 1ull };
+    std::atomic<uint64_t> versionFrame  = { 0ull };
+    std::atomic<uint64_t> cachedVersion = { 0ull };
+    uint64_t              cachedFrame   = 0ull;
+    std::shared_ptr<std::vector<char>> data;
+    UINT                  rowPitch      = 0u;
+    UINT                  depthPitch    = 0u;
+  };
+
+  std::atomic<ULONG>              m_refCount = { 0u };
+  std::atomic<bool>               m_enabled  = { true };
+  std::atomic<uint64_t>           m_timelineValue = { 0ull };
+  std::atomic<uint64_t>           m_lastReadFrame = { 0ull };
+
+  mutex                           m_mutex;
+
+  ReadbackWorker*                 m_worker;
+  CopyStrategy*                   m_strategy;
+  ATFIX_RESOURCE_INFO             m_info;
+
+  uint32_t                        m_subresourceCount;
+  std::unique_ptr<Subresource[]>  m_subresources;
+
+};
+
+
+/**
+ * \brief Readback worker
+ *
+ * Waits for shadow resource writes to complete on the GPU and
+ * copies the shadow resource contents into the shadow cache, so
+ * that the blocking map on the render thread is avoided.
+ *
+ * Queued jobs for the same shadow resource are processed together,
+ * so that shadows that share an arena buffer can be read back with
+ * a single \c Map. If the arena buffer is busy with writes to other
+ * shadows, jobs are held back until a later job for the same buffer
+ * gets processed.
+ *
+ * GPU progress is tracked with the GPU timeline of the context.
+ * Mapping the shadow resources from the worker thread relies on
+ * the immediate context being multithread-protected, so the worker
+ * is not available on runtimes without \c ID3D11Multithread, and
+ * only used if the game enabled protection or the user allows
+ * atfix to do so.
+ *
+ * One worker is created per immediate context and attached to it
+ * as private data, without holding a reference to the context.
+ * Shadow caches keep the worker alive as well, and the worker keeps
+ * the GPU timeline alive. Once the last reference is gone, the
+ * worker thread is stopped and joined.
+ */
+class ReadbackWorker final : public IUnknown {
+
+public:
+
+  ReadbackWorker(
+          ID3D11DeviceContext*      pContext,
+          ID3D11Multithread*        pMultithread,
+          GpuTimeline*              pTimeline);
+
+  ~ReadbackWorker();
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(
+          REFIID                    riid,
+          void**                    ppvObject);
+
+  ULONG STDMETHODCALLTYPE AddRef();
+
+  ULONG STDMETHODCALLTYPE Release();
+
+  /** Retrieves readback worker for the given immediate context,
+   *  and creates it if necessary. Returns \c nullptr if the
+   *  runtime does not support background readbacks. */
+  static ReadbackWorker* get(
+          ID3D11DeviceContext*      pContext);
+
+  /** Drops the context's reference to its worker */
+  static void detach(
+          ID3D11DeviceContext*      pContext);
+
+  /** Schedules a readback of all stale subresources of the
+   *  shadow at the given offset within the shadow resource,
+   *  once the given timeline value has completed. Must be
+   *  called from the thread that owns the immediate context. */
+  void scheduleReadback(
+          ID3D11Resource*           pShadowResource,
+          UINT                      Offset,
+          ShadowCache*              pCache,
+          uint64_t                  TimelineValue);
+
+private:
+
+  struct Job {
+    ID3D11Resource* shadow;
+    UINT            offset;
+    ShadowCache*    cache;
+    uint64_t        timelineValue;
+  };
+
+  struct Readback {
+    const Job*      job;
+    uint64_t        version;
+    uint64_t        frame;
+  };
+
+  std::atomic<ULONG>        m_refCount    = { 0u };
+
+  ID3D11DeviceContext*      m_context     = nullptr;
+  ID3D11Multithread*        m_multithread = nullptr;
+  GpuTimeline*              m_timeline    = nullptr;
+  HANDLE                    m_thread      = nullptr;
+  DWORD                     m_threadId    = 0u;
+
+  mutex                     m_mutex;
+  condition_variable        m_cond;
+  std::deque<Job>           m_jobs;
+  bool                      m_stopped     = false;
+  bool                      m_detached    = false;
+
+  std::vector<Job>          m_batch;
+  std::deque<Job>           m_deferred;
+  std::vector<Readback>     m_readbacks;
+
+  void gatherJobs(
+          std::deque<Job>&          Jobs);
+
+  void processBatch();
+
+  bool readbackSubresource(
+          UINT                      Subresource,
+          bool*                     pBusy);
+
+  void run();
+
+  static DWORD WINAPI threadProc(LPVOID pParam);
+
+};
+
+}
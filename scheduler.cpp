@@ -0,0 +1,162 @@
+#include <algorithm>
+
+#include "config.h"
+#include "scheduler.h"
+
+namespace atfix {
+
+static const GUID IID_SubmitScheduler = {0x6e2a94c3,0xd5b1,0x4c7f,{0x82,0x0d,0x4b,0xf9,0x13,0x6a,0xe5,0x28}};
+
+/* Bounds for how long before a predicted read to flush */
+constexpr auto MinLeadTime = std::chrono::microseconds(500);
+constexpr auto MaxLeadTime = std::chrono::microseconds(4000);
+
+/* Flushing has a fixed cost in the driver, so don't do
+ * it more often than this even if reads are clustered */
+constexpr auto MinFlushInterval = std::chrono::microseconds(1000);
+constexpr uint32_t MaxFlushesPerFrame = 8u;
+
+/* Reads recorded per frame, far more than games
+ * normally issue within a single frame */
+constexpr size_t MaxReadsPerFrame = 256u;
+
+
+SubmitScheduler::SubmitScheduler()
+: m_frameStart(clock::now()), m_leadTime(MinLeadTime) {
+  m_statsInterval = getConfig()->FrameStatsInterval;
+}
+
+
+HRESULT STDMETHODCALLTYPE SubmitScheduler::QueryInterface(
+        REFIID                    riid,
+        void**                    ppvObject) {
+  if (!ppvObject)
+    return E_POINTER;
+
+  *ppvObject = nullptr;
+
+  if (riid == __uuidof(IUnknown)) {
+    AddRef();
+    *ppvObject = static_cast<IUnknown*>(this);
+    return S_OK;
+  }
+
+  return E_NOINTERFACE;
+}
+
+
+ULONG STDMETHODCALLTYPE SubmitScheduler::AddRef() {
+  return ++m_refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE SubmitScheduler::Release() {
+  ULONG refCount = --m_refCount;
+
+  if (!refCount)
+    delete this;
+
+  return refCount;
+}
+
+
+SubmitScheduler* SubmitScheduler::get(
+        ID3D11DeviceContext*      pContext) {
+  static mutex s_mutex;
+  std::lock_guard lock(s_mutex);
+
+  SubmitScheduler* scheduler = nullptr;
+  UINT size = sizeof(scheduler);
+
+  /* The context holds a reference to the scheduler, so the
+   * one returned by GetPrivateData can be dropped */
+  if (SUCCEEDED(pContext->GetPrivateData(IID_SubmitScheduler, &size, &scheduler))) {
+    if (scheduler)
+      scheduler->Release();
+    return scheduler;
+  }
+
+  if (getConfig()->EarlyFlush)
+    scheduler = new SubmitScheduler();
+
+  /* Also store null pointer so we don't try again */
+  if (scheduler)
+    pContext->SetPrivateDataInterface(IID_SubmitScheduler, scheduler);
+  else
+    pContext->SetPrivateData(IID_SubmitScheduler, sizeof(scheduler), &scheduler);
+
+  return scheduler;
+}
+
+
+void SubmitScheduler::detach(
+        ID3D11DeviceContext*      pContext) {
+  pContext->SetPrivateData(IID_SubmitScheduler, 0, nullptr);
+}
+
+
+bool SubmitScheduler::shouldFlush() {
+  auto now = clock::now();
+  auto offset = now - m_frameStart;
+
+  skipPastReads(offset);
+
+  if (m_nextRead >= m_predictedReads.size())
+    return false;
+
+  if (m_frameFlushes >= MaxFlushesPerFrame || now - m_lastFlush < MinFlushInterval)
+    return false;
+
+  if (m_predictedReads[m_nextRead] - offset > m_leadTime)
+    return false;
+
+  m_lastFlush = now;
+  m_frameFlushes += 1;
+  m_totalFlushes += 1;
+  return true;
+}
+
+
+void SubmitScheduler::recordRead(
+        clock::duration           WaitTime) {
+  if (m_reads.size() < MaxReadsPerFrame)
+    m_reads.push_back(clock::now() - m_frameStart);
+
+  m_maxWaitTime = std::max(m_maxWaitTime, WaitTime);
+}
+
+
+void SubmitScheduler::endFrame() {
+  auto now = clock::now();
+
+  /* Reads are recorded in order, so the list stays sorted */
+  m_predictedReads.swap(m_reads);
+  m_reads.clear();
+  m_nextRead = 0u;
+
+  /* Waiting for the GPU at all means the last flush was late,
+   * so give the GPU as much time as the longest wait took */
+  m_leadTime = std::clamp<clock::duration>(m_maxWaitTime, MinLeadTime, MaxLeadTime);
+  m_maxWaitTime = clock::duration::zero();
+
+  m_frameFlushes = 0u;
+  m_frameStart = now;
+
+  uint64_t frameId = ++m_frameId;
+
+  if (m_statsInterval && !(frameId % m_statsInterval) && m_totalFlushes) {
+    log("Submit scheduler: ", m_totalFlushes, " early flushes in the last ", m_statsInterval, " frames",
+      ", lead time: ", std::chrono::duration_cast<std::chrono::microseconds>(m_leadTime).count(), " us");
+
+    m_totalFlushes = 0u;
+  }
+}
+
+
+void SubmitScheduler::skipPastReads(
+        clock::duration           Offset) {
+  while (m_nextRead < m_predictedReads.size() && m_predictedReads[m_nextRead] < Offset)
+    m_nextRead++;
+}
+
+}
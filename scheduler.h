@@ -0,0 +1,105 @@
+#pragma once
+
+#include <d3d11.h>
+
+#include <chrono>
+#include <vector>
+
+#include "impl.h"
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief Submission scheduler
+ *
+ * Decides when to flush the immediate context after atfix issued
+ * copies that the CPU will wait for later, i.e. shadow resource
+ * updates and GPU copies to staging resources. Without a flush,
+ * the driver may hold on to those copies until the game maps a
+ * resource, at which point the GPU only just received the work
+ * that the CPU is about to wait for.
+ *
+ * Games read back resources at roughly the same points in each
+ * frame, so the scheduler records when blocking reads happen
+ * relative to the start of the frame, and flushes if the next
+ * read predicted from the previous frame is due soon. The lead
+ * time is derived from how long reads had to wait for the GPU.
+ * Flushes are rate-limited so that driver overhead stays low.
+ *
+ * Frames end at Present, or at the next Map if the game has not
+ * presented in a while. Only the first few reads of each frame are
+ * recorded, so that a missed frame boundary can't grow the list
+ * without bound.
+ *
+ * One scheduler is created per immediate context if enabled, and
+ * is attached to it as private data. Must only be used from the
+ * thread that owns the immediate context.
+ */
+class SubmitScheduler final : public IUnknown {
+
+public:
+
+  using clock = std::chrono::steady_clock;
+
+  SubmitScheduler();
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(
+          REFIID                    riid,
+          void**                    ppvObject);
+
+  ULONG STDMETHODCALLTYPE AddRef();
+
+  ULONG STDMETHODCALLTYPE Release();
+
+  /** Retrieves scheduler for the given immediate context,
+   *  and creates it if necessary. Returns \c nullptr if
+   *  early flushes are disabled. */
+  static SubmitScheduler* get(
+          ID3D11DeviceContext*      pContext);
+
+  /** Drops the context's reference to its scheduler */
+  static void detach(
+          ID3D11DeviceContext*      pContext);
+
+  /** Checks whether the context should be flushed now,
+   *  after work that the CPU will wait for was issued.
+   *  Assumes that the caller flushes if this succeeds. */
+  bool shouldFlush();
+
+  /** Records a read of a CPU-accessible resource, along
+   *  with the time the read had to wait for the GPU */
+  void recordRead(
+          clock::duration           WaitTime);
+
+  /** Ends the current frame and makes its reads the
+   *  prediction for the next frame */
+  void endFrame();
+
+private:
+
+  std::atomic<ULONG>            m_refCount = { 0u };
+
+  clock::time_point             m_frameStart;
+  clock::time_point             m_lastFlush;
+
+  std::vector<clock::duration>  m_reads;
+  std::vector<clock::duration>  m_predictedReads;
+  size_t                        m_nextRead    = 0u;
+
+  clock::duration               m_waitTime    = clock::duration::zero();
+  clock::duration               m_maxWaitTime = clock::duration::zero();
+  clock::duration               m_leadTime;
+
+  uint32_t                      m_frameFlushes = 0u;
+
+  uint32_t                      m_statsInterval = 0u;
+  uint64_t                      m_frameId       = 0u;
+  uint64_t                      m_totalFlushes  = 0u;
+
+  void skipPastReads(
+          clock::duration           Offset);
+
+};
+
+}
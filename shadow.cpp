@@ -0,0 +1,398 @@
+#include "shadow.h"
+#include "trace.h"
+
+namespace atfix {
+
+static const GUID IID_ShadowWorker = {0x6a1f0c37,0xd84e,0x4b62,{0x93,0x0d,0x27,0xe5,0xbc,0x41,0x8f,0x76}};
+
+/* Shared by all shadow sets so that generations are unique */
+static std::atomic<uint64_t> s_nextGeneration = { 1ull };
+
+void releaseShadow(
+  const ATFIX_SHADOW*               pShadow) {
+  if (pShadow->Resource)
+    pShadow->Resource->Release();
+
+  if (pShadow->Arena)
+    pShadow->Arena->Release();
+
+  if (pShadow->Cache)
+    pShadow->Cache->Release();
+
+  if (pShadow->Stats)
+    pShadow->Stats->Release();
+}
+
+void destroyShadow(
+  const ATFIX_SHADOW*               pShadow) {
+  if (pShadow->Arena && pShadow->Resource)
+    pShadow->Arena->free(pShadow->Resource, pShadow->Offset);
+
+  releaseShadow(pShadow);
+}
+
+
+ShadowSet::ShadowSet(
+        uint32_t                  SubresourceCount)
+: m_entries(SubresourceCount),
+  m_generations(new std::atomic<uint64_t>[SubresourceCount]) {
+  markWritten(~0u);
+}
+
+
+ShadowSet::~ShadowSet() {
+  for (const Entry& entry : m_entries) {
+    destroyShadow(&entry.shadow);
+
+    if (entry.published)
+      entry.published->Release();
+  }
+}
+
+
+HRESULT STDMETHODCALLTYPE ShadowSet::QueryInterface(
+        REFIID                    riid,
+        void**                    ppvObject) {
+  if (!ppvObject)
+    return E_POINTER;
+
+  *ppvObject = nullptr;
+
+  if (riid == __uuidof(IUnknown)) {
+    AddRef();
+    *ppvObject = static_cast<IUnknown*>(this);
+    return S_OK;
+  }
+
+  return E_NOINTERFACE;
+}
+
+
+ULONG STDMETHODCALLTYPE ShadowSet::AddRef() {
+  return ++m_refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE ShadowSet::Release() {
+  ULONG refCount = --m_refCount;
+
+  if (!refCount)
+    delete this;
+
+  return refCount;
+}
+
+
+bool ShadowSet::getShadow(
+        UINT                      Subresource,
+        ATFIX_SHADOW*             pShadow) {
+  std::lock_guard lock(m_mutex);
+
+  if (Subresource >= m_entries.size() || !m_entries[Subresource].shadow.Resource)
+    return false;
+
+  *pShadow = m_entries[Subresource].shadow;
+  pShadow->Resource->AddRef();
+
+  if (pShadow->Arena)
+    pShadow->Arena->AddRef();
+
+  if (pShadow->Cache)
+    pShadow->Cache->AddRef();
+
+  if (pShadow->Stats)
+    pShadow->Stats->AddRef();
+
+  return true;
+}
+
+
+void ShadowSet::setShadow(
+        UINT                      Subresource,
+  const ATFIX_SHADOW*             pShadow) {
+  std::lock_guard lock(m_mutex);
+
+  if (Subresource >= m_entries.size())
+    return;
+
+  Entry& entry = m_entries[Subresource];
+  destroyShadow(&entry.shadow);
+
+  entry.shadow = *pShadow;
+
+  if (entry.shadow.Resource)
+    entry.shadow.Resource->AddRef();
+
+  if (entry.shadow.Arena)
+    entry.shadow.Arena->AddRef();
+
+  if (entry.shadow.Cache)
+    entry.shadow.Cache->AddRef();
+
+  if (entry.shadow.Stats)
+    entry.shadow.Stats->AddRef();
+}
+
+
+void ShadowSet::clear() {
+  std::lock_guard lock(m_mutex);
+
+  for (Entry& entry : m_entries) {
+    destroyShadow(&entry.shadow);
+    entry.shadow = ATFIX_SHADOW { };
+
+    if (entry.published)
+      entry.published->Release();
+
+    entry.published = nullptr;
+  }
+}
+
+
+bool ShadowSet::beginCreation(
+        UINT                      Subresource) {
+  std::lock_guard lock(m_mutex);
+
+  if (Subresource >= m_entries.size())
+    return false;
+
+  Entry& entry = m_entries[Subresource];
+
+  if (entry.pending || entry.published || entry.failed)
+    return false;
+
+  entry.pending = true;
+  return true;
+}
+
+
+void ShadowSet::publishShadow(
+        UINT                      Subresource,
+        ID3D11Resource*           pShadowResource) {
+  std::lock_guard lock(m_mutex);
+
+  if (Subresource >= m_entries.size())
+    return;
+
+  Entry& entry = m_entries[Subresource];
+
+  if (pShadowResource)
+    pShadowResource->AddRef();
+
+  if (entry.published)
+    entry.published->Release();
+
+  entry.published = pShadowResource;
+  entry.pending = false;
+  entry.failed = !pShadowResource;
+}
+
+
+bool ShadowSet::isCreationFailed(
+        UINT                      Subresource) {
+  std::lock_guard lock(m_mutex);
+
+  return Subresource < m_entries.size()
+    && m_entries[Subresource].failed;
+}
+
+
+void ShadowSet::markWritten(
+        UINT                      Subresource) {
+  if (Subresource == ~0u) {
+    for (uint32_t i = 0; i < m_entries.size(); i++)
+      m_generations[i] = s_nextGeneration++;
+  } else if (Subresource < m_entries.size()) {
+    m_generations[Subresource] = s_nextGeneration++;
+  }
+}
+
+
+uint64_t ShadowSet::getGeneration(
+        UINT                      Subresource) const {
+  return Subresource < m_entries.size()
+    ? m_generations[Subresource].load()
+    : 0ull;
+}
+
+
+ID3D11Resource* ShadowSet::takePublishedShadow(
+        UINT                      Subresource) {
+  std::lock_guard lock(m_mutex);
+
+  if (Subresource >= m_entries.size())
+    return nullptr;
+
+  Entry& entry = m_entries[Subresource];
+
+  ID3D11Resource* shadow = entry.published;
+  entry.published = nullptr;
+  return shadow;
+}
+
+
+ShadowWorker::ShadowWorker(
+        ID3D11Device*             pDevice)
+: m_device(pDevice) {
+  m_thread = CreateThread(nullptr, 0, &threadProc, this, 0, &m_threadId);
+}
+
+
+ShadowWorker::~ShadowWorker() {
+  CloseHandle(m_thread);
+}
+
+
+HRESULT STDMETHODCALLTYPE ShadowWorker::QueryInterface(
+        REFIID                    riid,
+        void**                    ppvObject) {
+  if (!ppvObject)
+    return E_POINTER;
+
+  *ppvObject = nullptr;
+
+  if (riid == __uuidof(IUnknown)) {
+    AddRef();
+    *ppvObject = static_cast<IUnknown*>(this);
+    return S_OK;
+  }
+
+  return E_NOINTERFACE;
+}
+
+
+ULONG STDMETHODCALLTYPE ShadowWorker::AddRef() {
+  return ++m_refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE ShadowWorker::Release() {
+  ULONG refCount = --m_refCount;
+
+  if (refCount)
+    return refCount;
+
+  std::unique_lock lock(m_mutex);
+  m_stopped = true;
+  m_cond.notify_one();
+
+  /* Releasing a job on the worker thread may destroy the device
+   * and with it the worker, in which case the thread cannot join
+   * itself, and deletes the worker once it returns instead. */
+  if (GetCurrentThreadId() == m_threadId) {
+    m_detached = true;
+    return 0;
+  }
+
+  lock.unlock();
+
+  WaitForSingleObject(m_thread, INFINITE);
+  delete this;
+  return 0;
+}
+
+
+ShadowWorker* ShadowWorker::get(
+        ID3D11DeviceContext*      pContext) {
+  static mutex s_mutex;
+  std::lock_guard lock(s_mutex);
+
+  ShadowWorker* worker = nullptr;
+  UINT size = sizeof(worker);
+
+  /* The context holds a reference to the worker, so the
+   * one returned by GetPrivateData can be dropped */
+  if (SUCCEEDED(pContext->GetPrivateData(IID_ShadowWorker, &size, &worker))) {
+    if (worker)
+      worker->Release();
+    return worker;
+  }
+
+  ID3D11Device* device = nullptr;
+  pContext->GetDevice(&device);
+
+  if (!(device->GetCreationFlags() & D3D11_CREATE_DEVICE_SINGLETHREADED))
+    worker = new ShadowWorker(device);
+  else
+    log("Shadow worker: Device is single-threaded");
+
+  device->Release();
+
+  /* Also store null pointer so we don't try again */
+  if (worker)
+    pContext->SetPrivateDataInterface(IID_ShadowWorker, worker);
+  else
+    pContext->SetPrivateData(IID_ShadowWorker, sizeof(worker), &worker);
+
+  return worker;
+}
+
+
+void ShadowWorker::scheduleCreation(
+        ShadowSet*                pShadows,
+        ID3D11Resource*           pBaseResource,
+        UINT                      Subresource) {
+  Job job = { };
+  job.shadows = pShadows;
+  job.base = pBaseResource;
+  job.subresource = Subresource;
+
+  job.shadows->AddRef();
+  job.base->AddRef();
+
+  std::lock_guard lock(m_mutex);
+  m_jobs.push(job);
+  m_cond.notify_one();
+}
+
+
+void ShadowWorker::run() {
+  while (true) {
+    Job job;
+
+    { std::unique_lock lock(m_mutex);
+      m_cond.wait(lock, [this] { return m_stopped || !m_jobs.empty(); });
+
+      /* Pending jobs hold references to the device, so
+       * there can't be any if the worker is destroyed */
+      if (m_stopped)
+        return;
+
+      job = m_jobs.front();
+      m_jobs.pop();
+    }
+
+    ID3D11Resource* shadow = nullptr;
+
+    { TraceScope trace("atfix::createShadowResource", job.base);
+
+      if (FAILED(createShadowResource(m_device, job.base, job.subresource, &shadow)))
+        shadow = nullptr;
+    }
+
+    job.shadows->publishShadow(job.subresource, shadow);
+
+    if (shadow)
+      shadow->Release();
+
+    job.shadows->Release();
+    job.base->Release();
+  }
+}
+
+
+DWORD WINAPI ShadowWorker::threadProc(LPVOID pParam) {
+  auto worker = reinterpret_cast<ShadowWorker*>(pParam);
+  worker->run();
+
+  std::unique_lock lock(worker->m_mutex);
+  bool detached = worker->m_detached;
+  lock.unlock();
+
+  if (detached)
+    delete worker;
+
+  return 0;
+}
+
+}
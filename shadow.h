@@ -0,0 +1,232 @@
+#pragma once
+
+#include <d3d11.h>
+
+#include <memory>
+#include <queue>
+#include <vector>
+
+#include "arena.h"
+#include "impl.h"
+#include "readback.h"
+#include "strategy.h"
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief Shadow of a single subresource
+ *
+ * Shadows of small buffers may be sub-allocated from a shadow arena,
+ * in which case the resource is an arena buffer that is shared with
+ * other shadows, and the offset is the location of the shadow within
+ * that buffer. Other shadows are staging resources of their own, with
+ * an offset of zero and no arena.
+ *
+ * Since arena buffers are shared, the cache and statistics are kept
+ * here rather than as private data of the shadow resource. Both may
+ * be \c nullptr. Holds a reference to all objects, including the arena.
+ */
+struct ATFIX_SHADOW {
+  ID3D11Resource* Resource;
+  UINT            Offset;
+  ShadowArena*    Arena;
+  ShadowCache*    Cache;
+  ResourceStats*  Stats;
+};
+
+/** Releases all references held by a shadow */
+void releaseShadow(
+  const ATFIX_SHADOW*               pShadow);
+
+/**
+ * \brief Shadow resources of a base resource
+ *
+ * Attached to base resources as private data. Shadow resources are
+ * created per subresource of the base resource, and only for those
+ * subresources that the game actually copies to a CPU-accessible
+ * resource, since games typically only read back the top mip level
+ * of a render target or a single layer of an array texture.
+ *
+ * Each shadow resource is a staging resource with one subresource,
+ * which matches the size of the respective base subresource. Buffers
+ * only have one subresource, so their shadow is a full copy. Arena
+ * slots are returned to the arena when the shadow set is destroyed.
+ *
+ * Shadow resources created by the shadow worker are published here
+ * first, and only get used once the render thread has taken them and
+ * issued their initial copy. Subresources for which creating a shadow
+ * resource failed are remembered, so that creation is not retried on
+ * every copy. Clearing the shadow set does not reset that.
+ *
+ * The shadow set also keeps a write generation per subresource, which
+ * is bumped on every write to the base resource that atfix sees, even
+ * if the subresource has no shadow. Generations are unique across all
+ * shadow sets, so that a generation observed earlier only matches the
+ * current one if the subresource has not been written in between.
+ */
+class ShadowSet final : public IUnknown {
+
+public:
+
+  ShadowSet(
+          uint32_t                  SubresourceCount);
+
+  ~ShadowSet();
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(
+          REFIID                    riid,
+          void**                    ppvObject);
+
+  ULONG STDMETHODCALLTYPE AddRef();
+
+  ULONG STDMETHODCALLTYPE Release();
+
+  uint32_t getSubresourceCount() const {
+    return m_entries.size();
+  }
+
+  /** Retrieves shadow for the given subresource of the base
+   *  resource. Returns \c false if no shadow has been created
+   *  for that subresource. Otherwise, the shadow must be
+   *  released with \c releaseShadow by the caller. */
+  bool getShadow(
+          UINT                      Subresource,
+          ATFIX_SHADOW*             pShadow);
+
+  /** Sets shadow for the given subresource */
+  void setShadow(
+          UINT                      Subresource,
+    const ATFIX_SHADOW*             pShadow);
+
+  /** Destroys all shadows. Write generations are kept, so that
+   *  writes to the base resource are still tracked. */
+  void clear();
+
+  /** Marks creation of a shadow resource as pending. Returns
+   *  \c false if creation is already pending, if a shadow
+   *  resource has been published for the subresource, or if
+   *  creation failed before. */
+  bool beginCreation(
+          UINT                      Subresource);
+
+  /** Publishes a shadow resource created in the background, and
+   *  ends pending creation. May be \c nullptr if creation failed,
+   *  in which case creation is not attempted again. */
+  void publishShadow(
+          UINT                      Subresource,
+          ID3D11Resource*           pShadowResource);
+
+  /** Checks whether creating a shadow resource for
+   *  the given subresource has failed before */
+  bool isCreationFailed(
+          UINT                      Subresource);
+
+  /** Bumps the write generation of the given subresource, or
+   *  of all subresources if \c Subresource is \c ~0u. */
+  void markWritten(
+          UINT                      Subresource);
+
+  /** Returns current write generation of a subresource */
+  uint64_t getGeneration(
+          UINT                      Subresource) const;
+
+  /** Takes published shadow resource for the given subresource.
+   *  Returns a new reference, or \c nullptr if none exists. */
+  ID3D11Resource* takePublishedShadow(
+          UINT                      Subresource);
+
+private:
+
+  struct Entry {
+    ATFIX_SHADOW    shadow    = { };
+    ID3D11Resource* published = nullptr;
+    bool            pending   = false;
+    bool            failed    = false;
+  };
+
+  std::atomic<ULONG>            m_refCount = { 0u };
+
+  mutex                         m_mutex;
+  std::vector<Entry>            m_entries;
+
+  std::unique_ptr<std::atomic<uint64_t>[]> m_generations;
+
+};
+
+
+/**
+ * \brief Shadow worker
+ *
+ * Creates shadow resources on a background thread, since creating
+ * a staging resource for a large render target can take a while,
+ * and D3D11 devices are free-threaded unless the game explicitly
+ * asks for a single-threaded device.
+ *
+ * The worker only creates the resource and publishes it to the
+ * shadow set. Everything that involves the immediate context,
+ * including the initial copy, is left to the render thread.
+ *
+ * One worker is created per immediate context and attached to it
+ * as private data, without holding a reference to the device.
+ * Once the context releases it, the worker thread is stopped
+ * and joined.
+ */
+class ShadowWorker final : public IUnknown {
+
+public:
+
+  ShadowWorker(
+          ID3D11Device*             pDevice);
+
+  ~ShadowWorker();
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(
+          REFIID                    riid,
+          void**                    ppvObject);
+
+  ULONG STDMETHODCALLTYPE AddRef();
+
+  ULONG STDMETHODCALLTYPE Release();
+
+  /** Retrieves shadow worker for the given immediate context,
+   *  and creates it if necessary. Returns \c nullptr if the
+   *  device is single-threaded. */
+  static ShadowWorker* get(
+          ID3D11DeviceContext*      pContext);
+
+  /** Schedules creation of a shadow resource for the given
+   *  subresource. Creation must have been marked as pending
+   *  in the shadow set. */
+  void scheduleCreation(
+          ShadowSet*                pShadows,
+          ID3D11Resource*           pBaseResource,
+          UINT                      Subresource);
+
+private:
+
+  struct Job {
+    ShadowSet*      shadows;
+    ID3D11Resource* base;
+    UINT            subresource;
+  };
+
+  std::atomic<ULONG>        m_refCount = { 0u };
+
+  ID3D11Device*             m_device   = nullptr;
+  HANDLE                    m_thread   = nullptr;
+  DWORD                     m_threadId = 0u;
+
+  mutex                     m_mutex;
+  condition_variable        m_cond;
+  std::queue<Job>           m_jobs;
+  bool                      m_stopped  = false;
+  bool                      m_detached = false;
+
+  void run();
+
+  static DWORD WINAPI threadProc(LPVOID pParam);
+
+};
+
+}
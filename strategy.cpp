@@ -0,0 +1,264 @@
+#include <algorithm>
+
+#include "strategy.h"
+
+namespace atfix {
+
+static const GUID IID_CopyStrategy = {0x6a0f3d52,0xe8b1,0x4c27,{0x93,0x4d,0x17,0xb5,0x02,0xc9,0x6e,0xa8}};
+
+/* Number of consecutive reads that have to favour the
+ * other mode before a resource actually switches modes */
+constexpr uint32_t ModeSwitchVotes = 8;
+
+/* Number of reads after which a resource in GPU
+ * mode gets another chance at the CPU path */
+constexpr uint32_t GpuModeProbeReads = 256;
+
+/* If a CPU copy takes longer than this on average, we
+ * are not saving anything compared to a plain sync */
+constexpr float MaxCpuCopyUs = 2000.0f;
+
+/* Large resources that are updated many times per read
+ * cost more to keep in sync than the sync itself */
+constexpr uint64_t LargeResourceSize = 1ull << 20;
+constexpr float MaxUpdatesPerRead = 32.0f;
+
+/* Weight of new samples in moving averages */
+constexpr float SampleWeight = 0.125f;
+
+float updateAverage(float avg, float sample, uint64_t count) {
+  return count > 1
+    ? avg + (sample - avg) * SampleWeight
+    : sample;
+}
+
+
+ResourceStats::ResourceStats(
+  const ATFIX_RESOURCE_INFO*      pInfo)
+: m_size(getResourceSize(pInfo)) {
+
+}
+
+
+HRESULT STDMETHODCALLTYPE ResourceStats::QueryInterface(
+        REFIID                    riid,
+        void**                    ppvObject) {
+  if (!ppvObject)
+    return E_POINTER;
+
+  *ppvObject = nullptr;
+
+  if (riid == __uuidof(IUnknown)) {
+    AddRef();
+    *ppvObject = static_cast<IUnknown*>(this);
+    return S_OK;
+  }
+
+  return E_NOINTERFACE;
+}
+
+
+ULONG STDMETHODCALLTYPE ResourceStats::AddRef() {
+  return ++m_refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE ResourceStats::Release() {
+  ULONG refCount = --m_refCount;
+
+  if (!refCount)
+    delete this;
+
+  return refCount;
+}
+
+
+CopyStrategy::CopyStrategy() {
+  auto config = getConfig();
+
+  m_adaptive = config->AdaptiveCopies;
+  m_budget = std::chrono::microseconds(config->CpuCopyBudget);
+  m_statsInterval = config->FrameStatsInterval;
+}
+
+
+HRESULT STDMETHODCALLTYPE CopyStrategy::QueryInterface(
+        REFIID                    riid,
+        void**                    ppvObject) {
+  if (!ppvObject)
+    return E_POINTER;
+
+  *ppvObject = nullptr;
+
+  if (riid == __uuidof(IUnknown)) {
+    AddRef();
+    *ppvObject = static_cast<IUnknown*>(this);
+    return S_OK;
+  }
+
+  return E_NOINTERFACE;
+}
+
+
+ULONG STDMETHODCALLTYPE CopyStrategy::AddRef() {
+  return ++m_refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE CopyStrategy::Release() {
+  ULONG refCount = --m_refCount;
+
+  if (!refCount)
+    delete this;
+
+  return refCount;
+}
+
+
+CopyStrategy* CopyStrategy::get(
+        ID3D11DeviceContext*      pContext) {
+  static mutex s_mutex;
+  std::lock_guard lock(s_mutex);
+
+  CopyStrategy* strategy = nullptr;
+  UINT size = sizeof(strategy);
+
+  /* The context holds a reference to the controller, so
+   * the one returned by GetPrivateData can be dropped */
+  if (SUCCEEDED(pContext->GetPrivateData(IID_CopyStrategy, &size, &strategy))) {
+    strategy->Release();
+    return strategy;
+  }
+
+  strategy = new CopyStrategy();
+  pContext->SetPrivateDataInterface(IID_CopyStrategy, strategy);
+  return strategy;
+}
+
+
+void CopyStrategy::detach(
+        ID3D11DeviceContext*      pContext) {
+  pContext->SetPrivateData(IID_CopyStrategy, 0, nullptr);
+}
+
+
+bool CopyStrategy::allowCpuCopy(
+        ResourceStats*            pStats) {
+  if (m_budget != clock::duration::zero() && m_frameCpuTime >= m_budget) {
+    if (!m_budgetLogged) {
+      log("Copy strategy: CPU copy budget exceeded in frame ", m_frameId.load());
+      m_budgetLogged = true;
+    }
+
+    return false;
+  }
+
+  if (!pStats || pStats->m_mode == ATFIX_COPY_MODE_CPU)
+    return true;
+
+  /* Give the CPU path another chance every now and then,
+   * the way the game uses the resource may have changed. */
+  if (++pStats->m_gpuReads >= GpuModeProbeReads) {
+    switchMode(pStats, ATFIX_COPY_MODE_CPU);
+    return true;
+  }
+
+  return false;
+}
+
+
+bool CopyStrategy::recordCpuCopy(
+        ResourceStats*            pStats,
+        clock::duration           CopyTime,
+        clock::duration           MapWaitTime) {
+  m_frameCpuTime += CopyTime;
+
+  if (!pStats)
+    return false;
+
+  auto& s = *pStats;
+  s.m_readCount += 1;
+
+  float copyUs = std::chrono::duration<float, std::micro>(CopyTime).count();
+  float waitUs = std::chrono::duration<float, std::micro>(MapWaitTime).count();
+  float updates = float(s.m_shadowUpdates.exchange(0u));
+  float interval = float(m_frameId - s.m_lastReadFrame);
+
+  s.m_cpuCopyUs = updateAverage(s.m_cpuCopyUs, copyUs, s.m_readCount);
+  s.m_mapWaitUs = updateAverage(s.m_mapWaitUs, waitUs, s.m_readCount);
+  s.m_updatesPerRead = updateAverage(s.m_updatesPerRead, updates, s.m_readCount);
+  s.m_readInterval = updateAverage(s.m_readInterval, interval, s.m_readCount);
+  s.m_lastReadFrame = m_frameId;
+
+  if (!m_adaptive || evaluate(pStats) == s.m_mode) {
+    s.m_votes = 0;
+    return false;
+  }
+
+  if (++s.m_votes < ModeSwitchVotes)
+    return false;
+
+  switchMode(pStats, ATFIX_COPY_MODE_GPU);
+  return true;
+}
+
+
+void CopyStrategy::recordStaleRead(
+        uint64_t                  SnapshotFrame) {
+  uint64_t frameId = m_frameId.load();
+  uint64_t staleness = frameId - std::min(SnapshotFrame, frameId);
+
+  m_staleReads += 1;
+  m_staleFrames += staleness;
+  m_maxStaleness = std::max(m_maxStaleness, staleness);
+}
+
+
+void CopyStrategy::endFrame() {
+  uint64_t frameId = ++m_frameId;
+  m_frameCpuTime = clock::duration::zero();
+  m_budgetLogged = false;
+
+  if (m_statsInterval && !(frameId % m_statsInterval) && m_staleReads) {
+    log("Copy strategy: ", m_staleReads, " stale reads in the last ", m_statsInterval, " frames",
+      ", staleness: ", double(m_staleFrames) / double(m_staleReads), " frames avg",
+      ", ", m_maxStaleness, " frames max");
+
+    m_staleReads = 0u;
+    m_staleFrames = 0u;
+    m_maxStaleness = 0u;
+  }
+}
+
+
+ATFIX_COPY_MODE CopyStrategy::evaluate(
+  const ResourceStats*            pStats) const {
+  if (pStats->m_cpuCopyUs > MaxCpuCopyUs)
+    return ATFIX_COPY_MODE_GPU;
+
+  if (pStats->m_size >= LargeResourceSize && pStats->m_updatesPerRead > MaxUpdatesPerRead)
+    return ATFIX_COPY_MODE_GPU;
+
+  return ATFIX_COPY_MODE_CPU;
+}
+
+
+void CopyStrategy::switchMode(
+        ResourceStats*            pStats,
+        ATFIX_COPY_MODE           Mode) {
+  log("Copy strategy: Switching ", static_cast<void*>(pStats), " (", pStats->m_size, " bytes) to ",
+    Mode == ATFIX_COPY_MODE_CPU ? "CPU" : "GPU", " copies",
+    ", reads: ", pStats->m_readCount,
+    ", frames/read: ", pStats->m_readInterval,
+    ", updates/read: ", pStats->m_updatesPerRead,
+    ", copy: ", pStats->m_cpuCopyUs, " us",
+    ", map wait: ", pStats->m_mapWaitUs, " us");
+
+  pStats->m_mode = Mode;
+  pStats->m_votes = 0;
+  pStats->m_gpuReads = 0;
+  pStats->m_readCount = 0;
+  pStats->m_shadowUpdates = 0;
+}
+
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <d3d11.h>
+
+#include <chrono>
+
+#include "config.h"
+#include "impl.h"
+#include "util.h"
+
+namespace atfix {
+
+enum ATFIX_COPY_MODE : uint32_t {
+  /** Copies from the resource are done on the CPU,
+   *  using a shadow resource if necessary */
+  ATFIX_COPY_MODE_CPU = 0,
+  /** Copies are done on the GPU, as the game intended,
+   *  and the resource does not have a shadow resource */
+  ATFIX_COPY_MODE_GPU = 1,
+};
+
+/**
+ * \brief Per-resource copy statistics
+ *
+ * Attached to GPU resources that the game copies to CPU-writable
+ * resources, and referenced by their shadows. Tracks how often
+ * the resource is read, how expensive CPU copies from it are, and
+ * how many shadow updates we do between reads, in order to decide
+ * whether the CPU path is worth it for this resource.
+ *
+ * All methods except \c recordShadowUpdate must only be called from
+ * the thread that owns the immediate context.
+ */
+class ResourceStats final : public IUnknown {
+
+public:
+
+  ResourceStats(
+    const ATFIX_RESOURCE_INFO*      pInfo);
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(
+          REFIID                    riid,
+          void**                    ppvObject);
+
+  ULONG STDMETHODCALLTYPE AddRef();
+
+  ULONG STDMETHODCALLTYPE Release();
+
+  ATFIX_COPY_MODE getMode() const {
+    return m_mode;
+  }
+
+  /** Counts a write to the shadow resource. May
+   *  be called from any thread. */
+  void recordShadowUpdate() {
+    m_shadowUpdates += 1;
+  }
+
+private:
+
+  friend class CopyStrategy;
+
+  std::atomic<ULONG>        m_refCount        = { 0u };
+  std::atomic<uint32_t>     m_shadowUpdates   = { 0u };
+
+  ATFIX_COPY_MODE           m_mode            = ATFIX_COPY_MODE_CPU;
+  uint32_t                  m_votes           = 0u;
+  uint32_t                  m_gpuReads        = 0u;
+
+  uint64_t                  m_size            = 0u;
+  uint64_t                  m_readCount       = 0u;
+  uint64_t                  m_lastReadFrame   = 0u;
+
+  float                     m_readInterval    = 0.0f;
+  float                     m_updatesPerRead  = 0.0f;
+  float                     m_cpuCopyUs       = 0.0f;
+  float                     m_mapWaitUs       = 0.0f;
+
+};
+
+
+/**
+ * \brief Copy strategy controller
+ *
+ * Decides per resource whether copies to CPU-writable resources
+ * are done on the CPU or the GPU, based on the statistics gathered
+ * for that resource. Mode switches only happen after a resource
+ * consistently favoured the other mode for a number of reads, and
+ * resources in GPU mode are periodically re-evaluated.
+ *
+ * Also enforces a per-frame budget for CPU copies so that the
+ * render thread does not end up doing more work than it saves.
+ * Frames end at \c Present, or at the next \c Map if the game
+ * has not presented in a while.
+ *
+ * One controller is created per immediate context and attached to
+ * it as private data. Shadow caches keep the controller alive with
+ * references of their own.
+ */
+class CopyStrategy final : public IUnknown {
+
+public:
+
+  using clock = std::chrono::steady_clock;
+
+  CopyStrategy();
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(
+          REFIID                    riid,
+          void**                    ppvObject);
+
+  ULONG STDMETHODCALLTYPE AddRef();
+
+  ULONG STDMETHODCALLTYPE Release();
+
+  /** Retrieves copy strategy for the given immediate
+   *  context, and creates it if necessary. */
+  static CopyStrategy* get(
+          ID3D11DeviceContext*      pContext);
+
+  /** Drops the context's reference to its copy strategy */
+  static void detach(
+          ID3D11DeviceContext*      pContext);
+
+  /** Checks whether a CPU copy from a resource with the given
+   *  statistics should be attempted. Statistics may be \c nullptr
+   *  if the source resource is CPU-readable or was never read. */
+  bool allowCpuCopy(
+          ResourceStats*            pStats);
+
+  /** Records a completed CPU copy. Returns \c true if the
+   *  resource was switched to GPU mode as a result, in which
+   *  case its shadow resource should be destroyed. */
+  bool recordCpuCopy(
+          ResourceStats*            pStats,
+          clock::duration           CopyTime,
+          clock::duration           MapWaitTime);
+
+  /** Records a read that was served from a snapshot taken
+   *  in the given frame, rather than from current data. */
+  void recordStaleRead(
+          uint64_t                  SnapshotFrame);
+
+  /** Starts a new frame and resets the CPU copy budget */
+  void endFrame();
+
+  /** Returns current frame number. May be called
+   *  from any thread. */
+  uint64_t getFrameId() const {
+    return m_frameId.load();
+  }
+
+private:
+
+  std::atomic<ULONG>        m_refCount      = { 0u };
+
+  bool                      m_adaptive      = true;
+  clock::duration           m_budget        = clock::duration::zero();
+  clock::duration           m_frameCpuTime  = clock::duration::zero();
+
+  std::atomic<uint64_t>     m_frameId       = { 0u };
+  bool                      m_budgetLogged  = false;
+
+  uint32_t                  m_statsInterval = 0u;
+  uint64_t                  m_staleReads    = 0u;
+  uint64_t                  m_staleFrames   = 0u;
+  uint64_t                  m_maxStaleness  = 0u;
+
+  ATFIX_COPY_MODE evaluate(
+    const ResourceStats*            pStats) const;
+
+  void switchMode(
+          ResourceStats*            pStats,
+          ATFIX_COPY_MODE           Mode);
+
+};
+
+}
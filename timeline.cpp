@@ -0,0 +1,284 @@
+#include "timeline.h"
+
+namespace atfix {
+
+static const GUID IID_GpuTimeline = {0x5d0e93b7,0x1c4a,0x4f2e,{0x8b,0x36,0xa2,0x47,0x19,0xce,0x60,0xd5}};
+static const GUID IID_GpuTimelineValue = {0xc7a1845e,0x93d2,0x4b0f,{0xb4,0x5a,0x0f,0x3e,0x72,0x6c,0x21,0x9b}};
+
+/* Timeline returned by the last lookup. Reset when that
+ * timeline gets destroyed, so it is valid while set. */
+static std::atomic<GpuTimeline*> s_lastTimeline = { nullptr };
+
+GpuTimeline::GpuTimeline(
+        ID3D11DeviceContext*      pContext)
+: m_context(pContext) {
+  ID3D11Device5* device5 = nullptr;
+  pContext->GetDevice(&m_device);
+
+  /* The context interfaces belong to the context itself, so
+   * keeping references to them would keep the context alive */
+  if (SUCCEEDED(m_device->QueryInterface(IID_PPV_ARGS(&device5)))
+   && SUCCEEDED(pContext->QueryInterface(IID_PPV_ARGS(&m_context4)))) {
+    if (SUCCEEDED(device5->CreateFence(0, D3D11_FENCE_FLAG_NONE, IID_PPV_ARGS(&m_fence))))
+      addInternalDeviceRefs(m_device, 1);
+
+    m_context4->Release();
+
+    if (!m_fence)
+      m_context4 = nullptr;
+  }
+
+  if (device5)
+    device5->Release();
+
+  m_device->Release();
+
+  /* Queries may be polled from other threads, which is only
+   * safe if the context is multithread-protected. */
+  if (!m_fence && SUCCEEDED(pContext->QueryInterface(IID_PPV_ARGS(&m_multithread))))
+    m_multithread->Release();
+  else
+    m_multithread = nullptr;
+
+  if (m_fence)
+    m_event = CreateEventA(nullptr, FALSE, FALSE, nullptr);
+
+  log("GPU timeline: Using ", m_fence ? "ID3D11Fence" : "event queries");
+}
+
+
+GpuTimeline::~GpuTimeline() {
+  GpuTimeline* self = this;
+  s_lastTimeline.compare_exchange_strong(self, nullptr);
+
+  std::vector<ID3D11Query*> queries = std::move(m_queries);
+
+  for (const auto& entry : m_pending)
+    queries.push_back(entry.query);
+
+  addInternalDeviceRefs(m_device, -int32_t(queries.size() + (m_fence ? 1u : 0u)));
+
+  for (ID3D11Query* query : queries)
+    query->Release();
+
+  if (m_fence)
+    m_fence->Release();
+
+  if (m_event)
+    CloseHandle(m_event);
+}
+
+
+HRESULT STDMETHODCALLTYPE GpuTimeline::QueryInterface(
+        REFIID                    riid,
+        void**                    ppvObject) {
+  if (!ppvObject)
+    return E_POINTER;
+
+  *ppvObject = nullptr;
+
+  if (riid == __uuidof(IUnknown)) {
+    AddRef();
+    *ppvObject = static_cast<IUnknown*>(this);
+    return S_OK;
+  }
+
+  return E_NOINTERFACE;
+}
+
+
+ULONG STDMETHODCALLTYPE GpuTimeline::AddRef() {
+  return ++m_refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE GpuTimeline::Release() {
+  ULONG refCount = --m_refCount;
+
+  if (!refCount)
+    delete this;
+
+  return refCount;
+}
+
+
+GpuTimeline* GpuTimeline::get(
+        ID3D11DeviceContext*      pContext) {
+  /* This gets called from most hooks, so skip the
+   * private data lookup for the common case */
+  GpuTimeline* timeline = s_lastTimeline.load();
+
+  if (timeline && timeline->m_context == pContext)
+    return timeline;
+
+  static mutex s_mutex;
+  std::lock_guard lock(s_mutex);
+
+  UINT size = sizeof(timeline);
+
+  /* The context holds a reference to the timeline, so the
+   * one returned by GetPrivateData can be dropped */
+  if (SUCCEEDED(pContext->GetPrivateData(IID_GpuTimeline, &size, &timeline))) {
+    timeline->Release();
+  } else {
+    timeline = new GpuTimeline(pContext);
+    pContext->SetPrivateDataInterface(IID_GpuTimeline, timeline);
+  }
+
+  s_lastTimeline.store(timeline);
+  return timeline;
+}
+
+
+void GpuTimeline::detach(
+        ID3D11DeviceContext*      pContext) {
+  pContext->SetPrivateData(IID_GpuTimeline, 0, nullptr);
+}
+
+
+uint64_t GpuTimeline::trackResource(
+        ID3D11Resource*           pResource) {
+  uint64_t value = track();
+  pResource->SetPrivateData(IID_GpuTimelineValue, sizeof(value), &value);
+  return value;
+}
+
+
+void GpuTimeline::submit() {
+  if (!m_hasWork)
+    return;
+
+  uint64_t value = m_nextValue++;
+  m_hasWork = false;
+
+  if (m_fence) {
+    m_context4->Signal(m_fence, value);
+  } else {
+    ID3D11Query* query = allocQuery();
+
+    if (!query)
+      return;
+
+    forwardEnd(m_context, query);
+
+    std::lock_guard lock(m_mutex);
+    m_pending.push_back({ value, query });
+  }
+}
+
+
+bool GpuTimeline::isComplete(
+        uint64_t                  Value) {
+  if (Value <= m_completed.load())
+    return true;
+
+  uint64_t completed = m_fence
+    ? m_fence->GetCompletedValue()
+    : pollQueries();
+
+  /* Other threads may update the value concurrently */
+  uint64_t expected = m_completed.load();
+
+  while (expected < completed && !m_completed.compare_exchange_weak(expected, completed))
+    continue;
+
+  return Value <= completed;
+}
+
+
+bool GpuTimeline::isResourceIdle(
+        ID3D11Resource*           pResource) {
+  uint64_t value = 0ull;
+  UINT size = sizeof(value);
+
+  if (FAILED(pResource->GetPrivateData(IID_GpuTimelineValue, &size, &value)))
+    return true;
+
+  return isComplete(value);
+}
+
+
+void GpuTimeline::untrackResource(
+        ID3D11Resource*           pResource) {
+  pResource->SetPrivateData(IID_GpuTimelineValue, 0, nullptr);
+}
+
+
+void GpuTimeline::wait(
+        uint64_t                  Value) {
+  if (isComplete(Value))
+    return;
+
+  if (m_fence) {
+    /* The event is shared, so only one thread may wait at a time */
+    std::lock_guard lock(m_eventMutex);
+
+    if (SUCCEEDED(m_fence->SetEventOnCompletion(Value, m_event)))
+      WaitForSingleObject(m_event, INFINITE);
+  } else {
+    while (!isComplete(Value))
+      Sleep(1);
+  }
+}
+
+
+ID3D11Query* GpuTimeline::allocQuery() {
+  { std::lock_guard lock(m_mutex);
+
+    if (!m_queries.empty()) {
+      ID3D11Query* query = m_queries.back();
+      m_queries.pop_back();
+      return query;
+    }
+  }
+
+  D3D11_QUERY_DESC desc = { };
+  desc.Query = D3D11_QUERY_EVENT;
+
+  ID3D11Query* query = nullptr;
+
+  if (SUCCEEDED(m_device->CreateQuery(&desc, &query)))
+    addInternalDeviceRefs(m_device, 1);
+  else
+    log("GPU timeline: Failed to create event query");
+
+  return query;
+}
+
+
+uint64_t GpuTimeline::pollQueries() {
+  /* Enter the runtime first, the readback worker may
+   * call into the timeline while holding that lock. */
+  if (m_multithread)
+    m_multithread->Enter();
+
+  std::unique_lock lock(m_mutex);
+  uint64_t completed = m_completed.load();
+
+  /* Queries complete in order, so stop at the first one
+   * that is still pending. Don't flush, since that would
+   * defeat the purpose of using the timeline at all. */
+  while (!m_pending.empty()) {
+    auto& entry = m_pending.front();
+
+    HRESULT hr = forwardGetData(m_context, entry.query,
+      nullptr, 0, D3D11_ASYNC_GETDATA_DONOTFLUSH);
+
+    if (hr != S_OK)
+      break;
+
+    completed = entry.value;
+
+    m_queries.push_back(entry.query);
+    m_pending.pop_front();
+  }
+
+  lock.unlock();
+
+  if (m_multithread)
+    m_multithread->Leave();
+
+  return completed;
+}
+
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <d3d11_4.h>
+
+#include <deque>
+#include <vector>
+
+#include "impl.h"
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief GPU timeline
+ *
+ * Tracks completion of GPU work issued by atfix on the immediate
+ * context. Work is tracked in batches: Resources that are used in
+ * a batch store the timeline value of that batch as private data,
+ * and submitting the batch signals that value on the GPU.
+ *
+ * Uses an \c ID3D11Fence on D3D11.4 runtimes, and a pool of event
+ * queries otherwise. Querying whether a resource is idle is then a
+ * single integer compare against the last known completed value,
+ * and only refreshes that value from the GPU if necessary.
+ *
+ * Note that the timeline only knows about work that atfix issued
+ * itself. A resource being idle according to the timeline does not
+ * mean that the game did not use it in the meantime, however, a
+ * resource being busy means that it definitely is.
+ *
+ * One timeline is created per immediate context and attached to it
+ * as private data, without holding a reference to the context. The
+ * fence and queries count as internal references to the device, see
+ * \c addInternalDeviceRefs. Objects that use the timeline keep it
+ * alive with a reference of their own.
+ */
+class GpuTimeline final : public IUnknown {
+
+public:
+
+  GpuTimeline(
+          ID3D11DeviceContext*      pContext);
+
+  ~GpuTimeline();
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(
+          REFIID                    riid,
+          void**                    ppvObject);
+
+  ULONG STDMETHODCALLTYPE AddRef();
+
+  ULONG STDMETHODCALLTYPE Release();
+
+  /** Retrieves timeline for the given immediate context,
+   *  and creates it if necessary. */
+  static GpuTimeline* get(
+          ID3D11DeviceContext*      pContext);
+
+  /** Drops the context's reference to its timeline */
+  static void detach(
+          ID3D11DeviceContext*      pContext);
+
+  /** Returns timeline value of the current batch. The value
+   *  will be signaled with the next call to \c submit. */
+  uint64_t track() {
+    m_hasWork = true;
+    return m_nextValue.load();
+  }
+
+  /** Returns the timeline value that will be signaled with the
+   *  next call to \c submit. Unlike \c track, this does not add
+   *  any work to the batch and may be called from any thread. */
+  uint64_t getNextValue() const {
+    return m_nextValue.load();
+  }
+
+  /** Checks whether the current batch contains any work */
+  bool hasWork() const {
+    return m_hasWork;
+  }
+
+  /** Adds resource to the current batch and returns
+   *  the timeline value of that batch. */
+  uint64_t trackResource(
+          ID3D11Resource*           pResource);
+
+  /** Signals current batch if it contains any work */
+  void submit();
+
+  /** Checks whether the given timeline value has completed */
+  bool isComplete(
+          uint64_t                  Value);
+
+  /** Checks whether the last use of the resource that was
+   *  tracked by the timeline has completed on the GPU. */
+  bool isResourceIdle(
+          ID3D11Resource*           pResource);
+
+  /** Removes the timeline value from a resource, so
+   *  that it is considered idle from now on. */
+  static void untrackResource(
+          ID3D11Resource*           pResource);
+
+  /** Waits for the given timeline value to complete. Must
+   *  not be called from the render thread. */
+  void wait(
+          uint64_t                  Value);
+
+private:
+
+  struct PendingQuery {
+    uint64_t      value;
+    ID3D11Query*  query;
+  };
+
+  std::atomic<ULONG>        m_refCount    = { 0u };
+
+  ID3D11Device*             m_device      = nullptr;
+  ID3D11DeviceContext*      m_context     = nullptr;
+  ID3D11DeviceContext4*     m_context4    = nullptr;
+  ID3D11Multithread*        m_multithread = nullptr;
+  ID3D11Fence*              m_fence       = nullptr;
+  HANDLE                    m_event       = nullptr;
+  mutex                     m_eventMutex;
+
+  bool                      m_hasWork     = false;
+  std::atomic<uint64_t>     m_nextValue   = { 1ull };
+  std::atomic<uint64_t>     m_completed   = { 0ull };
+
+  mutex                     m_mutex;
+  std::deque<PendingQuery>  m_pending;
+  std::vector<ID3D11Query*> m_queries;
+
+  ID3D11Query* allocQuery();
+
+  uint64_t pollQueries();
+
+};
+
+}
@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <iomanip>
+
+#include "trace.h"
+
+namespace atfix {
+
+bool                      Tracer::s_enabled = false;
+thread_local Tracer::Chunk* Tracer::t_chunk = nullptr;
+
+mutex                     Tracer::s_mutex;
+condition_variable        Tracer::s_cond;
+std::queue<Tracer::Chunk*> Tracer::s_queue;
+std::vector<Tracer::Chunk*> Tracer::s_active;
+
+mutex                     Tracer::s_fileMutex;
+std::ofstream             Tracer::s_file;
+bool                      Tracer::s_firstEvent = true;
+double                    Tracer::s_ticksPerUs = 1.0;
+
+void Tracer::init() {
+  static mutex s_initMutex;
+  static bool s_initialized = false;
+
+  std::lock_guard lock(s_initMutex);
+
+  if (s_initialized)
+    return;
+
+  s_initialized = true;
+
+  auto config = getConfig();
+
+  if (config->TracePath.empty())
+    return;
+
+  s_file.open(config->TracePath, std::ios::out | std::ios::trunc);
+
+  if (!s_file) {
+    log("Trace: Failed to open ", config->TracePath);
+    return;
+  }
+
+  LARGE_INTEGER freq;
+  QueryPerformanceFrequency(&freq);
+  s_ticksPerUs = double(freq.QuadPart) / 1000000.0;
+
+  /* Chrome and Perfetto accept files with a missing closing
+   * bracket, so a trace is still usable after a crash. */
+  s_file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  s_file << std::fixed << std::setprecision(3);
+
+  CreateThread(nullptr, 0, &threadProc, nullptr, 0, nullptr);
+
+  log("Trace: Writing to ", config->TracePath);
+  s_enabled = true;
+}
+
+
+void Tracer::shutdown() {
+  if (!s_enabled)
+    return;
+
+  /* Other threads are gone at this point, so we can safely write
+   * out partially filled chunks as well. Threads may have been
+   * terminated while holding a lock though, so don't block. */
+  std::unique_lock lock(s_mutex, std::try_to_lock);
+  std::unique_lock fileLock(s_fileMutex, std::try_to_lock);
+
+  if (!lock || !fileLock) {
+    log("Trace: Failed to write remaining events");
+    return;
+  }
+
+  while (!s_queue.empty()) {
+    writeChunk(s_queue.front());
+    s_queue.pop();
+  }
+
+  for (auto chunk : s_active)
+    writeChunk(chunk);
+
+  s_file << "\n]}\n";
+  s_file.flush();
+}
+
+
+int64_t Tracer::now() {
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return counter.QuadPart;
+}
+
+
+void Tracer::record(
+  const ATFIX_TRACE_EVENT&        Event) {
+  Chunk* chunk = t_chunk;
+
+  if (!chunk)
+    t_chunk = chunk = allocChunk();
+
+  uint32_t index = chunk->count.load(std::memory_order_relaxed);
+  chunk->events[index] = Event;
+  chunk->count.store(index + 1, std::memory_order_release);
+
+  if (index + 1 == ChunkSize) {
+    submitChunk(chunk);
+    t_chunk = nullptr;
+  }
+}
+
+
+Tracer::Chunk* Tracer::allocChunk() {
+  Chunk* chunk = new Chunk();
+  chunk->threadId = GetCurrentThreadId();
+  chunk->count.store(0);
+
+  std::lock_guard lock(s_mutex);
+  s_active.push_back(chunk);
+  return chunk;
+}
+
+
+void Tracer::submitChunk(
+        Chunk*                    pChunk) {
+  std::lock_guard lock(s_mutex);
+
+  auto entry = std::find(s_active.begin(), s_active.end(), pChunk);
+
+  if (entry != s_active.end())
+    s_active.erase(entry);
+
+  s_queue.push(pChunk);
+  s_cond.notify_one();
+}
+
+
+void Tracer::writeChunk(
+  const Chunk*                    pChunk) {
+  static const DWORD s_processId = GetCurrentProcessId();
+
+  uint32_t count = pChunk->count.load(std::memory_order_acquire);
+
+  for (uint32_t i = 0; i < count; i++) {
+    const auto& e = pChunk->events[i];
+
+    if (!s_firstEvent)
+      s_file << ",\n";
+
+    s_firstEvent = false;
+
+    s_file << "{\"name\":\"" << e.Name << "\",\"ph\":\"X\""
+           << ",\"pid\":" << s_processId
+           << ",\"tid\":" << pChunk->threadId
+           << ",\"ts\":" << double(e.Start) / s_ticksPerUs
+           << ",\"dur\":" << double(e.Duration) / s_ticksPerUs;
+
+    if (e.HasResource) {
+      s_file << ",\"args\":{\"size\":" << e.Size
+             << ",\"format\":" << uint32_t(e.Format) << "}";
+    }
+
+    s_file << "}";
+  }
+}
+
+
+DWORD WINAPI Tracer::threadProc(LPVOID pParam) {
+  while (true) {
+    Chunk* chunk = nullptr;
+
+    { std::unique_lock lock(s_mutex);
+      s_cond.wait(lock, [] { return !s_queue.empty(); });
+
+      chunk = s_queue.front();
+      s_queue.pop();
+    }
+
+    { std::lock_guard lock(s_fileMutex);
+      writeChunk(chunk);
+    }
+
+    delete chunk;
+  }
+
+  return 0;
+}
+
+
+void TraceScope::begin(
+  const char*                     pName,
+        ID3D11Resource*           pResource) {
+  if (pResource) {
+    ATFIX_RESOURCE_INFO info = { };
+    getResourceInfo(pResource, &info);
+
+    m_event.Size = getResourceSize(&info);
+    m_event.Format = info.Format;
+    m_event.HasResource = true;
+  }
+
+  m_event.Name = pName;
+  m_event.Start = Tracer::now();
+}
+
+
+void TraceScope::end() {
+  m_event.Duration = Tracer::now() - m_event.Start;
+  Tracer::record(m_event);
+}
+
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <d3d11.h>
+
+#include <array>
+#include <fstream>
+#include <queue>
+#include <vector>
+
+#include "config.h"
+#include "impl.h"
+#include "util.h"
+
+namespace atfix {
+
+struct ATFIX_TRACE_EVENT {
+  const char*   Name;
+  int64_t       Start;
+  int64_t       Duration;
+  uint64_t      Size;
+  DXGI_FORMAT   Format;
+  bool          HasResource;
+};
+
+/**
+ * \brief Trace recorder
+ *
+ * Writes spans of hook activity to a file in the Chrome trace event
+ * format, which can be loaded into \c chrome://tracing or Perfetto.
+ * Tracing is enabled by setting \c ATFIX_TRACE to the output path.
+ *
+ * Events are recorded into per-thread chunks without any locking.
+ * Full chunks are handed to a writer thread, and partially filled
+ * chunks are written when the process exits. If tracing is disabled,
+ * recording a span only costs a single well-predicted branch.
+ */
+class Tracer {
+
+public:
+
+  /** Enables tracing if requested by the user. Must
+   *  be called before any hooks are installed. */
+  static void init();
+
+  /** Writes all remaining events. Called when the
+   *  DLL gets unloaded. */
+  static void shutdown();
+
+  static bool isEnabled() {
+    return s_enabled;
+  }
+
+  /** Returns current timestamp in trace ticks */
+  static int64_t now();
+
+  /** Records an event for the calling thread */
+  static void record(
+    const ATFIX_TRACE_EVENT&        Event);
+
+private:
+
+  static constexpr size_t ChunkSize = 4096;
+
+  struct Chunk {
+    DWORD                                     threadId;
+    std::atomic<uint32_t>                     count;
+    std::array<ATFIX_TRACE_EVENT, ChunkSize>  events;
+  };
+
+  static bool               s_enabled;
+  static thread_local Chunk* t_chunk;
+
+  static mutex              s_mutex;
+  static condition_variable s_cond;
+  static std::queue<Chunk*> s_queue;
+  static std::vector<Chunk*> s_active;
+
+  static mutex              s_fileMutex;
+  static std::ofstream      s_file;
+  static bool               s_firstEvent;
+  static double             s_ticksPerUs;
+
+  static Chunk* allocChunk();
+
+  static void submitChunk(
+          Chunk*                    pChunk);
+
+  static void writeChunk(
+    const Chunk*                    pChunk);
+
+  static DWORD WINAPI threadProc(LPVOID pParam);
+
+};
+
+
+/**
+ * \brief Trace span
+ *
+ * Records an event covering the lifetime of the object. If a
+ * resource is given, its size and format are attached to the
+ * event as arguments.
+ */
+class TraceScope {
+
+public:
+
+  TraceScope(
+    const char*                     pName) {
+    if (ATFIX_UNLIKELY(Tracer::isEnabled()))
+      begin(pName, nullptr);
+  }
+
+  TraceScope(
+    const char*                     pName,
+          ID3D11Resource*           pResource) {
+    if (ATFIX_UNLIKELY(Tracer::isEnabled()))
+      begin(pName, pResource);
+  }
+
+  ~TraceScope() {
+    if (ATFIX_UNLIKELY(m_event.Name != nullptr))
+      end();
+  }
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator = (const TraceScope&) = delete;
+
+private:
+
+  ATFIX_TRACE_EVENT m_event = { };
+
+  void begin(
+    const char*                     pName,
+          ID3D11Resource*           pResource);
+
+  void end();
+
+};
+
+}
@@ -12,8 +12,20 @@
 
 #include "./minhook/include/MinHook.h"
 
+/* Branch hint for checks on hot paths that are almost never true */
+#ifdef _MSC_VER
+  #define ATFIX_UNLIKELY(x) (x)
+#else
+  #define ATFIX_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#endif
+
 namespace atfix {
 
+#ifdef ATFIX_LOCK_STATS
+/* Number of lock acquisitions, only counted in benchmark builds */
+inline std::atomic<uint64_t> g_lockCount = { 0ull };
+#endif
+
 /**
  * \brief SRW-based mutex implementation
  *
@@ -32,6 +44,9 @@ public:
   mutex& operator = (const mutex&) = delete;
 
   void lock() {
+#ifdef ATFIX_LOCK_STATS
+    g_lockCount++;
+#endif
     AcquireSRWLockExclusive(&m_lock);
   }
 
@@ -40,6 +55,9 @@ public:
   }
 
   bool try_lock() {
+#ifdef ATFIX_LOCK_STATS
+    g_lockCount++;
+#endif
     return TryAcquireSRWLockExclusive(&m_lock);
   }
 
@@ -78,6 +96,9 @@ public:
   recursive_mutex& operator = (const recursive_mutex&) = delete;
 
   void lock() {
+#ifdef ATFIX_LOCK_STATS
+    g_lockCount++;
+#endif
     EnterCriticalSection(&m_lock);
   }
 
@@ -86,6 +107,9 @@ public:
   }
 
   bool try_lock() {
+#ifdef ATFIX_LOCK_STATS
+    g_lockCount++;
+#endif
     return TryEnterCriticalSection(&m_lock);
   }
 
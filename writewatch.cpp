@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <cstring>
+
+#include "writewatch.h"
+
+namespace atfix {
+
+WriteWatch::WriteWatch() {
+
+}
+
+
+WriteWatch::~WriteWatch() {
+  if (m_memory)
+    VirtualFree(m_memory, 0, MEM_RELEASE);
+}
+
+
+HRESULT STDMETHODCALLTYPE WriteWatch::QueryInterface(
+        REFIID                    riid,
+        void**                    ppvObject) {
+  if (!ppvObject)
+    return E_POINTER;
+
+  *ppvObject = nullptr;
+
+  if (riid == __uuidof(IUnknown)) {
+    AddRef();
+    *ppvObject = static_cast<IUnknown*>(this);
+    return S_OK;
+  }
+
+  return E_NOINTERFACE;
+}
+
+
+ULONG STDMETHODCALLTYPE WriteWatch::AddRef() {
+  return ++m_refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE WriteWatch::Release() {
+  ULONG refCount = --m_refCount;
+
+  if (!refCount)
+    delete this;
+
+  return refCount;
+}
+
+
+bool WriteWatch::begin(
+  const D3D11_MAPPED_SUBRESOURCE* pMapped,
+        size_t                    Size,
+        D3D11_MAPPED_SUBRESOURCE* pWatched) {
+  if (Size > m_capacity) {
+    if (m_memory)
+      VirtualFree(m_memory, 0, MEM_RELEASE);
+
+    m_memory = VirtualAlloc(nullptr, Size,
+      MEM_RESERVE | MEM_COMMIT | MEM_WRITE_WATCH, PAGE_READWRITE);
+    m_capacity = m_memory ? Size : 0u;
+
+    if (!m_memory) {
+      log("Failed to allocate ", Size, " bytes of write-watched memory");
+      return false;
+    }
+  }
+
+  /* Copying the data marks all pages as written */
+  std::memcpy(m_memory, pMapped->pData, Size);
+  ResetWriteWatch(m_memory, Size);
+
+  m_size = Size;
+  m_target = pMapped->pData;
+  m_active = true;
+
+  pWatched->pData = m_memory;
+  pWatched->RowPitch = pMapped->RowPitch;
+  pWatched->DepthPitch = pMapped->DepthPitch;
+  return true;
+}
+
+
+void WriteWatch::end(
+        std::vector<WriteWatchRange>* pRanges) {
+  pRanges->clear();
+  m_active = false;
+
+  /* Allocation granularity is at least one 4k page */
+  m_pages.resize((m_size + 4095u) / 4096u);
+
+  ULONG_PTR pageCount = m_pages.size();
+  ULONG pageSize = 0u;
+
+  if (GetWriteWatch(WRITE_WATCH_FLAG_RESET, m_memory, m_size,
+      m_pages.data(), &pageCount, &pageSize) || !pageSize) {
+    /* Treat everything as written if the query fails */
+    log("Failed to query write watch, copying all data");
+    std::memcpy(m_target, m_memory, m_size);
+    pRanges->push_back({ 0u, m_size });
+    return;
+  }
+
+  for (ULONG_PTR i = 0; i < pageCount; i++) {
+    size_t offset = size_t(static_cast<char*>(m_pages[i]) - static_cast<char*>(m_memory));
+    size_t size = std::min<size_t>(pageSize, m_size - offset);
+
+    std::memcpy(
+      ptroffset(m_target, offset),
+      ptroffset(m_memory, offset),
+      size);
+
+    /* Pages are returned in ascending order */
+    if (!pRanges->empty() && pRanges->back().first + pRanges->back().second == offset)
+      pRanges->back().second += size;
+    else
+      pRanges->push_back({ offset, size });
+  }
+}
+
+}
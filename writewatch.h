@@ -0,0 +1,82 @@
+#pragma once
+
+#include <d3d11.h>
+
+#include <utility>
+#include <vector>
+
+#include "impl.h"
+#include "util.h"
+
+namespace atfix {
+
+/** Byte range of mapped data, as offset and size */
+using WriteWatchRange = std::pair<size_t, size_t>;
+
+/**
+ * \brief Write-watched mapping
+ *
+ * Serves a mapping of a staging resource from system memory that
+ * was allocated with \c MEM_WRITE_WATCH, so that the pages that the
+ * game wrote are known when the resource gets unmapped. Only those
+ * pages are copied back to the actual mapping.
+ *
+ * Mapped data has to be copied to the watched memory up front, so
+ * this only pays off if the game writes little of a large resource
+ * and copying the written parts back to the GPU saves more than that.
+ * The first write to each page is expensive, since write watches are
+ * implemented via page faults in wine.
+ *
+ * Attached to the staging resource as private data, so that the
+ * memory is reused for subsequent mappings.
+ */
+class WriteWatch final : public IUnknown {
+
+public:
+
+  WriteWatch();
+
+  ~WriteWatch();
+
+  HRESULT STDMETHODCALLTYPE QueryInterface(
+          REFIID                    riid,
+          void**                    ppvObject);
+
+  ULONG STDMETHODCALLTYPE AddRef();
+
+  ULONG STDMETHODCALLTYPE Release();
+
+  /** Copies mapped data to watched memory and returns a mapping
+   *  of that memory with the same layout. Returns \c false if
+   *  memory could not be allocated, in which case the original
+   *  mapping must be used. */
+  bool begin(
+    const D3D11_MAPPED_SUBRESOURCE* pMapped,
+          size_t                    Size,
+          D3D11_MAPPED_SUBRESOURCE* pWatched);
+
+  /** Checks whether the watched memory is currently mapped */
+  bool isActive() const {
+    return m_active;
+  }
+
+  /** Copies written pages back to the original mapping and
+   *  returns the written byte ranges, sorted by offset. */
+  void end(
+          std::vector<WriteWatchRange>* pRanges);
+
+private:
+
+  std::atomic<ULONG>  m_refCount = { 0u };
+
+  void*               m_memory    = nullptr;
+  size_t              m_capacity  = 0u;
+  size_t              m_size      = 0u;
+  void*               m_target    = nullptr;
+  bool                m_active    = false;
+
+  std::vector<void*>  m_pages;
+
+};
+
+}